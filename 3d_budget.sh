@@ -0,0 +1,16 @@
+#! /bin/bash
+
+cd ./build
+
+# Keypoint budget sweep on one record: match time vs map size and error.
+# Every budget has its own features/matches cache namespace.
+RECORD=${1:-1}
+for b in 0 8000 4000 2000 1000; do
+echo "Processing record: $RECORD, features_max_keypoints: $b ..."
+./bin/3d_recon --records="$RECORD" --pairs_look_back=4 --matches_num_thresh=7 \
+ --matches_line_dist_thresh=10.0 --sfm_repr_error_thresh=10.0               \
+ --sfm_max_merge_dist=5.0 --noviz --features_max_keypoints=$b               \
+ --output=sfm_out_budget_${RECORD}_$b.bin > log_budget_${RECORD}_$b.txt
+done
+
+grep -h "BUDGET_REPORT" log_budget_${RECORD}_*.txt
@@ -0,0 +1,58 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_CACHE_FILE_H_
+#define CV_GL_CACHE_FILE_H_
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+
+// Files of the features cache shared by concurrent 3d_recon processes
+// (3d_ones.sh runs one per record on the same _features_cache):
+//  - files are written into a temp file of the process and renamed over
+//    the target, so readers see either the old or the complete new file;
+//  - entries carry the payload size and checksum, a broken entry reads as
+//    missing and is computed again;
+//  - CacheClaim is an advisory claim (flock) of one entry, the process
+//    holding it computes the entry and the others wait and read it.
+//
+// Entry: magic, payload bytes (uint64), checksum (FNV-1a), payload
+
+// Temp file next to file, unique for the process and the call
+std::string CacheTempFile(const std::string& file);
+
+// Writes data into file via a temp file and rename, false on error
+bool WriteFileAtomic(const std::string& file, const std::string& data);
+
+uint32_t CacheChecksum(const char* data, const size_t bytes,
+                       uint32_t hash = 2166136261u);
+
+bool WriteCacheEntry(const std::string& file, const uint32_t magic,
+                     const std::string& payload);
+// False if the entry is of other magic, truncated or doesn't match its
+// checksum
+bool ReadCacheEntry(std::istream& in, const uint32_t magic,
+                    std::string& payload);
+
+class CacheClaim {
+public:
+  // Claim of the entry file (<file>.claim). Waits for the process (or
+  // thread) holding it when wait is set, otherwise nullptr if the entry
+  // is claimed. nullptr as well if the claim file can't be created.
+  static std::shared_ptr<CacheClaim> Acquire(const std::string& file,
+                                             const bool wait);
+  // Removes the claim file and releases the claim
+  ~CacheClaim();
+
+private:
+  CacheClaim(const std::string& claim_file, const int fd)
+      : claim_file_(claim_file), fd_(fd) {}
+  CacheClaim(const CacheClaim&) = delete;
+  CacheClaim& operator=(const CacheClaim&) = delete;
+
+  std::string claim_file_;
+  int fd_;
+};
+
+
+#endif  // CV_GL_CACHE_FILE_H_
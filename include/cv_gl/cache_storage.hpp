@@ -4,10 +4,21 @@
 
 #include <boost/filesystem.hpp>
 
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_set>
+#include <sstream>
+#include <iomanip>
 // #include <cereal/cereal.hpp>
 // #include <cereal/types/vector.hpp>
 
+#include "cv_gl/cache_file.h"
+#include "cv_gl/feature_pack.h"
+#include "cv_gl/image_retrieval.h"
+#include "cv_gl/match_store.h"
 #include "cv_gl/serialization.hpp"
 #include "cv_gl/sfm_common.h"
 
@@ -16,36 +27,119 @@
 
 #define CACHE_FEATURES_DIR  "features"
 #define CACHE_MATCHES_DIR  "matches"
+#define CACHE_THUMBNAILS_DIR  "thumbnails"
+#define CACHE_CLAIMS_DIR  "claims"
+
+// "CFT1" - compact features file
+#define CACHE_FEATURES_MAGIC  0x31544643u
+// "CFT2" - compact features in a checksummed entry (cache_file.h)
+#define CACHE_FEATURES_ENTRY_MAGIC  0x32544643u
+// "CTH1" - thumbnail in a checksummed entry
+#define CACHE_THUMBNAIL_ENTRY_MAGIC  0x31485443u
+
+// Query claims held by the threads of one process. flock is per open
+// file, so threads of the process wait for each other here and only the
+// first one takes the file claim against the other processes.
+struct QueryClaimTable {
+  std::mutex mu;
+  std::condition_variable released;
+  std::unordered_set<std::string> claimed;
+};
+
+// Claim of the matches of a query image by a thread of this process, see
+// CacheStorage::ClaimQueryMatches
+class QueryMatchesClaim {
+public:
+  QueryMatchesClaim(QueryClaimTable& table, const std::string& claim_file)
+      : table_(table), claim_file_(claim_file) {}
+  ~QueryMatchesClaim() {
+    file_claim_.reset();
+    std::lock_guard<std::mutex> lock(table_.mu);
+    table_.claimed.erase(claim_file_);
+    table_.released.notify_all();
+  }
+  // Another thread of the process held the query before (its matches are
+  // in the store already)
+  bool waited_thread = false;
+  // Another process held the query before, the store needs a refresh
+  bool waited_process = false;
+
+private:
+  friend class CacheStorage;
+  QueryMatchesClaim(const QueryMatchesClaim&) = delete;
+  QueryMatchesClaim& operator=(const QueryMatchesClaim&) = delete;
+
+  QueryClaimTable& table_;
+  std::string claim_file_;
+  std::shared_ptr<CacheClaim> file_claim_;
+};
 
 class CacheStorage {
 public:
-  explicit CacheStorage() : cache_dir_{"_features_cache"} {
+  explicit CacheStorage()
+      : cache_dir_{"_features_cache"},
+        features_dir_{CACHE_FEATURES_DIR},
+        matches_dir_{CACHE_MATCHES_DIR} {
     Init();
   }
   explicit CacheStorage(std::string cache_dir)
-      : cache_dir_{cache_dir} {
+      : cache_dir_{cache_dir},
+        features_dir_{CACHE_FEATURES_DIR},
+        matches_dir_{CACHE_MATCHES_DIR} {
     Init();
   }
 
-  bool GetFeatures(const std::string& img_path, Features& features) {
+  // Features (and so matches) extracted with non default params are
+  // stored in features_<ns> and matches_<ns> dirs. Thumbnails are shared.
+  // Should be set before any Get/Save call.
+  void SetNamespace(const std::string& ns) {
+    std::string features_dir = CACHE_FEATURES_DIR;
+    std::string matches_dir = CACHE_MATCHES_DIR;
+    if (!ns.empty()) {
+      features_dir += "_" + ns;
+      matches_dir += "_" + ns;
+    }
+    std::lock_guard<std::mutex> lock(packs_mu_);
+    if (features_dir == features_dir_) return;
+    features_dir_ = features_dir;
+    matches_dir_ = matches_dir;
+    packs_.clear();
+    saved_over_pack_.clear();
+    std::lock_guard<std::mutex> matches_lock(matches_mu_);
+    match_store_.reset();
+  }
+
+  // Record pack <features_dir>/<record>.fpack (see pack_features app) is
+  // authoritative: its features are wrapped from the mapped file and the
+  // per image file is looked up only for the images missing from the pack.
+  // An image saved again while in the pack (its pack entry was rejected)
+  // is read from its file by this process; pack_features merges the file
+  // into the pack (files win there).
+  bool GetFeatures(const std::string& img_path, CompactFeatures& features) {
     // std::cout << "GetFeatures: " << img_path << std::endl;
     boost::filesystem::path p(img_path);
     // std::cout << "p.size = " << p.size() << std::endl;
     // std::cout << "p.stem = " << p.stem() << std::endl;
     auto camera_path = p.parent_path();
     auto record_path = camera_path.parent_path();
+
+    if (!SavedOverPack(img_path)) {
+      std::shared_ptr<FeaturePack> pack = GetFeaturePack(
+          record_path.stem().string());
+      if (pack && pack->Get(FeaturePackKey(camera_path.stem().string(),
+                                           p.stem().string()), features)) {
+        return true;
+      }
+    }
+
     std::string feature_file = p.stem().string() + ".f";
     boost::filesystem::path cache_file(cache_dir_);
-    cache_file /= CACHE_FEATURES_DIR / record_path.stem()
+    cache_file /= features_dir_ / record_path.stem()
         / camera_path.stem() / feature_file;
     // std::cout << "cache_file = " << cache_file << std::endl;
     if (boost::filesystem::exists(cache_file)
         && boost::filesystem::is_regular_file(cache_file)) {
-      // Open and de-serialize features
-      std::ifstream file(cache_file.string(), std::ios::binary);
-      cereal::BinaryInputArchive archive(file);
-      archive(features);
-      return true;
+      return ReadFeaturesFile(cache_file.string(), features);
     }
     // std::cout << "pc2.stem = " << pc2.stem() << std::endl;
     // for (auto c : p) {
@@ -54,43 +148,193 @@ public:
     return false;
   }
 
-  void SaveFeatures(const std::string& img_path, const Features& features) {
+  // Features of the image are in the record pack or in its own file
+  bool HasFeatures(const std::string& img_path) {
+    boost::filesystem::path p(img_path);
+    auto camera_path = p.parent_path();
+    auto record_path = camera_path.parent_path();
+    std::shared_ptr<FeaturePack> pack = GetFeaturePack(
+        record_path.stem().string());
+    if (pack && pack->Contains(FeaturePackKey(camera_path.stem().string(),
+                                              p.stem().string()))) {
+      return true;
+    }
+    boost::filesystem::path cache_file(cache_dir_);
+    cache_file /= features_dir_ / record_path.stem()
+        / camera_path.stem() / (p.stem().string() + ".f");
+    return boost::filesystem::is_regular_file(cache_file);
+  }
+
+  // Features files are checksummed entries of the compact store
+  // (CACHE_FEATURES_ENTRY_MAGIC), files of the older versions start with
+  // CACHE_FEATURES_MAGIC or are the Features format converted on load.
+  // A broken entry reads as missing.
+  static bool ReadFeaturesFile(const std::string& cache_file,
+                               CompactFeatures& features) {
+    std::ifstream file(cache_file, std::ios::binary);
+    if (!file.is_open()) return false;
+    uint32_t magic = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    if (magic == CACHE_FEATURES_ENTRY_MAGIC) {
+      file.seekg(0);
+      std::string payload;
+      if (!ReadCacheEntry(file, CACHE_FEATURES_ENTRY_MAGIC, payload)) {
+        std::cerr << "Broken features cache file: " << cache_file
+                  << std::endl;
+        return false;
+      }
+      std::istringstream in(payload);
+      cereal::BinaryInputArchive archive(in);
+      archive(features);
+      return true;
+    }
+    if (magic != CACHE_FEATURES_MAGIC) {
+      file.clear();
+      file.seekg(0);
+      Features legacy_features;
+      cereal::BinaryInputArchive archive(file);
+      archive(legacy_features);
+      features.Assign(legacy_features);
+      return true;
+    }
+    cereal::BinaryInputArchive archive(file);
+    archive(features);
+    return true;
+  }
+
+  // Key of the image features in the record pack: <camera>/<file_stem>
+  static std::string FeaturePackKey(const std::string& camera,
+                                    const std::string& stem) {
+    return camera + "/" + stem;
+  }
+
+  // Key of the image in the retrieval index: <record>/<camera>/<file_stem>
+  static std::string ImageKey(const std::string& img_path) {
+    boost::filesystem::path p(img_path);
+    auto camera_path = p.parent_path();
+    auto record_path = camera_path.parent_path();
+    return record_path.stem().string() + "/"
+        + FeaturePackKey(camera_path.stem().string(), p.stem().string());
+  }
+
+  // Vocabulary tree (train_vocabulary app) and retrieval index of the
+  // features namespace: <features_dir>/vocabulary.voc, retrieval.idx
+  std::string VocabularyFile() const {
+    boost::filesystem::path file(cache_dir_);
+    file /= features_dir_;
+    file /= VOCABULARY_FILE;
+    return file.string();
+  }
+  std::string RetrievalIndexFile() const {
+    boost::filesystem::path file(cache_dir_);
+    file /= features_dir_;
+    file /= RETRIEVAL_INDEX_FILE;
+    return file.string();
+  }
+
+  void SaveFeatures(const std::string& img_path,
+                    const CompactFeatures& features) {
     // std::cout << "SaveFeatures: " << img_path << std::endl;
     boost::filesystem::path p(img_path);
     auto camera_path = p.parent_path();
     auto record_path = camera_path.parent_path();
     std::string feature_file = p.stem().string() + ".f";
     boost::filesystem::path cache_file_dir(cache_dir_);
-    cache_file_dir /= CACHE_FEATURES_DIR / record_path.stem()
+    cache_file_dir /= features_dir_ / record_path.stem()
         / camera_path.stem();
     // std::cout << "cache_file_dir = " << cache_file_dir << std::endl;
     if (!boost::filesystem::exists(cache_file_dir)) {
       boost::filesystem::create_directories(cache_file_dir);
     }
     boost::filesystem::path cache_file = cache_file_dir / feature_file;
-    if (boost::filesystem::exists(cache_file)
-        && boost::filesystem::is_regular_file(cache_file)) {
-      // Open and de-serialize features
-      std::cout << "CacheFile EXISTS - STRANGE!!!!\n";
-      boost::filesystem::remove(cache_file);
+
+    // Store Features, an existing file (of another process or a broken
+    // one) is replaced at once
+    std::ostringstream payload;
+    {
+      cereal::BinaryOutputArchive archive(payload);
+      archive(features);
+    }
+    if (!WriteCacheEntry(cache_file.string(), CACHE_FEATURES_ENTRY_MAGIC,
+                         payload.str())) {
+      std::cerr << "Can't save features " << cache_file.string() << std::endl;
+      return;
     }
+    std::shared_ptr<FeaturePack> pack = GetFeaturePack(
+        record_path.stem().string());
+    if (pack && pack->Contains(FeaturePackKey(camera_path.stem().string(),
+                                              p.stem().string()))) {
+      std::lock_guard<std::mutex> lock(packs_mu_);
+      saved_over_pack_.insert(ImageKey(img_path));
+    }
+  }
 
-    // Store Features
-    std::ofstream file(cache_file.string(), std::ios::binary);
-    cereal::BinaryOutputArchive archive(file);
-    archive(features);
+  // Claim of the image features (see CacheClaim), waits while another
+  // process extracts them. Features are checked again after the claim.
+  std::shared_ptr<CacheClaim> ClaimFeatures(const std::string& img_path) {
+    boost::filesystem::path p(img_path);
+    auto camera_path = p.parent_path();
+    auto record_path = camera_path.parent_path();
+    boost::filesystem::path cache_file_dir(cache_dir_);
+    cache_file_dir /= features_dir_ / record_path.stem()
+        / camera_path.stem();
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(cache_file_dir, ec);
+    return CacheClaim::Acquire(
+        (cache_file_dir / (p.stem().string() + ".f")).string(), true);
   }
 
-  bool GetImageMatches(const ImageData& im_data1, 
-                       const ImageData& im_data2, 
-                       Matches& matches) {
+  // Resized image stored by image path and resize scale, so cached runs
+  // don't need to decode the full size image
+  bool GetThumbnail(const std::string& img_path, const double scale,
+                    cv::Mat& img) {
+    boost::filesystem::path cache_file = ThumbnailFile(img_path, scale);
+    if (boost::filesystem::exists(cache_file)
+        && boost::filesystem::is_regular_file(cache_file)) {
+      std::ifstream file(cache_file.string(), std::ios::binary);
+      uint32_t magic = 0;
+      file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+      file.seekg(0);
+      if (magic != CACHE_THUMBNAIL_ENTRY_MAGIC) {
+        // Older thumbnails are the plain cv::Mat archive
+        cereal::BinaryInputArchive archive(file);
+        archive(img);
+        return !img.empty();
+      }
+      std::string payload;
+      if (!ReadCacheEntry(file, CACHE_THUMBNAIL_ENTRY_MAGIC, payload)) {
+        return false;
+      }
+      std::istringstream in(payload);
+      cereal::BinaryInputArchive archive(in);
+      archive(img);
+      return !img.empty();
+    }
+    return false;
+  }
 
-    // std::cout << "GetMatches: " << im_data1 << ", "
-    //           << im_data2 << std::endl;
+  void SaveThumbnail(const std::string& img_path, const double scale,
+                     const cv::Mat& img) {
+    boost::filesystem::path cache_file = ThumbnailFile(img_path, scale);
+    boost::filesystem::path cache_file_dir = cache_file.parent_path();
+    if (!boost::filesystem::exists(cache_file_dir)) {
+      boost::filesystem::create_directories(cache_file_dir);
+    }
 
-    assert(::IsPairInOrder(im_data1, im_data2));
+    // Store Thumbnail
+    std::ostringstream payload;
+    {
+      cereal::BinaryOutputArchive archive(payload);
+      archive(img);
+    }
+    WriteCacheEntry(cache_file.string(), CACHE_THUMBNAIL_ENTRY_MAGIC,
+                    payload.str());
+  }
 
-    // Create match file <record>_<cam_num>_<file_name>
+  // Key of the pair matches: <record>_<cam_num>_<file_stem> of both
+  // images (in order) joined by "_"
+  static std::string MatchesKey(const ImageData& im_data1,
+                                const ImageData& im_data2) {
     auto im1_stem = boost::filesystem::path(im_data1.filename).stem();
     auto im2_stem = boost::filesystem::path(im_data2.filename).stem();
 
@@ -101,29 +345,40 @@ public:
                             + std::to_string(im_data2.camera_num) + "_"
                             + im2_stem.string();
 
-    // std::cout << "cache1_name = " << cache1_name << std::endl;
-    // std::cout << "cache2_name = " << cache2_name << std::endl;
-
     // Concatenate in lexicographical order
-    std::string cache_name = cache1_name + "_" + cache2_name + ".m";
-    // std::cout << "cache_name = " << cache_name << std::endl;
+    return cache1_name + "_" + cache2_name;
+  }
 
-    boost::filesystem::path cache_file_dir(cache_dir_);
-    cache_file_dir /= CACHE_MATCHES_DIR;
-    // std::cout << "cache_file_dir = " << cache_file_dir << std::endl;
+  // Matches are in the match store of <matches_dir> (segment files),
+  // per pair <key>.m files of the older versions are still read
+  // (migrate_matches app moves them into the store)
+  bool GetImageMatches(const ImageData& im_data1, 
+                       const ImageData& im_data2, 
+                       Matches& matches) {
 
-    boost::filesystem::path cache_file(cache_file_dir);
-    cache_file /= cache_name;
+    // std::cout << "GetMatches: " << im_data1 << ", "
+    //           << im_data2 << std::endl;
+
+    assert(::IsPairInOrder(im_data1, im_data2));
+
+    const std::string key = MatchesKey(im_data1, im_data2);
+    bool legacy_files = false;
+    std::shared_ptr<MatchStore> store = GetMatchStore(legacy_files);
+    if (store && store->Get(key, matches.match)) {
+      return true;
+    }
+    if (!legacy_files) return false;
+
+    boost::filesystem::path cache_file(cache_dir_);
+    cache_file /= matches_dir_;
+    cache_file /= key + ".m";
     // std::cout << "cache_file = " << cache_file << std::endl;
     
     if (boost::filesystem::exists(cache_file)
         && boost::filesystem::is_regular_file(cache_file)) {
       // Open and de-serialize matches
       // std::cout << "restore matches from CACHE" << std::endl;
-      std::ifstream file(cache_file.string(), std::ios::binary);
-      cereal::BinaryInputArchive archive(file);
-      archive(matches);
-      return true;
+      return ReadMatchesFile(cache_file.string(), matches);
     }
 
     return false;
@@ -139,52 +394,157 @@ public:
 
     assert(::IsPairInOrder(im_data1, im_data2));
 
-    // Create match file <record>_<cam_num>_<file_name>
-    auto im1_stem = boost::filesystem::path(im_data1.filename).stem();
-    auto im2_stem = boost::filesystem::path(im_data2.filename).stem();
-
-    std::string cache1_name = im_data1.record + "_"
-                            + std::to_string(im_data1.camera_num) + "_"
-                            + im1_stem.string();
-    std::string cache2_name = im_data2.record + "_"
-                            + std::to_string(im_data2.camera_num) + "_"
-                            + im2_stem.string();
-
-    // std::cout << "cache1_name = " << cache1_name << std::endl;
-    // std::cout << "cache2_name = " << cache2_name << std::endl;
-
-    // Concatenate in lexicographical order
-    std::string cache_name = cache1_name + "_" + cache2_name + ".m";
-    // std::cout << "cache_name = " << cache_name << std::endl;
-
-    boost::filesystem::path cache_file_dir(cache_dir_);
-    cache_file_dir /= CACHE_MATCHES_DIR;
-    // std::cout << "cache_file_dir = " << cache_file_dir << std::endl;
-
-    boost::filesystem::path cache_file(cache_file_dir);
-    cache_file /= cache_name;
-    // std::cout << "cache_file = " << cache_file << std::endl;
+    const std::string key = MatchesKey(im_data1, im_data2);
+    bool legacy_files = false;
+    std::shared_ptr<MatchStore> store = GetMatchStore(legacy_files);
+    if (!store || !store->Put(key, matches.match)) {
+      std::cerr << "Can't save matches " << key << std::endl;
+    }
+  }
 
-    if (!boost::filesystem::exists(cache_file_dir)) {
-      boost::filesystem::create_directories(cache_file_dir);
+  // Claim of the matches of a query image with its partners, waits while
+  // another thread or process matches it. One per query so the claim
+  // files (see CacheClaim) stay few and they live in <matches_dir>/claims
+  // out of the store dir. Threads of this process share the in-process
+  // table, the file claim is taken once per process. nullptr if the claim
+  // file can't be created.
+  std::shared_ptr<QueryMatchesClaim> ClaimQueryMatches(
+      const ImageData& im_data) {
+    bool legacy_files = false;
+    if (!GetMatchStore(legacy_files)) return nullptr;
+    boost::filesystem::path claim_dir(cache_dir_);
+    claim_dir /= matches_dir_;
+    claim_dir /= CACHE_CLAIMS_DIR;
+    const std::string claim_name = im_data.record + "_"
+        + std::to_string(im_data.camera_num) + "_"
+        + boost::filesystem::path(im_data.filename).stem().string();
+    const std::string claim_file = (claim_dir / claim_name).string();
+
+    std::shared_ptr<QueryMatchesClaim> claim(
+        new QueryMatchesClaim(query_claims_, claim_file));
+    {
+      std::unique_lock<std::mutex> lock(query_claims_.mu);
+      while (query_claims_.claimed.count(claim_file) > 0) {
+        claim->waited_thread = true;
+        query_claims_.released.wait(lock);
+      }
+      query_claims_.claimed.insert(claim_file);
     }
-    if (boost::filesystem::exists(cache_file)
-        && boost::filesystem::is_regular_file(cache_file)) {
-      // Open and de-serialize features
-      std::cout << "CacheFile for Matches EXISTS - STRANGE!!!!\n";
-      boost::filesystem::remove(cache_file);
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(claim_dir, ec);
+    claim->file_claim_ = CacheClaim::Acquire(claim_file, false);
+    if (!claim->file_claim_) {
+      claim->waited_process = true;
+      claim->file_claim_ = CacheClaim::Acquire(claim_file, true);
     }
+    if (!claim->file_claim_) return nullptr;
+    return claim;
+  }
 
-    // Store Matches
-    std::ofstream file(cache_file.string(), std::ios::binary);
-    cereal::BinaryOutputArchive archive(file);
-    archive(matches);
+  // Indexes the matches saved by other processes since the store was
+  // opened (lists the matches dir, so only after waiting on a claim)
+  void RefreshMatches() {
+    bool legacy_files = false;
+    std::shared_ptr<MatchStore> store = GetMatchStore(legacy_files);
+    if (store) store->Refresh();
+  }
 
+  // Files are of the matches before CompactMatches (std::vector<DMatch>)
+  static bool ReadMatchesFile(const std::string& cache_file,
+                              Matches& matches) {
+    std::ifstream file(cache_file, std::ios::binary);
+    if (!file.is_open()) return false;
+    cereal::BinaryInputArchive archive(file);
+    std::vector<cv::DMatch> match;
+    archive(matches.image_index, match);
+    matches.match.Assign(match);
+    return true;
   }
 
 
 private:
   std::string cache_dir_;
+  std::string features_dir_;
+  std::string matches_dir_;
+
+  // Opened record packs (nullptr - no pack for the record)
+  std::map<std::string, std::shared_ptr<FeaturePack> > packs_;
+  // ImageKey of the images saved to their files while in the pack
+  std::unordered_set<std::string> saved_over_pack_;
+  std::mutex packs_mu_;
+
+  // Match store of matches_dir_, opened on first use
+  std::shared_ptr<MatchStore> match_store_;
+  // Dir still has per pair matches files
+  bool legacy_matches_files_ = false;
+  std::mutex matches_mu_;
+  // Query claims of this process threads
+  QueryClaimTable query_claims_;
+
+  std::shared_ptr<MatchStore> GetMatchStore(bool& legacy_files) {
+    std::lock_guard<std::mutex> lock(matches_mu_);
+    if (!match_store_) {
+      boost::filesystem::path matches_dir(cache_dir_);
+      matches_dir /= matches_dir_;
+      match_store_ = MatchStore::Open(matches_dir.string());
+      if (!match_store_) {
+        std::cerr << "Can't open match store " << matches_dir.string()
+                  << std::endl;
+        return nullptr;
+      }
+      legacy_matches_files_ = false;
+      for (boost::filesystem::directory_iterator it(matches_dir);
+           it != boost::filesystem::directory_iterator(); ++it) {
+        if (it->path().extension() == ".m") {
+          legacy_matches_files_ = true;
+          break;
+        }
+      }
+      std::cout << "Match store: " << matches_dir.string()
+                << " (" << match_store_->Count() << " pairs"
+                << (legacy_matches_files_ ? ", with matches files" : "")
+                << ")" << std::endl;
+    }
+    legacy_files = legacy_matches_files_;
+    return match_store_;
+  }
+
+  bool SavedOverPack(const std::string& img_path) {
+    std::lock_guard<std::mutex> lock(packs_mu_);
+    return !saved_over_pack_.empty()
+        && saved_over_pack_.count(ImageKey(img_path)) > 0;
+  }
+
+  std::shared_ptr<FeaturePack> GetFeaturePack(const std::string& record) {
+    std::lock_guard<std::mutex> lock(packs_mu_);
+    auto it = packs_.find(record);
+    if (it != packs_.end()) return it->second;
+    boost::filesystem::path pack_file(cache_dir_);
+    pack_file /= features_dir_;
+    pack_file /= record + FEATURE_PACK_EXT;
+    std::shared_ptr<FeaturePack> pack = FeaturePack::Open(pack_file.string());
+    if (pack) {
+      std::cout << "Feature pack: " << pack_file.string()
+                << " (" << pack->Count() << " images)" << std::endl;
+    }
+    packs_[record] = pack;
+    return pack;
+  }
+
+  // thumbnails/<record>/<camera>/<file_name>_<scale>.t
+  boost::filesystem::path ThumbnailFile(const std::string& img_path,
+                                        const double scale) const {
+    boost::filesystem::path p(img_path);
+    auto camera_path = p.parent_path();
+    auto record_path = camera_path.parent_path();
+    std::stringstream ss;
+    ss << p.stem().string() << "_" << std::fixed << std::setprecision(4)
+       << scale << ".t";
+    boost::filesystem::path cache_file(cache_dir_);
+    cache_file /= CACHE_THUMBNAILS_DIR / record_path.stem()
+        / camera_path.stem() / ss.str();
+    return cache_file;
+  }
   void Init() {
     // Create cache dir if needed
     std::cout << "Cache Storage: Init\n";
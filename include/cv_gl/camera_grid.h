@@ -0,0 +1,52 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_CAMERA_GRID_H_
+#define CV_GL_CAMERA_GRID_H_
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "cv_gl/sfm_common.h"
+
+// Uniform grid over camera positions (translation) for the pair
+// candidates search. A cell is cell_size meters per side, so a radius
+// query of cell_size visits 27 cells only and the cost doesn't depend on
+// the number of cameras in the map.
+class CameraGrid {
+public:
+  explicit CameraGrid(const double cell_size);
+
+  void Add(const int id, const glm::dvec3& pos);
+  int size() const { return static_cast<int>(ids_.size()); }
+
+  // Ids of the cameras within radius of pos, ordered by distance
+  void Radius(const glm::dvec3& pos, const double radius,
+              std::vector<int>& ids) const;
+
+private:
+  double cell_size_;
+  std::vector<int> ids_;
+  std::vector<glm::dvec3> positions_;
+  // cell key -> indices into ids_/positions_
+  std::unordered_map<uint64_t, std::vector<int> > cells_;
+
+  glm::ivec3 Cell(const glm::dvec3& pos) const;
+  static uint64_t CellKey(const glm::ivec3& cell);
+  // Appends points of the cells at Chebyshev distance ring from center
+  void CollectRing(const glm::ivec3& center, const int ring,
+                   std::vector<int>& points) const;
+};
+
+// Cheap overlap of the two camera views in [0, 1]: angle between the
+// optical axes relative to the sum of the horizontal half fields of view
+// (from the intrinsics), scaled down linearly with the distance up to
+// max_dist. Cameras looking away from each other (e.g. the opposite
+// driving direction) score 0.
+double GetViewOverlapScore(const CameraInfo& camera_info1,
+                           const CameraInfo& camera_info2,
+                           const double max_dist);
+
+
+#endif  // CV_GL_CAMERA_GRID_H_
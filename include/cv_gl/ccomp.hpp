@@ -2,7 +2,10 @@
 #ifndef CV_GL_CCOMP_HPP_
 #define CV_GL_CCOMP_HPP_
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <map>
 #include <algorithm>
@@ -117,5 +120,343 @@ private:
   int count;
 };
 
+// "DCC1" - tag of the dense components archive, archives of
+// CComponents<std::pair<int, int> > start with the elements count instead
+#define DENSE_CCOMP_TAG 0x31434344ULL
+
+// Components of (image, keypoint) elements with dense ids computed from
+// the keypoints counts of the images: id = offsets[image] + keypoint
+// (prefix sums, SetSizes). Flat parent and rank arrays, Find does path
+// halving and Union is by rank, so there is no map lookup or insert per
+// element as in CComponents<std::pair<int, int> >.
+// As there, elements are in the components from their first Union/Find
+// (Count, GetComponentIds), component id is the id of its root element.
+class ConcurrentCComponents;
+
+class DenseCComponents {
+public:
+  typedef std::pair<int, int> ElemType;
+
+  DenseCComponents(): count(0) {}
+
+  // Keypoints counts of the images. Ids of the images added to the end
+  // stay the same, any other change rebuilds the components with the new
+  // ids (elements out of the new sizes are dropped).
+  void SetSizes(const std::vector<int>& sizes) {
+    std::vector<int> new_offsets(sizes.size() + 1, 0);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      new_offsets[i + 1] = new_offsets[i] + sizes[i];
+    }
+    if (new_offsets.size() >= offsets.size()
+        && std::equal(offsets.begin(), offsets.end(), new_offsets.begin())) {
+      offsets.swap(new_offsets);
+      for (int id = parent.size(); id < offsets.back(); ++id) {
+        parent.push_back(id);
+      }
+      rank.resize(offsets.back(), -1);
+      return;
+    }
+    std::vector<std::pair<ElemType, ElemType> > links;
+    for (int id = 0; id < static_cast<int>(parent.size()); ++id) {
+      if (rank[id] >= 0) links.emplace_back(GetEl(id), GetEl(FindById(id)));
+    }
+    offsets.swap(new_offsets);
+    parent.resize(offsets.back());
+    for (int id = 0; id < offsets.back(); ++id) {
+      parent[id] = id;
+    }
+    rank.assign(offsets.back(), -1);
+    count = 0;
+    int dropped = 0;
+    for (const auto& l : links) {
+      if (!Contains(l.first) || !Contains(l.second)) {
+        ++dropped;
+        continue;
+      }
+      Union(l.first, l.second);
+      Find(l.first);
+    }
+    if (dropped > 0) {
+      std::cerr << "DenseCComponents: dropped elements = " << dropped
+                << std::endl;
+    }
+  }
+
+  bool Contains(ElemType e) const {
+    return e.first >= 0 && e.first + 1 < static_cast<int>(offsets.size())
+        && e.second >= 0
+        && e.second < offsets[e.first + 1] - offsets[e.first];
+  }
+
+  // Elements out of the sizes (e.g. of a stale cached match) are skipped,
+  // Find gives -1 for them
+  void Union(ElemType e1, ElemType e2) {
+    if (e1 == e2 || !Contains(e1) || !Contains(e2)) return;
+    int c1 = FindById(Use(GetId(e1)));
+    int c2 = FindById(Use(GetId(e2)));
+    if (c1 != c2) {
+      if (rank[c1] < rank[c2]) std::swap(c1, c2);
+      parent[c2] = c1;
+      if (rank[c1] == rank[c2]) ++rank[c1];
+      --count;
+    }
+  }
+  int Find(ElemType e) {
+    if (!Contains(e)) return -1;
+    return FindById(Use(GetId(e)));
+  }
+
+  int Connected(ElemType e1, ElemType e2) {
+    const int c1 = Find(e1);
+    return (c1 >= 0 && c1 == Find(e2)) ? 1 : 0;
+  }
+
+  std::vector<int> GetComponentIds() const {
+    std::vector<int> comp_ids;
+    for (int i = 0; i < static_cast<int>(parent.size()); ++i) {
+      if (rank[i] >= 0 && parent[i] == i) comp_ids.push_back(i);
+    }
+    return comp_ids;
+  }
+
+  std::vector<ElemType> GetElementsById(int id) {
+    std::vector<ElemType> comp_elems;
+    for (int i = 0; i < static_cast<int>(parent.size()); ++i) {
+      if (rank[i] >= 0 && id == FindById(i)) {
+        comp_elems.push_back(GetEl(i));
+      }
+    }
+    return comp_elems;
+  }
+
+  int Count() const { return count; }
+
+  // Smallest element id of the component per element id (-1 - not used),
+  // the same for the same components whatever the order of the unions
+  std::vector<int> Labels() {
+    std::vector<int> labels(parent.size(), -1);
+    std::vector<int> min_ids(parent.size(), parent.size());
+    for (int i = 0; i < static_cast<int>(parent.size()); ++i) {
+      if (rank[i] >= 0) {
+        int& min_id = min_ids[FindById(i)];
+        min_id = std::min(min_id, i);
+      }
+    }
+    for (int i = 0; i < static_cast<int>(parent.size()); ++i) {
+      if (rank[i] >= 0) labels[i] = min_ids[FindById(i)];
+    }
+    return labels;
+  }
+
+  template<class Archive>
+  void save(Archive& archive) const {
+    uint64_t tag = DENSE_CCOMP_TAG;
+    archive(tag, offsets, parent, rank, count);
+  }
+  // Legacy CComponents<std::pair<int, int> > archives are converted with
+  // the sizes known from their elements, SetSizes with the keypoints
+  // counts remaps them then
+  template<class Archive>
+  void load(Archive& archive) {
+    uint64_t tag;
+    archive(tag);
+    LoadTagged(archive, tag);
+  }
+  // Rest of the archive after its first field (tag) was read
+  template<class Archive>
+  void LoadTagged(Archive& archive, const uint64_t tag) {
+    if (tag == DENSE_CCOMP_TAG) {
+      archive(offsets, parent, rank, count);
+      return;
+    }
+    std::vector<ElemType> elems(tag);
+    for (ElemType& e : elems) {
+      archive(e);
+    }
+    std::vector<int> tr, depth;
+    std::map<ElemType, int> ids;
+    int legacy_count;
+    archive(tr, depth, ids, legacy_count);
+    std::vector<int> sizes;
+    for (const ElemType& e : elems) {
+      if (e.first >= static_cast<int>(sizes.size())) sizes.resize(e.first + 1);
+      sizes[e.first] = std::max(sizes[e.first], e.second + 1);
+    }
+    offsets.clear();
+    parent.clear();
+    rank.clear();
+    count = 0;
+    SetSizes(sizes);
+    for (int i = 0; i < static_cast<int>(elems.size()); ++i) {
+      int root = i;
+      while (tr[root] != -1) {
+        root = tr[root];
+      }
+      Union(elems[i], elems[root]);
+      Find(elems[i]);
+    }
+  }
+
+private:
+  int GetId(ElemType e) const { return offsets[e.first] + e.second; }
+  ElemType GetEl(int id) const {
+    const int image = std::upper_bound(offsets.begin(), offsets.end(), id)
+        - offsets.begin() - 1;
+    return std::make_pair(image, id - offsets[image]);
+  }
+  // Element is counted on the first use
+  int Use(int id) {
+    if (rank[id] < 0) {
+      rank[id] = 0;
+      ++count;
+    }
+    return id;
+  }
+  int FindById(int id) {
+    while (parent[id] != id) {
+      parent[id] = parent[parent[id]];
+      id = parent[id];
+    }
+    return id;
+  }
+
+  friend class ConcurrentCComponents;
+
+  // offsets[image] - id of the first keypoint of the image, size + 1
+  std::vector<int> offsets;
+  std::vector<int> parent;
+  // -1 - element is not used yet
+  std::vector<int8_t> rank;
+  int count;
+};
+
+// DenseCComponents for the matcher threads: Union and Find are safe to
+// call concurrently without a lock. Roots are linked with CAS, always the
+// larger id under the smaller one, so parent[id] <= id and the root of a
+// component is its smallest element id whatever the order of the unions.
+// Find walks strictly decreasing ids (wait-free), its path halving is a
+// CAS that is not retried. Union retries only when another thread linked
+// one of the roots in between (lock-free).
+// Sizes are fixed, taken with the components from DenseCComponents and
+// given back with CopyTo (not concurrently with Union/Find).
+class ConcurrentCComponents {
+public:
+  typedef std::pair<int, int> ElemType;
+
+  explicit ConcurrentCComponents(const DenseCComponents& c)
+      : offsets(c.offsets), size(c.parent.size()),
+        parent(new std::atomic<int>[c.parent.size()]),
+        used(new std::atomic<bool>[c.parent.size()]),
+        count(c.count) {
+    // Elements of a component point to its smallest id
+    std::vector<int> roots(size);
+    std::vector<int> min_ids(size, size);
+    for (int id = 0; id < size; ++id) {
+      int root = id;
+      while (c.parent[root] != root) {
+        root = c.parent[root];
+      }
+      roots[id] = root;
+      min_ids[root] = std::min(min_ids[root], id);
+    }
+    for (int id = 0; id < size; ++id) {
+      parent[id].store(min_ids[roots[id]], std::memory_order_relaxed);
+      used[id].store(c.rank[id] >= 0, std::memory_order_relaxed);
+    }
+  }
+
+  bool Contains(ElemType e) const {
+    return e.first >= 0 && e.first + 1 < static_cast<int>(offsets.size())
+        && e.second >= 0
+        && e.second < offsets[e.first + 1] - offsets[e.first];
+  }
+
+  // True if the components were connected by this call. Elements out of
+  // the sizes are skipped (Find gives -1) as in DenseCComponents.
+  bool Union(ElemType e1, ElemType e2) {
+    if (e1 == e2 || !Contains(e1) || !Contains(e2)) return false;
+    int a = Use(GetId(e1));
+    int b = Use(GetId(e2));
+    while (true) {
+      a = FindById(a);
+      b = FindById(b);
+      if (a == b) return false;
+      if (a < b) std::swap(a, b);
+      int expected = a;
+      if (parent[a].compare_exchange_strong(expected, b)) {
+        count.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+      // a was linked by another thread
+    }
+  }
+  int Find(ElemType e) {
+    if (!Contains(e)) return -1;
+    return FindById(Use(GetId(e)));
+  }
+
+  int Connected(ElemType e1, ElemType e2) {
+    // Roots may be linked in between, a stable root answers
+    int a = Find(e1);
+    int b = Find(e2);
+    if (a < 0 || b < 0) return 0;
+    while (a != b) {
+      if (parent[a].load() == a && parent[b].load() == b) return 0;
+      a = FindById(a);
+      b = FindById(b);
+    }
+    return 1;
+  }
+
+  int Count() const { return count.load(); }
+
+  // Components into c (of the same sizes), every element points to its
+  // root
+  void CopyTo(DenseCComponents& c) const {
+    c.offsets = offsets;
+    c.parent.resize(size);
+    c.rank.resize(size);
+    for (int id = 0; id < size; ++id) {
+      int root = id;
+      while (parent[root].load(std::memory_order_relaxed) != root) {
+        root = parent[root].load(std::memory_order_relaxed);
+      }
+      c.parent[id] = root;
+      c.rank[id] = used[id].load(std::memory_order_relaxed) ? 0 : -1;
+    }
+    for (int id = 0; id < size; ++id) {
+      if (c.parent[id] != id) c.rank[c.parent[id]] = 1;
+    }
+    c.count = count.load();
+  }
+
+private:
+  int GetId(ElemType e) const { return offsets[e.first] + e.second; }
+  int Use(int id) {
+    if (!used[id].load(std::memory_order_relaxed)
+        && !used[id].exchange(true)) {
+      count.fetch_add(1, std::memory_order_relaxed);
+    }
+    return id;
+  }
+  int FindById(int id) {
+    int p = parent[id].load();
+    while (p != id) {
+      const int gp = parent[p].load();
+      // Path halving, a failed CAS means the path is shorter already
+      if (gp != p) parent[id].compare_exchange_weak(p, gp);
+      id = gp;
+      p = parent[id].load();
+    }
+    return id;
+  }
+
+  std::vector<int> offsets;
+  int size;
+  std::unique_ptr<std::atomic<int>[]> parent;
+  std::unique_ptr<std::atomic<bool>[]> used;
+  std::atomic<int> count;
+};
+
 
 #endif  // CV_GL_CCOMP_HPP
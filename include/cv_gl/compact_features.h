@@ -0,0 +1,166 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_COMPACT_FEATURES_H_
+#define CV_GL_COMPACT_FEATURES_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <memory>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+struct Features;
+
+// Allocator for SIMD friendly descriptor blocks
+template<typename T, size_t Align>
+struct AlignedAllocator {
+  typedef T value_type;
+  template<typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+  AlignedAllocator() {}
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+  T* allocate(size_t n) {
+    void* p = nullptr;
+    if (posix_memalign(&p, Align, n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(p);
+  }
+  void deallocate(T* p, size_t) { free(p); }
+};
+template<typename T, typename U, size_t Align>
+bool operator==(const AlignedAllocator<T, Align>&,
+                const AlignedAllocator<U, Align>&) { return true; }
+template<typename T, typename U, size_t Align>
+bool operator!=(const AlignedAllocator<T, Align>&,
+                const AlignedAllocator<U, Align>&) { return false; }
+
+
+// Structure of arrays storage of the image keypoints and descriptors
+// that stays resident for the whole run.
+// Per keypoint: float2 position (8 bytes), size in 1/16 px (2 bytes),
+// angle in 360/65536 deg (2 bytes) and octave (1 byte) instead of 28 bytes
+// of cv::KeyPoint. Response and class_id are not kept.
+// Descriptors are one block with rows padded to kDescriptorAlign bytes
+// (zero filled), so the row starts are aligned for SIMD.
+// Arrays are either owned or wrapped from an external storage (memory
+// mapped feature pack) without a copy, accessors work the same way.
+class CompactFeatures {
+public:
+  static const int kDescriptorAlign = 32;
+  static const int kSizeScale = 16;
+
+  typedef std::vector<uchar, AlignedAllocator<uchar, kDescriptorAlign> >
+      DescriptorBlock;
+
+  CompactFeatures();
+  explicit CompactFeatures(const Features& features);
+  CompactFeatures(const CompactFeatures& other);
+  CompactFeatures(CompactFeatures&& other);
+  CompactFeatures& operator=(const CompactFeatures& other);
+  CompactFeatures& operator=(CompactFeatures&& other);
+
+  void Assign(const Features& features);
+  void Clear();
+  // Views external arrays, storage keeps them alive. Descriptors rows are
+  // descriptor_stride bytes apart (nullptr - no descriptors).
+  void Wrap(const int n,
+            const cv::Point2f* points,
+            const uint16_t* sizes,
+            const uint16_t* angles,
+            const int8_t* octaves,
+            const uchar* descriptors,
+            const int descriptor_type,
+            const int descriptor_cols,
+            const int descriptor_stride,
+            std::shared_ptr<const void> storage);
+  bool IsWrapped() const { return static_cast<bool>(storage_); }
+  // Descriptors are in the wrapped storage, dropping them frees nothing
+  bool HasWrappedDescriptors() const {
+    return HasDescriptors() && descriptors_.empty();
+  }
+  // Frees descriptors, keypoints stay in place. Layout is kept so
+  // descriptor_bytes() still tells the expected descriptors.
+  void DropDescriptors();
+  // Owned copy of the other features descriptors, false if the other
+  // keypoints are not the same, keypoints views are not touched
+  bool RestoreDescriptors(const CompactFeatures& other);
+  // Same keypoints positions (the same extraction of an image)
+  bool SameKeypoints(const CompactFeatures& other) const;
+  // Full cv::KeyPoint and cv::Mat copy (quantized values)
+  Features ToFeatures() const;
+
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // == Keypoints views
+  const cv::Point2f& pt(const int i) const { return points_data_[i]; }
+  const cv::Point2f* points() const { return points_data_; }
+  float keypoint_size(const int i) const {
+    return static_cast<float>(sizes_data_[i]) / kSizeScale;
+  }
+  float angle(const int i) const {
+    return static_cast<float>(angles_data_[i]) * (360.0f / 65536.0f);
+  }
+  int octave(const int i) const { return octaves_data_[i]; }
+  const uint16_t* sizes() const { return sizes_data_; }
+  const uint16_t* angles() const { return angles_data_; }
+  const int8_t* octaves() const { return octaves_data_; }
+  cv::KeyPoint keypoint(const int i) const;
+  std::vector<cv::KeyPoint> keypoints() const;
+
+  // == Descriptors views
+  bool HasDescriptors() const { return descriptors_data_ != nullptr; }
+  int descriptor_bytes() const { return descriptor_cols_ * descriptor_elem_; }
+  int descriptor_stride() const { return descriptor_stride_; }
+  int descriptor_type() const { return descriptor_type_; }
+  const uchar* descriptor(const int i) const {
+    return descriptors_data_ + static_cast<size_t>(i) * descriptor_stride_;
+  }
+  // Header over the descriptor block (no copy), valid while the object
+  // is alive and not modified
+  cv::Mat descriptors() const;
+
+  // Heap memory used by the store (wrapped arrays are not counted)
+  size_t MemoryBytes() const;
+  // Memory the same features take as cv::KeyPoint vector + cv::Mat
+  size_t FeaturesMemoryBytes() const;
+
+  template<class Archive>
+  friend void save(Archive& archive, const CompactFeatures& f);
+  template<class Archive>
+  friend void load(Archive& archive, CompactFeatures& f);
+
+private:
+  // Owned arrays
+  std::vector<cv::Point2f> points_;
+  std::vector<uint16_t> sizes_;
+  std::vector<uint16_t> angles_;
+  std::vector<int8_t> octaves_;
+
+  DescriptorBlock descriptors_;
+  int descriptor_type_;
+  int descriptor_cols_;
+  int descriptor_elem_;
+  int descriptor_stride_;
+
+  // Views to the owned or wrapped arrays
+  int size_;
+  const cv::Point2f* points_data_;
+  const uint16_t* sizes_data_;
+  const uint16_t* angles_data_;
+  const int8_t* octaves_data_;
+  const uchar* descriptors_data_;
+  std::shared_ptr<const void> storage_;
+
+  void SetDescriptorLayout(const int type, const int cols);
+  // Points views to the owned arrays
+  void UpdateViews();
+  void CopyFrom(const CompactFeatures& other);
+};
+
+
+#endif  // CV_GL_COMPACT_FEATURES_H_
@@ -0,0 +1,71 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_COMPACT_MATCHES_H_
+#define CV_GL_COMPACT_MATCHES_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Matches of an image pair as (query, train) keypoint index pairs: 8
+// bytes per match instead of 16 of cv::DMatch. imgIdx is always 0 and the
+// distance is needed by the ratio test only, so distances are kept (as
+// 8 bits, saturated) only when enabled with SetWithDistances.
+// operator[] gives a cv::DMatch value, ToDMatches() the full vector for
+// the OpenCV helpers (drawMatches etc.).
+//
+// Encoded form (cache and archives): count and flags, then per match
+// zigzag varint of the query delta and varint of the train index, then
+// the distances. Matchers emit matches by ascending query, so deltas fit
+// one byte and a match takes ~3 bytes.
+class CompactMatches {
+public:
+  CompactMatches() : with_distances_(false) {}
+  explicit CompactMatches(const std::vector<cv::DMatch>& matches,
+                          const bool with_distances = false);
+
+  void Assign(const std::vector<cv::DMatch>& matches);
+  void push_back(const cv::DMatch& match);
+  void clear();
+  void reserve(const size_t n);
+
+  size_t size() const { return pairs_.size(); }
+  bool empty() const { return pairs_.empty(); }
+  int queryIdx(const size_t i) const { return pairs_[i].query; }
+  int trainIdx(const size_t i) const { return pairs_[i].train; }
+  float distance(const size_t i) const {
+    return with_distances_ ? distances_[i] : 0.0f;
+  }
+  cv::DMatch operator[](const size_t i) const {
+    return cv::DMatch(pairs_[i].query, pairs_[i].train, 0, distance(i));
+  }
+  std::vector<cv::DMatch> ToDMatches() const;
+
+  // Distances are kept for the matches added next, the current ones are
+  // cleared
+  void SetWithDistances(const bool with_distances);
+  bool WithDistances() const { return with_distances_; }
+
+  // Keeps matches with values[i] <= max_value (NaN fails), in place
+  // without reallocation. Returns number of removed matches.
+  size_t KeepByValue(const std::vector<float>& values,
+                     const float max_value);
+
+  size_t MemoryBytes() const;
+
+  void Encode(std::vector<uint8_t>& data) const;
+  // False (and empty) on broken data
+  bool Decode(const uint8_t* data, const size_t bytes);
+
+private:
+  struct IndexPair {
+    int32_t query;
+    int32_t train;
+  };
+  std::vector<IndexPair> pairs_;
+  std::vector<uint8_t> distances_;
+  bool with_distances_;
+};
+
+
+#endif  // CV_GL_COMPACT_MATCHES_H_
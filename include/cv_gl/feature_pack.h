@@ -0,0 +1,93 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_FEATURE_PACK_H_
+#define CV_GL_FEATURE_PACK_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cv_gl/compact_features.h"
+
+// One file with the compact features of many images (usually a record)
+// and an index by image key. The pack is memory mapped on read and
+// features are wrapped without a copy.
+//
+// Layout (native endianness):
+//   header: magic "FPK1", version, count, index_offset (uint64)
+//   data: per image points | sizes | angles | octaves | descriptors
+//         every array starts at kFeaturePackAlign, descriptor rows are
+//         padded to the CompactFeatures stride
+//   index at index_offset: per image key and array offsets
+#define FEATURE_PACK_MAGIC  0x314b5046u
+#define FEATURE_PACK_VERSION  1
+#define FEATURE_PACK_EXT  ".fpack"
+
+struct FeaturePackEntry {
+  int size;
+  int descriptor_type;
+  int descriptor_cols;
+  int descriptor_stride;
+  uint64_t points_offset;
+  uint64_t sizes_offset;
+  uint64_t angles_offset;
+  uint64_t octaves_offset;
+  // 0 - no descriptors
+  uint64_t descriptors_offset;
+};
+
+class FeaturePackWriter {
+public:
+  static const int kFeaturePackAlign = 64;
+
+  // Writes into a temp file next to pack_file, Close() moves it in place
+  explicit FeaturePackWriter(const std::string& pack_file);
+  ~FeaturePackWriter();
+
+  bool IsOpen() const { return file_.is_open(); }
+  bool Add(const std::string& key, const CompactFeatures& features);
+  bool Close();
+  int Count() const { return static_cast<int>(keys_.size()); }
+
+private:
+  std::string pack_file_;
+  std::string tmp_file_;
+  std::ofstream file_;
+  uint64_t offset_;
+  std::vector<std::string> keys_;
+  std::vector<FeaturePackEntry> entries_;
+
+  uint64_t WriteArray(const void* data, const size_t bytes);
+  void Pad();
+};
+
+class FeaturePack : public std::enable_shared_from_this<FeaturePack> {
+public:
+  // nullptr if there is no valid pack file
+  static std::shared_ptr<FeaturePack> Open(const std::string& pack_file);
+  ~FeaturePack();
+
+  // Wraps the mapped arrays, features keep the pack mapped
+  bool Get(const std::string& key, CompactFeatures& features) const;
+  bool Contains(const std::string& key) const {
+    return index_.find(key) != index_.end();
+  }
+  int Count() const { return static_cast<int>(index_.size()); }
+  std::vector<std::string> Keys() const;
+  size_t Bytes() const { return size_; }
+
+private:
+  FeaturePack() : data_(nullptr), size_(0) {}
+  bool ReadIndex();
+  // [offset, offset + bytes) is within the mapped file
+  bool InPack(const uint64_t offset, const size_t bytes) const;
+
+  const uchar* data_;
+  size_t size_;
+  std::unordered_map<std::string, FeaturePackEntry> index_;
+};
+
+
+#endif  // CV_GL_FEATURE_PACK_H_
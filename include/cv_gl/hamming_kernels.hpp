@@ -0,0 +1,156 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_HAMMING_KERNELS_HPP_
+#define CV_GL_HAMMING_KERNELS_HPP_
+
+#include <climits>
+
+#include <opencv2/opencv.hpp>
+
+#include "cv_gl/hamming_matcher.h"
+
+// Internal part of the hamming matcher. Every ISA lives in its own
+// translation unit built with its -m flags (see src/CMakeLists.txt) and
+// instantiates the templates below with its Dist:
+//   template<int kStride> static int Dist::Distance(a, b, stride)
+// kStride == 0 - stride known at runtime only.
+// The kernels don't call std or cv inline functions: their out of line
+// copies built with -mavx2 could be picked by the linker for the whole
+// program and break it on older CPUs.
+
+// Train block of ~64KB stays in L2 while a query block runs over it
+const int kHammingTrainBlockBytes = 64 * 1024;
+const int kHammingQueryBlock = 32;
+
+// Query blocks run over all train sets in turn, so a block stays in L1
+// for every partner. Accepted matches of train set k are written to
+// matches[k] (query_rows capacity), their count to matches_sizes[k].
+template<int kStride, class Dist>
+void HammingKnn2Ratio(const uchar* query, const int query_rows,
+                      const HammingTrainSet* trains,
+                      const int trains_size,
+                      const int stride, const float ratio_thresh,
+                      cv::DMatch* const* matches, int* matches_sizes) {
+  int train_block = kHammingTrainBlockBytes / (stride > 0 ? stride : 1);
+  if (train_block < 1) train_block = 1;
+  int best[kHammingQueryBlock];
+  int second[kHammingQueryBlock];
+  int best_idx[kHammingQueryBlock];
+  for (int k = 0; k < trains_size; ++k) {
+    matches_sizes[k] = 0;
+  }
+
+  for (int q0 = 0; q0 < query_rows; q0 += kHammingQueryBlock) {
+    const int qn = query_rows - q0 < kHammingQueryBlock
+        ? query_rows - q0 : kHammingQueryBlock;
+    for (int k = 0; k < trains_size; ++k) {
+      const uchar* train = trains[k].descriptors;
+      const int train_rows = trains[k].rows;
+      for (int q = 0; q < qn; ++q) {
+        best[q] = INT_MAX;
+        second[q] = INT_MAX;
+        best_idx[q] = -1;
+      }
+
+      for (int t0 = 0; t0 < train_rows; t0 += train_block) {
+        const int t1 = train_rows - t0 < train_block
+            ? train_rows : t0 + train_block;
+        for (int q = 0; q < qn; ++q) {
+          const uchar* qd = query + static_cast<size_t>(q0 + q) * stride;
+          int b = best[q];
+          int s = second[q];
+          int bi = best_idx[q];
+          const uchar* td = train + static_cast<size_t>(t0) * stride;
+          for (int t = t0; t < t1; ++t, td += stride) {
+            const int d = Dist::template Distance<kStride>(qd, td, stride);
+            if (d < s) {
+              if (d < b) {
+                s = b;
+                b = d;
+                bi = t;
+              } else {
+                s = d;
+              }
+            }
+          }
+          best[q] = b;
+          second[q] = s;
+          best_idx[q] = bi;
+        }
+      }
+
+      // Lowe's ratio test, two train rows at least as knn
+      for (int q = 0; q < qn; ++q) {
+        if (best_idx[q] < 0 || second[q] == INT_MAX) continue;
+        if (best[q] < ratio_thresh * second[q]) {
+          cv::DMatch& m = matches[k][matches_sizes[k]++];
+          m.queryIdx = q0 + q;
+          m.trainIdx = best_idx[q];
+          m.imgIdx = 0;
+          m.distance = static_cast<float>(best[q]);
+        }
+      }
+    }
+  }
+}
+
+template<class Dist>
+void HammingKnn2RatioDispatch(const uchar* query, const int query_rows,
+                              const HammingTrainSet* trains,
+                              const int trains_size,
+                              const int stride, const float ratio_thresh,
+                              cv::DMatch* const* matches, int* matches_sizes) {
+  switch (stride) {
+    case 32:
+      HammingKnn2Ratio<32, Dist>(query, query_rows, trains, trains_size,
+                                 stride, ratio_thresh, matches, matches_sizes);
+      break;
+    case 64:
+      HammingKnn2Ratio<64, Dist>(query, query_rows, trains, trains_size,
+                                 stride, ratio_thresh, matches, matches_sizes);
+      break;
+    default:
+      HammingKnn2Ratio<0, Dist>(query, query_rows, trains, trains_size,
+                                stride, ratio_thresh, matches, matches_sizes);
+  }
+}
+
+template<int kStride, class Dist>
+int HammingRowDistance(const uchar* a, const uchar* b, const int stride) {
+  return Dist::template Distance<kStride>(a, b, stride);
+}
+
+template<class Dist>
+HammingDistanceFunc HammingDistanceFuncDispatch(const int stride) {
+  switch (stride) {
+    case 32: return &HammingRowDistance<32, Dist>;
+    case 64: return &HammingRowDistance<64, Dist>;
+    default: return &HammingRowDistance<0, Dist>;
+  }
+}
+
+// Kernels of the ISA translation units
+void HammingKnn2RatioScalar(const uchar* query, const int query_rows,
+                            const HammingTrainSet* trains,
+                            const int trains_size,
+                            const int stride, const float ratio_thresh,
+                            cv::DMatch* const* matches, int* matches_sizes);
+HammingDistanceFunc HammingDistanceFuncScalar(const int stride);
+#ifdef CV_GL_HAMMING_AVX2
+void HammingKnn2RatioAvx2(const uchar* query, const int query_rows,
+                          const HammingTrainSet* trains,
+                          const int trains_size,
+                          const int stride, const float ratio_thresh,
+                          cv::DMatch* const* matches, int* matches_sizes);
+HammingDistanceFunc HammingDistanceFuncAvx2(const int stride);
+#endif
+#ifdef CV_GL_HAMMING_AVX512
+void HammingKnn2RatioAvx512(const uchar* query, const int query_rows,
+                            const HammingTrainSet* trains,
+                            const int trains_size,
+                            const int stride, const float ratio_thresh,
+                            cv::DMatch* const* matches, int* matches_sizes);
+HammingDistanceFunc HammingDistanceFuncAvx512(const int stride);
+#endif
+
+
+#endif  // CV_GL_HAMMING_KERNELS_HPP_
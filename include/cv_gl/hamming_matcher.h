@@ -0,0 +1,51 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_HAMMING_MATCHER_H_
+#define CV_GL_HAMMING_MATCHER_H_
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Brute force 2-NN Hamming matcher for binary descriptors in the
+// CompactFeatures layout: rows are `stride` bytes apart and zero padded,
+// so whole strides are compared. Kernels are specialized on the stride
+// (32 - ORB, 64 - AKAZE 61 bytes and BRISK) and picked at runtime by the
+// CPU: AVX-512 VPOPCNTDQ, AVX2 or scalar popcount.
+// Query x train is processed in cache sized blocks and Lowe's ratio test
+// is fused in, so only accepted matches are written, one flat array
+// without per query allocations.
+
+typedef int (*HammingDistanceFunc)(const uchar* a, const uchar* b,
+                                   const int stride);
+
+// Train descriptors of one partner image
+struct HammingTrainSet {
+  const uchar* descriptors;
+  int rows;
+};
+
+// Appends DMatch(query, best_train, 0, dist) ordered by query index for
+// the queries with best < ratio_thresh * second best (two train rows at
+// least)
+void MatchHammingKnn2(const uchar* query, const int query_rows,
+                      const uchar* train, const int train_rows,
+                      const int stride, const float ratio_thresh,
+                      std::vector<cv::DMatch>& matches);
+
+// One query image against all its partners in one pass: every query block
+// is matched with all train sets while it's hot. matches[k] gets the same
+// matches as MatchHammingKnn2 with trains[k] would append.
+void MatchHammingKnn2Batch(
+    const uchar* query, const int query_rows,
+    const std::vector<HammingTrainSet>& trains,
+    const int stride, const float ratio_thresh,
+    const std::vector<std::vector<cv::DMatch>*>& matches);
+
+// Distance of two rows for the random access (guided) matching
+HammingDistanceFunc GetHammingDistanceFunc(const int stride);
+
+// Kernel used on this CPU: "avx512_vpopcnt", "avx2" or "scalar"
+const char* HammingKernelName();
+
+
+#endif  // CV_GL_HAMMING_MATCHER_H_
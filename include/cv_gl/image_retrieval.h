@@ -0,0 +1,62 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_IMAGE_RETRIEVAL_H_
+#define CV_GL_IMAGE_RETRIEVAL_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cv_gl/vocabulary_tree.h"
+
+// Inverted index of the image bag of words vectors by image key
+// (<record>/<camera>/<image>). Images are only added, so the index is
+// kept in the features cache and updated by every run with the new
+// images. It's valid for one vocabulary (Id), other ones start empty.
+//
+// File layout (native endianness):
+//   header: magic "RIX1", version, images, vocabulary id (uint64)
+//   per image: key length, key, words, (word, weight) pairs
+#define RETRIEVAL_INDEX_MAGIC  0x31584952u
+#define RETRIEVAL_INDEX_VERSION  1
+#define RETRIEVAL_INDEX_FILE  "retrieval.idx"
+
+class ImageRetrievalIndex {
+public:
+  explicit ImageRetrievalIndex(const uint64_t vocabulary_id = 0)
+      : vocabulary_id_(vocabulary_id) {}
+
+  // Loads only an index of the same vocabulary, false otherwise
+  bool Load(const std::string& file, const uint64_t vocabulary_id);
+  bool Save(const std::string& file) const;
+
+  // Image id of the key, -1 if not indexed
+  int Find(const std::string& key) const;
+  // Adds a new image (or returns id of the existing one)
+  int Add(const std::string& key, const BowVector& bow);
+  int Count() const { return static_cast<int>(bows_.size()); }
+  const BowVector& Bow(const int id) const { return bows_[id]; }
+
+  // Best scored images for the vector among allowed ones (allowed[id]
+  // != 0, nullptr - all), top_k at most, best first. Only images sharing
+  // words are visited (inverted lists).
+  std::vector<std::pair<int, float> > Query(
+      const BowVector& bow, const int top_k,
+      const std::vector<char>* allowed = nullptr) const;
+
+private:
+  uint64_t vocabulary_id_;
+  std::vector<std::string> keys_;
+  std::vector<BowVector> bows_;
+  std::unordered_map<std::string, int> ids_;
+  // word -> (image id, weight)
+  std::unordered_map<int, std::vector<std::pair<int, float> > > inverted_;
+
+  // Query accumulators, reused between queries
+  mutable std::vector<float> scores_;
+  mutable std::vector<int> touched_;
+};
+
+
+#endif  // CV_GL_IMAGE_RETRIEVAL_H_
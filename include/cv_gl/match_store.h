@@ -0,0 +1,118 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_MATCH_STORE_H_
+#define CV_GL_MATCH_STORE_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cv_gl/compact_matches.h"
+
+// Log structured store of the pair matches in a few append only segment
+// files instead of one file per pair. Records are only appended, the last
+// record of a key wins. Index (key -> record location) is kept in memory
+// and loaded on Open from the hint files of the segments, or by scanning
+// the segments without one. Every Open appends into its own new segment,
+// records of the older ones are never changed, Compact() rewrites the
+// live records and drops the rest.
+//
+// Get/Put are safe to call from many threads of one process. Processes
+// sharing the dir append into their own segments (locked with flock
+// while written); Refresh() indexes the records the others have added
+// since Open. Compact() is refused while another process writes.
+//
+// Segment <id>.mseg: magic "MSG1", version, then records:
+//   key length, payload bytes, checksum (FNV-1a of key + payload), key,
+//   payload: CompactMatches::Encode of the matches (version 2) or
+//   matches count, per match queryIdx, trainIdx, imgIdx, distance (1)
+// Version 1 segments are read, Compact() rewrites them as version 2.
+// Hint <id>.mhint: magic "MHN1", version, segment bytes (uint64), count,
+//   per record: key length, key, offset (uint64), record bytes
+#define MATCH_STORE_MAGIC  0x3147534du
+#define MATCH_STORE_HINT_MAGIC  0x314e484du
+#define MATCH_STORE_VERSION  2
+#define MATCH_STORE_HINT_VERSION  1
+#define MATCH_STORE_SEGMENT_EXT  ".mseg"
+#define MATCH_STORE_HINT_EXT  ".mhint"
+
+class MatchStore {
+public:
+  // Segments are rotated after kMatchSegmentBytes
+  static const uint64_t kMatchSegmentBytes = 256ull << 20;
+
+  // nullptr if the dir can't be created or read
+  static std::shared_ptr<MatchStore> Open(const std::string& dir);
+  // Seals the segment written by this store (writes its hint)
+  ~MatchStore();
+
+  bool Get(const std::string& key, CompactMatches& matches) const;
+  bool Put(const std::string& key, const CompactMatches& matches);
+  bool Contains(const std::string& key) const;
+  // Loads the segments created and scans the records appended by other
+  // processes
+  void Refresh();
+  int Count() const;
+  std::vector<std::string> Keys() const;
+
+  // Bytes of the records in the index and of the overwritten ones
+  uint64_t LiveBytes() const;
+  uint64_t DeadBytes() const;
+
+  // Rewrites the live records into new segments (key order) and removes
+  // the old segments. Any record that can't be read keeps the old segments
+  // (false).
+  bool Compact();
+
+private:
+  struct Segment {
+    Segment(const int segment_id, const int segment_fd)
+        : id(segment_id), fd(segment_fd), size(0),
+          version(MATCH_STORE_VERSION), live(false) {}
+    ~Segment();
+    int id;
+    int fd;
+    // Bytes indexed (valid records) of the segment
+    uint64_t size;
+    uint32_t version;
+    // Still written by another process
+    bool live;
+  };
+  struct Location {
+    int segment;
+    uint64_t offset;
+    uint32_t bytes;
+  };
+
+  explicit MatchStore(const std::string& dir)
+      : dir_(dir), next_segment_(1), live_bytes_(0), dead_bytes_(0) {}
+
+  std::string SegmentFile(const int id) const;
+  std::string HintFile(const int id) const;
+  bool LoadSegment(const int id);
+  bool LoadHint(const Segment& segment);
+  // Indexes the records from segment.size up to file_size
+  bool ScanSegment(Segment& segment, const uint64_t file_size);
+  std::vector<int> ListSegments(bool& ok) const;
+  void WriteHint(const Segment& segment) const;
+  void IndexLocked(const std::string& key, const Location& location);
+  // Appends one complete record into the active segment (new or rotated)
+  bool AppendLocked(const std::string& key, const char* record,
+                    const uint32_t bytes);
+  void SealLocked();
+
+  std::string dir_;
+  int next_segment_;
+  std::map<int, std::shared_ptr<Segment> > segments_;
+  std::shared_ptr<Segment> active_;
+  std::unordered_map<std::string, Location> index_;
+  uint64_t live_bytes_;
+  uint64_t dead_bytes_;
+  mutable std::mutex mu_;
+};
+
+
+#endif  // CV_GL_MATCH_STORE_H_
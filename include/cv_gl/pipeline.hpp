@@ -0,0 +1,232 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_PIPELINE_HPP_
+#define CV_GL_PIPELINE_HPP_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+
+// Time the calling thread was blocked in BoundedQueue::Push (usec), so a
+// stage that pushes downstream from its process can leave it out of its
+// busy time
+inline long& PipelinePushWaitUs() {
+  static thread_local long push_wait_us = 0;
+  return push_wait_us;
+}
+
+// Blocking FIFO with a fixed capacity. Producers wait on a full queue
+// (backpressure) and consumers wait on an empty one until it's closed.
+// Queue occupancy and wait times are accumulated for the stats report.
+template<typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(std::max<size_t>(capacity, 1)),
+        closed_(false),
+        occupancy_sum_(0),
+        occupancy_samples_(0),
+        occupancy_max_(0),
+        push_wait_us_(0),
+        pop_wait_us_(0) {}
+
+  // Returns false if the queue was closed and the item is dropped
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lck(mu_);
+    if (items_.size() >= capacity_ && !closed_) {
+      auto t0 = std::chrono::high_resolution_clock::now();
+      not_full_.wait(lck, [this]() {
+        return items_.size() < capacity_ || closed_;
+      });
+      const long wait_us = ElapsedUs(t0);
+      push_wait_us_ += wait_us;
+      PipelinePushWaitUs() += wait_us;
+    }
+    if (closed_) return false;
+    items_.push_back(std::move(item));
+    Sample();
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Returns false when the queue is closed and drained
+  bool Pop(T& item) {
+    std::unique_lock<std::mutex> lck(mu_);
+    if (items_.empty() && !closed_) {
+      auto t0 = std::chrono::high_resolution_clock::now();
+      not_empty_.wait(lck, [this]() {
+        return !items_.empty() || closed_;
+      });
+      pop_wait_us_ += ElapsedUs(t0);
+    }
+    if (items_.empty()) return false;
+    item = std::move(items_.front());
+    items_.pop_front();
+    Sample();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // No more pushes, consumers drain what's left
+  void Close() {
+    std::lock_guard<std::mutex> lck(mu_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  size_t Capacity() const { return capacity_; }
+
+  double AvgOccupancy() const {
+    std::lock_guard<std::mutex> lck(mu_);
+    return occupancy_samples_ > 0
+        ? static_cast<double>(occupancy_sum_) / occupancy_samples_ : 0.0;
+  }
+  size_t MaxOccupancy() const {
+    std::lock_guard<std::mutex> lck(mu_);
+    return occupancy_max_;
+  }
+  // Time producers were blocked on the full queue (sec)
+  double PushWaitTime() const {
+    std::lock_guard<std::mutex> lck(mu_);
+    return push_wait_us_ / 1e+6;
+  }
+  // Time consumers were starving on the empty queue (sec)
+  double PopWaitTime() const {
+    std::lock_guard<std::mutex> lck(mu_);
+    return pop_wait_us_ / 1e+6;
+  }
+
+  void PrintStats(const std::string& name, std::ostream& os = std::cout) const {
+    os << "queue " << name << ": capacity = " << Capacity()
+       << ", occupancy_avg = " << AvgOccupancy()
+       << ", occupancy_max = " << MaxOccupancy()
+       << ", push_wait = " << PushWaitTime()
+       << ", pop_wait = " << PopWaitTime()
+       << std::endl;
+  }
+
+private:
+  void Sample() {
+    occupancy_sum_ += items_.size();
+    ++occupancy_samples_;
+    occupancy_max_ = std::max(occupancy_max_, items_.size());
+  }
+  static long ElapsedUs(std::chrono::high_resolution_clock::time_point t0) {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(high_resolution_clock::now() - t0).count();
+  }
+
+  const size_t capacity_;
+  std::deque<T> items_;
+  bool closed_;
+  mutable std::mutex mu_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+
+  // stats
+  size_t occupancy_sum_;
+  size_t occupancy_samples_;
+  size_t occupancy_max_;
+  long push_wait_us_;
+  long pop_wait_us_;
+};
+
+
+// Pool of worker threads that pop items from an input queue and process
+// them. The last finished worker calls on_finish (usually closes the output
+// queue of the stage so the next stage can drain and stop).
+class PipelineStage {
+public:
+  PipelineStage(const std::string& name, int concurrency)
+      : name_(name),
+        concurrency_(std::max(concurrency, 1)),
+        running_(0),
+        items_(0),
+        busy_us_(0),
+        wall_us_(0) {}
+
+  ~PipelineStage() { Join(); }
+
+  template<typename In, typename Fn>
+  void Run(BoundedQueue<In>& input, Fn process,
+           std::function<void()> on_finish = std::function<void()>()) {
+    using namespace std::chrono;
+    t0_ = high_resolution_clock::now();
+    running_ = concurrency_;
+    for (int i = 0; i < concurrency_; ++i) {
+      threads_.push_back(std::thread([this, &input, process, on_finish]() {
+        In item;
+        while (input.Pop(item)) {
+          // Backpressure of the downstream queue isn't work
+          const long wait0 = PipelinePushWaitUs();
+          auto t0 = high_resolution_clock::now();
+          process(item);
+          auto t1 = high_resolution_clock::now();
+          busy_us_ += duration_cast<microseconds>(t1 - t0).count()
+                      - (PipelinePushWaitUs() - wait0);
+          ++items_;
+        }
+        if (--running_ == 0) {
+          wall_us_ = duration_cast<microseconds>(
+              high_resolution_clock::now() - t0_).count();
+          if (on_finish) on_finish();
+        }
+      }));
+    }
+  }
+
+  void Join() {
+    for (auto& th : threads_) {
+      if (th.joinable()) th.join();
+    }
+  }
+
+  const std::string& Name() const { return name_; }
+  int Concurrency() const { return concurrency_; }
+  int Items() const { return items_.load(); }
+  // Accumulated processing time of all workers without the time blocked
+  // on full downstream queues (sec)
+  double BusyTime() const { return busy_us_.load() / 1e+6; }
+  // From start till the last worker finished (sec)
+  double WallTime() const { return wall_us_.load() / 1e+6; }
+  // Share of the stage capacity spent on processing
+  double Utilization() const {
+    double wall = WallTime() * concurrency_;
+    return wall > 0.0 ? BusyTime() / wall : 0.0;
+  }
+  double Throughput() const {
+    double wall = WallTime();
+    return wall > 0.0 ? Items() / wall : 0.0;
+  }
+
+  void PrintStats(std::ostream& os = std::cout) const {
+    os << "stage " << name_ << ": concurrency = " << concurrency_
+       << ", items = " << Items()
+       << ", busy_time = " << BusyTime()
+       << ", wall_time = " << WallTime()
+       << ", throughput = " << Throughput() << " items/s"
+       << ", utilization = " << Utilization()
+       << std::endl;
+  }
+
+private:
+  std::string name_;
+  int concurrency_;
+  std::vector<std::thread> threads_;
+  std::atomic<int> running_;
+  std::atomic<int> items_;
+  std::atomic<long> busy_us_;
+  std::atomic<long> wall_us_;
+  std::chrono::high_resolution_clock::time_point t0_;
+};
+
+
+#endif  // CV_GL_PIPELINE_HPP_
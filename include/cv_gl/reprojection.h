@@ -0,0 +1,117 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_REPROJECTION_H_
+#define CV_GL_REPROJECTION_H_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cv_gl/sfm_common.h"
+
+// Projections of the cameras computed once instead of GetProjMatrix per
+// observation (Euler angles trig, glm and cv::Mat products): CenteredProj
+// is the 3x3 float K * R^T of the camera at its center (row major), the
+// point relative to Center() is small enough for float while the world
+// coordinates of the records are not.
+class CameraProjections {
+public:
+  CameraProjections() {}
+  // Matrices of the cameras that are the same in prev are copied
+  explicit CameraProjections(const std::vector<CameraInfo>& cameras,
+                             const CameraProjections* prev = nullptr);
+
+  size_t size() const { return cameras_.size(); }
+  const float* CenteredProj(const int camera) const {
+    return &centered_proj_[9 * camera];
+  }
+  const double* Center(const int camera) const {
+    return &center_[3 * camera];
+  }
+
+  // True if made of these cameras (count, intrinsics and poses)
+  bool SameCameras(const std::vector<CameraInfo>& cameras) const;
+
+private:
+  std::vector<CameraInfo> cameras_;
+  std::vector<float> centered_proj_;
+  std::vector<double> center_;
+};
+
+// Projections of the current cameras for the SfM3D cameras_ that grows
+// and may be restored: Get recomputes them only when the cameras changed
+// since the previous Get (and only the changed ones). Safe to call from
+// the viewer and the reconstruction threads, the returned projections
+// don't change and stay valid while held.
+class CameraProjectionCache {
+public:
+  std::shared_ptr<const CameraProjections> Get(
+      const std::vector<CameraInfo>& cameras);
+
+private:
+  std::mutex mu_;
+  std::shared_ptr<const CameraProjections> projections_;
+};
+
+// Worker threads kept between the batch reprojections (the viewer asks
+// for the map errors on every update), started on the first Run. Runs
+// one task at a time, concurrent callers wait for each other.
+class ReprojectionWorkers {
+public:
+  // Threads with the calling one (0 - hardware concurrency)
+  explicit ReprojectionWorkers(const int threads = 0) : threads_(threads) {}
+  ~ReprojectionWorkers();
+
+  int size() const;
+  // task() on every worker and the calling thread, returns when all of
+  // them are done
+  void Run(const std::function<void()>& task);
+
+private:
+  ReprojectionWorkers(const ReprojectionWorkers&) = delete;
+  ReprojectionWorkers& operator=(const ReprojectionWorkers&) = delete;
+  void Loop();
+
+  const int threads_;
+  std::mutex run_mu_;
+  std::mutex mu_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const std::function<void()>* task_ = nullptr;
+  long generation_ = 0;
+  int pending_ = 0;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
+// Reprojection errors of the map points. Error of an observation is
+// 0.5 * (dx^2 + dy^2), the term of GetReprojectionError.
+struct MapReprojectionErrors {
+  // Sum of the observation errors of the point / its views count
+  // (GetReprojectionErrors)
+  std::vector<double> point_errors;
+  // Observations of the point i (in order of its views) are
+  // [observation_offsets[i], observation_offsets[i + 1])
+  std::vector<int> observation_offsets;
+  std::vector<float> observation_errors;
+  // Sum of all observation errors (GetReprojectionError of the map)
+  double total = 0.0;
+};
+
+// Batch reprojection of all map observations: the points are split into
+// blocks between the workers (nullptr or small maps - the calling thread
+// only), a block gathers its observations into flat arrays and projects
+// them by the SIMD kernel of the CPU (reprojection_kernels.hpp).
+void ComputeReprojectionErrors(const Map3D& map,
+                               const CameraProjections& projections,
+                               const std::vector<CompactFeatures>& features,
+                               MapReprojectionErrors& errors,
+                               ReprojectionWorkers* workers = nullptr);
+
+// Reprojection kernel picked for this CPU (avx2, scalar)
+const char* ReprojectionKernelName();
+
+
+#endif  // CV_GL_REPROJECTION_H_
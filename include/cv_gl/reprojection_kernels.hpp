@@ -0,0 +1,32 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_REPROJECTION_KERNELS_HPP_
+#define CV_GL_REPROJECTION_KERNELS_HPP_
+
+// Internal part of the batch reprojection. The same as the hamming
+// kernels (see hamming_kernels.hpp) every ISA lives in its own translation
+// unit built with its -m flags and is picked at runtime by the CPU. The
+// kernels use the plain arrays only, no std or cv inline functions.
+
+// Observations of a block as flat arrays: point relative to the camera
+// center, keypoint and the centered projection of the camera (row major)
+struct ReprojectionArrays {
+  const float* x;
+  const float* y;
+  const float* z;
+  const float* u;
+  const float* v;
+  const float* m[9];
+};
+
+// err[j] = 0.5 * (dx^2 + dy^2) of the observations [0, count), every ISA
+// does the same float operations in the same order, so the errors don't
+// depend on the kernel
+void ReprojectArraysScalar(const ReprojectionArrays& a, const int count,
+                           float* err);
+#ifdef CV_GL_REPROJECTION_AVX2
+void ReprojectArraysAvx2(const ReprojectionArrays& a, const int count,
+                         float* err);
+#endif
+
+
+#endif  // CV_GL_REPROJECTION_KERNELS_HPP_
@@ -29,6 +29,36 @@ void load(Archive& archive, ImagePair& ip) {
   archive(ip.first, ip.second);
 }
 
+// == Image pairs of SfM3D ==============
+// With the pairs left out by the pairs scheduler after the tag, archives
+// without it start with the size of std::vector<ImagePair>
+#define IMAGE_PAIRS_VEC_TAG 0x3153524941504943ULL
+
+struct ImagePairsVec {
+  std::vector<ImagePair>& pairs;
+  std::vector<ImagePair>& skipped_pairs;
+};
+
+template<class Archive>
+void save(Archive& archive, const ImagePairsVec& pv) {
+  uint64_t tag = IMAGE_PAIRS_VEC_TAG;
+  archive(tag, pv.pairs, pv.skipped_pairs);
+}
+template<class Archive>
+void load(Archive& archive, ImagePairsVec& pv) {
+  uint64_t tag;
+  archive(tag);
+  if (tag == IMAGE_PAIRS_VEC_TAG) {
+    archive(pv.pairs, pv.skipped_pairs);
+    return;
+  }
+  pv.pairs.resize(tag);
+  for (ImagePair& ip : pv.pairs) {
+    archive(ip);
+  }
+  pv.skipped_pairs.clear();
+}
+
 // == CameraIntrinsics =========================
 template<class Archive>
 void save(Archive& archive, const CameraIntrinsics& ci) {
@@ -111,6 +141,111 @@ void load(Archive& archive, Features& f) {
   archive(f.keypoints, f.descriptors);
 }
 
+// == CompactFeatures ==================
+// Arrays are written from the views (owned or wrapped ones) in the layout
+// of std::vector, descriptors without the row padding
+template<class Archive>
+void save(Archive& archive, const CompactFeatures& f) {
+  int n = f.size();
+  archive(n, f.descriptor_type_, f.descriptor_cols_);
+  archive(cereal::binary_data(f.points(), n * sizeof(cv::Point2f)));
+  archive(cereal::make_size_tag(static_cast<cereal::size_type>(n)));
+  archive(cereal::binary_data(f.sizes(), n * sizeof(uint16_t)));
+  archive(cereal::make_size_tag(static_cast<cereal::size_type>(n)));
+  archive(cereal::binary_data(f.angles(), n * sizeof(uint16_t)));
+  archive(cereal::make_size_tag(static_cast<cereal::size_type>(n)));
+  archive(cereal::binary_data(f.octaves(), n * sizeof(int8_t)));
+  bool has_descriptors = f.HasDescriptors();
+  archive(has_descriptors);
+  if (has_descriptors) {
+    for (int i = 0; i < n; ++i) {
+      archive(cereal::binary_data(f.descriptor(i), f.descriptor_bytes()));
+    }
+  }
+}
+template<class Archive>
+void load(Archive& archive, CompactFeatures& f) {
+  f.Clear();
+  int n, type, cols;
+  archive(n, type, cols);
+  f.SetDescriptorLayout(type, cols);
+  f.points_.resize(n);
+  archive(cereal::binary_data(f.points_.data(),
+                              n * sizeof(cv::Point2f)));
+  archive(f.sizes_, f.angles_, f.octaves_);
+  bool has_descriptors;
+  archive(has_descriptors);
+  if (has_descriptors) {
+    f.descriptors_.assign(static_cast<size_t>(n) * f.descriptor_stride_, 0);
+    for (int i = 0; i < n; ++i) {
+      archive(cereal::binary_data(
+          f.descriptors_.data() + i * f.descriptor_stride_,
+          f.descriptor_bytes()));
+    }
+  }
+  f.UpdateViews();
+}
+
+// == Image features of SfM3D ===========
+// Tagged so archives stored before the compact features (plain
+// std::vector<Features>) are still loaded and converted, the second tag
+// has the features cache namespace of the extraction in front
+#define COMPACT_FEATURES_VEC_TAG 0x3146434d4f435643ULL
+#define COMPACT_FEATURES_NS_VEC_TAG 0x3246434d4f435643ULL
+
+struct CompactFeaturesVec {
+  std::vector<CompactFeatures>& features;
+  // Unknown (false) for the archives without it
+  bool& has_namespace;
+  std::string& cache_namespace;
+};
+
+template<class Archive>
+void save(Archive& archive, const CompactFeaturesVec& fv) {
+  uint64_t tag = COMPACT_FEATURES_NS_VEC_TAG;
+  archive(tag, fv.has_namespace, fv.cache_namespace, fv.features);
+}
+template<class Archive>
+void load(Archive& archive, CompactFeaturesVec& fv) {
+  // Either the tag or the size of legacy std::vector<Features>
+  uint64_t tag;
+  archive(tag);
+  if (tag == COMPACT_FEATURES_NS_VEC_TAG) {
+    archive(fv.has_namespace, fv.cache_namespace, fv.features);
+    return;
+  }
+  fv.has_namespace = false;
+  fv.cache_namespace.clear();
+  if (tag == COMPACT_FEATURES_VEC_TAG) {
+    archive(fv.features);
+    return;
+  }
+  fv.features.clear();
+  fv.features.resize(tag);
+  for (uint64_t i = 0; i < tag; ++i) {
+    Features features;
+    archive(features);
+    fv.features[i].Assign(features);
+  }
+}
+
+// == CompactMatches ===================
+// As the encoded bytes (delta coded index pairs)
+template<class Archive>
+void save(Archive& archive, const CompactMatches& m) {
+  std::vector<uint8_t> data;
+  m.Encode(data);
+  archive(data);
+}
+template<class Archive>
+void load(Archive& archive, CompactMatches& m) {
+  std::vector<uint8_t> data;
+  archive(data);
+  if (!m.Decode(data.data(), data.size())) {
+    std::cerr << "Broken matches data" << std::endl;
+  }
+}
+
 // == Matches ==========================
 template<class Archive>
 void save(Archive& archive, const Matches& m) {
@@ -121,6 +256,38 @@ void load(Archive& archive, Matches& m) {
   archive(m.image_index, m.match);
 }
 
+// == Image matches of SfM3D ============
+// Tagged so archives stored before the compact matches (std::vector<Matches>
+// with std::vector<cv::DMatch> inside) are still loaded and converted
+#define COMPACT_MATCHES_VEC_TAG 0x3148434d4f435643ULL
+
+struct MatchesVec {
+  std::vector<Matches>& matches;
+};
+
+template<class Archive>
+void save(Archive& archive, const MatchesVec& mv) {
+  uint64_t tag = COMPACT_MATCHES_VEC_TAG;
+  archive(tag, mv.matches);
+}
+template<class Archive>
+void load(Archive& archive, MatchesVec& mv) {
+  // Either the tag or the size of legacy std::vector<Matches>
+  uint64_t tag;
+  archive(tag);
+  if (tag == COMPACT_MATCHES_VEC_TAG) {
+    archive(mv.matches);
+    return;
+  }
+  mv.matches.clear();
+  mv.matches.resize(tag);
+  std::vector<cv::DMatch> match;
+  for (uint64_t i = 0; i < tag; ++i) {
+    archive(mv.matches[i].image_index, match);
+    mv.matches[i].match.Assign(match);
+  }
+}
+
 
 namespace cv {
 
@@ -19,6 +19,8 @@
 #include "cv_gl/utils.h"
 #include "cv_gl/camera.h"
 #include "cv_gl/ccomp.hpp"
+#include "cv_gl/track_table.h"
+#include "cv_gl/reprojection.h"
 #include "cv_gl/cache_storage.hpp"
 
 // #include <cereal/cereal.hpp>
@@ -27,6 +29,18 @@
 
 // #include <cereal/details/traits.hpp>
 
+// Concurrency of ExtractFeatures pipeline stages: read -> decode ->
+// thumbnail -> extract -> cache write (0 - choose automatically)
+struct ExtractPipelineConfig {
+  int read_threads = 0;
+  int decode_threads = 0;
+  int thumbnail_threads = 0;
+  int extract_threads = 0;
+  int cache_threads = 0;
+  // Max items waiting in between of the stages
+  int queue_size = 4;
+};
+
 class SfM3D {
 public:
   typedef std::pair<int, int> IntPair;
@@ -75,7 +89,22 @@ public:
                  const std::vector<ImageData>& camera2_images,
                  const bool make_pairs = true, const int look_back = 5);
   void ExtractFeatures();
+  // Extraction and matching throughput of the features backends on the
+  // same first max_images images and their pairs (no cache used)
+  void BenchmarkFeatureBackends(const std::vector<std::string>& backends,
+                                const int max_images,
+                                const double max_line_dist = 10.0);
   void Print(std::ostream& os = std::cout) const;
+  // Brute force and epipolar guided matching of the same first max_pairs
+  // pairs (MATCHES_BENCH lines), no matches cache used
+  void BenchmarkGuidedMatching(const int max_pairs,
+                               const double max_line_dist = 10.0);
+  // Epipolar filter of pair_matches random matches per pair on the first
+  // max_pairs pairs: per match cv::Mat + erase against the batched kernel
+  // (EPIPOLAR_BENCH lines)
+  void BenchmarkEpipolarFilter(const int max_pairs,
+                               const int pair_matches = 30000,
+                               const double max_line_dist = 10.0);
   void MatchImageFeatures(const int skip_thresh = 10, 
                           const double max_line_dist = 10.0, 
                           const bool use_cache = true);
@@ -84,6 +113,15 @@ public:
   void ReconstructAll();
   void PrintFinalStats();
 
+  // Phase aware memory: descriptors are used by matching only, so they are
+  // dropped after it (spilled to the features cache if not there yet) and
+  // reloaded lazily when some later stage asks for them
+  void EvictDescriptors();
+  bool LoadDescriptors(const int img_id);
+  void LoadAllDescriptors();
+  // MEMORY_PHASE line with peak RSS since the last ::ResetPeakRSS()
+  void ReportMemoryPhase(const std::string& phase);
+
   bool GetMapPointsVec(std::vector<Point3DColor>& glm_points);
   bool GetMapCamerasWithPointsVec(MapCameras& map_cameras);
   void GetMapPointsAndCameras(std::vector<Point3DColor>& glm_points,
@@ -117,6 +155,31 @@ public:
   double repr_error_thresh;
   double max_merge_dist;
   double resize_scale = 0.08;
+  // Next views triangulate every track they see once over all the used
+  // views instead of pairwise with each used view
+  bool multiview_triangulation = true;
+
+  ExtractPipelineConfig extract_pipeline;
+  FeatureExtractionParams feature_params;
+  // Epipolar band guided matching instead of brute force knn
+  bool matches_guided = true;
+  // Brute force knn with MatchHammingKnn2 instead of cv::BFMatcher
+  bool matches_simd_knn = true;
+  // Match all pairs of a query image by one thread in one pass
+  bool matches_batched = true;
+  // Pairs from the top_k most similar images by the vocabulary tree (if
+  // the features cache has one) when AddImages made no pairs, 0 - all pairs
+  int pairs_retrieval_top_k = 0;
+  // Cross record pairs per new image (0 - all) with the view overlap
+  // (GetViewOverlapScore) above pairs_min_overlap
+  int pairs_cross_budget = 10;
+  double pairs_min_overlap = 0.0;
+  // Pairs scheduler: partners of a query image are matched by the view
+  // overlap order and the rest are skipped after pairs_stop_misses
+  // partners in a row below the matches threshold or pairs_target_partners
+  // good ones (0 - off)
+  int pairs_stop_misses = 0;
+  int pairs_target_partners = 0;
   
 
   // TODO: https://www.patrikhuber.ch/blog/6-serialising-opencv-matrices-using-boost-and-cereal
@@ -137,17 +200,25 @@ public:
     archive(repr_error_thresh);
     archive(max_merge_dist);
     archive(images_resized_);
-    archive(image_features_);
-    archive(image_pairs_);
-    archive(image_matches_);
+    archive(CompactFeaturesVec{image_features_, features_namespace_known_,
+                               features_namespace_});
+    archive(ImagePairsVec{image_pairs_, scheduler_skipped_pairs_});
+    archive(MatchesVec{image_matches_});
     archive(todo_views_);
     archive(used_views_);
     archive(map_);
     archive(matches_index_);
-    archive(ccomp_);
+    archive(ComponentsTracks{ccomp_, tracks_});
+    // Converted legacy components get the ids of the keypoints counts
+    const std::vector<int> sizes = KeypointCounts();
+    ccomp_.SetSizes(sizes);
+    // Archives without the tracks (or of other keypoints counts)
+    if (!tracks_.HasSizes(sizes)) BuildTracks();
   }
 private:
   void GenerateAllPairs();
+  // False if there is no usable vocabulary in the features cache
+  bool GenerateRetrievalPairs(const int top_k);
 
   void TriangulatePointsFromViews(const int first_id, 
                                   const int second_id, 
@@ -156,29 +227,68 @@ private:
   void OptimizeMap(Map3D& map);
   
 
+  // Points of next_img_id triangulated with each used view it has matches
+  // with, a track gets a point per pair
+  void TriangulateViewPairs(const int next_img_id, Map3D& view_map);
+  // Point per track seen from next_img_id, solved over all its
+  // observations in the used views (N-view DLT), view_map has one point
+  // per track with the observations that pass the checks
+  void TriangulateViewTracks(const int next_img_id, Map3D& view_map);
   void ReconstructNextView(const int next_img_id);
   void ReconstructNextViewPair(const int first_id, const int second_id);
 
   int FindMaxSizeMatch(const bool within_todo_views = false) const;
 
+  void PrintBudgetReport(const double final_error) const;
+  std::string ImagePath(const int img_id) const;
+  // Features cache namespace image_features_ were extracted with, the one
+  // of feature_params for the archives without it
+  std::string FeaturesNamespace() const;
+  // Keypoints count per image, element ids of ccomp_
+  std::vector<int> KeypointCounts() const;
+  // Track table of ccomp_, component ids of the map points are its tracks
+  void BuildTracks();
+  // Reprojection errors of map_ with the cached projections of cameras_
+  void ComputeMapErrors(MapReprojectionErrors& errors);
+
   bool IsPairInOrder(const int p1, const int p2);
+  // Matches of the pairs (ids into image_pairs_, the same in order first
+  // image), restored from the cache or computed and cached
+  void MatchPairs(const std::vector<int>& pairs, const double max_line_dist,
+                  const bool use_cache, std::vector<Matches>& pairs_matches,
+                  std::vector<bool>& from_cache);
+  // Matches of pairs_matches[compute] (the same first image), not cached
+  void ComputePairsMatches(const std::vector<int>& compute,
+                           const double max_line_dist,
+                           std::vector<Matches>& pairs_matches);
   
 
   // Data Initial
   std::vector<CameraIntrinsics> intrinsics_;
   std::vector<ImageData> image_data_;
   std::vector<CameraInfo> cameras_;
+  // Projections of cameras_, recomputed when they change
+  CameraProjectionCache camera_projections_;
+  // Threads of ComputeMapErrors, kept for the viewer updates
+  ReprojectionWorkers reprojection_workers_;
   std::vector<cv::Mat> images_;
 
 
   std::vector<cv::Mat> images_resized_;
 
   // Pre-processing & Feature Extraction
-  std::vector<Features> image_features_;
+  std::vector<CompactFeatures> image_features_;
+  // Cache namespace of image_features_ (serialized with them)
+  bool features_namespace_known_ = false;
+  std::string features_namespace_;
   std::vector<ImagePair> image_pairs_;
+  // Pairs left out by the pairs scheduler (not matched, not cached)
+  std::vector<ImagePair> scheduler_skipped_pairs_;
 
   // Matching
-  CComponents<IntPair> ccomp_;
+  DenseCComponents ccomp_;
+  // Tracks of ccomp_, built once the matching is done
+  TrackTable tracks_;
   std::vector<Matches> image_matches_;
   std::map<IntPair, int> matches_index_;
   
@@ -194,6 +304,15 @@ private:
   // Preprocessing storage
   CacheStorage cache_storage;
 
+  // Stage times of the current run (not serialized, zero on restore)
+  double extract_time_ = 0.0;
+  double match_time_ = 0.0;
+
+  // Guards descriptors eviction and lazy reload
+  std::mutex descriptors_mu_;
+  // Peak RSS of the previous reported memory phase
+  size_t phase_peak_rss_ = 0;
+
 
   std::mutex map_mutex;
   std::condition_variable map_update_;
@@ -4,18 +4,83 @@
 #include <vector>
 #include <map>
 #include <unordered_set>
+#include <string>
+#include <functional>
 
 #include <opencv2/opencv.hpp>
 
 #include "cv_gl/utils.h"
 #include "cv_gl/camera.h"
 #include "cv_gl/ccomp.hpp"
+#include "cv_gl/track_table.h"
+#include "cv_gl/compact_features.h"
+#include "cv_gl/compact_matches.h"
 
 struct Features {
   std::vector<cv::KeyPoint> keypoints;
   cv::Mat descriptors;
 };
 
+// Feature extraction options. With tiles_x * tiles_y > 1 the image is split
+// into overlapping tiles that are extracted in parallel.
+struct FeatureExtractionParams {
+  // Detector/descriptor backend name, see FeatureBackendNames()
+  std::string backend = "akaze";
+
+  int tiles_x = 1;
+  int tiles_y = 1;
+  // Context (px) around every tile so detector/descriptor support near the
+  // tile border is the same as in the whole image
+  int tile_overlap = 96;
+  // Max keypoints per tile selected by response (0 - keep all)
+  int tile_max_keypoints = 0;
+  // Keypoints of neighbour tiles closer than that (px) are duplicates
+  double tile_dedup_dist = 2.0;
+  // Threads for the tiles (0 - one per tile up to hardware concurrency)
+  int tile_threads = 0;
+
+  // Per image keypoint budget (0 - keep all)
+  int max_keypoints = 0;
+  // Select budget with adaptive non-maximal suppression, so keypoints are
+  // spread over the image, otherwise just the strongest responses
+  bool anms = true;
+  // Tune AKAZE threshold per image to get about that many keypoints
+  // (0 - fixed akaze_threshold)
+  int target_keypoints = 0;
+  double target_tolerance = 0.1;
+  int target_max_iterations = 4;
+  double akaze_threshold = 0.001;
+
+  bool IsTiled() const { return tiles_x * tiles_y > 1; }
+  bool IsBudgeted() const { return max_keypoints > 0 || target_keypoints > 0; }
+
+  // Features extracted with different params (or backend) have different keypoint
+  // indices, so they (and matches) are cached separately.
+  // Empty for the default params.
+  std::string CacheNamespace() const;
+};
+
+// Feature detector/descriptor with the matching settings for its descriptors
+struct FeatureBackend {
+  std::string name;
+  // Descriptor row length in bytes
+  int descriptor_bytes;
+  // Matcher norm for the descriptors (cv::NORM_HAMMING etc)
+  int norm_type;
+  // Lowe's ratio test threshold
+  float match_ratio;
+  // Only AKAZE threshold can be tuned to the target_keypoints
+  bool tunable_threshold;
+  std::function<cv::Ptr<cv::Feature2D>(const FeatureExtractionParams&)> create;
+};
+
+// Registered backends: akaze (default), orb, brisk
+std::vector<std::string> FeatureBackendNames();
+// nullptr for unknown name
+const FeatureBackend* FindFeatureBackend(const std::string& name);
+// Falls back to akaze for unknown name
+const FeatureBackend& GetFeatureBackend(const std::string& name);
+
 struct ImagePair {
   int first;
   int second;
@@ -32,7 +97,7 @@ inline bool operator<(const ImagePair& ip1, const ImagePair& ip2) {
 
 struct Matches {
   ImagePair image_index;
-  std::vector<cv::DMatch> match;
+  CompactMatches match;
 };
 
 struct CameraInfo {
@@ -72,20 +137,65 @@ void CalcFundamental(const CameraInfo& camera_info1, const CameraInfo& camera_in
 cv::Mat CalcFundamental(const CameraIntrinsics& intr1, const ImageData& img_data1, const CameraIntrinsics& intr2, const ImageData& img_data2);
 
 void ExtractFeatures(cv::Mat img, Features& features);
+// Returns AKAZE threshold used, tuned one in the target_keypoints mode
+// (good start for the next similar image)
+double ExtractFeatures(cv::Mat img, Features& features,
+                       const FeatureExtractionParams& params);
+void ExtractFeaturesTiled(cv::Mat img, Features& features,
+                          const FeatureExtractionParams& params);
+// Indices (ascending) of num keypoints selected by adaptive non-maximal
+// suppression on response within image of img_size
+std::vector<int> SelectKeypointsANMS(const std::vector<cv::KeyPoint>& keypoints,
+                                     const int num,
+                                     const cv::Size& img_size);
+// Keeps at most max_keypoints with their descriptors
+void ApplyKeypointBudget(Features& features, const int max_keypoints,
+                         const bool anms, const cv::Size& img_size);
 void ExtractFeaturesAndCameraInfo(const std::string& image_path,
                                   const ImageData& im_data,
                                   const CameraIntrinsics& intr, 
                                   cv::Mat& img,
                                   Features& features,
                                   CameraInfo& camera_info);
-void ComputeLineKeyPointsMatch(const Features& features1, 
+// simd_knn - MatchHammingKnn2 instead of cv::BFMatcher (NORM_HAMMING only)
+void ComputeLineKeyPointsMatch(const CompactFeatures& features1, 
                                const CameraInfo camera_info1, 
-                               const Features& features2, 
+                               const CompactFeatures& features2, 
                                const CameraInfo& camera_info2, 
-                               Matches& matches);
-void FilterMatchByLineDistance(const Features& features1, 
+                               Matches& matches,
+                               const int norm_type = cv::NORM_HAMMING,
+                               const float ratio_thresh = 0.5f,
+                               const bool simd_knn = false);
+// One query image against its partners, same result per partner as
+// ComputeLineKeyPointsMatch. With simd_knn the query descriptors run over
+// all partners in one pass (MatchHammingKnn2Batch).
+void ComputeLineKeyPointsMatchBatch(
+    const CompactFeatures& features1,
+    const CameraInfo& camera_info1,
+    const std::vector<const CompactFeatures*>& features2,
+    const std::vector<const CameraInfo*>& camera_info2,
+    const std::vector<Matches*>& matches,
+    const int norm_type = cv::NORM_HAMMING,
+    const float ratio_thresh = 0.5f,
+    const bool simd_knn = false);
+// Guided matching with known poses: image 2 keypoints are binned by their
+// epipolar line in image 1 (angle around the epipole, or offset when
+// the epipole is at infinity) and every image 1 descriptor is compared
+// only with the keypoints whose lines are within max_line_dist. Ratio test
+// runs inside the band. Returns number of descriptor comparisons.
+// Only NORM_HAMMING is guided, other norms use ComputeLineKeyPointsMatch.
+long ComputeGuidedKeyPointsMatch(const CompactFeatures& features1,
+                                 const CameraInfo& camera_info1,
+                                 const CompactFeatures& features2,
+                                 const CameraInfo& camera_info2,
+                                 Matches& matches,
+                                 const double max_line_dist,
+                                 const int norm_type = cv::NORM_HAMMING,
+                                 const float ratio_thresh = 0.5f);
+// Batched, see FilterMatchesByEpipolarDistance (epipolar_filter.h)
+void FilterMatchByLineDistance(const CompactFeatures& features1, 
                                const CameraInfo camera_info1, 
-                               const Features& features2, 
+                               const CompactFeatures& features2, 
                                const CameraInfo& camera_info2, 
                                Matches& matches, 
                                const double line_dist);
@@ -94,10 +204,13 @@ void GetLineImagePoints(const cv::Mat& line, std::vector<cv::Point2f>& line_pts,
                         const double image_width, const double image_height);
 
 void GetLineMatchedSURFKeypoints(const cv::Mat img1, std::vector<cv::KeyPoint>& keypoints1,
-    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund);
+    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund,
+    const std::string& backend = "akaze");
 
+// fund - keeps matches within max_line_dist px of the epipolar lines
 void GetMatchedSURFKeypoints(const cv::Mat img1, std::vector<cv::KeyPoint>& keypoints1,
-    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund = cv::Mat());
+    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund = cv::Mat(),
+    const double max_line_dist = 10.0);
 
 cv::Mat GetProjMatrix(const CameraInfo& camera_info);
 cv::Mat GetRotationTranslationTransform(const CameraInfo& camera_info);
@@ -109,38 +222,49 @@ void TriangulatePoints(const CameraInfo& camera_info1, const std::vector<cv::Poi
                        const CameraInfo& camera_info2, const std::vector<cv::Point2f>& points2,
                        cv::Mat& points3d);
 
+// N-view DLT: the point of the least algebraic error for the projection
+// matrices (GetProjMatrix) and the image points of the views. False if the
+// solution is at infinity.
+bool TriangulateMultiView(const std::vector<cv::Mat>& projs,
+                          const std::vector<cv::Point2f>& points,
+                          cv::Point3d& point3d);
+
 std::vector<double> GetReprojectionErrors(
     const std::vector<cv::Point2f>& points,
     const cv::Mat& proj,
     const cv::Mat& points3d);
+class CameraProjections;  // cv_gl/reprojection.h
+
+// Map errors by ComputeReprojectionErrors with the projections of the
+// cameras (SfM3D keeps them cached, see CameraProjectionCache)
 double GetReprojectionError(
     const Map3D& map,
-    const std::vector<CameraInfo>& cameras, 
-    const std::vector<Features>& features);
+    const CameraProjections& projections,
+    const std::vector<CompactFeatures>& features);
 std::vector<double> GetReprojectionErrors(
     const Map3D& map,
-    const std::vector<CameraInfo>& cameras, 
-    const std::vector<Features>& features);
+    const CameraProjections& projections,
+    const std::vector<CompactFeatures>& features);
 double GetReprojectionError(const WorldPoint3D& point3d,
                             const std::vector<CameraInfo>& cameras, 
-                            const std::vector<Features>& features);
+                            const std::vector<CompactFeatures>& features);
 std::vector<double> GetZDistanceFromCamera(const CameraInfo& camera_info,
                                            const cv::Mat& points3d);
 void RemoveOutliersByError(Map3D& map,
-                           const std::vector<CameraInfo>& cameras,
-                           const std::vector<Features>& features,
+                           const CameraProjections& projections,
+                           const std::vector<CompactFeatures>& features,
                            const float percentile);
 
 Map3D ReduceMapByError(const Map3D& map,
-                       const std::vector<CameraInfo>& cameras,
-                       const std::vector<Features>& features,
+                       const CameraProjections& projections,
+                       const std::vector<CompactFeatures>& features,
                        const float ratio);
 
 
 
 int GetNextBestView(const Map3D& map, 
     const std::unordered_set<int>& views, 
-    CComponents<std::pair<int, int> >& ccomp,
+    const TrackTable& tracks,
     const std::vector<Matches>& image_matches,
     const std::map<std::pair<int, int>, int>& matches_index);
 
@@ -151,19 +275,30 @@ int GetNextBestViewByViews(const Map3D& map,
     const std::map<std::pair<int, int>, int>& matches_index);
 
 
-// TODO: Make CComponents const
 void MergeToTheMap(Map3D& map, 
                    const Map3D& local_map, 
-                   CComponents<std::pair<int, int> >& ccomp);
+                   const TrackTable& tracks);
 
 void MergeToTheMapImproved(Map3D& map,
                            const Map3D& local_map,
-                           CComponents<std::pair<int, int> >& ccomp);
-
-void CombineMapComponents(Map3D& map, const double max_keep_dist);
+                           const TrackTable& tracks);
+
+// Points of the same component (track) closer than max_keep_dist are
+// combined, the rest of the component is discarded. With the tracks count
+// the component ids are track ids 0 .. tracks_count - 1 and the points are
+// grouped by a counting pass instead of sorting the whole map.
+void CombineMapComponents(Map3D& map, const double max_keep_dist,
+                          const int tracks_count = 0);
 void MergeAndCombinePoints(Map3D& map,
                            const Map3D& local_map,
-                           const double max_keep_dist);
+                           const double max_keep_dist,
+                           const int tracks_count = 0);
+// Points of the tracks in tracks_map (one per track, component ids are the
+// track ids) take the place of the map points of the same tracks, if they
+// keep all the views of those points (the map points are kept otherwise)
+void ReplaceTrackPoints(Map3D& map,
+                        const Map3D& tracks_map,
+                        const int tracks_count);
 
 
 void GetKeyPointColors(const cv::Mat& img, 
@@ -177,7 +312,7 @@ void GetKeyPointColors(const cv::Mat& img,
 
 // ============ Ceres Types / Functions ====
 void OptimizeBundle(Map3D& map, const std::vector<CameraInfo>& cameras,
-                    const std::vector<Features>& features);
+                    const std::vector<CompactFeatures>& features);
 
 
 
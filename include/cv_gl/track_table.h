@@ -0,0 +1,128 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_TRACK_TABLE_H_
+#define CV_GL_TRACK_TABLE_H_
+
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "cv_gl/ccomp.hpp"
+
+// "TRK1" - tag of the track table archive
+#define TRACK_TABLE_TAG 0x314b5254ULL
+
+// Feature tracks (components of the matched keypoints) built once from
+// DenseCComponents after matching:
+//  - observations of the tracks in CSR layout, the observations of track
+//    t are observations_[track_offsets_[t] .. track_offsets_[t + 1]),
+//    by image and keypoint;
+//  - reverse lookup of the track of (image, keypoint) via the dense
+//    element id (offsets_[image] + keypoint, as in DenseCComponents).
+// Track ids are 0 .. Count() - 1 in order of the smallest element id of
+// the component, so the same matches give the same ids. Keypoints that
+// are not matched are in no track (-1).
+// All queries are O(1) and const, unlike Find of the union-find.
+class TrackTable {
+public:
+  typedef std::pair<int, int> ElemType;
+
+  TrackTable() : track_offsets_(1, 0) {}
+
+  // Tracks of the components, sizes are the keypoints counts of the
+  // images the components were built with (DenseCComponents::SetSizes)
+  void Build(const std::vector<int>& sizes, DenseCComponents& ccomp);
+  void clear();
+
+  // True if built for the keypoints counts
+  bool HasSizes(const std::vector<int>& sizes) const;
+
+  int Count() const { return static_cast<int>(track_offsets_.size()) - 1; }
+  bool empty() const { return Count() <= 0; }
+  size_t ObservationsCount() const { return observations_.size(); }
+
+  // Track of the keypoint, -1 if it's not matched (or out of the sizes)
+  int TrackOf(const ElemType& e) const {
+    if (e.first < 0 || e.first + 1 >= static_cast<int>(offsets_.size())
+        || e.second < 0
+        || e.second >= offsets_[e.first + 1] - offsets_[e.first]) {
+      return -1;
+    }
+    return track_of_[offsets_[e.first] + e.second];
+  }
+  bool Connected(const ElemType& e1, const ElemType& e2) const {
+    const int t = TrackOf(e1);
+    return t >= 0 && t == TrackOf(e2);
+  }
+
+  int TrackSize(const int track) const {
+    return track_offsets_[track + 1] - track_offsets_[track];
+  }
+  // Observations (image, keypoint) of the track, by image
+  const ElemType* TrackBegin(const int track) const {
+    return observations_.data() + track_offsets_[track];
+  }
+  const ElemType* TrackEnd(const int track) const {
+    return observations_.data() + track_offsets_[track + 1];
+  }
+  // Keypoint of the track in the image, -1 if the track isn't seen there
+  int KeypointIn(const int track, const int image) const;
+
+  size_t MemoryBytes() const;
+
+  template<class Archive>
+  void save(Archive& archive) const {
+    uint64_t tag = TRACK_TABLE_TAG;
+    archive(tag, offsets_, track_of_, track_offsets_, observations_);
+  }
+  template<class Archive>
+  void load(Archive& archive) {
+    uint64_t tag;
+    archive(tag);
+    if (tag != TRACK_TABLE_TAG) {
+      std::cerr << "TrackTable: unknown archive tag = " << tag << std::endl;
+      clear();
+      return;
+    }
+    archive(offsets_, track_of_, track_offsets_, observations_);
+  }
+
+private:
+  // offsets_[image] - element id of the first keypoint of the image
+  std::vector<int> offsets_;
+  // Track per element id, -1 - not matched
+  std::vector<int> track_of_;
+  // CSR: Count() + 1 offsets into observations_
+  std::vector<int> track_offsets_;
+  std::vector<ElemType> observations_;
+};
+
+// "CTR1" - tag of the components with their tracks, archives without the
+// tracks start with the DenseCComponents archive
+#define COMPONENTS_TRACKS_TAG 0x31525443ULL
+
+struct ComponentsTracks {
+  DenseCComponents& ccomp;
+  TrackTable& tracks;
+};
+
+template<class Archive>
+void save(Archive& archive, const ComponentsTracks& ct) {
+  uint64_t tag = COMPONENTS_TRACKS_TAG;
+  archive(tag, ct.ccomp, ct.tracks);
+}
+// Tracks are empty when not in the archive, they are built again
+template<class Archive>
+void load(Archive& archive, ComponentsTracks& ct) {
+  uint64_t tag;
+  archive(tag);
+  if (tag == COMPONENTS_TRACKS_TAG) {
+    archive(ct.ccomp, ct.tracks);
+    return;
+  }
+  ct.ccomp.LoadTagged(archive, tag);
+  ct.tracks.clear();
+}
+
+
+#endif  // CV_GL_TRACK_TABLE_H_
@@ -0,0 +1,50 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_TRIANGULATION_H_
+#define CV_GL_TRIANGULATION_H_
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "cv_gl/sfm_common.h"
+
+// Camera of the fused pair triangulation: projection matrix (GetProjMatrix)
+// and the row of the depth of a point from the camera (third row of
+// GetRotationTranslationTransform), row major
+struct TriangulationCamera {
+  double proj[3][4];
+  double depth[4];
+};
+
+TriangulationCamera GetTriangulationCamera(const CameraInfo& camera_info);
+
+// Checks of the triangulated points (the same as of the map points): the
+// reprojection error in both views, the depth from both cameras and the
+// height of the point (it's out of the ground below min_height)
+struct TriangulationChecks {
+  double max_repr_error = 1.0;
+  double min_depth = 0.0;
+  double max_depth = 100.0;
+  double min_height = 38.0;
+};
+
+// Triangulates the matched points of two views and keeps the points that
+// pass the checks, in one pass instead of cv::triangulatePoints followed
+// by GetReprojectionErrors and GetZDistanceFromCamera for each view:
+//  - the point of a match is the least squares solution of the DLT rows
+//    of both views (each row of unit norm) by the 3x3 normal equations;
+//  - points go in fixed size blocks through branch free loops on stack
+//    buffers, there are no allocations except kept and points3d.
+// Indices of the kept matches go to kept and their points to points3d
+// (both cleared). Returns the number of kept points.
+size_t TriangulateValidatePair(const TriangulationCamera& camera1,
+                               const cv::Point2f* points1,
+                               const TriangulationCamera& camera2,
+                               const cv::Point2f* points2,
+                               const size_t count,
+                               const TriangulationChecks& checks,
+                               std::vector<int>& kept,
+                               std::vector<cv::Point3d>& points3d);
+
+
+#endif  // CV_GL_TRIANGULATION_H_
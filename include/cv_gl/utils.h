@@ -13,6 +13,8 @@
 #include <opencv2/opencv.hpp>
 // #include "opencv2/xfeatures2d.hpp"
 
+#include "cv_gl/compact_matches.h"
+
 
 // #define GLM_ENABLE_EXPERIMENTAL
 // #include <glm/gtx/string_cast.hpp>
@@ -65,7 +67,13 @@ std::vector<ImageData> ReadCameraPoses(const boost::filesystem::path file_path,
 std::vector<std::string> SelectRoadRecords(const std::vector<std::string>& krecords, 
                                            const std::string& records_filter);
 
+// Images with scale_factor < 1.0 are decoded in reduced size directly
 cv::Mat LoadImage(const ImageData& im_data, double scale_factor = 1.0);
+int GetReducedReadFlag(const double scale_factor, double& rest_scale);
+
+// Split of LoadImage into file read and in memory decode steps
+bool ReadImageBuffer(const ImageData& im_data, std::vector<uchar>& buffer);
+cv::Mat DecodeImage(const std::vector<uchar>& buffer, double scale_factor = 1.0);
 
 // template <typename T>
 // void PrintVec(const std::string& intro, const std::vector<T> vec,
@@ -114,6 +122,16 @@ void KeyPointsToPointVec(const std::vector<cv::KeyPoint>& kpoints1,
                          const std::vector<cv::DMatch>& match,
                          std::vector<cv::Point2f>& points1,
                          std::vector<cv::Point2f>& points2);
+void KeyPointsToPointVec(const cv::Point2f* kpoints1,
+                         const cv::Point2f* kpoints2,
+                         const std::vector<cv::DMatch>& match,
+                         std::vector<cv::Point2f>& points1,
+                         std::vector<cv::Point2f>& points2);
+void KeyPointsToPointVec(const cv::Point2f* kpoints1,
+                         const cv::Point2f* kpoints2,
+                         const CompactMatches& match,
+                         std::vector<cv::Point2f>& points1,
+                         std::vector<cv::Point2f>& points2);
 
 glm::dmat3 GetRotation(const float x_angle, const float y_angle, const float z_angle);
 
@@ -152,6 +170,13 @@ glm::vec3 GetGlmColorFromImage(const cv::Mat& img,
 
 std::vector<cv::DMatch> EmptyMatch();
 
+// Process resident memory from /proc/self/status (bytes, 0 if unknown)
+size_t GetCurrentRSS();
+size_t GetPeakRSS();
+// Resets peak RSS to the current RSS (Linux >= 4.0), so the next
+// GetPeakRSS() is the peak of the following phase only
+bool ResetPeakRSS();
+
 
 
 
@@ -0,0 +1,84 @@
+// Copyright Pavlo 2018
+#ifndef CV_GL_VOCABULARY_TREE_H_
+#define CV_GL_VOCABULARY_TREE_H_
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cv_gl/compact_features.h"
+#include "cv_gl/hamming_matcher.h"
+
+// Bag of binary words: hierarchical k-majority tree over binary
+// descriptors (AKAZE/ORB/BRISK) with idf weights per leaf word.
+// Trained offline from the features cache (train_vocabulary app) and
+// stored as one file next to the features it was trained on.
+//
+// File layout (native endianness):
+//   header: magic "VOC1", version, branching, depth, descriptor_bytes,
+//           descriptor_stride, nodes, words
+//   nodes: first child (-1 - leaf), children count, word (-1 - inner)
+//   centroids: nodes x descriptor_stride bytes (root row is zero)
+//   idf: words floats
+#define VOCABULARY_MAGIC  0x31434f56u
+#define VOCABULARY_VERSION  1
+#define VOCABULARY_FILE  "vocabulary.voc"
+
+// Sparse tf-idf vector sorted by word, L1 normalized
+typedef std::vector<std::pair<int, float> > BowVector;
+
+class VocabularyTree {
+public:
+  VocabularyTree();
+
+  // Clusters descriptor rows (stride bytes apart, descriptor_bytes used)
+  // into up to branching^depth words. row_images - training image of
+  // every row, gives idf = log(images / images with the word).
+  bool Train(const uchar* descriptors, const int rows, const int stride,
+             const int descriptor_bytes, const std::vector<int>& row_images,
+             const int branching, const int depth,
+             const unsigned int seed = 0);
+
+  bool Save(const std::string& file) const;
+  bool Load(const std::string& file);
+
+  bool empty() const { return words_ == 0; }
+  int Words() const { return words_; }
+  int DescriptorBytes() const { return descriptor_bytes_; }
+  // Changes with any retraining, retrieval indexes keep it to stay valid
+  uint64_t Id() const { return id_; }
+
+  // Leaf word of one descriptor row (descriptor_stride padded)
+  int Quantize(const uchar* descriptor) const;
+  // Words of all features descriptors weighted by tf-idf, empty if the
+  // features have no or other descriptors
+  BowVector Transform(const CompactFeatures& features) const;
+
+  // L1 score of two normalized vectors in [0, 1]
+  static float Score(const BowVector& a, const BowVector& b);
+
+private:
+  int branching_;
+  int depth_;
+  int descriptor_bytes_;
+  int descriptor_stride_;
+  int words_;
+  uint64_t id_;
+  HammingDistanceFunc distance_;
+
+  std::vector<int> node_first_child_;
+  std::vector<int> node_children_;
+  std::vector<int> node_word_;
+  CompactFeatures::DescriptorBlock centroids_;
+  std::vector<float> idf_;
+
+  const uchar* centroid(const int node) const {
+    return centroids_.data() + static_cast<size_t>(node) * descriptor_stride_;
+  }
+  int AddNode(const uchar* centroid);
+  void ComputeId();
+};
+
+
+#endif  // CV_GL_VOCABULARY_TREE_H_
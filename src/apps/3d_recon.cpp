@@ -67,6 +67,19 @@ DEFINE_string(records, "1,4", "--records=\"1,4\" set of [1,2, ... 14]"
 DEFINE_int32(pairs_look_back, 4, "Number of images to look back for"
     " making pairs. It's also determines the distance to make pairs"
     " between records.");
+DEFINE_int32(pairs_cross_budget, 10, "Max pairs of a new image with the"
+    " images of the earlier records, best view overlap first (0 - all)");
+DEFINE_double(pairs_min_overlap, 0.0, "Min view overlap score [0, 1] of"
+    " cross record pairs");
+DEFINE_int32(pairs_stop_misses, 0, "Stop matching partners of an image"
+    " (best view overlap first) after N in a row with less than"
+    " --matches_num_thresh matches, 0 - match all pairs");
+DEFINE_int32(pairs_target_partners, 0, "Stop matching partners of an image"
+    " after N good ones, 0 - no limit");
+DEFINE_bool(pairs_retrieval, false, "Make pairs by the vocabulary tree image"
+    " retrieval (train_vocabulary app) instead of --pairs_look_back");
+DEFINE_int32(pairs_retrieval_top_k, 20, "Most similar images to pair with"
+    " every image by the retrieval");
 
 DEFINE_bool(cameraimage, true, "Render camera images");
 DEFINE_bool(camera, true, "Render cameras");
@@ -79,19 +92,70 @@ DEFINE_bool(matches_cache, true, "Use cached matches and store newly computed"
 DEFINE_double(matches_line_dist_thresh, 10.0, "Max distance to the epiline"
     " between matched corresponding points");
 DEFINE_int32(matches_num_thresh, 7, "Min number of matches betwee image pairs");
+DEFINE_bool(matches_guided, true, "Match descriptors only within the"
+    " epipolar band of --matches_line_dist_thresh (known poses)");
+DEFINE_bool(matches_simd_knn, true, "Brute force matching with SIMD Hamming"
+    " kNN kernel instead of cv::BFMatcher");
+DEFINE_bool(matches_batched, true, "Match every query image against all"
+    " its pair partners in one pass");
+DEFINE_int32(matches_bench, 0, "Compare brute force and guided matching on"
+    " the first N pairs and exit");
+DEFINE_int32(epipolar_bench, 0, "Compare per match and batched epipolar"
+    " filter on the first N pairs and exit");
+DEFINE_int32(epipolar_bench_matches, 30000, "Random matches per pair for"
+    " --epipolar_bench");
 DEFINE_bool(features_cache, true, "Use cached features and store new features"
     " into cache");
 
+DEFINE_string(features, "akaze", "Features backend: akaze|orb|brisk");
+DEFINE_bool(features_evict, true, "Drop descriptors from memory after"
+    " matching, reconstruction needs only keypoints");
+DEFINE_int32(features_bench, 0, "Compare extraction and matching throughput"
+    " of all features backends on the first N images and exit (0 - off)");
+DEFINE_int32(features_tiles_x, 1, "Split images into N tile columns for"
+    " parallel feature extraction");
+DEFINE_int32(features_tiles_y, 1, "Split images into N tile rows for"
+    " parallel feature extraction");
+DEFINE_int32(features_tile_overlap, 96, "Overlap (px) between neighbour tiles");
+DEFINE_int32(features_tile_max_keypoints, 0, "Max keypoints per tile"
+    " selected by response (0 - all)");
+DEFINE_int32(features_max_keypoints, 0, "Keypoint budget per image"
+    " (0 - all)");
+DEFINE_bool(features_anms, true, "Select budgeted keypoints with adaptive"
+    " non-maximal suppression (spread over the image), otherwise by response");
+DEFINE_int32(features_target_keypoints, 0, "Tune AKAZE threshold per image"
+    " to get about N keypoints (0 - fixed threshold)");
+DEFINE_double(features_akaze_threshold, 0.001, "AKAZE detector threshold"
+    " (start value in --features_target_keypoints mode)");
+
+DEFINE_int32(extract_read_threads, 0, "Feature extraction pipeline: number of"
+    " image file reader threads (0 - auto)");
+DEFINE_int32(extract_decode_threads, 0, "Feature extraction pipeline: number"
+    " of image decoder threads (0 - auto)");
+DEFINE_int32(extract_thumbnail_threads, 0, "Feature extraction pipeline:"
+    " number of image resize threads (0 - auto)");
+DEFINE_int32(extract_compute_threads, 0, "Feature extraction pipeline: number"
+    " of AKAZE extractor threads (0 - auto)");
+DEFINE_int32(extract_cache_threads, 0, "Feature extraction pipeline: number"
+    " of cache writer threads (0 - auto)");
+DEFINE_int32(extract_queue_size, 4, "Feature extraction pipeline: max images"
+    " waiting between stages");
+
 DEFINE_double(sfm_repr_error_thresh, 10.0, "Max reprojection error allowed"
     " during points triangulation");
 DEFINE_double(sfm_max_merge_dist, 3.0, "Maximum distance between points"
     " from different views that we merge into one point");
+DEFINE_bool(sfm_multiview, true, "Triangulate the tracks of a next view"
+    " over all the used views at once, otherwise pairwise with each of them"
+    " and merge the points");
 
 DEFINE_string(restore, "", "--restore=\"<filename>\" Saved SfM serialization"
                            " to continue SfM reconstruction pipeline");
 DEFINE_string(output, "sfm_out.bin", "--output=\"<filename>\" : Destination"
                       " for SfM serialization");
 DEFINE_bool(save_images, false, "Saved resized images to the serialized archive");
+DEFINE_bool(save_descriptors, true, "Save descriptors to the serialized"
+    " archive (evicted descriptors are reloaded from the features cache)");
 
 
 DEFINE_bool(h, false, "Show help");
@@ -173,7 +237,38 @@ int main(int argc, char* argv[]) {
   SfM3D sfm(camera_intrs);
   sfm.repr_error_thresh = FLAGS_sfm_repr_error_thresh;
   sfm.max_merge_dist = FLAGS_sfm_max_merge_dist;
+  sfm.multiview_triangulation = FLAGS_sfm_multiview;
   sfm.resize_scale = FLAGS_viz_image_scale;
+  sfm.extract_pipeline.read_threads = FLAGS_extract_read_threads;
+  sfm.extract_pipeline.decode_threads = FLAGS_extract_decode_threads;
+  sfm.extract_pipeline.thumbnail_threads = FLAGS_extract_thumbnail_threads;
+  sfm.extract_pipeline.extract_threads = FLAGS_extract_compute_threads;
+  sfm.extract_pipeline.cache_threads = FLAGS_extract_cache_threads;
+  sfm.extract_pipeline.queue_size = FLAGS_extract_queue_size;
+  if (::FindFeatureBackend(FLAGS_features) == nullptr) {
+    std::cerr << "Unknown --features=" << FLAGS_features << ", use one of: ";
+    PrintVec("", ::FeatureBackendNames(), std::cerr);
+    std::cerr << std::endl;
+    return EXIT_FAILURE;
+  }
+  sfm.feature_params.backend = FLAGS_features;
+  sfm.feature_params.tiles_x = FLAGS_features_tiles_x;
+  sfm.feature_params.tiles_y = FLAGS_features_tiles_y;
+  sfm.feature_params.tile_overlap = FLAGS_features_tile_overlap;
+  sfm.feature_params.tile_max_keypoints = FLAGS_features_tile_max_keypoints;
+  sfm.feature_params.max_keypoints = FLAGS_features_max_keypoints;
+  sfm.feature_params.anms = FLAGS_features_anms;
+  sfm.feature_params.target_keypoints = FLAGS_features_target_keypoints;
+  sfm.feature_params.akaze_threshold = FLAGS_features_akaze_threshold;
+  sfm.matches_guided = FLAGS_matches_guided;
+  sfm.matches_simd_knn = FLAGS_matches_simd_knn;
+  sfm.matches_batched = FLAGS_matches_batched;
+  sfm.pairs_retrieval_top_k =
+      FLAGS_pairs_retrieval ? FLAGS_pairs_retrieval_top_k : 0;
+  sfm.pairs_cross_budget = FLAGS_pairs_cross_budget;
+  sfm.pairs_min_overlap = FLAGS_pairs_min_overlap;
+  sfm.pairs_stop_misses = FLAGS_pairs_stop_misses;
+  sfm.pairs_target_partners = FLAGS_pairs_target_partners;
 
   if (FLAGS_restore.empty()) {
     // Create new run
@@ -224,16 +319,38 @@ int main(int argc, char* argv[]) {
       camera2_poses_s.insert(camera2_poses_s.begin(),
                             camera2_poses.begin() + p_camera_start, 
                             camera2_poses.begin() + p_camera_finish);
-      sfm.AddImages(camera1_poses_s, camera2_poses_s, true, FLAGS_pairs_look_back);
+      sfm.AddImages(camera1_poses_s, camera2_poses_s, !FLAGS_pairs_retrieval,
+                    FLAGS_pairs_look_back);
 
     }
 
 
+    if (FLAGS_features_bench > 0) {
+      sfm.BenchmarkFeatureBackends(::FeatureBackendNames(),
+                                   FLAGS_features_bench,
+                                   FLAGS_matches_line_dist_thresh);
+      return EXIT_SUCCESS;
+    }
+
     sfm.ExtractFeatures();
 
+    if (FLAGS_matches_bench > 0) {
+      sfm.BenchmarkGuidedMatching(FLAGS_matches_bench,
+                                  FLAGS_matches_line_dist_thresh);
+      return EXIT_SUCCESS;
+    }
+
+    if (FLAGS_epipolar_bench > 0) {
+      sfm.BenchmarkEpipolarFilter(FLAGS_epipolar_bench,
+                                  FLAGS_epipolar_bench_matches,
+                                  FLAGS_matches_line_dist_thresh);
+      return EXIT_SUCCESS;
+    }
+
     sfm.MatchImageFeatures(FLAGS_matches_num_thresh, 
                            FLAGS_matches_line_dist_thresh,
                            FLAGS_matches_cache);
+    sfm.ReportMemoryPhase("match");
 
     sfm.InitReconstruction();
 
@@ -245,6 +362,7 @@ int main(int argc, char* argv[]) {
     sfm.RestoreImages();
     sfm.PrintFinalStats();
     std::cout << "De-Serializing SFM!!!! - DONE\n";
+    sfm.ReportMemoryPhase("restore");
 
     
     // ::RemoveOutliersByError(map_, cameras_, image_features_, 0.05);
@@ -263,8 +381,15 @@ int main(int argc, char* argv[]) {
   // return EXIT_SUCCESS;
   
 
+  // Reconstruction phase needs keypoints only
+  if (FLAGS_features_evict) {
+    sfm.EvictDescriptors();
+  }
+  ::ResetPeakRSS();
+
   if (!FLAGS_viz) {
     sfm.ReconstructAll();
+    sfm.ReportMemoryPhase("reconstruct");
     // sfm.PrintFinalStats();
     StoreSfM(sfm);
     return EXIT_SUCCESS;
@@ -273,6 +398,7 @@ int main(int argc, char* argv[]) {
 
   std::thread recon_thread([&sfm]() {
     sfm.ReconstructAll();
+    sfm.ReportMemoryPhase("reconstruct");
     sfm.SetProcStatus(SfM3D::FINISH);
   });
 
@@ -790,6 +916,12 @@ void StoreSfM(SfM3D& sfm) {
     sfm.ClearImages();
   }
 
+  if (FLAGS_save_descriptors) {
+    sfm.LoadAllDescriptors();
+  } else {
+    sfm.EvictDescriptors();
+  }
+
   std::cout << "Serializing SFM!!!! to: " << output_file << std::endl;
   std::ofstream file(output_file, std::ios::binary);
   cereal::BinaryOutputArchive archive(file);
@@ -0,0 +1,148 @@
+// Copyright Pavlo 2018
+// Stress test and thread scaling benchmark of ConcurrentCComponents on
+// synthetic matches (random image pairs and keypoints):
+//  - components of the concurrent unions (every threads count, a few
+//    runs) must be identical to the sequential DenseCComponents result;
+//  - CCOMP_BENCH lines give the union throughput per threads count.
+// Exit code is a failure on any difference.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define STRIP_FLAG_HELP 1    // this must go before the #include!
+#include <gflags/gflags.h>
+
+#include "cv_gl/ccomp.hpp"
+
+DEFINE_int32(images, 500, "Images");
+DEFINE_int32(keypoints, 4000, "Keypoints per image");
+DEFINE_int32(pairs, 5000, "Matched image pairs");
+DEFINE_int32(matches, 300, "Matches per pair");
+DEFINE_int32(max_threads, 0, "Max threads, 0 - hardware concurrency");
+DEFINE_int32(runs, 5, "Stress runs per threads count");
+DEFINE_int32(seed, 0, "Random seed");
+
+typedef std::pair<int, int> IntPair;
+typedef std::pair<IntPair, IntPair> ElemLink;
+
+// Unions of the links split between threads (one pair of matches per
+// work item as the matcher threads do), returns seconds
+double ConcurrentUnions(const std::vector<ElemLink>& links,
+                        const int threads_count,
+                        DenseCComponents& components) {
+  ConcurrentCComponents ccomp(components);
+  const int item_size = std::max(FLAGS_matches, 1);
+  const int items = (links.size() + item_size - 1) / item_size;
+  std::atomic<int> next_item(0);
+  auto t0 = std::chrono::high_resolution_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threads_count; ++t) {
+    threads.push_back(std::thread([&links, &ccomp, &next_item, item_size,
+                                   items]() {
+      int item;
+      while ((item = next_item++) < items) {
+        const size_t last = std::min(links.size(),
+                                     static_cast<size_t>(item + 1)
+                                         * item_size);
+        for (size_t i = static_cast<size_t>(item) * item_size; i < last;
+             ++i) {
+          ccomp.Union(links[i].first, links[i].second);
+        }
+      }
+    }));
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  auto t1 = std::chrono::high_resolution_clock::now();
+  ccomp.CopyTo(components);
+  return std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0)
+      .count() / 1e+6;
+}
+
+int main(int argc, char* argv[]) {
+
+  gflags::SetUsageMessage("Concurrent union-find stress test and benchmark");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  int max_threads = FLAGS_max_threads;
+  if (max_threads <= 0) {
+    max_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()),
+                           1);
+  }
+
+  std::mt19937 rng(FLAGS_seed);
+  std::uniform_int_distribution<int> image_dist(0, FLAGS_images - 1);
+  std::uniform_int_distribution<int> keypoint_dist(0, FLAGS_keypoints - 1);
+  std::vector<int> sizes(FLAGS_images, FLAGS_keypoints);
+  std::vector<ElemLink> links;
+  links.reserve(static_cast<size_t>(FLAGS_pairs) * FLAGS_matches);
+  for (int p = 0; p < FLAGS_pairs; ++p) {
+    const int img1 = image_dist(rng);
+    int img2 = image_dist(rng);
+    if (img2 == img1) img2 = (img1 + 1) % FLAGS_images;
+    for (int m = 0; m < FLAGS_matches; ++m) {
+      links.push_back(ElemLink(IntPair(img1, keypoint_dist(rng)),
+                               IntPair(img2, keypoint_dist(rng))));
+    }
+  }
+  std::cout << "Links = " << links.size()
+            << ", elements = " << static_cast<long>(FLAGS_images)
+                * FLAGS_keypoints << std::endl;
+
+  // Sequential reference
+  DenseCComponents sequential;
+  sequential.SetSizes(sizes);
+  auto t0 = std::chrono::high_resolution_clock::now();
+  for (const ElemLink& l : links) {
+    sequential.Union(l.first, l.second);
+  }
+  auto t1 = std::chrono::high_resolution_clock::now();
+  const double sequential_time =
+      std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0)
+          .count() / 1e+6;
+  const std::vector<int> labels = sequential.Labels();
+  std::cout << "CCOMP_BENCH path = sequential, unions = " << links.size()
+            << ", components = " << sequential.Count()
+            << ", time = " << sequential_time
+            << ", unions_per_sec = "
+            << (sequential_time > 0.0 ? links.size() / sequential_time : 0.0)
+            << std::endl;
+
+  bool ok = true;
+  double single_time = 0.0;
+  for (int threads = 1; threads <= max_threads;
+       threads = (threads < max_threads ? std::min(threads * 2, max_threads)
+                                        : threads + 1)) {
+    double best_time = 0.0;
+    int failed = 0;
+    for (int run = 0; run < FLAGS_runs; ++run) {
+      DenseCComponents concurrent;
+      concurrent.SetSizes(sizes);
+      const double time = ConcurrentUnions(links, threads, concurrent);
+      if (run == 0 || time < best_time) best_time = time;
+      if (concurrent.Count() != sequential.Count()
+          || concurrent.Labels() != labels) {
+        ++failed;
+      }
+    }
+    if (threads == 1) single_time = best_time;
+    ok = ok && failed == 0;
+    std::cout << "CCOMP_BENCH path = concurrent, threads = " << threads
+              << ", unions = " << links.size()
+              << ", time = " << best_time
+              << ", unions_per_sec = "
+              << (best_time > 0.0 ? links.size() / best_time : 0.0)
+              << ", speedup = "
+              << (best_time > 0.0 ? single_time / best_time : 0.0)
+              << ", runs = " << FLAGS_runs
+              << ", failed = " << failed << std::endl;
+  }
+
+  std::cout << "Components " << (ok ? "match" : "DIFFER") << std::endl;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
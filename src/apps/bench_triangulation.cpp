@@ -0,0 +1,178 @@
+// Copyright Pavlo 2018
+// Per pair triangulation time of TriangulatePointsFromViews on synthetic
+// matches of two cameras (noisy projections of random points and a share
+// of wrong matches):
+//  - path = mats: cv::triangulatePoints, GetReprojectionErrors and
+//    GetZDistanceFromCamera for each view and the filter loop (as before);
+//  - path = fused: TriangulateValidatePair.
+// TRIANGULATE_BENCH lines give the time per pair of each path and how many
+// points both keep.
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#define STRIP_FLAG_HELP 1    // this must go before the #include!
+#include <gflags/gflags.h>
+
+#include "cv_gl/sfm_common.h"
+#include "cv_gl/triangulation.h"
+
+DEFINE_int32(matches, 2000, "Matches per pair");
+DEFINE_int32(pairs, 200, "Pairs triangulated per run");
+DEFINE_int32(runs, 5, "Runs of each path, the best one is reported");
+DEFINE_double(noise, 0.5, "Keypoints noise, px");
+DEFINE_double(outliers, 0.1, "Share of wrong matches");
+DEFINE_double(repr_error_thresh, 10.0, "Max reprojection error");
+DEFINE_int32(seed, 0, "Random seed");
+
+// The checks of TriangulatePointsFromViews before the fused kernel
+std::vector<int> TriangulateMats(const CameraInfo& camera1,
+                                 const std::vector<cv::Point2f>& points1,
+                                 const CameraInfo& camera2,
+                                 const std::vector<cv::Point2f>& points2,
+                                 const double repr_error_thresh,
+                                 std::vector<cv::Point3d>& points) {
+  cv::Mat points3d;
+  ::TriangulatePoints(camera1, points1, camera2, points2, points3d);
+  cv::Mat proj1 = ::GetProjMatrix(camera1);
+  cv::Mat proj2 = ::GetProjMatrix(camera2);
+  std::vector<double> errs1 = ::GetReprojectionErrors(points1, proj1, points3d);
+  std::vector<double> errs2 = ::GetReprojectionErrors(points2, proj2, points3d);
+  std::vector<double> cam1_zdist = ::GetZDistanceFromCamera(camera1, points3d);
+  std::vector<double> cam2_zdist = ::GetZDistanceFromCamera(camera2, points3d);
+  std::vector<int> kept;
+  points.clear();
+  for (size_t i = 0; i < errs1.size(); ++i) {
+    if (   errs1[i] > repr_error_thresh
+        || errs2[i] > repr_error_thresh
+        || cam1_zdist[i] < 0 || cam2_zdist[i] < 0
+        || cam1_zdist[i] > 100.0 || cam2_zdist[i] > 100.0
+        || points3d.at<float>(i, 2) < 38.0) {
+      continue;
+    }
+    kept.push_back(i);
+    points.push_back(cv::Point3d(points3d.at<float>(i, 0),
+                                 points3d.at<float>(i, 1),
+                                 points3d.at<float>(i, 2)));
+  }
+  return kept;
+}
+
+int main(int argc, char* argv[]) {
+
+  gflags::SetUsageMessage("Pair triangulation benchmark");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  // ApolloScape like cameras, the second one is a step ahead and turned
+  CameraIntrinsics intr = {2304.54786556982, 2305.875668062, 0.0,
+                           1686.23787612802, 1354.98486439791, 1.0};
+  CameraInfo camera1, camera2;
+  camera1.intr = intr;
+  camera1.translation = glm::dvec3(0.0, 0.0, 0.0);
+  camera1.rotation_angles = glm::dvec3(0.0, 0.0, 0.0);
+  camera2.intr = intr;
+  camera2.translation = glm::dvec3(0.6, -0.1, 2.0);
+  camera2.rotation_angles = glm::dvec3(0.01, 0.03, 0.0);
+  const cv::Mat proj1 = ::GetProjMatrix(camera1);
+  const cv::Mat proj2 = ::GetProjMatrix(camera2);
+
+  std::mt19937 rng(FLAGS_seed);
+  std::uniform_real_distribution<double> x_dist(-30.0, 30.0);
+  std::uniform_real_distribution<double> y_dist(-15.0, 15.0);
+  // Depths from 5 to 120, part of the points fail the depth or the
+  // ground test
+  std::uniform_real_distribution<double> z_dist(5.0, 120.0);
+  std::uniform_real_distribution<double> u_dist(0.0, 3384.0);
+  std::uniform_real_distribution<double> v_dist(0.0, 2710.0);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  std::normal_distribution<double> noise(0.0, FLAGS_noise);
+  auto project = [&noise, &rng](const cv::Mat& proj, const cv::Point3d& p) {
+    cv::Mat x = proj * cv::Mat(cv::Matx41d(p.x, p.y, p.z, 1.0));
+    return cv::Point2f(x.at<double>(0) / x.at<double>(2) + noise(rng),
+                       x.at<double>(1) / x.at<double>(2) + noise(rng));
+  };
+
+  std::vector<std::vector<cv::Point2f> > points1(FLAGS_pairs);
+  std::vector<std::vector<cv::Point2f> > points2(FLAGS_pairs);
+  for (int p = 0; p < FLAGS_pairs; ++p) {
+    for (int i = 0; i < FLAGS_matches; ++i) {
+      const cv::Point3d pt(x_dist(rng), y_dist(rng), z_dist(rng));
+      points1[p].push_back(project(proj1, pt));
+      if (unit(rng) < FLAGS_outliers) {
+        points2[p].push_back(cv::Point2f(u_dist(rng), v_dist(rng)));
+      } else {
+        points2[p].push_back(project(proj2, pt));
+      }
+    }
+  }
+
+  std::vector<std::vector<int> > kept_mats(FLAGS_pairs);
+  std::vector<std::vector<int> > kept_fused(FLAGS_pairs);
+  std::vector<std::vector<cv::Point3d> > points_mats(FLAGS_pairs);
+  std::vector<std::vector<cv::Point3d> > points_fused(FLAGS_pairs);
+  double mats_time = 0.0;
+  double fused_time = 0.0;
+  for (int run = 0; run < FLAGS_runs; ++run) {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for (int p = 0; p < FLAGS_pairs; ++p) {
+      kept_mats[p] = TriangulateMats(camera1, points1[p], camera2, points2[p],
+                                     FLAGS_repr_error_thresh, points_mats[p]);
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (int p = 0; p < FLAGS_pairs; ++p) {
+      // Cameras are taken per pair as TriangulatePointsFromViews does
+      TriangulationChecks checks;
+      checks.max_repr_error = FLAGS_repr_error_thresh;
+      ::TriangulateValidatePair(::GetTriangulationCamera(camera1),
+                                points1[p].data(),
+                                ::GetTriangulationCamera(camera2),
+                                points2[p].data(), points1[p].size(), checks,
+                                kept_fused[p], points_fused[p]);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    const double mt = std::chrono::duration_cast<std::chrono::microseconds>(
+        t1 - t0).count() / 1e+6;
+    const double ft = std::chrono::duration_cast<std::chrono::microseconds>(
+        t2 - t1).count() / 1e+6;
+    if (run == 0 || mt < mats_time) mats_time = mt;
+    if (run == 0 || ft < fused_time) fused_time = ft;
+  }
+
+  // Points kept by both paths and the largest distance between them
+  size_t total_mats = 0, total_fused = 0, common = 0;
+  double max_dist = 0.0;
+  for (int p = 0; p < FLAGS_pairs; ++p) {
+    total_mats += kept_mats[p].size();
+    total_fused += kept_fused[p].size();
+    size_t a = 0, b = 0;
+    while (a < kept_mats[p].size() && b < kept_fused[p].size()) {
+      if (kept_mats[p][a] < kept_fused[p][b]) {
+        ++a;
+      } else if (kept_fused[p][b] < kept_mats[p][a]) {
+        ++b;
+      } else {
+        max_dist = std::max(max_dist,
+            cv::norm(points_mats[p][a] - points_fused[p][b]));
+        ++common;
+        ++a;
+        ++b;
+      }
+    }
+  }
+
+  const int pairs = std::max(FLAGS_pairs, 1);
+  std::cout << "TRIANGULATE_BENCH path = mats, matches = " << FLAGS_matches
+            << ", pair_time_ms = " << mats_time * 1e+3 / pairs
+            << ", kept = " << total_mats << std::endl;
+  std::cout << "TRIANGULATE_BENCH path = fused, matches = " << FLAGS_matches
+            << ", pair_time_ms = " << fused_time * 1e+3 / pairs
+            << ", kept = " << total_fused
+            << ", speedup = "
+            << (fused_time > 0.0 ? mats_time / fused_time : 0.0)
+            << std::endl;
+  std::cout << "Kept by both = " << common
+            << ", max_point_dist = " << max_dist << std::endl;
+  return EXIT_SUCCESS;
+}
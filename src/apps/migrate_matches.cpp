@@ -0,0 +1,112 @@
+// Copyright Pavlo 2018
+// Moves per pair matches files of the cache into the match store of
+// their dir and compacts it:
+//   <cache_dir>/matches*/<key>.m -> <cache_dir>/matches*/<id>.mseg
+// Pairs that are already in the store are kept (the store is newer).
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#define STRIP_FLAG_HELP 1    // this must go before the #include!
+#include <gflags/gflags.h>
+
+#include "cv_gl/cache_storage.hpp"
+#include "cv_gl/match_store.h"
+
+DEFINE_string(cache_dir, "_features_cache", "Features cache dir");
+DEFINE_bool(remove_files, false,
+            "Remove per pair matches files after they are moved");
+DEFINE_bool(compact, true, "Compact the match stores");
+
+namespace fs = boost::filesystem;
+
+// Migrates one matches dir, false on error
+bool MigrateMatchesDir(const fs::path& matches_dir) {
+  std::vector<fs::path> files;
+  for (fs::directory_iterator it(matches_dir);
+       it != fs::directory_iterator(); ++it) {
+    const fs::path& p = it->path();
+    if (fs::is_regular_file(p) && p.extension() == ".m") files.push_back(p);
+  }
+  std::sort(files.begin(), files.end());
+
+  std::shared_ptr<MatchStore> store = MatchStore::Open(matches_dir.string());
+  if (!store) {
+    std::cerr << "Can't open match store " << matches_dir.string()
+              << std::endl;
+    return false;
+  }
+
+  int migrated = 0;
+  for (const fs::path& f : files) {
+    const std::string key = f.stem().string();
+    if (!store->Contains(key)) {
+      Matches matches;
+      if (!CacheStorage::ReadMatchesFile(f.string(), matches)) {
+        std::cerr << "Can't read " << f.string() << std::endl;
+        return false;
+      }
+      if (!store->Put(key, matches.match)) {
+        std::cerr << "Can't add " << f.string() << " to store" << std::endl;
+        return false;
+      }
+      ++migrated;
+    }
+  }
+
+  if (FLAGS_compact && !store->Compact()) {
+    std::cerr << "Can't compact " << matches_dir.string() << std::endl;
+    return false;
+  }
+
+  // Files are removed only when the store is safely written
+  if (FLAGS_remove_files) {
+    for (const fs::path& f : files) {
+      fs::remove(f);
+    }
+  }
+
+  std::cout << matches_dir.string() << ": files = " << files.size()
+            << ", migrated = " << migrated
+            << ", pairs = " << store->Count()
+            << ", live_mb = " << store->LiveBytes() / (1024.0 * 1024.0)
+            << ", dead_mb = " << store->DeadBytes() / (1024.0 * 1024.0)
+            << std::endl;
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+
+  gflags::SetUsageMessage("Move matches files into the match stores");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  fs::path cache_dir(FLAGS_cache_dir);
+  if (!fs::exists(cache_dir) || !fs::is_directory(cache_dir)) {
+    std::cerr << "Cache dir doesn't exist: " << FLAGS_cache_dir << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // matches and matches_<ns> dirs
+  std::vector<fs::path> matches_dirs;
+  for (fs::directory_iterator it(cache_dir);
+       it != fs::directory_iterator(); ++it) {
+    const std::string name = it->path().filename().string();
+    if (fs::is_directory(it->path())
+        && name.compare(0, strlen(CACHE_MATCHES_DIR),
+                        CACHE_MATCHES_DIR) == 0) {
+      matches_dirs.push_back(it->path());
+    }
+  }
+  std::sort(matches_dirs.begin(), matches_dirs.end());
+
+  for (const fs::path& matches_dir : matches_dirs) {
+    if (!MigrateMatchesDir(matches_dir)) return EXIT_FAILURE;
+  }
+  std::cout << "stores = " << matches_dirs.size() << std::endl;
+
+  return EXIT_SUCCESS;
+}
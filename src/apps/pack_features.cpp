@@ -0,0 +1,137 @@
+// Copyright Pavlo 2018
+// Converts per image features files of the features cache into one
+// feature pack per record:
+//   <cache_dir>/features*/<record>/<camera>/<image>.f
+//     -> <cache_dir>/features*/<record>.fpack
+// Images that are already in the record pack are kept (files win).
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#define STRIP_FLAG_HELP 1    // this must go before the #include!
+#include <gflags/gflags.h>
+
+#include "cv_gl/cache_storage.hpp"
+#include "cv_gl/feature_pack.h"
+
+DEFINE_string(cache_dir, "_features_cache", "Features cache dir");
+DEFINE_bool(remove_files, true,
+            "Remove per image features files after they are packed (the"
+            " pack is read first, the files of packed images are unused)");
+
+namespace fs = boost::filesystem;
+
+// Packs one record dir, returns number of images in pack (-1 on error)
+int PackRecord(const fs::path& record_dir, int& files_count) {
+  fs::path pack_file = record_dir.string() + FEATURE_PACK_EXT;
+
+  // key -> features file
+  std::map<std::string, std::string> files;
+  for (fs::directory_iterator cam_it(record_dir);
+       cam_it != fs::directory_iterator(); ++cam_it) {
+    if (!fs::is_directory(cam_it->path())) continue;
+    const std::string camera = cam_it->path().filename().string();
+    for (fs::directory_iterator it(cam_it->path());
+         it != fs::directory_iterator(); ++it) {
+      const fs::path& p = it->path();
+      if (!fs::is_regular_file(p) || p.extension() != ".f") continue;
+      files[CacheStorage::FeaturePackKey(camera, p.stem().string())]
+          = p.string();
+    }
+  }
+  files_count = files.size();
+  if (files.empty()) return 0;
+
+  std::shared_ptr<FeaturePack> old_pack = FeaturePack::Open(
+      pack_file.string());
+
+  FeaturePackWriter writer(pack_file.string());
+  if (!writer.IsOpen()) {
+    std::cerr << "Can't write pack " << pack_file.string() << std::endl;
+    return -1;
+  }
+  if (old_pack) {
+    for (const std::string& key : old_pack->Keys()) {
+      if (files.count(key) > 0) continue;
+      CompactFeatures features;
+      old_pack->Get(key, features);
+      writer.Add(key, features);
+    }
+  }
+  for (const auto& f : files) {
+    CompactFeatures features;
+    if (!CacheStorage::ReadFeaturesFile(f.second, features)) {
+      std::cerr << "Can't read " << f.second << std::endl;
+      return -1;
+    }
+    if (!writer.Add(f.first, features)) {
+      std::cerr << "Can't add " << f.second << " to pack" << std::endl;
+      return -1;
+    }
+  }
+  int count = writer.Count();
+  if (!writer.Close()) {
+    std::cerr << "Can't write pack " << pack_file.string() << std::endl;
+    return -1;
+  }
+
+  if (FLAGS_remove_files) {
+    for (const auto& f : files) {
+      fs::remove(f.second);
+    }
+  }
+  return count;
+}
+
+int main(int argc, char* argv[]) {
+
+  gflags::SetUsageMessage("Pack features cache into one file per record");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  fs::path cache_dir(FLAGS_cache_dir);
+  if (!fs::exists(cache_dir) || !fs::is_directory(cache_dir)) {
+    std::cerr << "Cache dir doesn't exist: " << FLAGS_cache_dir << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // features and features_<ns> dirs
+  std::vector<fs::path> features_dirs;
+  for (fs::directory_iterator it(cache_dir);
+       it != fs::directory_iterator(); ++it) {
+    const std::string name = it->path().filename().string();
+    if (fs::is_directory(it->path())
+        && name.compare(0, strlen(CACHE_FEATURES_DIR),
+                        CACHE_FEATURES_DIR) == 0) {
+      features_dirs.push_back(it->path());
+    }
+  }
+  std::sort(features_dirs.begin(), features_dirs.end());
+
+  int packs = 0;
+  for (const fs::path& features_dir : features_dirs) {
+    std::vector<fs::path> records;
+    for (fs::directory_iterator it(features_dir);
+         it != fs::directory_iterator(); ++it) {
+      if (fs::is_directory(it->path())) records.push_back(it->path());
+    }
+    std::sort(records.begin(), records.end());
+    for (const fs::path& record_dir : records) {
+      int files_count = 0;
+      int count = PackRecord(record_dir, files_count);
+      if (count < 0) return EXIT_FAILURE;
+      if (files_count == 0) continue;
+      std::cout << record_dir.string() << FEATURE_PACK_EXT
+                << ": files = " << files_count
+                << ", images = " << count << std::endl;
+      ++packs;
+    }
+  }
+  std::cout << "packs = " << packs << std::endl;
+
+  return EXIT_SUCCESS;
+}
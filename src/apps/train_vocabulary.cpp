@@ -0,0 +1,160 @@
+// Copyright Pavlo 2018
+// Trains the vocabulary tree of one features dir of the features cache
+// (packs and per image files):
+//   <cache_dir>/<features_dir>/<record>.fpack
+//   <cache_dir>/<features_dir>/<record>/<camera>/<image>.f
+//     -> <cache_dir>/<features_dir>/vocabulary.voc
+// 3d_recon then makes pairs by the image retrieval with it.
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#define STRIP_FLAG_HELP 1    // this must go before the #include!
+#include <gflags/gflags.h>
+
+#include "cv_gl/cache_storage.hpp"
+#include "cv_gl/feature_pack.h"
+#include "cv_gl/vocabulary_tree.h"
+
+DEFINE_string(cache_dir, "_features_cache", "Features cache dir");
+DEFINE_string(features_dir, CACHE_FEATURES_DIR, "Features dir in the cache"
+    " (features_<namespace> for non default backends)");
+DEFINE_int32(branching, 10, "Children per vocabulary tree node");
+DEFINE_int32(depth, 5, "Vocabulary tree levels (branching^depth words)");
+DEFINE_int32(max_per_image, 300, "Descriptors sampled from one image");
+DEFINE_int32(max_images, 0, "Images used for training, 0 - all");
+DEFINE_int32(seed, 0, "Random seed of the clustering");
+
+namespace fs = boost::filesystem;
+
+// Contiguous sample of the binary descriptors of many images
+struct TrainingSet {
+  std::vector<uchar> descriptors;
+  std::vector<int> row_images;
+  int descriptor_bytes = 0;
+  int stride = 0;
+  int images = 0;
+};
+
+// Adds evenly spaced rows of one image, false if the image is skipped
+bool AddTrainingImage(const CompactFeatures& features, TrainingSet& set) {
+  if (!features.HasDescriptors() || features.empty()
+      || features.descriptor_type() != CV_8U) {
+    return false;
+  }
+  if (set.images == 0) {
+    set.descriptor_bytes = features.descriptor_bytes();
+    set.stride = features.descriptor_stride();
+  }
+  if (features.descriptor_bytes() != set.descriptor_bytes
+      || features.descriptor_stride() != set.stride) {
+    return false;
+  }
+  const int n = features.size();
+  const int take = FLAGS_max_per_image > 0
+      ? std::min(n, FLAGS_max_per_image) : n;
+  for (int k = 0; k < take; ++k) {
+    const int i = static_cast<int>(static_cast<long>(k) * n / take);
+    const uchar* row = features.descriptor(i);
+    set.descriptors.insert(set.descriptors.end(), row, row + set.stride);
+    set.row_images.push_back(set.images);
+  }
+  ++set.images;
+  return true;
+}
+
+bool EnoughImages(const TrainingSet& set) {
+  return FLAGS_max_images > 0 && set.images >= FLAGS_max_images;
+}
+
+int main(int argc, char* argv[]) {
+
+  gflags::SetUsageMessage("Train vocabulary tree of the features cache");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  fs::path features_dir = fs::path(FLAGS_cache_dir) / FLAGS_features_dir;
+  if (!fs::exists(features_dir) || !fs::is_directory(features_dir)) {
+    std::cerr << "Features dir doesn't exist: " << features_dir.string()
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // key -> features file, packed images are taken from the packs
+  std::vector<fs::path> packs;
+  std::map<std::string, std::string> files;
+  for (fs::directory_iterator it(features_dir);
+       it != fs::directory_iterator(); ++it) {
+    const fs::path& p = it->path();
+    if (fs::is_regular_file(p) && p.extension() == FEATURE_PACK_EXT) {
+      packs.push_back(p);
+      continue;
+    }
+    if (!fs::is_directory(p)) continue;
+    for (fs::recursive_directory_iterator fit(p);
+         fit != fs::recursive_directory_iterator(); ++fit) {
+      const fs::path& f = fit->path();
+      if (!fs::is_regular_file(f) || f.extension() != ".f") continue;
+      files[CacheStorage::ImageKey(f.string())] = f.string();
+    }
+  }
+  std::sort(packs.begin(), packs.end());
+
+  TrainingSet set;
+  int skipped = 0;
+  for (const fs::path& pack_file : packs) {
+    if (EnoughImages(set)) break;
+    std::shared_ptr<FeaturePack> pack = FeaturePack::Open(pack_file.string());
+    if (!pack) {
+      std::cerr << "Can't open pack " << pack_file.string() << std::endl;
+      continue;
+    }
+    const std::string record = pack_file.stem().string();
+    for (const std::string& key : pack->Keys()) {
+      if (EnoughImages(set)) break;
+      files.erase(record + "/" + key);
+      CompactFeatures features;
+      if (!pack->Get(key, features) || !AddTrainingImage(features, set)) {
+        ++skipped;
+      }
+    }
+  }
+  for (const auto& f : files) {
+    if (EnoughImages(set)) break;
+    CompactFeatures features;
+    if (!CacheStorage::ReadFeaturesFile(f.second, features)
+        || !AddTrainingImage(features, set)) {
+      ++skipped;
+    }
+  }
+
+  const int rows = set.row_images.size();
+  std::cout << "images = " << set.images << ", skipped = " << skipped
+            << ", descriptors = " << rows
+            << ", descriptor_bytes = " << set.descriptor_bytes << std::endl;
+  if (rows == 0) {
+    std::cerr << "No binary descriptors to train on" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  VocabularyTree vocabulary;
+  if (!vocabulary.Train(set.descriptors.data(), rows, set.stride,
+                        set.descriptor_bytes, set.row_images,
+                        FLAGS_branching, FLAGS_depth, FLAGS_seed)) {
+    std::cerr << "Can't train vocabulary" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const std::string vocabulary_file = (features_dir / VOCABULARY_FILE).string();
+  if (!vocabulary.Save(vocabulary_file)) {
+    std::cerr << "Can't save vocabulary " << vocabulary_file << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << vocabulary_file << ": words = " << vocabulary.Words()
+            << std::endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+// Copyright Pavlo 2018
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cv_gl/cache_file.h"
+
+#define CACHE_CLAIM_EXT  ".claim"
+
+std::string CacheTempFile(const std::string& file) {
+  static std::atomic<unsigned> counter(0);
+  std::stringstream ss;
+  ss << file << ".tmp." << getpid() << "." << counter++;
+  return ss.str();
+}
+
+bool WriteFileAtomic(const std::string& file, const std::string& data) {
+  const std::string tmp_file = CacheTempFile(file);
+  std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) return false;
+  out.write(data.data(), data.size());
+  bool ok = out.good();
+  out.close();
+  if (!ok || std::rename(tmp_file.c_str(), file.c_str()) != 0) {
+    std::remove(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+uint32_t CacheChecksum(const char* data, const size_t bytes,
+                       uint32_t hash) {
+  for (size_t i = 0; i < bytes; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+bool WriteCacheEntry(const std::string& file, const uint32_t magic,
+                     const std::string& payload) {
+  const uint64_t bytes = payload.size();
+  const uint32_t checksum = CacheChecksum(payload.data(), payload.size());
+  std::string data;
+  data.reserve(sizeof(magic) + sizeof(bytes) + sizeof(checksum)
+               + payload.size());
+  data.append(reinterpret_cast<const char*>(&magic), sizeof(magic));
+  data.append(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+  data.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+  data.append(payload);
+  return WriteFileAtomic(file, data);
+}
+
+bool ReadCacheEntry(std::istream& in, const uint32_t magic,
+                    std::string& payload) {
+  uint32_t file_magic = 0;
+  uint64_t bytes = 0;
+  uint32_t checksum = 0;
+  if (!in.read(reinterpret_cast<char*>(&file_magic), sizeof(file_magic))
+      || file_magic != magic
+      || !in.read(reinterpret_cast<char*>(&bytes), sizeof(bytes))
+      || !in.read(reinterpret_cast<char*>(&checksum), sizeof(checksum))) {
+    return false;
+  }
+  // Size is checked against the rest of the stream before the allocation
+  const std::streampos start = in.tellg();
+  in.seekg(0, std::ios::end);
+  const std::streampos end = in.tellg();
+  if (start < 0 || end < start
+      || static_cast<uint64_t>(end - start) != bytes) {
+    return false;
+  }
+  in.seekg(start);
+  payload.resize(bytes);
+  if (bytes > 0 && !in.read(&payload[0], bytes)) return false;
+  return CacheChecksum(payload.data(), payload.size()) == checksum;
+}
+
+std::shared_ptr<CacheClaim> CacheClaim::Acquire(const std::string& file,
+                                                const bool wait) {
+  const std::string claim_file = file + CACHE_CLAIM_EXT;
+  while (true) {
+    const int fd = open(claim_file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return nullptr;
+    if (flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+      const bool interrupted = errno == EINTR;
+      close(fd);
+      if (wait && interrupted) continue;
+      return nullptr;
+    }
+    // The holder removes the file on release, the lock taken is of the
+    // removed file then and the claim is tried again
+    struct stat fd_stat, file_stat;
+    if (fstat(fd, &fd_stat) == 0 && stat(claim_file.c_str(), &file_stat) == 0
+        && fd_stat.st_dev == file_stat.st_dev
+        && fd_stat.st_ino == file_stat.st_ino) {
+      return std::shared_ptr<CacheClaim>(new CacheClaim(claim_file, fd));
+    }
+    close(fd);
+  }
+}
+
+CacheClaim::~CacheClaim() {
+  // Removed while still locked, see Acquire
+  unlink(claim_file_.c_str());
+  close(fd_);
+}
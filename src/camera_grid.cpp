@@ -0,0 +1,94 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cmath>
+
+#include "cv_gl/camera_grid.h"
+#include "cv_gl/utils.h"
+
+CameraGrid::CameraGrid(const double cell_size)
+    : cell_size_(cell_size > 0.0 ? cell_size : 1.0) {}
+
+glm::ivec3 CameraGrid::Cell(const glm::dvec3& pos) const {
+  return glm::ivec3(static_cast<int>(std::floor(pos.x / cell_size_)),
+                    static_cast<int>(std::floor(pos.y / cell_size_)),
+                    static_cast<int>(std::floor(pos.z / cell_size_)));
+}
+
+uint64_t CameraGrid::CellKey(const glm::ivec3& cell) {
+  // 21 bits per axis, +-1M cells is far beyond any record
+  const uint64_t mask = (1u << 21) - 1;
+  return ((static_cast<uint64_t>(cell.x + (1 << 20)) & mask) << 42)
+      | ((static_cast<uint64_t>(cell.y + (1 << 20)) & mask) << 21)
+      | (static_cast<uint64_t>(cell.z + (1 << 20)) & mask);
+}
+
+void CameraGrid::Add(const int id, const glm::dvec3& pos) {
+  cells_[CellKey(Cell(pos))].push_back(ids_.size());
+  ids_.push_back(id);
+  positions_.push_back(pos);
+}
+
+void CameraGrid::CollectRing(const glm::ivec3& center, const int ring,
+                             std::vector<int>& points) const {
+  for (int x = center.x - ring; x <= center.x + ring; ++x) {
+    for (int y = center.y - ring; y <= center.y + ring; ++y) {
+      const bool side = std::abs(x - center.x) == ring
+          || std::abs(y - center.y) == ring;
+      // Inner columns of the cube have only their two end cells in the ring
+      const int z_step = (side || ring == 0) ? 1 : 2 * ring;
+      for (int z = center.z - ring; z <= center.z + ring; z += z_step) {
+        auto it = cells_.find(CellKey(glm::ivec3(x, y, z)));
+        if (it == cells_.end()) continue;
+        points.insert(points.end(), it->second.begin(), it->second.end());
+      }
+    }
+  }
+}
+
+void CameraGrid::Radius(const glm::dvec3& pos, const double radius,
+                        std::vector<int>& ids) const {
+  ids.clear();
+  if (ids_.empty() || radius < 0.0) return;
+  const glm::ivec3 center = Cell(pos);
+  const int rings = static_cast<int>(std::ceil(radius / cell_size_));
+  std::vector<int> points;
+  for (int ring = 0; ring <= rings; ++ring) {
+    CollectRing(center, ring, points);
+  }
+  std::vector<std::pair<double, int> > found;
+  for (int p : points) {
+    const double d = glm::distance(pos, positions_[p]);
+    if (d <= radius) found.push_back(std::make_pair(d, ids_[p]));
+  }
+  std::sort(found.begin(), found.end());
+  for (const auto& f : found) ids.push_back(f.second);
+}
+
+static double HalfFov(const CameraIntrinsics& intr) {
+  // cx is the half width of the image in the same units as fx
+  if (intr.fx <= 0.0f) return 0.0;
+  return std::atan(std::abs(intr.cx) / intr.fx);
+}
+
+double GetViewOverlapScore(const CameraInfo& camera_info1,
+                           const CameraInfo& camera_info2,
+                           const double max_dist) {
+  const double dist = ::GetCamerasDistance(camera_info1, camera_info2);
+  if (max_dist <= 0.0 || dist > max_dist) return 0.0;
+
+  const glm::dvec3 axis(0.0, 0.0, 1.0);
+  glm::dmat3 r1 = GetRotation(camera_info1.rotation_angles[0],
+                              camera_info1.rotation_angles[1],
+                              camera_info1.rotation_angles[2]);
+  glm::dmat3 r2 = GetRotation(camera_info2.rotation_angles[0],
+                              camera_info2.rotation_angles[1],
+                              camera_info2.rotation_angles[2]);
+  const double cos_angle = glm::clamp(
+      glm::dot(glm::normalize(r1 * axis), glm::normalize(r2 * axis)),
+      -1.0, 1.0);
+  const double angle = std::acos(cos_angle);
+  const double fov = HalfFov(camera_info1.intr) + HalfFov(camera_info2.intr);
+  if (fov <= 0.0 || angle >= fov) return 0.0;
+
+  return (1.0 - angle / fov) * (1.0 - dist / max_dist);
+}
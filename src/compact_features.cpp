@@ -0,0 +1,243 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "cv_gl/compact_features.h"
+#include "cv_gl/sfm_common.h"
+
+CompactFeatures::CompactFeatures()
+    : descriptor_type_(CV_8U),
+      descriptor_cols_(0),
+      descriptor_elem_(1),
+      descriptor_stride_(0),
+      size_(0),
+      points_data_(nullptr),
+      sizes_data_(nullptr),
+      angles_data_(nullptr),
+      octaves_data_(nullptr),
+      descriptors_data_(nullptr) {}
+
+CompactFeatures::CompactFeatures(const Features& features)
+    : CompactFeatures() {
+  Assign(features);
+}
+
+CompactFeatures::CompactFeatures(const CompactFeatures& other)
+    : CompactFeatures() {
+  CopyFrom(other);
+}
+
+CompactFeatures::CompactFeatures(CompactFeatures&& other)
+    : CompactFeatures() {
+  *this = std::move(other);
+}
+
+CompactFeatures& CompactFeatures::operator=(const CompactFeatures& other) {
+  if (this != &other) {
+    CopyFrom(other);
+  }
+  return *this;
+}
+
+CompactFeatures& CompactFeatures::operator=(CompactFeatures&& other) {
+  if (this == &other) return *this;
+  // Moved vectors keep their buffers, so the views stay valid
+  points_ = std::move(other.points_);
+  sizes_ = std::move(other.sizes_);
+  angles_ = std::move(other.angles_);
+  octaves_ = std::move(other.octaves_);
+  descriptors_ = std::move(other.descriptors_);
+  descriptor_type_ = other.descriptor_type_;
+  descriptor_cols_ = other.descriptor_cols_;
+  descriptor_elem_ = other.descriptor_elem_;
+  descriptor_stride_ = other.descriptor_stride_;
+  size_ = other.size_;
+  points_data_ = other.points_data_;
+  sizes_data_ = other.sizes_data_;
+  angles_data_ = other.angles_data_;
+  octaves_data_ = other.octaves_data_;
+  descriptors_data_ = other.descriptors_data_;
+  storage_ = std::move(other.storage_);
+  other.Clear();
+  return *this;
+}
+
+void CompactFeatures::Clear() {
+  std::vector<cv::Point2f>().swap(points_);
+  std::vector<uint16_t>().swap(sizes_);
+  std::vector<uint16_t>().swap(angles_);
+  std::vector<int8_t>().swap(octaves_);
+  DescriptorBlock().swap(descriptors_);
+  SetDescriptorLayout(CV_8U, 0);
+  UpdateViews();
+}
+
+void CompactFeatures::CopyFrom(const CompactFeatures& other) {
+  points_ = other.points_;
+  sizes_ = other.sizes_;
+  angles_ = other.angles_;
+  octaves_ = other.octaves_;
+  descriptors_ = other.descriptors_;
+  descriptor_type_ = other.descriptor_type_;
+  descriptor_cols_ = other.descriptor_cols_;
+  descriptor_elem_ = other.descriptor_elem_;
+  descriptor_stride_ = other.descriptor_stride_;
+  storage_ = other.storage_;
+  if (storage_) {
+    // Wrapped arrays are shared
+    size_ = other.size_;
+    points_data_ = other.points_data_;
+    sizes_data_ = other.sizes_data_;
+    angles_data_ = other.angles_data_;
+    octaves_data_ = other.octaves_data_;
+    descriptors_data_ = other.descriptors_data_;
+    if (!descriptors_.empty()) {
+      // Restored descriptors are owned
+      descriptors_data_ = descriptors_.data();
+    }
+  } else {
+    UpdateViews();
+  }
+}
+
+void CompactFeatures::UpdateViews() {
+  storage_.reset();
+  size_ = static_cast<int>(points_.size());
+  points_data_ = points_.data();
+  sizes_data_ = sizes_.data();
+  angles_data_ = angles_.data();
+  octaves_data_ = octaves_.data();
+  descriptors_data_ = descriptors_.empty() ? nullptr : descriptors_.data();
+}
+
+void CompactFeatures::Wrap(const int n,
+                           const cv::Point2f* points,
+                           const uint16_t* sizes,
+                           const uint16_t* angles,
+                           const int8_t* octaves,
+                           const uchar* descriptors,
+                           const int descriptor_type,
+                           const int descriptor_cols,
+                           const int descriptor_stride,
+                           std::shared_ptr<const void> storage) {
+  Clear();
+  SetDescriptorLayout(descriptor_type, descriptor_cols);
+  descriptor_stride_ = descriptor_stride;
+  size_ = n;
+  points_data_ = points;
+  sizes_data_ = sizes;
+  angles_data_ = angles;
+  octaves_data_ = octaves;
+  descriptors_data_ = descriptors;
+  storage_ = std::move(storage);
+}
+
+void CompactFeatures::DropDescriptors() {
+  DescriptorBlock().swap(descriptors_);
+  descriptors_data_ = nullptr;
+}
+
+bool CompactFeatures::RestoreDescriptors(const CompactFeatures& other) {
+  if (!other.HasDescriptors() || !SameKeypoints(other)) return false;
+  SetDescriptorLayout(other.descriptor_type_, other.descriptor_cols_);
+  if (other.descriptor_stride_ != descriptor_stride_) return false;
+  const uchar* data = other.descriptor(0);
+  descriptors_.assign(data,
+                      data + static_cast<size_t>(size_) * descriptor_stride_);
+  descriptors_data_ = descriptors_.data();
+  return true;
+}
+
+bool CompactFeatures::SameKeypoints(const CompactFeatures& other) const {
+  if (other.size() != size()) return false;
+  if (size_ == 0) return true;
+  return std::memcmp(other.points(), points(),
+                     static_cast<size_t>(size_) * sizeof(cv::Point2f)) == 0;
+}
+
+void CompactFeatures::SetDescriptorLayout(const int type, const int cols) {
+  descriptor_type_ = type;
+  descriptor_cols_ = cols;
+  descriptor_elem_ = static_cast<int>(CV_ELEM_SIZE(type));
+  int row_bytes = descriptor_cols_ * descriptor_elem_;
+  descriptor_stride_ = (row_bytes + kDescriptorAlign - 1)
+      / kDescriptorAlign * kDescriptorAlign;
+}
+
+void CompactFeatures::Assign(const Features& features) {
+  const std::vector<cv::KeyPoint>& kps = features.keypoints;
+  const int n = kps.size();
+
+  points_.resize(n);
+  sizes_.resize(n);
+  angles_.resize(n);
+  octaves_.resize(n);
+  for (int i = 0; i < n; ++i) {
+    const cv::KeyPoint& kp = kps[i];
+    points_[i] = kp.pt;
+    float size = std::round(kp.size * kSizeScale);
+    sizes_[i] = static_cast<uint16_t>(std::max(std::min(size, 65535.0f), 0.0f));
+    // angle is -1 for the detectors without orientation
+    float angle = kp.angle < 0.0f ? 0.0f : std::fmod(kp.angle, 360.0f);
+    angles_[i] = static_cast<uint16_t>(
+        static_cast<int>(std::round(angle * (65536.0f / 360.0f))) & 0xFFFF);
+    octaves_[i] = static_cast<int8_t>(kp.octave);
+  }
+
+  const cv::Mat& desc = features.descriptors;
+  descriptors_.clear();
+  if (desc.empty()) {
+    SetDescriptorLayout(CV_8U, 0);
+    UpdateViews();
+    return;
+  }
+  SetDescriptorLayout(desc.type(), desc.cols);
+  const int row_bytes = descriptor_bytes();
+  descriptors_.assign(static_cast<size_t>(desc.rows) * descriptor_stride_, 0);
+  for (int r = 0; r < desc.rows; ++r) {
+    std::memcpy(descriptors_.data() + r * descriptor_stride_,
+                desc.ptr(r), row_bytes);
+  }
+  UpdateViews();
+}
+
+cv::KeyPoint CompactFeatures::keypoint(const int i) const {
+  return cv::KeyPoint(points_data_[i], keypoint_size(i), angle(i), 0.0f,
+                      octaves_data_[i]);
+}
+
+std::vector<cv::KeyPoint> CompactFeatures::keypoints() const {
+  std::vector<cv::KeyPoint> kps;
+  kps.reserve(size());
+  for (int i = 0; i < size(); ++i) {
+    kps.push_back(keypoint(i));
+  }
+  return kps;
+}
+
+cv::Mat CompactFeatures::descriptors() const {
+  if (!HasDescriptors()) return cv::Mat();
+  return cv::Mat(size(), descriptor_cols_, descriptor_type_,
+                 const_cast<uchar*>(descriptors_data_),
+                 descriptor_stride_);
+}
+
+Features CompactFeatures::ToFeatures() const {
+  Features features;
+  features.keypoints = keypoints();
+  features.descriptors = descriptors().clone();
+  return features;
+}
+
+size_t CompactFeatures::MemoryBytes() const {
+  return points_.capacity() * sizeof(cv::Point2f)
+      + sizes_.capacity() * sizeof(uint16_t)
+      + angles_.capacity() * sizeof(uint16_t)
+      + octaves_.capacity() * sizeof(int8_t)
+      + descriptors_.capacity();
+}
+
+size_t CompactFeatures::FeaturesMemoryBytes() const {
+  return size() * (sizeof(cv::KeyPoint) + descriptor_bytes());
+}
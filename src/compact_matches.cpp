@@ -0,0 +1,158 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cmath>
+
+#include "cv_gl/compact_matches.h"
+
+static const uint8_t kWithDistancesFlag = 1;
+
+static void PutVarint(uint32_t value, std::vector<uint8_t>& data) {
+  while (value >= 0x80) {
+    data.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  data.push_back(static_cast<uint8_t>(value));
+}
+
+static bool GetVarint(const uint8_t*& p, const uint8_t* end,
+                      uint32_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 35 && p < end; shift += 7) {
+    const uint8_t b = *p++;
+    value |= static_cast<uint32_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+static uint32_t ZigZag(const int32_t v) {
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+static int32_t UnZigZag(const uint32_t v) {
+  return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+static uint8_t QuantizeDistance(const float distance) {
+  if (!(distance > 0.0f)) return 0;
+  return static_cast<uint8_t>(std::min(255.0f, std::round(distance)));
+}
+
+CompactMatches::CompactMatches(const std::vector<cv::DMatch>& matches,
+                               const bool with_distances)
+    : with_distances_(with_distances) {
+  Assign(matches);
+}
+
+void CompactMatches::Assign(const std::vector<cv::DMatch>& matches) {
+  clear();
+  reserve(matches.size());
+  for (const cv::DMatch& m : matches) {
+    push_back(m);
+  }
+}
+
+void CompactMatches::push_back(const cv::DMatch& match) {
+  pairs_.push_back(IndexPair{match.queryIdx, match.trainIdx});
+  if (with_distances_) {
+    distances_.push_back(QuantizeDistance(match.distance));
+  }
+}
+
+void CompactMatches::clear() {
+  pairs_.clear();
+  distances_.clear();
+}
+
+void CompactMatches::reserve(const size_t n) {
+  pairs_.reserve(n);
+  if (with_distances_) distances_.reserve(n);
+}
+
+std::vector<cv::DMatch> CompactMatches::ToDMatches() const {
+  std::vector<cv::DMatch> matches;
+  matches.reserve(size());
+  for (size_t i = 0; i < size(); ++i) {
+    matches.push_back((*this)[i]);
+  }
+  return matches;
+}
+
+void CompactMatches::SetWithDistances(const bool with_distances) {
+  clear();
+  with_distances_ = with_distances;
+}
+
+size_t CompactMatches::KeepByValue(const std::vector<float>& values,
+                                   const float max_value) {
+  size_t kept = 0;
+  for (size_t i = 0; i < pairs_.size(); ++i) {
+    if (values[i] <= max_value) {
+      if (kept != i) {
+        pairs_[kept] = pairs_[i];
+        if (with_distances_) distances_[kept] = distances_[i];
+      }
+      ++kept;
+    }
+  }
+  const size_t removed = pairs_.size() - kept;
+  pairs_.resize(kept);
+  if (with_distances_) distances_.resize(kept);
+  return removed;
+}
+
+size_t CompactMatches::MemoryBytes() const {
+  return pairs_.capacity() * sizeof(IndexPair) + distances_.capacity();
+}
+
+void CompactMatches::Encode(std::vector<uint8_t>& data) const {
+  data.clear();
+  data.reserve(8 + pairs_.size() * 3 + distances_.size());
+  PutVarint(pairs_.size(), data);
+  data.push_back(with_distances_ ? kWithDistancesFlag : 0);
+  int32_t prev_query = 0;
+  for (const IndexPair& p : pairs_) {
+    PutVarint(ZigZag(p.query - prev_query), data);
+    PutVarint(static_cast<uint32_t>(p.train), data);
+    prev_query = p.query;
+  }
+  data.insert(data.end(), distances_.begin(), distances_.end());
+}
+
+bool CompactMatches::Decode(const uint8_t* data, const size_t bytes) {
+  clear();
+  const uint8_t* p = data;
+  const uint8_t* end = data + bytes;
+  uint32_t count;
+  // Every match takes two bytes at least
+  if (!GetVarint(p, end, count) || p >= end
+      || count > static_cast<size_t>(end - p) / 2) {
+    return false;
+  }
+  with_distances_ = (*p++ & kWithDistancesFlag) != 0;
+  pairs_.resize(count);
+  int32_t prev_query = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t delta, train;
+    if (!GetVarint(p, end, delta) || !GetVarint(p, end, train)) {
+      clear();
+      return false;
+    }
+    pairs_[i].query = prev_query + UnZigZag(delta);
+    pairs_[i].train = static_cast<int32_t>(train);
+    prev_query = pairs_[i].query;
+  }
+  if (with_distances_) {
+    if (static_cast<size_t>(end - p) < count) {
+      clear();
+      return false;
+    }
+    distances_.assign(p, p + count);
+    p += count;
+  }
+  if (p != end) {
+    clear();
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,194 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cv_gl/epipolar_filter.h"
+
+void EpipolarBuffer::Resize(const size_t n) {
+  x1.resize(n);
+  y1.resize(n);
+  x2.resize(n);
+  y2.resize(n);
+  distances.resize(n);
+}
+
+void ComputeEpipolarDistances(const cv::Mat& fund,
+                              const float* x1, const float* y1,
+                              const float* x2, const float* y2,
+                              const int count, float* distances) {
+  // Distance is invariant to the scale of F, bring it to ~1 for floats
+  double scale = 0.0;
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      scale = std::max(scale, std::abs(fund.at<double>(row, col)));
+    }
+  }
+  if (scale <= 0.0) scale = 1.0;
+  float f[9];
+  for (int k = 0; k < 9; ++k) {
+    f[k] = static_cast<float>(fund.at<double>(k / 3, k % 3) / scale);
+  }
+
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128 f0 = _mm_set1_ps(f[0]), f1 = _mm_set1_ps(f[1]),
+      f2 = _mm_set1_ps(f[2]), f3 = _mm_set1_ps(f[3]), f4 = _mm_set1_ps(f[4]),
+      f5 = _mm_set1_ps(f[5]), f6 = _mm_set1_ps(f[6]), f7 = _mm_set1_ps(f[7]),
+      f8 = _mm_set1_ps(f[8]);
+  const __m128 sign_mask = _mm_set1_ps(-0.0f);
+  for (; i + 4 <= count; i += 4) {
+    const __m128 px2 = _mm_loadu_ps(x2 + i);
+    const __m128 py2 = _mm_loadu_ps(y2 + i);
+    // Line l = F * (x2, y2, 1)
+    const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f0, px2),
+                                           _mm_mul_ps(f1, py2)), f2);
+    const __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f3, px2),
+                                           _mm_mul_ps(f4, py2)), f5);
+    const __m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f6, px2),
+                                           _mm_mul_ps(f7, py2)), f8);
+    const __m128 r = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(a, _mm_loadu_ps(x1 + i)),
+                   _mm_mul_ps(b, _mm_loadu_ps(y1 + i))), c);
+    const __m128 n = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(a, a),
+                                            _mm_mul_ps(b, b)));
+    _mm_storeu_ps(distances + i, _mm_div_ps(_mm_andnot_ps(sign_mask, r), n));
+  }
+#endif
+  for (; i < count; ++i) {
+    const float a = f[0] * x2[i] + f[1] * y2[i] + f[2];
+    const float b = f[3] * x2[i] + f[4] * y2[i] + f[5];
+    const float c = f[6] * x2[i] + f[7] * y2[i] + f[8];
+    const float r = a * x1[i] + b * y1[i] + c;
+    distances[i] = std::abs(r) / std::sqrt(a * a + b * b);
+  }
+}
+
+static inline const cv::Point2f& MatchPoint(const CompactFeatures& features,
+                                            const int i) {
+  return features.pt(i);
+}
+
+static inline const cv::Point2f& MatchPoint(
+    const std::vector<cv::KeyPoint>& keypoints, const int i) {
+  return keypoints[i].pt;
+}
+
+static inline int QueryIdx(const std::vector<cv::DMatch>& matches,
+                           const size_t i) {
+  return matches[i].queryIdx;
+}
+
+static inline int QueryIdx(const CompactMatches& matches, const size_t i) {
+  return matches.queryIdx(i);
+}
+
+static inline int TrainIdx(const std::vector<cv::DMatch>& matches,
+                           const size_t i) {
+  return matches[i].trainIdx;
+}
+
+static inline int TrainIdx(const CompactMatches& matches, const size_t i) {
+  return matches.trainIdx(i);
+}
+
+template<class Points, class MatchesT>
+static void ComputeEpipolarDistancesImpl(const cv::Mat& fund,
+                                         const Points& points1,
+                                         const Points& points2,
+                                         const MatchesT& matches,
+                                         EpipolarBuffer& buffer) {
+  const size_t n = matches.size();
+  buffer.Resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    const cv::Point2f& p1 = MatchPoint(points1, QueryIdx(matches, i));
+    const cv::Point2f& p2 = MatchPoint(points2, TrainIdx(matches, i));
+    buffer.x1[i] = p1.x;
+    buffer.y1[i] = p1.y;
+    buffer.x2[i] = p2.x;
+    buffer.y2[i] = p2.y;
+  }
+  ComputeEpipolarDistances(fund, buffer.x1.data(), buffer.y1.data(),
+                           buffer.x2.data(), buffer.y2.data(),
+                           static_cast<int>(n), buffer.distances.data());
+}
+
+void ComputeEpipolarDistances(const cv::Mat& fund,
+                              const CompactFeatures& features1,
+                              const CompactFeatures& features2,
+                              const std::vector<cv::DMatch>& matches,
+                              EpipolarBuffer& buffer) {
+  ComputeEpipolarDistancesImpl(fund, features1, features2, matches, buffer);
+}
+
+void ComputeEpipolarDistances(const cv::Mat& fund,
+                              const CompactFeatures& features1,
+                              const CompactFeatures& features2,
+                              const CompactMatches& matches,
+                              EpipolarBuffer& buffer) {
+  ComputeEpipolarDistancesImpl(fund, features1, features2, matches, buffer);
+}
+
+void ComputeEpipolarDistances(const cv::Mat& fund,
+                              const std::vector<cv::KeyPoint>& keypoints1,
+                              const std::vector<cv::KeyPoint>& keypoints2,
+                              const std::vector<cv::DMatch>& matches,
+                              EpipolarBuffer& buffer) {
+  ComputeEpipolarDistancesImpl(fund, keypoints1, keypoints2, matches, buffer);
+}
+
+size_t CompactMatchesByDistance(const std::vector<float>& distances,
+                                std::vector<cv::DMatch>& matches,
+                                const double max_dist) {
+  const float max_distf = static_cast<float>(max_dist);
+  size_t kept = 0;
+  for (size_t i = 0; i < matches.size(); ++i) {
+    // NaN fails the test as well
+    if (distances[i] <= max_distf) {
+      if (kept != i) matches[kept] = matches[i];
+      ++kept;
+    }
+  }
+  const size_t removed = matches.size() - kept;
+  matches.resize(kept);
+  return removed;
+}
+
+size_t CompactMatchesByDistance(const std::vector<float>& distances,
+                                CompactMatches& matches,
+                                const double max_dist) {
+  return matches.KeepByValue(distances, static_cast<float>(max_dist));
+}
+
+size_t FilterMatchesByEpipolarDistance(const cv::Mat& fund,
+                                       const CompactFeatures& features1,
+                                       const CompactFeatures& features2,
+                                       CompactMatches& matches,
+                                       const double max_dist) {
+  EpipolarBuffer buffer;
+  ComputeEpipolarDistances(fund, features1, features2, matches, buffer);
+  return CompactMatchesByDistance(buffer.distances, matches, max_dist);
+}
+
+size_t FilterMatchesByEpipolarDistance(const cv::Mat& fund,
+                                       const CompactFeatures& features1,
+                                       const CompactFeatures& features2,
+                                       std::vector<cv::DMatch>& matches,
+                                       const double max_dist) {
+  EpipolarBuffer buffer;
+  ComputeEpipolarDistances(fund, features1, features2, matches, buffer);
+  return CompactMatchesByDistance(buffer.distances, matches, max_dist);
+}
+
+size_t FilterMatchesByEpipolarDistance(const cv::Mat& fund,
+                                       const std::vector<cv::KeyPoint>& keypoints1,
+                                       const std::vector<cv::KeyPoint>& keypoints2,
+                                       std::vector<cv::DMatch>& matches,
+                                       const double max_dist) {
+  EpipolarBuffer buffer;
+  ComputeEpipolarDistances(fund, keypoints1, keypoints2, matches, buffer);
+  return CompactMatchesByDistance(buffer.distances, matches, max_dist);
+}
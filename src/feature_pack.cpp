@@ -0,0 +1,209 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cv_gl/feature_pack.h"
+
+// header: magic, version, count, reserved, index_offset
+static const size_t kFeaturePackHeaderSize = 4 * sizeof(uint32_t)
+                                             + sizeof(uint64_t);
+
+FeaturePackWriter::FeaturePackWriter(const std::string& pack_file)
+    : pack_file_(pack_file),
+      tmp_file_(pack_file + ".tmp"),
+      offset_(0) {
+  file_.open(tmp_file_, std::ios::binary | std::ios::trunc);
+  if (!file_.is_open()) return;
+  // Header placeholder, written on Close()
+  std::vector<char> header(kFeaturePackHeaderSize, 0);
+  file_.write(header.data(), header.size());
+  offset_ = header.size();
+}
+
+FeaturePackWriter::~FeaturePackWriter() {
+  if (file_.is_open()) {
+    // Not closed properly - drop the partial pack
+    file_.close();
+    std::remove(tmp_file_.c_str());
+  }
+}
+
+void FeaturePackWriter::Pad() {
+  static const char zeros[kFeaturePackAlign] = {0};
+  size_t rest = offset_ % kFeaturePackAlign;
+  if (rest > 0) {
+    file_.write(zeros, kFeaturePackAlign - rest);
+    offset_ += kFeaturePackAlign - rest;
+  }
+}
+
+uint64_t FeaturePackWriter::WriteArray(const void* data, const size_t bytes) {
+  Pad();
+  uint64_t start = offset_;
+  if (bytes > 0) {
+    file_.write(static_cast<const char*>(data), bytes);
+    offset_ += bytes;
+  }
+  return start;
+}
+
+bool FeaturePackWriter::Add(const std::string& key,
+                            const CompactFeatures& features) {
+  if (!file_.is_open()) return false;
+  const int n = features.size();
+  FeaturePackEntry entry;
+  entry.size = n;
+  entry.descriptor_type = features.descriptor_type();
+  entry.descriptor_cols = features.HasDescriptors()
+      ? features.descriptor_bytes() / static_cast<int>(
+          CV_ELEM_SIZE(features.descriptor_type()))
+      : 0;
+  entry.descriptor_stride = features.descriptor_stride();
+  entry.points_offset = WriteArray(features.points(), n * sizeof(cv::Point2f));
+  entry.sizes_offset = WriteArray(features.sizes(), n * sizeof(uint16_t));
+  entry.angles_offset = WriteArray(features.angles(), n * sizeof(uint16_t));
+  entry.octaves_offset = WriteArray(features.octaves(), n * sizeof(int8_t));
+  entry.descriptors_offset = 0;
+  if (features.HasDescriptors()) {
+    entry.descriptors_offset = WriteArray(features.descriptor(0),
+        static_cast<size_t>(n) * features.descriptor_stride());
+  }
+  keys_.push_back(key);
+  entries_.push_back(entry);
+  return file_.good();
+}
+
+bool FeaturePackWriter::Close() {
+  if (!file_.is_open()) return false;
+
+  // Index
+  Pad();
+  uint64_t index_offset = offset_;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    uint32_t key_len = keys_[i].size();
+    file_.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
+    file_.write(keys_[i].data(), key_len);
+    file_.write(reinterpret_cast<const char*>(&entries_[i]),
+                sizeof(FeaturePackEntry));
+  }
+
+  // Header
+  uint32_t header[4] = {FEATURE_PACK_MAGIC, FEATURE_PACK_VERSION,
+                        static_cast<uint32_t>(entries_.size()), 0};
+  file_.seekp(0);
+  file_.write(reinterpret_cast<const char*>(header), sizeof(header));
+  file_.write(reinterpret_cast<const char*>(&index_offset),
+              sizeof(index_offset));
+  bool ok = file_.good();
+  file_.close();
+  if (!ok || std::rename(tmp_file_.c_str(), pack_file_.c_str()) != 0) {
+    std::remove(tmp_file_.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+std::shared_ptr<FeaturePack> FeaturePack::Open(const std::string& pack_file) {
+  int fd = open(pack_file.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kFeaturePackHeaderSize) {
+    close(fd);
+    return nullptr;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return nullptr;
+
+  std::shared_ptr<FeaturePack> pack(new FeaturePack());
+  pack->data_ = static_cast<const uchar*>(data);
+  pack->size_ = st.st_size;
+  if (!pack->ReadIndex()) {
+    std::cerr << "Feature pack is broken: " << pack_file << std::endl;
+    return nullptr;
+  }
+  return pack;
+}
+
+FeaturePack::~FeaturePack() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uchar*>(data_), size_);
+  }
+}
+
+bool FeaturePack::InPack(const uint64_t offset, const size_t bytes) const {
+  return offset <= size_ && bytes <= size_ - offset;
+}
+
+bool FeaturePack::ReadIndex() {
+  uint32_t header[4];
+  uint64_t index_offset;
+  std::memcpy(header, data_, sizeof(header));
+  std::memcpy(&index_offset, data_ + sizeof(header), sizeof(index_offset));
+  if (header[0] != FEATURE_PACK_MAGIC || header[1] != FEATURE_PACK_VERSION) {
+    return false;
+  }
+  const uint32_t count = header[2];
+  size_t pos = index_offset;
+  index_.reserve(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t key_len;
+    if (!InPack(pos, sizeof(key_len))) return false;
+    std::memcpy(&key_len, data_ + pos, sizeof(key_len));
+    pos += sizeof(key_len);
+    if (!InPack(pos, key_len + sizeof(FeaturePackEntry))) return false;
+    std::string key(reinterpret_cast<const char*>(data_ + pos), key_len);
+    pos += key_len;
+    FeaturePackEntry entry;
+    std::memcpy(&entry, data_ + pos, sizeof(entry));
+    pos += sizeof(entry);
+    // Every array of the entry should be within the mapped file
+    if (entry.size < 0 || entry.descriptor_stride < 0) return false;
+    const size_t size = entry.size;
+    const size_t desc_bytes = entry.descriptors_offset > 0
+        ? size * entry.descriptor_stride : 0;
+    if (!InPack(entry.points_offset, size * sizeof(cv::Point2f))
+        || !InPack(entry.sizes_offset, size * sizeof(uint16_t))
+        || !InPack(entry.angles_offset, size * sizeof(uint16_t))
+        || !InPack(entry.octaves_offset, size * sizeof(int8_t))
+        || !InPack(entry.descriptors_offset, desc_bytes)) {
+      return false;
+    }
+    index_[key] = entry;
+  }
+  return true;
+}
+
+bool FeaturePack::Get(const std::string& key,
+                      CompactFeatures& features) const {
+  auto it = index_.find(key);
+  if (it == index_.end()) return false;
+  const FeaturePackEntry& e = it->second;
+  features.Wrap(e.size,
+      reinterpret_cast<const cv::Point2f*>(data_ + e.points_offset),
+      reinterpret_cast<const uint16_t*>(data_ + e.sizes_offset),
+      reinterpret_cast<const uint16_t*>(data_ + e.angles_offset),
+      reinterpret_cast<const int8_t*>(data_ + e.octaves_offset),
+      e.descriptors_offset > 0 ? data_ + e.descriptors_offset : nullptr,
+      e.descriptor_type, e.descriptor_cols, e.descriptor_stride,
+      shared_from_this());
+  return true;
+}
+
+std::vector<std::string> FeaturePack::Keys() const {
+  std::vector<std::string> keys;
+  keys.reserve(index_.size());
+  for (const auto& it : index_) {
+    keys.push_back(it.first);
+  }
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
@@ -0,0 +1,154 @@
+// Copyright Pavlo 2018
+#include <cstdint>
+#include <cstring>
+
+#include "cv_gl/hamming_matcher.h"
+#include "cv_gl/hamming_kernels.hpp"
+
+// Portable kernel, 64 bit words
+struct HammingScalarDist {
+  template<int kStride>
+  static inline int Distance(const uchar* a, const uchar* b, const int stride) {
+    const int bytes = kStride > 0 ? kStride : stride;
+    int dist = 0;
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+      uint64_t x, y;
+      std::memcpy(&x, a + i, sizeof(x));
+      std::memcpy(&y, b + i, sizeof(y));
+      dist += __builtin_popcountll(x ^ y);
+    }
+    for (; i < bytes; ++i) {
+      dist += __builtin_popcount(a[i] ^ b[i]);
+    }
+    return dist;
+  }
+};
+
+void HammingKnn2RatioScalar(const uchar* query, const int query_rows,
+                            const HammingTrainSet* trains,
+                            const int trains_size,
+                            const int stride, const float ratio_thresh,
+                            cv::DMatch* const* matches, int* matches_sizes) {
+  HammingKnn2RatioDispatch<HammingScalarDist>(
+      query, query_rows, trains, trains_size, stride, ratio_thresh,
+      matches, matches_sizes);
+}
+
+HammingDistanceFunc HammingDistanceFuncScalar(const int stride) {
+  return HammingDistanceFuncDispatch<HammingScalarDist>(stride);
+}
+
+
+enum HammingKernel {
+  HAMMING_SCALAR,
+  HAMMING_AVX2,
+  HAMMING_AVX512
+};
+
+static HammingKernel DetectHammingKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#ifdef CV_GL_HAMMING_AVX512
+  if (__builtin_cpu_supports("avx512f")
+      && __builtin_cpu_supports("avx512vpopcntdq")) {
+    return HAMMING_AVX512;
+  }
+#endif
+#ifdef CV_GL_HAMMING_AVX2
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    return HAMMING_AVX2;
+  }
+#endif
+#endif
+  return HAMMING_SCALAR;
+}
+
+static HammingKernel GetHammingKernel() {
+  static const HammingKernel kernel = DetectHammingKernel();
+  return kernel;
+}
+
+static void HammingKnn2Ratio(const uchar* query, const int query_rows,
+                             const HammingTrainSet* trains,
+                             const int trains_size,
+                             const int stride, const float ratio_thresh,
+                             cv::DMatch* const* matches, int* matches_sizes) {
+  switch (GetHammingKernel()) {
+#ifdef CV_GL_HAMMING_AVX512
+    case HAMMING_AVX512:
+      HammingKnn2RatioAvx512(query, query_rows, trains, trains_size,
+                             stride, ratio_thresh, matches, matches_sizes);
+      break;
+#endif
+#ifdef CV_GL_HAMMING_AVX2
+    case HAMMING_AVX2:
+      HammingKnn2RatioAvx2(query, query_rows, trains, trains_size,
+                           stride, ratio_thresh, matches, matches_sizes);
+      break;
+#endif
+    default:
+      HammingKnn2RatioScalar(query, query_rows, trains, trains_size,
+                             stride, ratio_thresh, matches, matches_sizes);
+  }
+}
+
+void MatchHammingKnn2(const uchar* query, const int query_rows,
+                      const uchar* train, const int train_rows,
+                      const int stride, const float ratio_thresh,
+                      std::vector<cv::DMatch>& matches) {
+  // At most one match per query
+  const size_t offset = matches.size();
+  matches.resize(offset + query_rows);
+  cv::DMatch* out = matches.data() + offset;
+  const HammingTrainSet train_set = {train, train_rows};
+  int count = 0;
+  HammingKnn2Ratio(query, query_rows, &train_set, 1, stride, ratio_thresh,
+                   &out, &count);
+  matches.resize(offset + count);
+}
+
+void MatchHammingKnn2Batch(
+    const uchar* query, const int query_rows,
+    const std::vector<HammingTrainSet>& trains,
+    const int stride, const float ratio_thresh,
+    const std::vector<std::vector<cv::DMatch>*>& matches) {
+  const size_t trains_size = trains.size();
+  std::vector<size_t> offsets(trains_size);
+  std::vector<cv::DMatch*> outs(trains_size);
+  std::vector<int> counts(trains_size, 0);
+  for (size_t k = 0; k < trains_size; ++k) {
+    offsets[k] = matches[k]->size();
+    matches[k]->resize(offsets[k] + query_rows);
+    outs[k] = matches[k]->data() + offsets[k];
+  }
+  HammingKnn2Ratio(query, query_rows, trains.data(),
+                   static_cast<int>(trains_size), stride, ratio_thresh,
+                   outs.data(), counts.data());
+  for (size_t k = 0; k < trains_size; ++k) {
+    matches[k]->resize(offsets[k] + counts[k]);
+  }
+}
+
+HammingDistanceFunc GetHammingDistanceFunc(const int stride) {
+  switch (GetHammingKernel()) {
+#ifdef CV_GL_HAMMING_AVX512
+    case HAMMING_AVX512:
+      return HammingDistanceFuncAvx512(stride);
+#endif
+#ifdef CV_GL_HAMMING_AVX2
+    case HAMMING_AVX2:
+      return HammingDistanceFuncAvx2(stride);
+#endif
+    default:
+      return HammingDistanceFuncScalar(stride);
+  }
+}
+
+const char* HammingKernelName() {
+  switch (GetHammingKernel()) {
+    case HAMMING_AVX512: return "avx512_vpopcnt";
+    case HAMMING_AVX2: return "avx2";
+    default: return "scalar";
+  }
+}
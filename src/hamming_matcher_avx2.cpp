@@ -0,0 +1,73 @@
+// Copyright Pavlo 2018
+// Built with -mavx2 -mpopcnt, called only when the CPU supports them
+#include <cstdint>
+#include <cstring>
+
+#include <immintrin.h>
+
+#include "cv_gl/hamming_kernels.hpp"
+
+// Nibble lookup popcount (vpshufb) over 32 byte chunks, byte counts are
+// summed with vpsadbw. Rows of any other stride use popcnt over words.
+struct HammingAvx2Dist {
+  static inline int Popcount256(const __m256i v) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const __m256i lo = _mm256_and_si256(v, low_mask);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    const __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                        _mm256_shuffle_epi8(lut, hi));
+    const __m256i sum = _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+    const __m128i sum2 = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                                       _mm256_extracti128_si256(sum, 1));
+    return static_cast<int>(_mm_cvtsi128_si64(sum2)
+                            + _mm_extract_epi64(sum2, 1));
+  }
+
+  template<int kStride>
+  static inline int Distance(const uchar* a, const uchar* b, const int stride) {
+    if (kStride == 32) {
+      return Popcount256(_mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b))));
+    }
+    if (kStride == 64) {
+      const __m256i x0 = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)));
+      const __m256i x1 = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + 32)),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + 32)));
+      return Popcount256(x0) + Popcount256(x1);
+    }
+    int dist = 0;
+    int i = 0;
+    for (; i + 8 <= stride; i += 8) {
+      uint64_t x, y;
+      std::memcpy(&x, a + i, sizeof(x));
+      std::memcpy(&y, b + i, sizeof(y));
+      dist += static_cast<int>(_mm_popcnt_u64(x ^ y));
+    }
+    for (; i < stride; ++i) {
+      dist += _mm_popcnt_u32(a[i] ^ b[i]);
+    }
+    return dist;
+  }
+};
+
+void HammingKnn2RatioAvx2(const uchar* query, const int query_rows,
+                          const HammingTrainSet* trains,
+                          const int trains_size,
+                          const int stride, const float ratio_thresh,
+                          cv::DMatch* const* matches, int* matches_sizes) {
+  HammingKnn2RatioDispatch<HammingAvx2Dist>(
+      query, query_rows, trains, trains_size, stride, ratio_thresh,
+      matches, matches_sizes);
+}
+
+HammingDistanceFunc HammingDistanceFuncAvx2(const int stride) {
+  return HammingDistanceFuncDispatch<HammingAvx2Dist>(stride);
+}
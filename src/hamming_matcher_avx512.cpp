@@ -0,0 +1,60 @@
+// Copyright Pavlo 2018
+// Built with -mavx512f -mavx512vpopcntdq -mpopcnt, called only when the
+// CPU supports them
+#include <cstdint>
+#include <cstring>
+
+#include <immintrin.h>
+
+#include "cv_gl/hamming_kernels.hpp"
+
+// 64 byte rows are one vpopcntq, 32 byte rows are zero extended to 512
+struct HammingAvx512Dist {
+  template<int kStride>
+  static inline int Distance(const uchar* a, const uchar* b, const int stride) {
+    if (kStride == 64) {
+      const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a),
+                                         _mm512_loadu_si512(b));
+      return static_cast<int>(_mm512_reduce_add_epi64(_mm512_popcnt_epi64(x)));
+    }
+    if (kStride == 32) {
+      const __m256i x = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)));
+      return static_cast<int>(_mm512_reduce_add_epi64(
+          _mm512_popcnt_epi64(_mm512_zextsi256_si512(x))));
+    }
+    int dist = 0;
+    int i = 0;
+    for (; i + 64 <= stride; i += 64) {
+      const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i),
+                                         _mm512_loadu_si512(b + i));
+      dist += static_cast<int>(
+          _mm512_reduce_add_epi64(_mm512_popcnt_epi64(x)));
+    }
+    for (; i + 8 <= stride; i += 8) {
+      uint64_t x, y;
+      std::memcpy(&x, a + i, sizeof(x));
+      std::memcpy(&y, b + i, sizeof(y));
+      dist += static_cast<int>(_mm_popcnt_u64(x ^ y));
+    }
+    for (; i < stride; ++i) {
+      dist += _mm_popcnt_u32(a[i] ^ b[i]);
+    }
+    return dist;
+  }
+};
+
+void HammingKnn2RatioAvx512(const uchar* query, const int query_rows,
+                            const HammingTrainSet* trains,
+                            const int trains_size,
+                            const int stride, const float ratio_thresh,
+                            cv::DMatch* const* matches, int* matches_sizes) {
+  HammingKnn2RatioDispatch<HammingAvx512Dist>(
+      query, query_rows, trains, trains_size, stride, ratio_thresh,
+      matches, matches_sizes);
+}
+
+HammingDistanceFunc HammingDistanceFuncAvx512(const int stride) {
+  return HammingDistanceFuncDispatch<HammingAvx512Dist>(stride);
+}
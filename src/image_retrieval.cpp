@@ -0,0 +1,159 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include "cv_gl/cache_file.h"
+#include "cv_gl/image_retrieval.h"
+
+// Sanity limits of the key length and words per image for broken files
+static const uint32_t kRetrievalMaxKey = 4096;
+static const uint32_t kRetrievalMaxWords = 1 << 22;
+
+int ImageRetrievalIndex::Find(const std::string& key) const {
+  auto it = ids_.find(key);
+  return it == ids_.end() ? -1 : it->second;
+}
+
+int ImageRetrievalIndex::Add(const std::string& key, const BowVector& bow) {
+  int id = Find(key);
+  if (id >= 0) return id;
+  id = bows_.size();
+  keys_.push_back(key);
+  bows_.push_back(bow);
+  ids_[key] = id;
+  for (const auto& w : bow) {
+    inverted_[w.first].push_back(std::make_pair(id, w.second));
+  }
+  return id;
+}
+
+std::vector<std::pair<int, float> > ImageRetrievalIndex::Query(
+    const BowVector& bow, const int top_k,
+    const std::vector<char>* allowed) const {
+  scores_.resize(bows_.size(), 0.0f);
+  touched_.clear();
+
+  // L1 score, sum of min weights over the common words
+  for (const auto& w : bow) {
+    auto it = inverted_.find(w.first);
+    if (it == inverted_.end()) continue;
+    for (const auto& posting : it->second) {
+      const int id = posting.first;
+      if (allowed != nullptr && !(*allowed)[id]) continue;
+      if (scores_[id] == 0.0f) touched_.push_back(id);
+      scores_[id] += std::min(w.second, posting.second);
+    }
+  }
+
+  std::vector<std::pair<int, float> > result;
+  result.reserve(touched_.size());
+  for (int id : touched_) {
+    result.push_back(std::make_pair(id, scores_[id]));
+    scores_[id] = 0.0f;
+  }
+  auto better = [](const std::pair<int, float>& a,
+                   const std::pair<int, float>& b) {
+    return a.second > b.second
+        || (a.second == b.second && a.first < b.first);
+  };
+  if (static_cast<int>(result.size()) > top_k) {
+    std::partial_sort(result.begin(), result.begin() + top_k, result.end(),
+                      better);
+    result.resize(top_k);
+  } else {
+    std::sort(result.begin(), result.end(), better);
+  }
+  return result;
+}
+
+bool ImageRetrievalIndex::Save(const std::string& file) const {
+  const std::string tmp_file = ::CacheTempFile(file);
+  std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) return false;
+  const uint32_t header[3] = {RETRIEVAL_INDEX_MAGIC, RETRIEVAL_INDEX_VERSION,
+                              static_cast<uint32_t>(bows_.size())};
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(&vocabulary_id_),
+            sizeof(vocabulary_id_));
+  for (size_t i = 0; i < bows_.size(); ++i) {
+    const uint32_t key_len = keys_[i].size();
+    const uint32_t words = bows_[i].size();
+    out.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
+    out.write(keys_[i].data(), key_len);
+    out.write(reinterpret_cast<const char*>(&words), sizeof(words));
+    for (const auto& w : bows_[i]) {
+      const int32_t word = w.first;
+      out.write(reinterpret_cast<const char*>(&word), sizeof(word));
+      out.write(reinterpret_cast<const char*>(&w.second), sizeof(w.second));
+    }
+  }
+  bool ok = out.good();
+  out.close();
+  if (!ok || std::rename(tmp_file.c_str(), file.c_str()) != 0) {
+    std::remove(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ImageRetrievalIndex::Load(const std::string& file,
+                               const uint64_t vocabulary_id) {
+  keys_.clear();
+  bows_.clear();
+  ids_.clear();
+  inverted_.clear();
+  vocabulary_id_ = vocabulary_id;
+
+  std::ifstream in(file, std::ios::binary);
+  if (!in.is_open()) return false;
+  uint32_t header[3];
+  uint64_t file_vocabulary_id = 0;
+  if (!in.read(reinterpret_cast<char*>(header), sizeof(header))
+      || !in.read(reinterpret_cast<char*>(&file_vocabulary_id),
+                  sizeof(file_vocabulary_id))
+      || header[0] != RETRIEVAL_INDEX_MAGIC
+      || header[1] != RETRIEVAL_INDEX_VERSION) {
+    std::cerr << "Retrieval index is broken: " << file << std::endl;
+    return false;
+  }
+  if (file_vocabulary_id != vocabulary_id) {
+    std::cout << "Retrieval index of other vocabulary, rebuild: "
+              << file << std::endl;
+    return false;
+  }
+  for (uint32_t i = 0; i < header[2]; ++i) {
+    uint32_t key_len = 0;
+    uint32_t words = 0;
+    in.read(reinterpret_cast<char*>(&key_len), sizeof(key_len));
+    if (!in || key_len > kRetrievalMaxKey) {
+      in.setstate(std::ios::failbit);
+      key_len = 0;
+    }
+    std::string key(key_len, '\0');
+    in.read(&key[0], key_len);
+    in.read(reinterpret_cast<char*>(&words), sizeof(words));
+    if (!in || words > kRetrievalMaxWords) {
+      in.setstate(std::ios::failbit);
+      words = 0;
+    }
+    BowVector bow(words);
+    for (uint32_t j = 0; j < words && in; ++j) {
+      int32_t word;
+      in.read(reinterpret_cast<char*>(&word), sizeof(word));
+      in.read(reinterpret_cast<char*>(&bow[j].second), sizeof(float));
+      bow[j].first = word;
+    }
+    if (!in) {
+      std::cerr << "Retrieval index is broken: " << file << std::endl;
+      keys_.clear();
+      bows_.clear();
+      ids_.clear();
+      inverted_.clear();
+      return false;
+    }
+    Add(key, bow);
+  }
+  return true;
+}
@@ -0,0 +1,545 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include "cv_gl/cache_file.h"
+#include "cv_gl/match_store.h"
+
+// record header: key length, payload bytes, checksum
+static const uint32_t kMatchRecordHeader = 3 * sizeof(uint32_t);
+// segment header: magic, version
+static const uint32_t kMatchSegmentHeader = 2 * sizeof(uint32_t);
+// per match of version 1: queryIdx, trainIdx, imgIdx, distance
+static const uint32_t kMatchBytes = 3 * sizeof(int32_t) + sizeof(float);
+// Sanity limit of the key length for broken files
+static const uint32_t kMatchMaxKey = 4096;
+
+static uint32_t Fnv1a(const char* data, const size_t n,
+                      uint32_t hash = 2166136261u) {
+  for (size_t i = 0; i < n; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Record of the current version
+static void EncodeRecord(const std::string& key,
+                         const CompactMatches& matches,
+                         std::vector<char>& record) {
+  std::vector<uint8_t> data;
+  matches.Encode(data);
+  const uint32_t key_len = key.size();
+  const uint32_t payload = data.size();
+  record.resize(kMatchRecordHeader + key_len + payload);
+  char* p = record.data() + kMatchRecordHeader;
+  std::memcpy(p, key.data(), key_len);
+  std::memcpy(p + key_len, data.data(), payload);
+  const uint32_t checksum = Fnv1a(record.data() + kMatchRecordHeader,
+                                  key_len + payload);
+  const uint32_t header[3] = {key_len, payload, checksum};
+  std::memcpy(record.data(), header, sizeof(header));
+}
+
+static bool DecodePayloadV1(const char* p, const uint32_t payload,
+                            CompactMatches* matches) {
+  if (payload < sizeof(uint32_t)) return false;
+  uint32_t count;
+  std::memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+  if (sizeof(count) + static_cast<uint64_t>(count) * kMatchBytes != payload) {
+    return false;
+  }
+  if (matches != nullptr) {
+    matches->clear();
+    matches->reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      int32_t idx[3];
+      cv::DMatch m;
+      std::memcpy(idx, p, sizeof(idx));
+      m.queryIdx = idx[0];
+      m.trainIdx = idx[1];
+      m.imgIdx = idx[2];
+      std::memcpy(&m.distance, p + sizeof(idx), sizeof(float));
+      matches->push_back(m);
+      p += kMatchBytes;
+    }
+  }
+  return true;
+}
+
+// Checks the record of bytes (segment version) and gives its key and
+// matches (if not null)
+static bool DecodeRecord(const char* record, const uint32_t bytes,
+                         const uint32_t version, std::string* key,
+                         CompactMatches* matches) {
+  if (bytes < kMatchRecordHeader) return false;
+  uint32_t header[3];
+  std::memcpy(header, record, sizeof(header));
+  const uint32_t key_len = header[0];
+  const uint32_t payload = header[1];
+  if (key_len > kMatchMaxKey
+      || static_cast<uint64_t>(kMatchRecordHeader) + key_len + payload
+          != bytes
+      || Fnv1a(record + kMatchRecordHeader, key_len + payload) != header[2]) {
+    return false;
+  }
+  const char* p = record + kMatchRecordHeader;
+  if (key != nullptr) key->assign(p, key_len);
+  p += key_len;
+  if (version == 1) return DecodePayloadV1(p, payload, matches);
+  if (matches == nullptr) return true;
+  return matches->Decode(reinterpret_cast<const uint8_t*>(p), payload);
+}
+
+static bool ReadFull(const int fd, char* data, const size_t bytes,
+                     const uint64_t offset) {
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t n = pread(fd, data + done, bytes - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool WriteFull(const int fd, const char* data, const size_t bytes,
+                      const uint64_t offset) {
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t n = pwrite(fd, data + done, bytes - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+MatchStore::Segment::~Segment() {
+  if (fd >= 0) close(fd);
+}
+
+std::string MatchStore::SegmentFile(const int id) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%06d", id);
+  return (boost::filesystem::path(dir_)
+          / (std::string(name) + MATCH_STORE_SEGMENT_EXT)).string();
+}
+
+std::string MatchStore::HintFile(const int id) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%06d", id);
+  return (boost::filesystem::path(dir_)
+          / (std::string(name) + MATCH_STORE_HINT_EXT)).string();
+}
+
+std::vector<int> MatchStore::ListSegments(bool& ok) const {
+  std::vector<int> ids;
+  boost::system::error_code ec;
+  for (boost::filesystem::directory_iterator it(dir_, ec);
+       !ec && it != boost::filesystem::directory_iterator(); ++it) {
+    const boost::filesystem::path& p = it->path();
+    if (p.extension() != MATCH_STORE_SEGMENT_EXT) continue;
+    const int id = std::atoi(p.stem().string().c_str());
+    if (id > 0) ids.push_back(id);
+  }
+  ok = !ec;
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+std::shared_ptr<MatchStore> MatchStore::Open(const std::string& dir) {
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(dir, ec);
+  if (!boost::filesystem::is_directory(dir, ec)) return nullptr;
+
+  std::shared_ptr<MatchStore> store(new MatchStore(dir));
+  bool ok = false;
+  const std::vector<int> ids = store->ListSegments(ok);
+  if (!ok) return nullptr;
+  std::lock_guard<std::mutex> lock(store->mu_);
+  for (const int id : ids) {
+    if (!store->LoadSegment(id)) {
+      std::cerr << "Match store segment is broken: "
+                << store->SegmentFile(id) << std::endl;
+    }
+    store->next_segment_ = id + 1;
+  }
+  return store;
+}
+
+MatchStore::~MatchStore() {
+  std::lock_guard<std::mutex> lock(mu_);
+  SealLocked();
+}
+
+bool MatchStore::LoadSegment(const int id) {
+  const int fd = open(SegmentFile(id).c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  std::shared_ptr<Segment> segment(new Segment(id, fd));
+  struct stat st;
+  if (fstat(fd, &st) != 0) return false;
+  const uint64_t file_size = st.st_size;
+  uint32_t header[2];
+  if (!ReadFull(fd, reinterpret_cast<char*>(header), sizeof(header), 0)
+      || header[0] != MATCH_STORE_MAGIC
+      || header[1] < 1 || header[1] > MATCH_STORE_VERSION) {
+    return false;
+  }
+  segment->version = header[1];
+  segments_[id] = segment;
+  // Writer holds the lock until the segment is sealed
+  segment->live = flock(fd, LOCK_SH | LOCK_NB) != 0;
+  segment->size = file_size;
+  if (LoadHint(*segment)) {
+    if (!segment->live) flock(fd, LOCK_UN);
+    return true;
+  }
+  // Not sealed (crashed or running writer) or old hint, the valid records
+  // are indexed
+  segment->size = kMatchSegmentHeader;
+  bool ok = ScanSegment(*segment, file_size);
+  if (segment->live) return true;
+  // Torn tail of a crashed writer is dead
+  if (file_size > segment->size) dead_bytes_ += file_size - segment->size;
+  segment->size = file_size;
+  WriteHint(*segment);
+  flock(fd, LOCK_UN);
+  return ok;
+}
+
+bool MatchStore::LoadHint(const Segment& segment) {
+  std::ifstream in(HintFile(segment.id), std::ios::binary);
+  if (!in.is_open()) return false;
+  uint32_t header[2];
+  uint64_t segment_bytes = 0;
+  uint32_t count = 0;
+  if (!in.read(reinterpret_cast<char*>(header), sizeof(header))
+      || !in.read(reinterpret_cast<char*>(&segment_bytes),
+                  sizeof(segment_bytes))
+      || !in.read(reinterpret_cast<char*>(&count), sizeof(count))
+      || header[0] != MATCH_STORE_HINT_MAGIC
+      || header[1] != MATCH_STORE_HINT_VERSION
+      || segment_bytes != segment.size
+      || count > segment.size / kMatchRecordHeader) {
+    return false;
+  }
+  std::vector<std::pair<std::string, Location> > entries(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t key_len = 0;
+    in.read(reinterpret_cast<char*>(&key_len), sizeof(key_len));
+    if (!in || key_len > kMatchMaxKey) return false;
+    std::string& key = entries[i].first;
+    Location& location = entries[i].second;
+    key.resize(key_len);
+    in.read(&key[0], key_len);
+    in.read(reinterpret_cast<char*>(&location.offset),
+            sizeof(location.offset));
+    in.read(reinterpret_cast<char*>(&location.bytes), sizeof(location.bytes));
+    if (!in || location.offset + location.bytes > segment.size) return false;
+    location.segment = segment.id;
+  }
+  // Overwritten records of the segment are not in the hint
+  uint64_t hint_bytes = kMatchSegmentHeader;
+  for (const auto& e : entries) {
+    IndexLocked(e.first, e.second);
+    hint_bytes += e.second.bytes;
+  }
+  if (segment.size > hint_bytes) dead_bytes_ += segment.size - hint_bytes;
+  return true;
+}
+
+bool MatchStore::ScanSegment(Segment& segment, const uint64_t file_size) {
+  // Header is checked by LoadSegment
+  std::ifstream in(SegmentFile(segment.id), std::ios::binary);
+  if (!in.seekg(segment.size)) return false;
+  uint64_t offset = segment.size;
+  std::vector<char> record;
+  std::string key;
+  while (offset + kMatchRecordHeader <= file_size) {
+    uint32_t record_header[3];
+    if (!in.read(reinterpret_cast<char*>(record_header),
+                 sizeof(record_header))) {
+      break;
+    }
+    const uint64_t bytes = static_cast<uint64_t>(kMatchRecordHeader)
+        + record_header[0] + record_header[1];
+    if (record_header[0] > kMatchMaxKey || offset + bytes > file_size) {
+      break;
+    }
+    record.resize(bytes);
+    std::memcpy(record.data(), record_header, sizeof(record_header));
+    if (!in.read(record.data() + kMatchRecordHeader,
+                 bytes - kMatchRecordHeader)
+        || !DecodeRecord(record.data(), bytes, segment.version, &key,
+                         nullptr)) {
+      break;
+    }
+    IndexLocked(key, Location{segment.id, offset,
+                              static_cast<uint32_t>(bytes)});
+    offset += bytes;
+  }
+  // Torn tail of an interrupted (or running) write is left out
+  segment.size = offset;
+  return offset == file_size;
+}
+
+void MatchStore::WriteHint(const Segment& segment) const {
+  std::vector<std::pair<std::string, Location> > entries;
+  for (const auto& it : index_) {
+    if (it.second.segment == segment.id) entries.push_back(it);
+  }
+  const std::string hint_file = HintFile(segment.id);
+  const std::string tmp_file = ::CacheTempFile(hint_file);
+  std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) return;
+  const uint32_t header[2] = {MATCH_STORE_HINT_MAGIC,
+                              MATCH_STORE_HINT_VERSION};
+  const uint32_t count = entries.size();
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(&segment.size),
+            sizeof(segment.size));
+  out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+  for (const auto& e : entries) {
+    const uint32_t key_len = e.first.size();
+    out.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
+    out.write(e.first.data(), key_len);
+    out.write(reinterpret_cast<const char*>(&e.second.offset),
+              sizeof(e.second.offset));
+    out.write(reinterpret_cast<const char*>(&e.second.bytes),
+              sizeof(e.second.bytes));
+  }
+  bool ok = out.good();
+  out.close();
+  if (!ok || std::rename(tmp_file.c_str(), hint_file.c_str()) != 0) {
+    std::remove(tmp_file.c_str());
+  }
+}
+
+void MatchStore::IndexLocked(const std::string& key,
+                             const Location& location) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    live_bytes_ -= it->second.bytes;
+    dead_bytes_ += it->second.bytes;
+    it->second = location;
+  } else {
+    index_.insert(std::make_pair(key, location));
+  }
+  live_bytes_ += location.bytes;
+}
+
+bool MatchStore::AppendLocked(const std::string& key, const char* record,
+                              const uint32_t bytes) {
+  if (active_ && active_->size > kMatchSegmentHeader
+      && active_->size + bytes > kMatchSegmentBytes) {
+    SealLocked();
+  }
+  if (!active_) {
+    int id = next_segment_++;
+    int fd = open(SegmentFile(id).c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    // Segment id taken by another process
+    while (fd < 0 && errno == EEXIST) {
+      id = next_segment_++;
+      fd = open(SegmentFile(id).c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0) return false;
+    // Readers of the other processes see the segment as live until sealed
+    flock(fd, LOCK_EX);
+    std::shared_ptr<Segment> segment(new Segment(id, fd));
+    const uint32_t header[2] = {MATCH_STORE_MAGIC, MATCH_STORE_VERSION};
+    if (!WriteFull(fd, reinterpret_cast<const char*>(header),
+                   sizeof(header), 0)) {
+      return false;
+    }
+    segment->size = sizeof(header);
+    segments_[id] = segment;
+    active_ = segment;
+  }
+  if (!WriteFull(active_->fd, record, bytes, active_->size)) return false;
+  IndexLocked(key, Location{active_->id, active_->size, bytes});
+  active_->size += bytes;
+  return true;
+}
+
+void MatchStore::SealLocked() {
+  if (!active_) return;
+  WriteHint(*active_);
+  flock(active_->fd, LOCK_UN);
+  active_.reset();
+}
+
+bool MatchStore::Get(const std::string& key,
+                     CompactMatches& matches) const {
+  Location location;
+  std::shared_ptr<Segment> segment;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = index_.find(key);
+    if (it == index_.end()) return false;
+    location = it->second;
+    segment = segments_.at(location.segment);
+  }
+  // Records are never changed, read without the lock
+  std::vector<char> record(location.bytes);
+  std::string record_key;
+  return ReadFull(segment->fd, record.data(), location.bytes,
+                  location.offset)
+      && DecodeRecord(record.data(), location.bytes, segment->version,
+                      &record_key, &matches)
+      && record_key == key;
+}
+
+bool MatchStore::Put(const std::string& key,
+                     const CompactMatches& matches) {
+  if (key.size() > kMatchMaxKey) return false;
+  std::vector<char> record;
+  EncodeRecord(key, matches, record);
+  std::lock_guard<std::mutex> lock(mu_);
+  return AppendLocked(key, record.data(), record.size());
+}
+
+void MatchStore::Refresh() {
+  bool ok = false;
+  const std::vector<int> ids = ListSegments(ok);
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const int id : ids) {
+    if (segments_.count(id) > 0) continue;
+    // Segment with the header not written yet is loaded next time
+    LoadSegment(id);
+    next_segment_ = std::max(next_segment_, id + 1);
+  }
+  for (auto& it : segments_) {
+    Segment& segment = *it.second;
+    if (!segment.live) continue;
+    // Sealed since the last check, all its records are there then
+    segment.live = flock(segment.fd, LOCK_SH | LOCK_NB) != 0;
+    struct stat st;
+    if (fstat(segment.fd, &st) == 0
+        && static_cast<uint64_t>(st.st_size) > segment.size) {
+      ScanSegment(segment, st.st_size);
+    }
+    if (!segment.live) flock(segment.fd, LOCK_UN);
+  }
+}
+
+bool MatchStore::Contains(const std::string& key) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return index_.find(key) != index_.end();
+}
+
+int MatchStore::Count() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return static_cast<int>(index_.size());
+}
+
+std::vector<std::string> MatchStore::Keys() const {
+  std::vector<std::string> keys;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    keys.reserve(index_.size());
+    for (const auto& it : index_) {
+      keys.push_back(it.first);
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+uint64_t MatchStore::LiveBytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return live_bytes_;
+}
+
+uint64_t MatchStore::DeadBytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return dead_bytes_;
+}
+
+bool MatchStore::Compact() {
+  Refresh();
+  std::lock_guard<std::mutex> lock(mu_);
+  SealLocked();
+  for (const auto& it : segments_) {
+    if (it.second->live) {
+      std::cerr << "Match store is written by another process: " << dir_
+                << std::endl;
+      return false;
+    }
+  }
+
+  const std::map<int, std::shared_ptr<Segment> > old_segments = segments_;
+  std::unordered_map<std::string, Location> old_index;
+  old_index.swap(index_);
+  const uint64_t old_live_bytes = live_bytes_;
+  const uint64_t old_dead_bytes = dead_bytes_;
+  live_bytes_ = 0;
+  dead_bytes_ = 0;
+
+  std::vector<std::string> keys;
+  keys.reserve(old_index.size());
+  for (const auto& it : old_index) {
+    keys.push_back(it.first);
+  }
+  std::sort(keys.begin(), keys.end());
+
+  bool ok = true;
+  std::vector<char> record;
+  CompactMatches matches;
+  for (const std::string& key : keys) {
+    const Location& location = old_index[key];
+    const Segment& segment = *old_segments.at(location.segment);
+    record.resize(location.bytes);
+    if (!ReadFull(segment.fd, record.data(), location.bytes,
+                  location.offset)) {
+      std::cerr << "Can't read match record " << key << std::endl;
+      ok = false;
+      break;
+    }
+    // Records of the older versions are converted
+    if (segment.version != MATCH_STORE_VERSION) {
+      if (!DecodeRecord(record.data(), location.bytes, segment.version,
+                        nullptr, &matches)) {
+        std::cerr << "Can't decode match record " << key << std::endl;
+        ok = false;
+        break;
+      }
+      EncodeRecord(key, matches, record);
+    }
+    if (!AppendLocked(key, record.data(), record.size())) {
+      ok = false;
+      break;
+    }
+  }
+  SealLocked();
+
+  // Only the complete new segments replace the old ones
+  std::vector<int> remove_ids;
+  for (const auto& it : segments_) {
+    const bool old = old_segments.count(it.first) > 0;
+    if (ok == old) remove_ids.push_back(it.first);
+  }
+  if (!ok) {
+    index_.swap(old_index);
+    live_bytes_ = old_live_bytes;
+    dead_bytes_ = old_dead_bytes;
+  }
+  for (const int id : remove_ids) {
+    segments_.erase(id);
+    std::remove(HintFile(id).c_str());
+    std::remove(SegmentFile(id).c_str());
+  }
+  return ok;
+}
@@ -0,0 +1,307 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "cv_gl/reprojection.h"
+#include "cv_gl/reprojection_kernels.hpp"
+
+// Points per work item of the batch reprojection
+static const int kReprojectionBlock = 2048;
+// Maps with fewer observations are done by the calling thread
+static const int kMinParallelObservations = 100000;
+
+static bool SameCamera(const CameraInfo& a, const CameraInfo& b) {
+  return a.intr.fx == b.intr.fx && a.intr.fy == b.intr.fy
+      && a.intr.s == b.intr.s && a.intr.cx == b.intr.cx
+      && a.intr.cy == b.intr.cy && a.intr.wr == b.intr.wr
+      && a.translation == b.translation
+      && a.rotation_angles == b.rotation_angles;
+}
+
+CameraProjections::CameraProjections(const std::vector<CameraInfo>& cameras,
+                                     const CameraProjections* prev)
+    : cameras_(cameras),
+      centered_proj_(9 * cameras.size()),
+      center_(3 * cameras.size()) {
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    if (prev != nullptr && i < prev->size()
+        && SameCamera(prev->cameras_[i], cameras[i])) {
+      std::copy(prev->CenteredProj(i), prev->CenteredProj(i) + 9,
+                &centered_proj_[9 * i]);
+      std::copy(prev->Center(i), prev->Center(i) + 3, &center_[3 * i]);
+      continue;
+    }
+    // proj = K * R^T * [I | -t], its left 3x3 is the centered projection
+    const cv::Mat proj = ::GetProjMatrix(cameras[i]);
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) {
+        centered_proj_[9 * i + 3 * r + c] =
+            static_cast<float>(proj.at<double>(r, c));
+      }
+      center_[3 * i + r] = cameras[i].translation[r];
+    }
+  }
+}
+
+bool CameraProjections::SameCameras(
+    const std::vector<CameraInfo>& cameras) const {
+  if (cameras.size() != cameras_.size()) return false;
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    if (!SameCamera(cameras[i], cameras_[i])) return false;
+  }
+  return true;
+}
+
+std::shared_ptr<const CameraProjections> CameraProjectionCache::Get(
+    const std::vector<CameraInfo>& cameras) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!projections_ || !projections_->SameCameras(cameras)) {
+    projections_ = std::make_shared<const CameraProjections>(
+        cameras, projections_.get());
+  }
+  return projections_;
+}
+
+ReprojectionWorkers::~ReprojectionWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  for (std::thread& t : workers_) {
+    t.join();
+  }
+}
+
+int ReprojectionWorkers::size() const {
+  const int threads = threads_ > 0
+      ? threads_ : static_cast<int>(std::thread::hardware_concurrency());
+  return std::max(threads, 1);
+}
+
+void ReprojectionWorkers::Run(const std::function<void()>& task) {
+  std::lock_guard<std::mutex> run_lock(run_mu_);
+  if (workers_.empty()) {
+    for (int i = 1; i < size(); ++i) {
+      workers_.push_back(std::thread(&ReprojectionWorkers::Loop, this));
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    task_ = &task;
+    pending_ = workers_.size();
+    ++generation_;
+  }
+  start_.notify_all();
+  task();
+  std::unique_lock<std::mutex> lock(mu_);
+  done_.wait(lock, [this]() { return pending_ == 0; });
+  task_ = nullptr;
+}
+
+void ReprojectionWorkers::Loop() {
+  long generation = 0;
+  while (true) {
+    const std::function<void()>* task;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      start_.wait(lock, [this, generation]() {
+        return stop_ || generation_ != generation;
+      });
+      if (stop_) return;
+      generation = generation_;
+      task = task_;
+    }
+    (*task)();
+    std::lock_guard<std::mutex> lock(mu_);
+    if (--pending_ == 0) done_.notify_one();
+  }
+}
+
+void ReprojectArraysScalar(const ReprojectionArrays& a, const int count,
+                           float* err) {
+  const float* x = a.x;
+  const float* y = a.y;
+  const float* z = a.z;
+  const float* u = a.u;
+  const float* v = a.v;
+  const float* m0 = a.m[0];
+  const float* m1 = a.m[1];
+  const float* m2 = a.m[2];
+  const float* m3 = a.m[3];
+  const float* m4 = a.m[4];
+  const float* m5 = a.m[5];
+  const float* m6 = a.m[6];
+  const float* m7 = a.m[7];
+  const float* m8 = a.m[8];
+  for (int j = 0; j < count; ++j) {
+    const float px = m0[j] * x[j] + m1[j] * y[j] + m2[j] * z[j];
+    const float py = m3[j] * x[j] + m4[j] * y[j] + m5[j] * z[j];
+    const float pw = m6[j] * x[j] + m7[j] * y[j] + m8[j] * z[j];
+    const float dx = px / pw - u[j];
+    const float dy = py / pw - v[j];
+    err[j] = 0.5f * (dx * dx + dy * dy);
+  }
+}
+
+enum ReprojectionKernel {
+  REPROJECTION_SCALAR,
+  REPROJECTION_AVX2
+};
+
+static ReprojectionKernel DetectReprojectionKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#ifdef CV_GL_REPROJECTION_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    return REPROJECTION_AVX2;
+  }
+#endif
+#endif
+  return REPROJECTION_SCALAR;
+}
+
+static ReprojectionKernel GetReprojectionKernel() {
+  static const ReprojectionKernel kernel = DetectReprojectionKernel();
+  return kernel;
+}
+
+static void ReprojectArrays(const ReprojectionArrays& a, const int count,
+                            float* err) {
+  switch (GetReprojectionKernel()) {
+#ifdef CV_GL_REPROJECTION_AVX2
+    case REPROJECTION_AVX2:
+      ReprojectArraysAvx2(a, count, err);
+      break;
+#endif
+    default:
+      ReprojectArraysScalar(a, count, err);
+  }
+}
+
+const char* ReprojectionKernelName() {
+  switch (GetReprojectionKernel()) {
+    case REPROJECTION_AVX2: return "avx2";
+    default: return "scalar";
+  }
+}
+
+// Observations of a block as flat arrays, reused by the thread
+struct ReprojectionBlock {
+  // Point relative to the camera center
+  std::vector<float> x, y, z;
+  // Keypoint
+  std::vector<float> u, v;
+  // Centered projection of the camera, row major
+  std::vector<float> m[9];
+
+  void resize(const size_t n) {
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    u.resize(n);
+    v.resize(n);
+    for (int i = 0; i < 9; ++i) {
+      m[i].resize(n);
+    }
+  }
+};
+
+// Errors of the points [first, last), returns the sum
+static double ReprojectBlock(const Map3D& map,
+                             const CameraProjections& projections,
+                             const std::vector<CompactFeatures>& features,
+                             const int first, const int last,
+                             MapReprojectionErrors& errors,
+                             ReprojectionBlock& block) {
+  const int obs_first = errors.observation_offsets[first];
+  const int count = errors.observation_offsets[last] - obs_first;
+  block.resize(count);
+
+  int k = 0;
+  for (int i = first; i < last; ++i) {
+    const WorldPoint3D& wp = map[i];
+    for (const auto& view : wp.views) {
+      const double* center = projections.Center(view.first);
+      const float* proj = projections.CenteredProj(view.first);
+      const cv::Point2f& point = features[view.first].pt(view.second);
+      block.x[k] = static_cast<float>(wp.pt.x - center[0]);
+      block.y[k] = static_cast<float>(wp.pt.y - center[1]);
+      block.z[k] = static_cast<float>(wp.pt.z - center[2]);
+      block.u[k] = point.x;
+      block.v[k] = point.y;
+      for (int j = 0; j < 9; ++j) {
+        block.m[j][k] = proj[j];
+      }
+      ++k;
+    }
+  }
+
+  ReprojectionArrays arrays;
+  arrays.x = block.x.data();
+  arrays.y = block.y.data();
+  arrays.z = block.z.data();
+  arrays.u = block.u.data();
+  arrays.v = block.v.data();
+  for (int j = 0; j < 9; ++j) {
+    arrays.m[j] = block.m[j].data();
+  }
+  ::ReprojectArrays(arrays, count,
+                    errors.observation_errors.data() + obs_first);
+
+  double total = 0.0;
+  for (int i = first; i < last; ++i) {
+    double sum = 0.0;
+    for (int o = errors.observation_offsets[i];
+         o < errors.observation_offsets[i + 1]; ++o) {
+      sum += errors.observation_errors[o];
+    }
+    const int views = map[i].views.size();
+    errors.point_errors[i] = views > 0 ? sum / views : 0.0;
+    total += sum;
+  }
+  return total;
+}
+
+void ComputeReprojectionErrors(const Map3D& map,
+                               const CameraProjections& projections,
+                               const std::vector<CompactFeatures>& features,
+                               MapReprojectionErrors& errors,
+                               ReprojectionWorkers* workers) {
+  const int points = map.size();
+  errors.observation_offsets.assign(points + 1, 0);
+  for (int i = 0; i < points; ++i) {
+    errors.observation_offsets[i + 1] =
+        errors.observation_offsets[i] + map[i].views.size();
+  }
+  errors.observation_errors.resize(errors.observation_offsets.back());
+  errors.point_errors.resize(points);
+
+  const int blocks = (points + kReprojectionBlock - 1) / kReprojectionBlock;
+  std::vector<double> block_totals(blocks, 0.0);
+
+  std::atomic<int> next_block(0);
+  auto reproject = [&]() {
+    ReprojectionBlock block;
+    int b;
+    while ((b = next_block++) < blocks) {
+      const int first = b * kReprojectionBlock;
+      const int last = std::min(first + kReprojectionBlock, points);
+      block_totals[b] = ReprojectBlock(map, projections, features, first,
+                                       last, errors, block);
+    }
+  };
+  if (workers != nullptr && blocks > 1
+      && errors.observation_offsets.back() >= kMinParallelObservations) {
+    workers->Run(reproject);
+  } else {
+    reproject();
+  }
+
+  // Sum in the blocks order, the same whatever the threads
+  errors.total = 0.0;
+  for (const double t : block_totals) {
+    errors.total += t;
+  }
+}
@@ -0,0 +1,47 @@
+// Copyright Pavlo 2018
+// Built with -mavx2, called only when the CPU supports it
+#include <immintrin.h>
+
+#include "cv_gl/reprojection_kernels.hpp"
+
+// 8 observations per step, no FMA so the sums are rounded as in the
+// scalar kernel. The tail goes one by one.
+void ReprojectArraysAvx2(const ReprojectionArrays& a, const int count,
+                         float* err) {
+  const __m256 half = _mm256_set1_ps(0.5f);
+  int j = 0;
+  for (; j + 8 <= count; j += 8) {
+    const __m256 x = _mm256_loadu_ps(a.x + j);
+    const __m256 y = _mm256_loadu_ps(a.y + j);
+    const __m256 z = _mm256_loadu_ps(a.z + j);
+    const __m256 px = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a.m[0] + j), x),
+                      _mm256_mul_ps(_mm256_loadu_ps(a.m[1] + j), y)),
+        _mm256_mul_ps(_mm256_loadu_ps(a.m[2] + j), z));
+    const __m256 py = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a.m[3] + j), x),
+                      _mm256_mul_ps(_mm256_loadu_ps(a.m[4] + j), y)),
+        _mm256_mul_ps(_mm256_loadu_ps(a.m[5] + j), z));
+    const __m256 pw = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a.m[6] + j), x),
+                      _mm256_mul_ps(_mm256_loadu_ps(a.m[7] + j), y)),
+        _mm256_mul_ps(_mm256_loadu_ps(a.m[8] + j), z));
+    const __m256 dx = _mm256_sub_ps(_mm256_div_ps(px, pw),
+                                    _mm256_loadu_ps(a.u + j));
+    const __m256 dy = _mm256_sub_ps(_mm256_div_ps(py, pw),
+                                    _mm256_loadu_ps(a.v + j));
+    _mm256_storeu_ps(err + j, _mm256_mul_ps(
+        half, _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy))));
+  }
+  for (; j < count; ++j) {
+    const float px = a.m[0][j] * a.x[j] + a.m[1][j] * a.y[j]
+        + a.m[2][j] * a.z[j];
+    const float py = a.m[3][j] * a.x[j] + a.m[4][j] * a.y[j]
+        + a.m[5][j] * a.z[j];
+    const float pw = a.m[6][j] * a.x[j] + a.m[7][j] * a.y[j]
+        + a.m[8][j] * a.z[j];
+    const float dx = px / pw - a.u[j];
+    const float dy = py / pw - a.v[j];
+    err[j] = 0.5f * (dx * dx + dy * dy);
+  }
+}
@@ -1,11 +1,20 @@
 
 #include <algorithm>
+#include <random>
+#include <set>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
 #include "cv_gl/utils.h"
 #include "cv_gl/sfm.h"
+#include "cv_gl/hamming_matcher.h"
+#include "cv_gl/epipolar_filter.h"
+#include "cv_gl/camera_grid.h"
+#include "cv_gl/image_retrieval.h"
+#include "cv_gl/pipeline.hpp"
+#include "cv_gl/triangulation.h"
+#include "cv_gl/reprojection.h"
 
 #include <boost/filesystem.hpp>
 
@@ -62,20 +71,46 @@ void SfM3D::AddImages(const std::vector<ImageData>& camera1_images,
 
     // TODO: Look for conics intersections?
     if (first_index > 0) {
-
-      // Add pair based on distance < 11m * n (works for apolloscape case only)
-      for (int i = 0; i < first_index - 1; ++i) {
-        for (int j = first_index; j < cameras_.size(); ++j) {
-          double d = ::GetCamerasDistance(cameras_[i], cameras_[j]);
-          if (d < look_back * 11.0) {
-            image_pairs_.push_back({ i, j });
-            // std::cout << "d = " << d << ": added pair ["
-            //           << i << ", " << j << "]"
-            //           << std::endl;
+      // Cross record pairs: earlier cameras near every new one (< 11m * n,
+      // works for apolloscape case only) found by the grid and ranked by
+      // the view overlap, pairs_cross_budget best per new image
+      const double max_dist = look_back * 11.0;
+      CameraGrid grid(max_dist);
+      for (int i = 0; i < first_index; ++i) {
+        grid.Add(i, cameras_[i].translation);
+      }
+      std::vector<int> near;
+      std::vector<std::pair<double, int> > scored;
+      int candidates = 0;
+      int rejected = 0;
+      int cross_pairs = 0;
+      for (int j = first_index; j < cameras_.size(); ++j) {
+        grid.Radius(cameras_[j].translation, max_dist, near);
+        candidates += near.size();
+        scored.clear();
+        for (int i : near) {
+          double score = ::GetViewOverlapScore(cameras_[i], cameras_[j],
+                                               max_dist);
+          if (score <= pairs_min_overlap) {
+            ++rejected;
+            continue;
           }
+          // Best score first, earlier camera on ties
+          scored.push_back(std::make_pair(-score, i));
+        }
+        std::sort(scored.begin(), scored.end());
+        if (pairs_cross_budget > 0
+            && static_cast<int>(scored.size()) > pairs_cross_budget) {
+          scored.resize(pairs_cross_budget);
         }
+        for (const auto& s : scored) {
+          image_pairs_.push_back({ s.second, j });
+        }
+        cross_pairs += scored.size();
       }
-
+      std::cout << "cross record pairs = " << cross_pairs
+                << " (candidates = " << candidates
+                << ", low overlap = " << rejected << ")" << std::endl;
     }
 
     // for (auto ip : image_pairs_) {
@@ -84,6 +119,20 @@ void SfM3D::AddImages(const std::vector<ImageData>& camera1_images,
   }
 }
 
+// Image passed through the ExtractFeatures pipeline stages
+struct ExtractItem {
+  int idx;
+  std::string image_path;
+  std::vector<uchar> buffer;
+  cv::Mat img;
+  // extracted features, compact ones are stored and cached
+  Features features;
+  CompactFeatures compact;
+  bool from_cache;
+  // Held from the cache miss until the extracted features are saved
+  std::shared_ptr<CacheClaim> claim;
+};
+
 void SfM3D::ExtractFeatures() {
   std::cout << "SfM3D: Extract Features\n";
 
@@ -96,76 +145,210 @@ void SfM3D::ExtractFeatures() {
   using namespace std::chrono;
   auto t0 = high_resolution_clock::now();
 
-  // bool tst = false;
-
-  
-  int capacity = std::max(
-      static_cast<int>(std::thread::hardware_concurrency() - 2), 1);
-  std::cout << "image_data_.size = " << image_data_.size() << std::endl;
-  capacity = std::min(capacity, static_cast<int>(image_data_.size()));
-  std::cout << "Extract features concurrency = " << capacity << std::endl;
+  const int images_size = image_data_.size();
+  std::cout << "image_data_.size = " << images_size << std::endl;
+
+  image_features_.resize(images_size);
+  images_resized_.resize(images_size);
+
+  if (images_size == 0) return;
+
+  // Budgeted/tiled features have their own cache
+  features_namespace_ = feature_params.CacheNamespace();
+  features_namespace_known_ = true;
+  cache_storage.SetNamespace(features_namespace_);
+  std::cout << "Features backend: " << feature_params.backend
+            << ", cache namespace: '"
+            << feature_params.CacheNamespace() << "'" << std::endl;
+
+  // Auto concurrency: I/O stages are mostly waiting on disk so they are
+  // kept small, AKAZE takes all the rest of cores
+  const int hw = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+  auto stage_capacity = [images_size](int threads, int auto_threads) {
+    int capacity = threads > 0 ? threads : auto_threads;
+    return std::max(std::min(capacity, images_size), 1);
+  };
+  const ExtractPipelineConfig& cfg = extract_pipeline;
+  const size_t queue_size = std::max(cfg.queue_size, 1);
+
+  PipelineStage read_stage("read", stage_capacity(cfg.read_threads, 2));
+  PipelineStage decode_stage("decode",
+      stage_capacity(cfg.decode_threads, std::max(hw / 4, 1)));
+  PipelineStage thumbnail_stage("thumbnail",
+      stage_capacity(cfg.thumbnail_threads, 1));
+  // Tiled extraction is parallel itself, so fewer images at once
+  int extract_auto = std::max(hw - 2, 1);
+  if (feature_params.IsTiled()) {
+    int tiles = feature_params.tiles_x * feature_params.tiles_y;
+    extract_auto = std::max(extract_auto / std::min(tiles, hw), 1);
+  }
+  PipelineStage extract_stage("extract",
+      stage_capacity(cfg.extract_threads, extract_auto));
+  PipelineStage cache_stage("cache_write",
+      stage_capacity(cfg.cache_threads, 1));
+
+  std::cout << "Extract features concurrency: "
+            << "read = " << read_stage.Concurrency()
+            << ", decode = " << decode_stage.Concurrency()
+            << ", thumbnail = " << thumbnail_stage.Concurrency()
+            << ", extract = " << extract_stage.Concurrency()
+            << ", cache_write = " << cache_stage.Concurrency()
+            << ", queue_size = " << queue_size
+            << std::endl;
 
-  image_features_.resize(image_data_.size());
-  images_resized_.resize(image_data_.size());
+  BoundedQueue<int> read_queue(images_size);
+  BoundedQueue<ExtractItem> decode_queue(queue_size);
+  BoundedQueue<ExtractItem> thumbnail_queue(queue_size);
+  BoundedQueue<ExtractItem> extract_queue(queue_size);
+  BoundedQueue<ExtractItem> cache_queue(queue_size);
 
-  std::atomic<int> next_idx(0);
-  std::vector<std::thread> extractor_threads;
+  for (int i = 0; i < images_size; ++i) {
+    read_queue.Push(i);
+  }
+  read_queue.Close();
 
   std::mutex cout_mu;
-  std::mutex acc_mu;
-  
-
-  for (int i = 0; i < capacity; ++i) {
-    auto extractor = [this, &next_idx, &cout_mu](int thread_id) {
-      int idx;
-      while ((idx = next_idx++) < image_data_.size()) {
-
-        std::stringstream ss;
-        
-        ss << "[th:" << thread_id << "] Extract " << idx << " out of " 
-           << image_data_.size();
-        
-
-        ImageData& im_data = image_data_[idx];
-        boost::filesystem::path full_image_path = boost::filesystem::path(im_data.image_dir)
+  auto report = [this, &cout_mu](const ExtractItem& item) {
+    std::stringstream ss;
+    ss << "Extract " << item.idx << " out of " << image_data_.size();
+    if (item.from_cache) {
+      ss << ": restored from cache";
+    } else {
+      ss << ": extracted ... cached ...";
+    }
+    ss << std::endl;
+    std::lock_guard<std::mutex> lck(cout_mu);
+    std::cout << ss.str();
+  };
+
+  // Read: cached features and thumbnail lookup and raw file bytes. Fully
+  // cached images never touch the image file.
+  const int descriptor_bytes =
+      ::GetFeatureBackend(feature_params.backend).descriptor_bytes;
+  read_stage.Run(read_queue, [this, &decode_queue, &report, descriptor_bytes](
+      int& idx) {
+    ExtractItem item;
+    item.idx = idx;
+    const ImageData& im_data = image_data_[idx];
+    boost::filesystem::path full_image_path =
+        boost::filesystem::path(im_data.image_dir)
         / boost::filesystem::path(im_data.filename);
-        cv::Mat img = ::LoadImage(im_data);
-
-        Features features;
-
-        // TODO: Refactor to use ImageData
-        if (!cache_storage.GetFeatures(full_image_path.string(),
-                                      features)) {
-          ss << ": extracted ...";
-          ::ExtractFeatures(img, features);
-          cache_storage.SaveFeatures(full_image_path.string(),
-                                    features);
-          ss << " cached ...";
-        } else {
-          ss << ": restored from cache";
-        }
-        ss << std::endl;
-
-        cv::resize(img, img, cv::Size(), resize_scale, resize_scale);
-        images_resized_[idx] = img;
-        image_features_[idx] = features;
-
-        cout_mu.lock();
-        std::cout << ss.str();
-        cout_mu.unlock();
-
+    item.image_path = full_image_path.string();
+    auto restore = [this, &item, descriptor_bytes]() {
+      // TODO: Refactor to use ImageData
+      item.from_cache = cache_storage.GetFeatures(item.image_path,
+                                                  item.compact);
+      if (item.from_cache && item.compact.HasDescriptors()
+          && item.compact.descriptor_bytes() != descriptor_bytes) {
+        // Cached by another backend, re-extract
+        item.from_cache = false;
+        item.compact = CompactFeatures();
       }
     };
-    extractor_threads.push_back(std::thread(extractor, i));
-  }
+    restore();
+    if (!item.from_cache) {
+      // Another process may be extracting the image, its features are
+      // used once it's done
+      item.claim = cache_storage.ClaimFeatures(item.image_path);
+      restore();
+      if (item.from_cache) item.claim.reset();
+    }
+    if (item.from_cache) {
+      cv::Mat img_resized;
+      if (cache_storage.GetThumbnail(item.image_path, resize_scale,
+                                     img_resized)) {
+        images_resized_[idx] = img_resized;
+        image_features_[idx] = std::move(item.compact);
+        report(item);
+        return;
+      }
+    }
+    ::ReadImageBuffer(im_data, item.buffer);
+    decode_queue.Push(std::move(item));
+  }, [&decode_queue]() { decode_queue.Close(); });
+
+  // Decode: JPEG to full size image, or straight to the thumbnail size
+  // (reduced DCT decode) when features are already cached
+  decode_stage.Run(decode_queue, [this, &thumbnail_queue](ExtractItem& item) {
+    item.img = ::DecodeImage(item.buffer,
+                             item.from_cache ? resize_scale : 1.0);
+    std::vector<uchar>().swap(item.buffer);
+    thumbnail_queue.Push(std::move(item));
+  }, [&thumbnail_queue]() { thumbnail_queue.Close(); });
+
+  // Thumbnail: resized image for visualization, cached features are done
+  thumbnail_stage.Run(thumbnail_queue, [this, &extract_queue, &report](
+      ExtractItem& item) {
+    cv::Mat img_resized;
+    if (item.from_cache) {
+      img_resized = item.img;
+    } else {
+      cv::resize(item.img, img_resized, cv::Size(),
+                 resize_scale, resize_scale, cv::INTER_AREA);
+    }
+    cache_storage.SaveThumbnail(item.image_path, resize_scale, img_resized);
+    images_resized_[item.idx] = img_resized;
+    if (item.from_cache) {
+      image_features_[item.idx] = std::move(item.compact);
+      report(item);
+      return;
+    }
+    extract_queue.Push(std::move(item));
+  }, [&extract_queue]() { extract_queue.Close(); });
+
+  // Extract: keypoints and descriptors. AKAZE threshold is tuned per image
+  // from feature_params, so the features of an image (and their cache) don't
+  // depend on the order the extract threads took the images in.
+  extract_stage.Run(extract_queue, [this, &cache_queue](ExtractItem& item) {
+    ::ExtractFeatures(item.img, item.features, feature_params);
+    item.img = cv::Mat();
+    item.compact.Assign(item.features);
+    item.features = Features();
+    cache_queue.Push(std::move(item));
+  }, [&cache_queue]() { cache_queue.Close(); });
+
+  // Cache Write: store extracted features
+  cache_stage.Run(cache_queue, [this, &report](ExtractItem& item) {
+    cache_storage.SaveFeatures(item.image_path, item.compact);
+    item.claim.reset();
+    image_features_[item.idx] = std::move(item.compact);
+    report(item);
+  });
+
+  read_stage.Join();
+  decode_stage.Join();
+  thumbnail_stage.Join();
+  extract_stage.Join();
+  cache_stage.Join();
 
-  for(int i = 0; i < capacity; ++i) {
-    extractor_threads[i].join();
-  }
-  
   auto t1 = high_resolution_clock::now();
   auto dur = duration_cast<microseconds>(t1 - t0);
-  std::cout << "EXTRACT_FEATURES_TIME = " << dur.count() / 1e+6 << std::endl;
+
+  // Stats to find the bottleneck: stage with utilization close to 1.0 and
+  // a full queue in front of it
+  std::cout << "=== Extract pipeline stats:" << std::endl;
+  read_stage.PrintStats();
+  decode_queue.PrintStats("decode");
+  decode_stage.PrintStats();
+  thumbnail_queue.PrintStats("thumbnail");
+  thumbnail_stage.PrintStats();
+  extract_queue.PrintStats("extract");
+  extract_stage.PrintStats();
+  cache_queue.PrintStats("cache_write");
+  cache_stage.PrintStats();
+
+  size_t features_bytes = 0;
+  size_t features_full_bytes = 0;
+  for (const CompactFeatures& f : image_features_) {
+    features_bytes += f.MemoryBytes();
+    features_full_bytes += f.FeaturesMemoryBytes();
+  }
+  std::cout << "FEATURES_memory = " << features_bytes / (1024.0 * 1024.0)
+            << " MB (as cv::KeyPoint + cv::Mat: "
+            << features_full_bytes / (1024.0 * 1024.0) << " MB)" << std::endl;
+
+  extract_time_ = dur.count() / 1e+6;
+  std::cout << "EXTRACT_FEATURES_TIME = " << extract_time_ << std::endl;
 
 
   // ShowFeatures(128); // Records008
@@ -175,6 +358,527 @@ void SfM3D::ExtractFeatures() {
   
 }
 
+void SfM3D::BenchmarkFeatureBackends(const std::vector<std::string>& backends,
+                                     const int max_images,
+                                     const double max_line_dist) {
+  using namespace std::chrono;
+
+  const int images_size = std::min(max_images,
+                                   static_cast<int>(image_data_.size()));
+  std::cout << "SfM3D: Benchmark Feature Backends on " << images_size
+            << " images" << std::endl;
+
+  // Same images for all backends, decode is not measured
+  std::vector<cv::Mat> images(images_size);
+  for (int i = 0; i < images_size; ++i) {
+    images[i] = ::LoadImage(image_data_[i]);
+  }
+  std::vector<ImagePair> pairs;
+  for (const ImagePair& ip : image_pairs_) {
+    if (ip.first < images_size && ip.second < images_size) {
+      ImagePair p = ip;
+      if (!IsPairInOrder(p.first, p.second)) {
+        std::swap(p.first, p.second);
+      }
+      pairs.push_back(p);
+    }
+  }
+
+  for (const std::string& name : backends) {
+    const FeatureBackend* backend = ::FindFeatureBackend(name);
+    if (backend == nullptr) {
+      std::cerr << "Unknown features backend: " << name << std::endl;
+      continue;
+    }
+    FeatureExtractionParams params = feature_params;
+    params.backend = name;
+
+    std::vector<CompactFeatures> features(images_size);
+    long keypoints_total = 0;
+    auto t0 = high_resolution_clock::now();
+    for (int i = 0; i < images_size; ++i) {
+      Features image_features;
+      ::ExtractFeatures(images[i], image_features, params);
+      features[i].Assign(image_features);
+      keypoints_total += features[i].size();
+    }
+    auto t1 = high_resolution_clock::now();
+    double extract_time = duration_cast<microseconds>(t1 - t0).count() / 1e+6;
+
+    long matches_total = 0;
+    long inliers_total = 0;
+    for (const ImagePair& ip : pairs) {
+      Matches matches;
+      matches.image_index = ip;
+      ::ComputeLineKeyPointsMatch(features[ip.first], cameras_[ip.first],
+                                  features[ip.second], cameras_[ip.second],
+                                  matches, backend->norm_type,
+                                  backend->match_ratio, matches_simd_knn);
+      matches_total += matches.match.size();
+      ::FilterMatchByLineDistance(features[ip.first], cameras_[ip.first],
+                                  features[ip.second], cameras_[ip.second],
+                                  matches, max_line_dist);
+      inliers_total += matches.match.size();
+    }
+    auto t2 = high_resolution_clock::now();
+    double match_time = duration_cast<microseconds>(t2 - t1).count() / 1e+6;
+
+    std::cout << "FEATURES_BENCH backend = " << name
+              << ", images = " << images_size
+              << ", extract_time = " << extract_time
+              << ", images_per_sec = "
+              << (extract_time > 0.0 ? images_size / extract_time : 0.0)
+              << ", keypoints_avg = "
+              << (images_size > 0
+                  ? static_cast<double>(keypoints_total) / images_size : 0.0)
+              << ", descriptor_bytes = " << backend->descriptor_bytes
+              << ", pairs = " << pairs.size()
+              << ", match_time = " << match_time
+              << ", pairs_per_sec = "
+              << (match_time > 0.0 ? pairs.size() / match_time : 0.0)
+              << ", matches_avg = "
+              << (pairs.empty()
+                  ? 0.0 : static_cast<double>(matches_total) / pairs.size())
+              << ", inliers_avg = "
+              << (pairs.empty()
+                  ? 0.0 : static_cast<double>(inliers_total) / pairs.size())
+              << std::endl;
+  }
+}
+
+void SfM3D::BenchmarkGuidedMatching(const int max_pairs,
+                                    const double max_line_dist) {
+  if (image_pairs_.empty()) {
+    GenerateAllPairs();
+  }
+  const int pairs_size = std::min(static_cast<int>(image_pairs_.size()),
+                                  max_pairs);
+  const FeatureBackend& backend = ::GetFeatureBackend(feature_params.backend);
+
+  using namespace std::chrono;
+  double brute_time = 0.0;
+  double brute_simd_time = 0.0;
+  double guided_time = 0.0;
+  long brute_comparisons = 0;
+  long guided_comparisons = 0;
+  long brute_matches = 0;
+  long brute_simd_matches = 0;
+  long guided_matches = 0;
+  long common_matches = 0;
+  long common_simd_matches = 0;
+  for (int i = 0; i < pairs_size; ++i) {
+    int img_first = image_pairs_[i].first;
+    int img_second = image_pairs_[i].second;
+    if (!IsPairInOrder(img_first, img_second)) {
+      std::swap(img_first, img_second);
+    }
+    LoadDescriptors(img_first);
+    LoadDescriptors(img_second);
+    const CompactFeatures& features1 = image_features_[img_first];
+    const CompactFeatures& features2 = image_features_[img_second];
+    const CameraInfo& camera_info1 = cameras_[img_first];
+    const CameraInfo& camera_info2 = cameras_[img_second];
+
+    // Current path: brute force knn over all pairs + epiline filter
+    Matches brute;
+    auto t0 = high_resolution_clock::now();
+    ::ComputeLineKeyPointsMatch(features1, camera_info1,
+                                features2, camera_info2, brute,
+                                backend.norm_type, backend.match_ratio);
+    ::FilterMatchByLineDistance(features1, camera_info1,
+                                features2, camera_info2,
+                                brute, max_line_dist);
+    auto t1 = high_resolution_clock::now();
+
+    // Same brute force with the SIMD knn kernel
+    Matches brute_simd;
+    ::ComputeLineKeyPointsMatch(features1, camera_info1,
+                                features2, camera_info2, brute_simd,
+                                backend.norm_type, backend.match_ratio, true);
+    ::FilterMatchByLineDistance(features1, camera_info1,
+                                features2, camera_info2,
+                                brute_simd, max_line_dist);
+    auto t1s = high_resolution_clock::now();
+
+    Matches guided;
+    guided_comparisons += ::ComputeGuidedKeyPointsMatch(
+        features1, camera_info1, features2, camera_info2, guided,
+        max_line_dist, backend.norm_type, backend.match_ratio);
+    ::FilterMatchByLineDistance(features1, camera_info1,
+                                features2, camera_info2,
+                                guided, max_line_dist);
+    auto t2 = high_resolution_clock::now();
+
+    brute_time += duration_cast<microseconds>(t1 - t0).count() / 1e+6;
+    brute_simd_time += duration_cast<microseconds>(t1s - t1).count() / 1e+6;
+    guided_time += duration_cast<microseconds>(t2 - t1s).count() / 1e+6;
+    brute_comparisons += static_cast<long>(features1.size())
+        * features2.size();
+    brute_matches += brute.match.size();
+    brute_simd_matches += brute_simd.match.size();
+    guided_matches += guided.match.size();
+
+    std::set<IntPair> brute_set;
+    for (size_t i = 0; i < brute.match.size(); ++i) {
+      brute_set.insert(IntPair(brute.match.queryIdx(i),
+                               brute.match.trainIdx(i)));
+    }
+    for (size_t i = 0; i < guided.match.size(); ++i) {
+      common_matches += brute_set.count(IntPair(guided.match.queryIdx(i),
+                                                guided.match.trainIdx(i)));
+    }
+    for (size_t i = 0; i < brute_simd.match.size(); ++i) {
+      common_simd_matches += brute_set.count(
+          IntPair(brute_simd.match.queryIdx(i), brute_simd.match.trainIdx(i)));
+    }
+  }
+
+  // Same brute force SIMD knn batched by the query image
+  std::map<int, std::vector<int> > query_partners;
+  for (int i = 0; i < pairs_size; ++i) {
+    int img_first = image_pairs_[i].first;
+    int img_second = image_pairs_[i].second;
+    if (!IsPairInOrder(img_first, img_second)) {
+      std::swap(img_first, img_second);
+    }
+    query_partners[img_first].push_back(img_second);
+  }
+  long brute_batched_matches = 0;
+  auto tb0 = high_resolution_clock::now();
+  for (const auto& qp : query_partners) {
+    std::vector<const CompactFeatures*> partners_features;
+    std::vector<const CameraInfo*> partners_cameras;
+    std::vector<Matches> partners_matches(qp.second.size());
+    std::vector<Matches*> partners_matches_ptr;
+    for (size_t k = 0; k < qp.second.size(); ++k) {
+      partners_features.push_back(&image_features_[qp.second[k]]);
+      partners_cameras.push_back(&cameras_[qp.second[k]]);
+      partners_matches_ptr.push_back(&partners_matches[k]);
+    }
+    ::ComputeLineKeyPointsMatchBatch(image_features_[qp.first],
+                                     cameras_[qp.first],
+                                     partners_features, partners_cameras,
+                                     partners_matches_ptr, backend.norm_type,
+                                     backend.match_ratio, true);
+    for (size_t k = 0; k < qp.second.size(); ++k) {
+      ::FilterMatchByLineDistance(image_features_[qp.first],
+                                  cameras_[qp.first],
+                                  image_features_[qp.second[k]],
+                                  cameras_[qp.second[k]],
+                                  partners_matches[k], max_line_dist);
+      brute_batched_matches += partners_matches[k].match.size();
+    }
+  }
+  auto tb1 = high_resolution_clock::now();
+  const double brute_batched_time =
+      duration_cast<microseconds>(tb1 - tb0).count() / 1e+6;
+
+  auto print_path = [pairs_size](const std::string& path, const double time,
+                                 const long comparisons, const long matches) {
+    std::cout << "MATCHES_BENCH path = " << path
+              << ", pairs = " << pairs_size
+              << ", time = " << time
+              << ", pairs_per_sec = "
+              << (time > 0.0 ? pairs_size / time : 0.0)
+              << ", comparisons_avg = "
+              << (pairs_size > 0
+                  ? static_cast<double>(comparisons) / pairs_size : 0.0)
+              << ", matches_avg = "
+              << (pairs_size > 0
+                  ? static_cast<double>(matches) / pairs_size : 0.0);
+  };
+  print_path("brute", brute_time, brute_comparisons, brute_matches);
+  std::cout << std::endl;
+  print_path("brute_simd", brute_simd_time, brute_comparisons,
+             brute_simd_matches);
+  std::cout << ", kernel = " << ::HammingKernelName()
+            << ", common_with_brute = "
+            << (brute_matches > 0
+                ? static_cast<double>(common_simd_matches) / brute_matches
+                : 0.0)
+            << ", speedup = "
+            << (brute_simd_time > 0.0 ? brute_time / brute_simd_time : 0.0)
+            << std::endl;
+  print_path("brute_simd_batched", brute_batched_time, brute_comparisons,
+             brute_batched_matches);
+  std::cout << ", queries = " << query_partners.size()
+            << ", speedup_vs_simd = "
+            << (brute_batched_time > 0.0
+                ? brute_simd_time / brute_batched_time : 0.0)
+            << std::endl;
+  print_path("guided", guided_time, guided_comparisons, guided_matches);
+  std::cout << ", common_with_brute = "
+            << (brute_matches > 0
+                ? static_cast<double>(common_matches) / brute_matches : 0.0)
+            << ", speedup = "
+            << (guided_time > 0.0 ? brute_time / guided_time : 0.0)
+            << std::endl;
+}
+
+void SfM3D::BenchmarkEpipolarFilter(const int max_pairs,
+                                    const int pair_matches,
+                                    const double max_line_dist) {
+  if (image_pairs_.empty()) {
+    GenerateAllPairs();
+  }
+  const int pairs_size = std::min(static_cast<int>(image_pairs_.size()),
+                                  max_pairs);
+
+  // Previous FilterMatchByLineDistance: cv::Mat per match, erase in place
+  auto filter_per_match = [](const cv::Mat& fund,
+                             const CompactFeatures& features1,
+                             const CompactFeatures& features2,
+                             std::vector<cv::DMatch>& matches,
+                             const double line_dist) {
+    auto match = matches.begin();
+    while (match != matches.end()) {
+      cv::Mat points2(3, 1, CV_64F);
+      points2.at<double>(0, 0) = features2.pt(match->trainIdx).x;
+      points2.at<double>(1, 0) = features2.pt(match->trainIdx).y;
+      points2.at<double>(2, 0) = 1.0;
+
+      cv::Mat points1(1, 3, CV_64F);
+      points1.at<double>(0, 0) = features1.pt(match->queryIdx).x;
+      points1.at<double>(0, 1) = features1.pt(match->queryIdx).y;
+      points1.at<double>(0, 2) = 1.0;
+
+      cv::Mat kp_l2 = fund * points2;
+      double a = kp_l2.at<double>(0);
+      double b = kp_l2.at<double>(1);
+      double d = sqrt(a*a + b*b);
+
+      cv::Mat dd_mat = points1 * kp_l2 / d;
+      double dd = std::abs(dd_mat.at<double>(0));
+      if (dd > line_dist) {
+        match = matches.erase(match);
+        continue;
+      }
+      ++match;
+    }
+  };
+
+  using namespace std::chrono;
+  std::mt19937 rng(42);
+  double per_match_time = 0.0;
+  double batched_time = 0.0;
+  long total_matches = 0;
+  long per_match_kept = 0;
+  long batched_kept = 0;
+  long diff_matches = 0;
+  int pairs_used = 0;
+  for (int i = 0; i < pairs_size; ++i) {
+    const int img_first = image_pairs_[i].first;
+    const int img_second = image_pairs_[i].second;
+    const CompactFeatures& features1 = image_features_[img_first];
+    const CompactFeatures& features2 = image_features_[img_second];
+    if (features1.empty() || features2.empty()) continue;
+
+    // Random correspondences, mostly outliers as after a loose ratio test
+    std::uniform_int_distribution<int> query_dist(0, features1.size() - 1);
+    std::uniform_int_distribution<int> train_dist(0, features2.size() - 1);
+    std::vector<cv::DMatch> matches(pair_matches);
+    for (cv::DMatch& m : matches) {
+      m = cv::DMatch(query_dist(rng), train_dist(rng), 0.0f);
+    }
+
+    cv::Mat fund;
+    CalcFundamental(cameras_[img_first], cameras_[img_second], fund);
+
+    std::vector<cv::DMatch> per_match = matches;
+    auto t0 = high_resolution_clock::now();
+    filter_per_match(fund, features1, features2, per_match, max_line_dist);
+    auto t1 = high_resolution_clock::now();
+    std::vector<cv::DMatch> batched = matches;
+    ::FilterMatchesByEpipolarDistance(fund, features1, features2, batched,
+                                      max_line_dist);
+    auto t2 = high_resolution_clock::now();
+
+    per_match_time += duration_cast<microseconds>(t1 - t0).count() / 1e+6;
+    batched_time += duration_cast<microseconds>(t2 - t1).count() / 1e+6;
+    total_matches += pair_matches;
+    per_match_kept += per_match.size();
+    batched_kept += batched.size();
+
+    // Both keep the order, differences only at the threshold (float)
+    std::set<IntPair> per_match_set;
+    for (const cv::DMatch& m : per_match) {
+      per_match_set.insert(IntPair(m.queryIdx, m.trainIdx));
+    }
+    long common = 0;
+    for (const cv::DMatch& m : batched) {
+      common += per_match_set.count(IntPair(m.queryIdx, m.trainIdx));
+    }
+    diff_matches += (per_match.size() - common) + (batched.size() - common);
+    ++pairs_used;
+  }
+
+  auto print_path = [pairs_used, total_matches](const std::string& path,
+                                                const double time,
+                                                const long kept) {
+    std::cout << "EPIPOLAR_BENCH path = " << path
+              << ", pairs = " << pairs_used
+              << ", matches = " << total_matches
+              << ", kept = " << kept
+              << ", time = " << time
+              << ", matches_per_sec = "
+              << (time > 0.0 ? total_matches / time : 0.0);
+  };
+  print_path("per_match", per_match_time, per_match_kept);
+  std::cout << std::endl;
+  print_path("batched", batched_time, batched_kept);
+  std::cout << ", diff = " << diff_matches
+            << ", speedup = "
+            << (batched_time > 0.0 ? per_match_time / batched_time : 0.0)
+            << std::endl;
+}
+
+void SfM3D::MatchPairs(const std::vector<int>& pairs,
+                       const double max_line_dist, const bool use_cache,
+                       std::vector<Matches>& pairs_matches,
+                       std::vector<bool>& from_cache) {
+  const int pairs_size = pairs.size();
+  pairs_matches.assign(pairs_size, Matches());
+  from_cache.assign(pairs_size, true);
+
+  // Cached matches of features extracted again since (other keypoints)
+  // may point past the keypoints, they are matched again
+  auto in_range = [this](const Matches& matches) {
+    const int query_size = image_features_[matches.image_index.first].size();
+    const int train_size =
+        image_features_[matches.image_index.second].size();
+    for (size_t i = 0; i < matches.match.size(); ++i) {
+      if (matches.match.queryIdx(i) < 0
+          || matches.match.queryIdx(i) >= query_size
+          || matches.match.trainIdx(i) < 0
+          || matches.match.trainIdx(i) >= train_size) {
+        std::cerr << "Cached matches out of the keypoints: "
+                  << matches.image_index << std::endl;
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Restore from cache what we can, compute the rest
+  std::vector<int> compute;
+  for (int k = 0; k < pairs_size; ++k) {
+    const ImagePair& ip = image_pairs_[pairs[k]];
+    int img_first = ip.first;
+    int img_second = ip.second;
+
+    if (!IsPairInOrder(img_first, img_second)) {
+      std::swap(img_first, img_second);
+    }
+
+    Matches& matches = pairs_matches[k];
+    matches.image_index.first = img_first;
+    matches.image_index.second = img_second;
+
+    const bool cached = use_cache
+        && cache_storage.GetImageMatches(image_data_[img_first],
+                                         image_data_[img_second],
+                                         matches);
+    // Restore indexes to the current run
+    matches.image_index.first = img_first;
+    matches.image_index.second = img_second;
+    if (!cached || !in_range(matches)) {
+      matches.match.clear();
+      from_cache[k] = false;
+      compute.push_back(k);
+    }
+  }
+  if (compute.empty()) return;
+  if (!use_cache) {
+    ComputePairsMatches(compute, max_line_dist, pairs_matches);
+    return;
+  }
+
+  auto save = [this, &pairs_matches](const std::vector<int>& computed) {
+    for (const int k : computed) {
+      const Matches& matches = pairs_matches[k];
+      cache_storage.SaveImageMatches(
+          image_data_[matches.image_index.first],
+          image_data_[matches.image_index.second], matches);
+    }
+  };
+
+  auto restore = [this, &pairs_matches, &from_cache, &in_range](
+      const int k) {
+    Matches& matches = pairs_matches[k];
+    const ImagePair ip = matches.image_index;
+    from_cache[k] = cache_storage.GetImageMatches(
+        image_data_[ip.first], image_data_[ip.second], matches);
+    matches.image_index = ip;
+    from_cache[k] = from_cache[k] && in_range(matches);
+    if (!from_cache[k]) matches.match.clear();
+    return from_cache[k];
+  };
+
+  // The pairs are of one query image, another thread or process that
+  // matches the same query right now is waited for and the pairs it has
+  // saved are restored. The store is refreshed only after another process,
+  // the threads of this one save to the same store.
+  const ImageData& query =
+      image_data_[pairs_matches[compute[0]].image_index.first];
+  std::shared_ptr<QueryMatchesClaim> claim =
+      cache_storage.ClaimQueryMatches(query);
+  if (!claim || claim->waited_process) {
+    cache_storage.RefreshMatches();
+  }
+  if (!claim || claim->waited_thread || claim->waited_process) {
+    compute.erase(std::remove_if(compute.begin(), compute.end(), restore),
+                  compute.end());
+  }
+  ComputePairsMatches(compute, max_line_dist, pairs_matches);
+  save(compute);
+}
+
+void SfM3D::ComputePairsMatches(const std::vector<int>& compute,
+                                const double max_line_dist,
+                                std::vector<Matches>& pairs_matches) {
+  if (compute.empty()) return;
+
+  // Matcher norm and ratio for the descriptors of the features backend
+  const FeatureBackend& backend = ::GetFeatureBackend(feature_params.backend);
+  const int img_query = pairs_matches[compute[0]].image_index.first;
+  LoadDescriptors(img_query);
+  if (!matches_guided && matches_batched && compute.size() > 1) {
+    // One pass of the query descriptors over all partners
+    std::vector<const CompactFeatures*> partners_features;
+    std::vector<const CameraInfo*> partners_cameras;
+    std::vector<Matches*> partners_matches;
+    for (const int k : compute) {
+      const int img_partner = pairs_matches[k].image_index.second;
+      LoadDescriptors(img_partner);
+      partners_features.push_back(&image_features_[img_partner]);
+      partners_cameras.push_back(&cameras_[img_partner]);
+      partners_matches.push_back(&pairs_matches[k]);
+    }
+    ::ComputeLineKeyPointsMatchBatch(
+        image_features_[img_query], cameras_[img_query],
+        partners_features, partners_cameras, partners_matches,
+        backend.norm_type, backend.match_ratio, matches_simd_knn);
+  } else {
+    for (const int k : compute) {
+      const int img_partner = pairs_matches[k].image_index.second;
+      LoadDescriptors(img_partner);
+      if (matches_guided) {
+        ::ComputeGuidedKeyPointsMatch(
+            image_features_[img_query], cameras_[img_query],
+            image_features_[img_partner], cameras_[img_partner],
+            pairs_matches[k], max_line_dist, backend.norm_type,
+            backend.match_ratio);
+      } else {
+        ::ComputeLineKeyPointsMatch(
+            image_features_[img_query], cameras_[img_query],
+            image_features_[img_partner], cameras_[img_partner],
+            pairs_matches[k], backend.norm_type, backend.match_ratio,
+            matches_simd_knn);
+      }
+    }
+  }
+}
+
 void SfM3D::MatchImageFeatures(const int skip_thresh,
                                const double max_line_dist,
                                const bool use_cache) {
@@ -215,158 +919,193 @@ void SfM3D::MatchImageFeatures(const int skip_thresh,
   int capacity = std::max(
       static_cast<int>(std::thread::hardware_concurrency() / 2 - 2), 1);
   std::cout << "image_pairs_.size = " << image_pairs_.size() << std::endl;
-  capacity = std::min(capacity, static_cast<int>(image_pairs_.size()));
-  std::cout << "Concurrency = " << capacity << std::endl;
 
 
-  std::atomic<int> next_idx(0);
+  std::cout << "Matcher = " << (matches_guided ? "guided" : "brute force")
+            << ", hamming kernel = "
+            << (matches_guided || matches_simd_knn
+                ? ::HammingKernelName() : "cv::BFMatcher")
+            << std::endl;
+
+  // Work items: one pair, or with matches_batched (or the pairs scheduler)
+  // all pairs of the same query (in order first) image, matched in one pass
+  // against its partners
+  const bool scheduled = pairs_stop_misses > 0 || pairs_target_partners > 0;
+  std::vector<std::vector<int> > work_items;
+  if (matches_batched || scheduled) {
+    std::map<int, int> query_items;
+    for (int idx = 0; idx < image_pairs_.size(); ++idx) {
+      int img_first = image_pairs_[idx].first;
+      if (!IsPairInOrder(img_first, image_pairs_[idx].second)) {
+        img_first = image_pairs_[idx].second;
+      }
+      auto it = query_items.find(img_first);
+      if (it == query_items.end()) {
+        it = query_items.insert(
+            std::make_pair(img_first, work_items.size())).first;
+        work_items.push_back(std::vector<int>());
+      }
+      work_items[it->second].push_back(idx);
+    }
+    std::cout << "Query matching: queries = " << work_items.size()
+              << ", partners_avg = "
+              << (work_items.empty() ? 0.0
+                  : static_cast<double>(image_pairs_.size())
+                      / work_items.size())
+              << std::endl;
+  } else {
+    for (int idx = 0; idx < image_pairs_.size(); ++idx) {
+      work_items.push_back(std::vector<int>(1, idx));
+    }
+  }
+  if (scheduled) {
+    // Partners of a query by the expected view overlap, best first
+    for (std::vector<int>& item_pairs : work_items) {
+      double max_dist = 0.0;
+      for (const int idx : item_pairs) {
+        max_dist = std::max(max_dist, ::GetCamerasDistance(
+            cameras_[image_pairs_[idx].first],
+            cameras_[image_pairs_[idx].second]));
+      }
+      std::vector<std::pair<double, int> > order;
+      for (const int idx : item_pairs) {
+        const double score = ::GetViewOverlapScore(
+            cameras_[image_pairs_[idx].first],
+            cameras_[image_pairs_[idx].second], max_dist + 1.0);
+        order.push_back(std::make_pair(-score, idx));
+      }
+      std::sort(order.begin(), order.end());
+      for (size_t k = 0; k < order.size(); ++k) {
+        item_pairs[k] = order[k].second;
+      }
+    }
+    std::cout << "Pairs scheduler: stop_misses = " << pairs_stop_misses
+              << ", target_partners = " << pairs_target_partners
+              << std::endl;
+  }
+  capacity = std::min(capacity, static_cast<int>(work_items.size()));
+  std::cout << "Concurrency = " << capacity << std::endl;
+
+  std::atomic<int> next_item(0);
   std::vector<std::thread> matcher_threads;
 
   std::mutex cout_mu;
-  std::mutex acc_mu;
+
+  // Every thread collects its pairs into its own buffer and connects the
+  // keypoints of its matches in the lock-free components right away. The
+  // buffers are merged after join in the pair index order; components
+  // (roots are the smallest ids) don't depend on timing either.
+  ccomp_.SetSizes(KeypointCounts());
+  ConcurrentCComponents ccomp(ccomp_);
+  struct MatcherResult {
+    std::vector<std::pair<int, Matches> > pairs;
+    std::vector<int> scheduler_skipped;
+    int skipped_matches = 0;
+    int filtered_by_distance = 0;
+  };
+  std::vector<MatcherResult> matcher_results(capacity);
 
   // capacity = 2;
 
   for (int i = 0; i < capacity; ++i) {
-    auto matcher = [this, &next_idx, &cout_mu, &acc_mu,
-                    &skipped_matches, &total_matched_points,
-                    &filtered_by_distance,
-                    skip_thresh, use_cache, max_line_dist
-                    ](int thread_id) {
-      int idx;
-      while ((idx = next_idx++) < image_pairs_.size()) {
+    auto matcher = [this, &next_item, &work_items, &cout_mu,
+                    &matcher_results, &ccomp, skip_thresh, use_cache,
+                    max_line_dist](int thread_id) {
+      MatcherResult& result = matcher_results[thread_id];
+      int item;
+      while ((item = next_item++) < work_items.size()) {
+        const std::vector<int>& item_pairs = work_items[item];
+        const int item_size = item_pairs.size();
 
         // cout_mu.lock();
         // std::cout << "thread " << thread_id << " : "
-        //           << "process " << idx 
-        //           << " = " << image_pairs_[idx]
+        //           << "process " << item
+        //           << " = " << item_size << " pairs"
         //           << std::endl;
         // cout_mu.unlock();
 
-        
-        ImagePair ip = image_pairs_[idx];
-
-        int img_first = ip.first;
-        int img_second = ip.second;
-
-        if (!IsPairInOrder(img_first, img_second)) {
-          std::swap(img_first, img_second);
-        }
-
-        ImageData& im_data1 = image_data_[img_first];
-        ImageData& im_data2 = image_data_[img_second];
-        Features& features1 = image_features_[img_first];
-        Features& features2 = image_features_[img_second];
-        CameraInfo& camera_info1 = cameras_[img_first];
-        CameraInfo& camera_info2 = cameras_[img_second];
-
-        Matches matches;
-        matches.image_index.first = img_first;
-        matches.image_index.second = img_second;
-
-        bool from_cache = true;
-        // bool tst = true;
-        if (use_cache) {
-          if(!cache_storage.GetImageMatches(im_data1, im_data2, matches)) {
-            from_cache = false;
-            ::ComputeLineKeyPointsMatch(features1, camera_info1, features2, camera_info2, matches);
-            // Save to Cache
-            cache_storage.SaveImageMatches(im_data1, im_data2, matches);
+        // Scheduler matches partners by rounds that can't go past the stop
+        // point (pairs left to pairs_stop_misses misses in a row or to
+        // pairs_target_partners good ones), so nothing after it is computed
+        // or cached. Decisions depend on the match sizes only, so restored
+        // and computed matches give the same pairs.
+        int good_partners = 0;
+        int misses = 0;
+        bool stop = false;
+        int first = 0;
+        while (first < item_size && !stop) {
+          int round_size = item_size;
+          if (pairs_stop_misses > 0) {
+            round_size = pairs_stop_misses - misses;
+          }
+          if (pairs_target_partners > 0) {
+            round_size = std::min(round_size,
+                                  pairs_target_partners - good_partners);
+          }
+          const int last = std::min(first + round_size, item_size);
+          std::vector<int> round_pairs(item_pairs.begin() + first,
+                                       item_pairs.begin() + last);
+          first = last;
+          std::vector<Matches> round_matches;
+          std::vector<bool> from_cache;
+          MatchPairs(round_pairs, max_line_dist, use_cache, round_matches,
+                     from_cache);
+
+          for (int k = 0; k < round_pairs.size(); ++k) {
+            const int idx = round_pairs[k];
+            Matches& matches = round_matches[k];
+            const int img_first = matches.image_index.first;
+            const int img_second = matches.image_index.second;
+
+            int msize = matches.match.size();
+
+            // ShowMatchesLineConstraints(matches, max_line_dist);
+
+            // Filter Matches base on Line Distance
+            FilterMatchByLineDistance(image_features_[img_first],
+                                      cameras_[img_first],
+                                      image_features_[img_second],
+                                      cameras_[img_second],
+                                      matches, max_line_dist);
+
+            result.filtered_by_distance += msize - matches.match.size();
+
+            const bool skipped = matches.match.size() < skip_thresh;
+
+            cout_mu.lock();
+            std::cout << "[th:" << thread_id << "] ";
+            std::cout << "Mtch:"
+                      // << " (" << img_first << "," << img_second << ")"
+                      << " " << idx << " out of " << image_pairs_.size()
+                      << " [" << (from_cache[k] ? "R" : "C") << "]"
+                      << ": matches.size = " << matches.match.size()
+                      << (skipped ? ", skipped ..." : "")
+                      << std::endl;
+            cout_mu.unlock();
+
+            // Don't add empty or small matches
+            if (skipped) {
+              ++result.skipped_matches;
+              ++misses;
+            } else {
+              // Connect keypoints and images for a quick retrieval later
+              for (int i = 0; i < matches.match.size(); ++i) {
+                ccomp.Union(IntPair(img_first, matches.match.queryIdx(i)),
+                            IntPair(img_second, matches.match.trainIdx(i)));
+              }
+              result.pairs.push_back(std::make_pair(idx, std::move(matches)));
+              ++good_partners;
+              misses = 0;
+            }
+            stop = (pairs_stop_misses > 0 && misses >= pairs_stop_misses)
+                || (pairs_target_partners > 0
+                    && good_partners >= pairs_target_partners);
           }
-        } else {
-          from_cache = false;
-          ::ComputeLineKeyPointsMatch(features1, camera_info1, features2, camera_info2, matches);
-        }
-
-        int msize = matches.match.size();
-
-        // ShowMatchesLineConstraints(matches, max_line_dist);
-
-        // Filter Matches base on Line Distance
-        FilterMatchByLineDistance(features1, camera_info1,
-                                  features2, camera_info2,
-                                  matches, max_line_dist);
-
-        filtered_by_distance += msize - matches.match.size();
-
-        // Restore indexes to the current run
-        matches.image_index.first = img_first;
-        matches.image_index.second = img_second;    
-
-        // cout_mu.lock();
-        // std::cout << "thread " << thread_id << " : ";
-        // std::cout << "Match: "
-        //           << "(" << img_first << ", " << img_second << ")"
-        //           << " [" << (from_cache ? "R" : "C") << "]"
-        //           << ": matches.size = " << matches.match.size()
-        //           << std::endl;
-        // cout_mu.unlock();
-                  // << std::endl;
-
-        // Don't add empty or small matches
-        if (matches.match.size() < skip_thresh) { 
-          // std::lock_guard<std::mutex> lck(acc_mu);
-          acc_mu.lock();
-          ++skipped_matches;
-          acc_mu.unlock();
-          
-          cout_mu.lock();
-          std::cout << "[th:" << thread_id << "] ";
-          std::cout << "Mtch:"
-                  // << " (" << img_first << "," << img_second << ")"
-                  << " " << idx << " out of " << image_pairs_.size()
-                  << " [" << (from_cache ? "R" : "C") << "]"
-                  << ": matches.size = " << matches.match.size();
-                  // << std::endl;
-          std::cout << ", skipped ...\n";
-          cout_mu.unlock();
-          continue;
-        }
-
-
-        acc_mu.lock();
-        image_matches_.push_back(matches);
-
-        // put index into matches_index_
-        auto p1 = std::make_pair(img_first, img_second);
-        auto p2 = std::make_pair(img_second, img_first);
-        matches_index_.insert(
-            std::make_pair(p1, image_matches_.size() - 1));
-        matches_index_.insert(
-            std::make_pair(p2, image_matches_.size() - 1));
-
-        int mid = image_matches_.size() - 1;
-        int tmp = total_matched_points;
-
-        // Connect keypoints and images for a quick retrieval later
-        for (int i = 0; i < matches.match.size(); ++i) {
-          IntPair p1 = std::make_pair(
-              matches.image_index.first,
-              matches.match[i].queryIdx);
-          IntPair p2 = std::make_pair(
-              matches.image_index.second, 
-              matches.match[i].trainIdx);
-          // std::cout << "union: " << p1 << ", " << p2 << std::endl;
-          ccomp_.Union(p1, p2);
         }
+        result.scheduler_skipped.insert(result.scheduler_skipped.end(),
+                                        item_pairs.begin() + first,
+                                        item_pairs.end());
 
-        acc_mu.unlock();
-
-        cout_mu.lock();
-        total_matched_points += matches.match.size();
-        std::cout << "[th:" << thread_id << "] ";
-        std::cout << "Mtch:"
-                  // << " (" << img_first << "," << img_second << ")"
-                  << " " << idx << " out of " << image_pairs_.size()
-                  << " [" << (from_cache ? "R" : "C") << "]"
-                  << ": matches.size = " << matches.match.size();
-                  // << std::endl;
-        std::cout << ", total_matched_points = " << total_matched_points 
-                  << ", id: " << image_matches_.size() - 1
-                  << std::endl;
-        // std::cout << "thread " << thread_id << " : waiting\n";
-        cout_mu.unlock();
-        
         // std::this_thread::sleep_for(std::chrono::milliseconds(1500));
       }
       // cout_mu.lock();
@@ -379,6 +1118,49 @@ void SfM3D::MatchImageFeatures(const int skip_thresh,
   for (int i = 0; i < capacity; ++i) {
     matcher_threads[i].join();
   }  
+
+  // Merge in the pair order: ids, index and keypoint components
+  std::vector<std::pair<int, Matches>* > merged;
+  std::vector<int> scheduler_skipped;
+  for (MatcherResult& result : matcher_results) {
+    skipped_matches += result.skipped_matches;
+    filtered_by_distance += result.filtered_by_distance;
+    for (std::pair<int, Matches>& pm : result.pairs) {
+      merged.push_back(&pm);
+    }
+    scheduler_skipped.insert(scheduler_skipped.end(),
+                             result.scheduler_skipped.begin(),
+                             result.scheduler_skipped.end());
+  }
+  // Not matched pairs are kept (and archived), a deeper run matches them
+  std::sort(scheduler_skipped.begin(), scheduler_skipped.end());
+  scheduler_skipped_pairs_.clear();
+  for (const int idx : scheduler_skipped) {
+    scheduler_skipped_pairs_.push_back(image_pairs_[idx]);
+  }
+  std::sort(merged.begin(), merged.end(),
+            [](const std::pair<int, Matches>* a,
+               const std::pair<int, Matches>* b) {
+              return a->first < b->first;
+            });
+  image_matches_.reserve(image_matches_.size() + merged.size());
+  ccomp.CopyTo(ccomp_);
+  for (std::pair<int, Matches>* pm : merged) {
+    image_matches_.push_back(std::move(pm->second));
+    const Matches& matches = image_matches_.back();
+    const int mid = image_matches_.size() - 1;
+
+    // put index into matches_index_
+    auto p1 = std::make_pair(matches.image_index.first,
+                             matches.image_index.second);
+    auto p2 = std::make_pair(matches.image_index.second,
+                             matches.image_index.first);
+    matches_index_.insert(std::make_pair(p1, mid));
+    matches_index_.insert(std::make_pair(p2, mid));
+
+    total_matched_points += matches.match.size();
+  }
+  matcher_results.clear();
   
 
   // Show Matches
@@ -476,10 +1258,10 @@ void SfM3D::MatchImageFeatures(const int skip_thresh,
     for (int i = 0; i < matches.match.size(); ++i) {
       IntPair p1 = std::make_pair(
           matches.image_index.first,
-          matches.match[i].queryIdx);
+          matches.match.queryIdx(i));
       IntPair p2 = std::make_pair(
           matches.image_index.second, 
-          matches.match[i].trainIdx);
+          matches.match.trainIdx(i));
       // std::cout << "union: " << p1 << ", " << p2 << std::endl;
       ccomp_.Union(p1, p2);
     }
@@ -496,12 +1278,17 @@ void SfM3D::MatchImageFeatures(const int skip_thresh,
   //           << " (id: " << most_match_id << ")"
   //           << std::endl;
   std::cout << "skipped_matches = " << skipped_matches << std::endl;
+  std::cout << "scheduler_skipped_pairs = "
+            << scheduler_skipped_pairs_.size() << std::endl;
   std::cout << "filtered_by_distance = " << filtered_by_distance << std::endl;
   std::cout << "image_matches_.size = " << image_matches_.size() << std::endl;
 
+  BuildTracks();
+
   auto t1 = high_resolution_clock::now();
   auto dur = duration_cast<microseconds>(t1 - t0);
-  std::cout << "match_features_time = " << dur.count() / 1e+6 << std::endl;
+  match_time_ = dur.count() / 1e+6;
+  std::cout << "match_features_time = " << match_time_ << std::endl;
 
 }
 
@@ -531,6 +1318,8 @@ int SfM3D::FindMaxSizeMatch(const bool within_todo_views) const {
 
 void SfM3D::InitReconstruction() {
   std::cout << "Init Reconstruction\n";
+  std::cout << "Reprojection kernel = " << ::ReprojectionKernelName()
+            << ", threads = " << reprojection_workers_.size() << std::endl;
 
   assert(image_matches_.size() > 0);
 
@@ -561,7 +1350,7 @@ void SfM3D::InitReconstruction() {
   //   std::cout << "mp: " << wp << std::endl;
   // }
 
-  CombineMapComponents(map_, max_merge_dist);
+  CombineMapComponents(map_, max_merge_dist, tracks_.Count());
 
   OptimizeMap(map_);
 
@@ -599,101 +1388,36 @@ void SfM3D::TriangulatePointsFromViews(const int first_id,
 
   // == Triangulate Points =====
   std::vector<cv::Point2f> points1f, points2f;
-  ::KeyPointsToPointVec(image_features_[first_id].keypoints, 
-                        image_features_[second_id].keypoints,
+  ::KeyPointsToPointVec(image_features_[first_id].points(), 
+                        image_features_[second_id].points(),
                         image_matches_[match_index].match, 
                         points1f, points2f);
 
-  cv::Mat points3d;
-  ::TriangulatePoints(cameras_[first_id], points1f, 
-                    cameras_[second_id], points2f, 
-                    points3d);
-
-  // Backprojection error
-  cv::Mat proj1 = ::GetProjMatrix(cameras_[first_id]);
-  cv::Mat proj2 = ::GetProjMatrix(cameras_[second_id]);
-
-  std::vector<double> errs1 = ::GetReprojectionErrors(points1f, proj1, points3d);
-  std::vector<double> errs2 = ::GetReprojectionErrors(points2f, proj2, points3d);
-
-  // Z distance of points from camera
-  std::vector<double> cam1_zdist = ::GetZDistanceFromCamera(cameras_[first_id],
-                                                            points3d);
-  std::vector<double> cam2_zdist = GetZDistanceFromCamera(cameras_[second_id],
-                                                          points3d);
-
-  // for (size_t i = 0; i < cam1_zdist.size(); ++i) {
-  //   std::cout << "p = " << i << " : " << cam1_zdist[i] << std::endl;
-  // }
-  // << [end front back]
-
-  // std::cout << "AFTER points3d.row(0) = " << points3d.row(0) << std::endl << std::flush;
-  // std::cout << "AFTER points3d.size = " << points3d.rows << ", " << points3d.cols 
-  //           << std::endl << std::flush;
-
-  double rep_err1 = 0.0;
-  double rep_err2 = 0.0;
-
-
-  // Show distances from camera
-  /*
-  std::vector<std::pair<int, double> > izs(cam1_zdist.size());
-  for (int i = 0; i < cam1_zdist.size(); ++i) {
-    izs[i] = std::make_pair(i, cam1_zdist[i]);
-  }
-  std::sort(izs.begin(), izs.end(), [](std::pair<int, double>& a1,
-      std::pair<int, double>& a2) { return a1.second > a2.second; });
-  for (int i = 0; i < izs.size(); ++i) {
-    if (cam1_zdist[izs[i].first] > 100.0 || cam2_zdist[izs[i].first] > 100.0) {
-      std::cout << i << ": zd1 = " << cam1_zdist[izs[i].first] 
-                << ", zd2 = " << cam2_zdist[izs[i].first] 
-                << " (" << izs[i].first << ")"
-                << " out of " << izs.size() 
-                << std::endl;
-    }
-  }
-  */
-  
-
-  for (size_t i = 0; i < errs1.size(); ++i) {
-    rep_err1 += errs1[i];
-    rep_err2 += errs2[i];
-
-    
-
-    // sqrt(errs1[i]*errs1[i] + errs2[i]*errs2[i]) < 2.0
-    // errs1[i] > 1.0 || errs2[i] > 1.0           // reprojection error too big
-    double d = sqrt(errs1[i]*errs1[i] + errs2[i]*errs2[i]);
-    if (   errs1[i] > repr_error_thresh    // reprojection error too big
-        || errs2[i] > repr_error_thresh  // reprojection error too big
-        || cam1_zdist[i] < 0 || cam2_zdist[i] < 0  // points on the back of the camera
-        || cam1_zdist[i] > 100.0 || cam2_zdist[i] > 100.0  // points too far from the camera
-        || points3d.at<float>(i, 2) < 38.0) {      // it's out of the ground
-      // std::cout << i << " [SKIP] : errs1, errs2 = " << errs1[i]
-      //           << ", " << errs2[i] 
-      //           << ", d = " << d
-      //           << ", z = " << points3d.at<float>(i, 2)
-      //           << std::endl;
-      continue;
-    }
+  // Triangulate, reprojection errors, depths from the cameras and the
+  // ground test in one pass
+  TriangulationChecks checks;
+  checks.max_repr_error = repr_error_thresh;
+  std::vector<int> kept;
+  std::vector<cv::Point3d> points3d;
+  ::TriangulateValidatePair(::GetTriangulationCamera(cameras_[first_id]),
+                            points1f.data(),
+                            ::GetTriangulationCamera(cameras_[second_id]),
+                            points2f.data(), points1f.size(), checks,
+                            kept, points3d);
+
+  const Matches& matches = image_matches_[match_index];
+  for (size_t k = 0; k < kept.size(); ++k) {
+    const int i = kept[k];
 
     // Add point to the map
     WorldPoint3D wp;
-    wp.pt = cv::Point3d(
-        points3d.at<float>(i, 0),
-        points3d.at<float>(i, 1),
-        points3d.at<float>(i, 2));
-    wp.views[image_matches_[match_index].image_index.first] 
-        = image_matches_[match_index].match[i].queryIdx;
-    wp.views[image_matches_[match_index].image_index.second] 
-        = image_matches_[match_index].match[i].trainIdx;
-    std::pair<int, int> vk = std::make_pair(
-          image_matches_[match_index].image_index.first,
-          image_matches_[match_index].match[i].queryIdx);
-    wp.component_id = ccomp_.Find(vk);
+    wp.pt = points3d[k];
+    wp.views[matches.image_index.first] = matches.match.queryIdx(i);
+    wp.views[matches.image_index.second] = matches.match.trainIdx(i);
+    std::pair<int, int> vk = std::make_pair(matches.image_index.first,
+                                            matches.match.queryIdx(i));
+    wp.component_id = tracks_.TrackOf(vk);
     map.push_back(wp);
-      
-    // }
   }
 
   // for (auto& wp : map) {
@@ -701,12 +1425,11 @@ void SfM3D::TriangulatePointsFromViews(const int first_id,
   // }
 
 
-  // std::cout << "rep_err1 = " << rep_err1 << std::endl;
-  // std::cout << "rep_err2 = " << rep_err2 << std::endl;
   // std::cout << "map.size = " << map.size() << std::endl;
 
   // double all_error;
-  // all_error = ::GetReprojectionError(map, cameras_, image_features_);
+  // all_error = ::GetReprojectionError(map, *camera_projections_.Get(cameras_),
+  //     image_features_);
   // std::cout << "all_error = " << all_error << std::endl;
 
 }
@@ -714,27 +1437,20 @@ void SfM3D::TriangulatePointsFromViews(const int first_id,
 void SfM3D::OptimizeMap(Map3D& map) {
   // std::cout << "SfM: Optimize Map, map.size = " << map.size() << std::endl;
   double all_error;
-  // all_error = ::GetReprojectionError(map, cameras_, image_features_);
+  // all_error = ::GetReprojectionError(map, *camera_projections_.Get(cameras_),
+  //     image_features_);
   // std::cout << ", err_before = " << all_error;
   // == Optimize Bundle ==
   // TODO!!!!!!!!!!!!!
   ::OptimizeBundle(map, cameras_, image_features_);
-  // all_error = ::GetReprojectionError(map, cameras_, image_features_);
+  // all_error = ::GetReprojectionError(map, *camera_projections_.Get(cameras_),
+  //     image_features_);
   // std::cout << ", err_after = " << all_error << std::endl;
 }
 
 
 
-void SfM3D::ReconstructNextView(const int next_img_id) {
-
-  assert(todo_views_.count(next_img_id) > 0);
-
-  std::cout << "====> Process img_id = " << next_img_id << " (";
-  std::cout << "todo_views.size = " << todo_views_.size();
-  std::cout <<  ")"; 
-
-  Map3D view_map;
-
+void SfM3D::TriangulateViewPairs(const int next_img_id, Map3D& view_map) {
   // Pairwise use next_img_id and used_views
   for (auto view_it = used_views_.begin(); view_it != used_views_.end(); ++view_it) {
     int view_id = (* view_it);
@@ -794,6 +1510,133 @@ void SfM3D::ReconstructNextView(const int next_img_id) {
     // }
 
   }
+}
+
+void SfM3D::TriangulateViewTracks(const int next_img_id, Map3D& view_map) {
+
+  // Views with the cameras in the map and the next one
+  std::vector<bool> registered(image_features_.size(), false);
+  for (const int view_id : used_views_) {
+    registered[view_id] = true;
+  }
+  registered[next_img_id] = true;
+
+  std::vector<int> view_tracks;
+  for (int kp = 0; kp < image_features_[next_img_id].size(); ++kp) {
+    const int track = tracks_.TrackOf(std::make_pair(next_img_id, kp));
+    if (track >= 0) {
+      view_tracks.push_back(track);
+    }
+  }
+  std::sort(view_tracks.begin(), view_tracks.end());
+  view_tracks.erase(std::unique(view_tracks.begin(), view_tracks.end()),
+                    view_tracks.end());
+
+  // Projections and camera transforms of the views, on first use
+  std::vector<cv::Mat> projs(cameras_.size());
+  std::vector<cv::Mat> rts(cameras_.size());
+
+  std::vector<IntPair> obs;
+  std::vector<cv::Mat> obs_projs;
+  std::vector<cv::Point2f> obs_points;
+  std::vector<IntPair> inliers;
+  int solves = 0;
+  int rejected = 0;
+  for (const int track : view_tracks) {
+    // Observations of the registered views, a view with more than one
+    // keypoint of the track is ambiguous and left out
+    obs.clear();
+    for (const IntPair* o = tracks_.TrackBegin(track);
+         o != tracks_.TrackEnd(track); ++o) {
+      if (!registered[o->first]) continue;
+      const bool same_prev = o != tracks_.TrackBegin(track)
+                             && (o - 1)->first == o->first;
+      const bool same_next = o + 1 != tracks_.TrackEnd(track)
+                             && (o + 1)->first == o->first;
+      if (!same_prev && !same_next) {
+        obs.push_back(*o);
+      }
+    }
+
+    // Observations failing the checks are dropped and the rest is
+    // solved once again
+    bool added = false;
+    for (int pass = 0; pass < 2 && !added; ++pass) {
+      auto next_view = std::find_if(obs.begin(), obs.end(),
+          [next_img_id](const IntPair& o) { return o.first == next_img_id; });
+      if (obs.size() < 2 || next_view == obs.end()) break;
+
+      obs_projs.clear();
+      obs_points.clear();
+      for (const IntPair& o : obs) {
+        if (projs[o.first].empty()) {
+          projs[o.first] = ::GetProjMatrix(cameras_[o.first]);
+          rts[o.first] = ::GetRotationTranslationTransform(cameras_[o.first]);
+        }
+        obs_projs.push_back(projs[o.first]);
+        obs_points.push_back(image_features_[o.first].points()[o.second]);
+      }
+
+      ++solves;
+      cv::Point3d pt;
+      if (!::TriangulateMultiView(obs_projs, obs_points, pt)) break;
+
+      const cv::Matx41d pth(pt.x, pt.y, pt.z, 1.0);
+      inliers.clear();
+      for (size_t i = 0; i < obs.size(); ++i) {
+        const cv::Mat proj = obs_projs[i] * cv::Mat(pth);
+        const double dx = proj.at<double>(0) / proj.at<double>(2)
+                          - obs_points[i].x;
+        const double dy = proj.at<double>(1) / proj.at<double>(2)
+                          - obs_points[i].y;
+        const cv::Mat cam = rts[obs[i].first] * cv::Mat(pth);
+        const double zdist = cam.at<double>(2);
+        if (sqrt(dx * dx + dy * dy) > repr_error_thresh  // reprojection error too big
+            || zdist < 0  // point on the back of the camera
+            || zdist > 100.0) {  // point too far from the camera
+          continue;
+        }
+        inliers.push_back(obs[i]);
+      }
+
+      if (inliers.size() == obs.size()) {
+        // Ground test of the final point only, an outlier of the first
+        // pass may pull it under the ground
+        if (pt.z < 38.0) break;  // it's out of the ground
+        WorldPoint3D wp;
+        wp.pt = pt;
+        wp.views.insert(obs.begin(), obs.end());
+        wp.component_id = track;
+        view_map.push_back(wp);
+        added = true;
+      }
+      obs.swap(inliers);
+    }
+    if (!added) {
+      ++rejected;
+    }
+  }
+
+  std::cout << ", view_tracks = " << view_tracks.size()
+            << ", track_solves = " << solves
+            << ", rejected_tracks = " << rejected;
+}
+
+void SfM3D::ReconstructNextView(const int next_img_id) {
+
+  assert(todo_views_.count(next_img_id) > 0);
+
+  std::cout << "====> Process img_id = " << next_img_id << " (";
+  std::cout << "todo_views.size = " << todo_views_.size();
+  std::cout <<  ")"; 
+
+  Map3D view_map;
+
+  if (multiview_triangulation) {
+    TriangulateViewTracks(next_img_id, view_map);
+  } else {
+    TriangulateViewPairs(next_img_id, view_map);
+  }
 
   std::cout << ", view_map = " << view_map.size();
 
@@ -813,9 +1656,14 @@ void SfM3D::ReconstructNextView(const int next_img_id) {
   */
 
   map_mutex.lock();
-  // ::MergeToTheMap(map_, view_map, ccomp_);
-  // ::MergeToTheMapImproved(map_, view_map, ccomp_);
-  ::MergeAndCombinePoints(map_, view_map, max_merge_dist);
+  // ::MergeToTheMap(map_, view_map, tracks_);
+  // ::MergeToTheMapImproved(map_, view_map, tracks_);
+  if (multiview_triangulation) {
+    // Points of the view tracks are solved from all their views already
+    ::ReplaceTrackPoints(map_, view_map, tracks_.Count());
+  } else {
+    ::MergeAndCombinePoints(map_, view_map, max_merge_dist, tracks_.Count());
+  }
   map_mutex.unlock();
 
   std::cout << ", map = " << map_.size();
@@ -857,9 +1705,9 @@ void SfM3D::ReconstructNextViewPair(const int first_id, const int second_id) {
   std::cout << ", view_map = " << view_map.size();
 
   map_mutex.lock();
-  // ::MergeToTheMap(map_, view_map, ccomp_);
-  // ::MergeToTheMapImproved(map_, view_map, ccomp_);
-  ::MergeAndCombinePoints(map_, view_map, max_merge_dist);
+  // ::MergeToTheMap(map_, view_map, tracks_);
+  // ::MergeToTheMapImproved(map_, view_map, tracks_);
+  ::MergeAndCombinePoints(map_, view_map, max_merge_dist, tracks_.Count());
   std::cout << ", map = " << map_.size();
   map_mutex.unlock();
 
@@ -930,7 +1778,7 @@ void SfM3D::ReconstructAll() {
 
 
     // int next_img_id1 = ::GetNextBestView(map_, todo_views_,
-    //     ccomp_, image_matches_, matches_index_);
+    //     tracks_, image_matches_, matches_index_);
 
     int next_img_id = ::GetNextBestViewByViews(map_, todo_views_,
         used_views_, image_matches_, matches_index_);
@@ -1049,7 +1897,9 @@ void SfM3D::PrintFinalStats() {
   }
 
 
-  double all_error = ::GetReprojectionError(map_, cameras_, image_features_);
+  MapReprojectionErrors map_errors;
+  ComputeMapErrors(map_errors);
+  double all_error = map_errors.total;
 
   map_mutex.unlock();
 
@@ -1058,12 +1908,15 @@ void SfM3D::PrintFinalStats() {
             << " out of " << image_features_.size() << std::endl;
   std::cout << "FINAL_map.size = " << map_.size() << " points" << std::endl;
 
+  PrintBudgetReport(all_error);
+
 
-  // ::RemoveOutliersByError(map_, cameras_, image_features_, 0.05);
+  // ::RemoveOutliersByError(map_, *camera_projections_.Get(cameras_),
+  //     image_features_, 0.05);
   // std::cout << "map res size = " << map_.size() << std::endl;
 
 
-  std::vector<double> errs = ::GetReprojectionErrors(map_, cameras_, image_features_);
+  const std::vector<double>& errs = map_errors.point_errors;
 
   typedef std::pair<int, double> ErrEl;
   std::vector<ErrEl> errsi(errs.size());
@@ -1123,6 +1976,185 @@ void SfM3D::PrintFinalStats() {
   
 }
 
+// Keypoint budget trade-off: match stage time vs the map size and error.
+// BUDGET_REPORT line is for grep over runs with different budgets
+// (see 3d_budget.sh)
+void SfM3D::PrintBudgetReport(const double final_error) const {
+  long keypoints_total = 0;
+  long features_bytes = 0;
+  for (const CompactFeatures& f : image_features_) {
+    keypoints_total += f.size();
+    features_bytes += f.MemoryBytes();
+  }
+  long matched_total = 0;
+  for (const Matches& m : image_matches_) {
+    matched_total += m.match.size();
+  }
+  double keypoints_avg = image_features_.empty()
+      ? 0.0 : static_cast<double>(keypoints_total) / image_features_.size();
+  double matched_avg = image_matches_.empty()
+      ? 0.0 : static_cast<double>(matched_total) / image_matches_.size();
+
+  std::cout << "=== Keypoint budget report:" << std::endl;
+  std::cout << "BUDGET_REPORT"
+            << " backend = " << feature_params.backend
+            << ", namespace = '" << feature_params.CacheNamespace() << "'"
+            << ", max_keypoints = " << feature_params.max_keypoints
+            << ", anms = " << feature_params.anms
+            << ", target_keypoints = " << feature_params.target_keypoints
+            << ", keypoints_avg = " << keypoints_avg
+            << ", features_mb = " << features_bytes / (1024.0 * 1024.0)
+            << ", pairs = " << image_matches_.size()
+            << ", matches_avg = " << matched_avg
+            << ", extract_time = " << extract_time_
+            << ", match_time = " << match_time_
+            << ", map_size = " << map_.size()
+            << ", used_views = " << used_views_.size()
+            << ", error = " << final_error
+            << std::endl;
+}
+
+void SfM3D::EvictDescriptors() {
+  std::lock_guard<std::mutex> lock(descriptors_mu_);
+  cache_storage.SetNamespace(FeaturesNamespace());
+  size_t freed_bytes = 0;
+  int evicted = 0;
+  int spilled = 0;
+  int mapped = 0;
+  int kept = 0;
+  for (size_t i = 0; i < image_features_.size(); ++i) {
+    CompactFeatures& features = image_features_[i];
+    if (!features.HasDescriptors()) continue;
+    // Pack mapped descriptors are clean file pages the kernel reclaims
+    // itself, they are kept
+    if (features.HasWrappedDescriptors()) {
+      ++mapped;
+      continue;
+    }
+    const std::string image_path = ImagePath(i);
+    if (!features_namespace_known_) {
+      // Archive without the namespace: the cache of feature_params may be
+      // of another extraction, descriptors are dropped only if the cached
+      // keypoints are the same and never spilled there
+      CompactFeatures cached;
+      if (!cache_storage.GetFeatures(image_path, cached)
+          || !cached.HasDescriptors() || !cached.SameKeypoints(features)) {
+        ++kept;
+        continue;
+      }
+    } else if (!cache_storage.HasFeatures(image_path)) {
+      cache_storage.SaveFeatures(image_path, features);
+      ++spilled;
+    }
+    size_t bytes = features.MemoryBytes();
+    features.DropDescriptors();
+    freed_bytes += bytes - features.MemoryBytes();
+    ++evicted;
+  }
+  std::cout << "DESCRIPTORS_evicted = " << evicted
+            << " images, " << freed_bytes / (1024.0 * 1024.0) << " MB"
+            << " (spilled to cache: " << spilled
+            << ", kept pack mapped: " << mapped
+            << ", kept not in cache: " << kept << ")" << std::endl;
+}
+
+bool SfM3D::LoadDescriptors(const int img_id) {
+  std::lock_guard<std::mutex> lock(descriptors_mu_);
+  CompactFeatures& features = image_features_[img_id];
+  if (features.HasDescriptors() || features.empty()) return true;
+  cache_storage.SetNamespace(FeaturesNamespace());
+  CompactFeatures cached;
+  if (!cache_storage.GetFeatures(ImagePath(img_id), cached)
+      || !features.RestoreDescriptors(cached)) {
+    std::cerr << "Can't reload descriptors of image " << img_id
+              << " from the features cache" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void SfM3D::LoadAllDescriptors() {
+  int loaded = 0;
+  for (size_t i = 0; i < image_features_.size(); ++i) {
+    if (image_features_[i].HasDescriptors()) continue;
+    if (LoadDescriptors(i)) ++loaded;
+  }
+  if (loaded > 0) {
+    std::cout << "DESCRIPTORS_reloaded = " << loaded << " images" << std::endl;
+  }
+}
+
+void SfM3D::ReportMemoryPhase(const std::string& phase) {
+  size_t peak_rss = ::GetPeakRSS();
+  size_t rss = ::GetCurrentRSS();
+  size_t features_bytes = 0;
+  int with_descriptors = 0;
+  for (const CompactFeatures& f : image_features_) {
+    features_bytes += f.MemoryBytes();
+    with_descriptors += f.HasDescriptors() ? 1 : 0;
+  }
+  const double mb = 1024.0 * 1024.0;
+  std::cout << "MEMORY_PHASE phase = " << phase
+            << ", peak_rss_mb = " << peak_rss / mb
+            << ", rss_mb = " << rss / mb
+            << ", features_mb = " << features_bytes / mb
+            << ", images_with_descriptors = " << with_descriptors
+            << " out of " << image_features_.size();
+  if (phase_peak_rss_ > 0) {
+    std::cout << ", peak_rss_diff_mb = "
+              << (static_cast<double>(peak_rss) - phase_peak_rss_) / mb;
+  }
+  std::cout << std::endl;
+  phase_peak_rss_ = peak_rss;
+}
+
+std::string SfM3D::ImagePath(const int img_id) const {
+  const ImageData& im_data = image_data_[img_id];
+  boost::filesystem::path full_image_path =
+      boost::filesystem::path(im_data.image_dir)
+      / boost::filesystem::path(im_data.filename);
+  return full_image_path.string();
+}
+
+std::string SfM3D::FeaturesNamespace() const {
+  return features_namespace_known_ ? features_namespace_
+                                   : feature_params.CacheNamespace();
+}
+
+std::vector<int> SfM3D::KeypointCounts() const {
+  std::vector<int> counts(image_features_.size());
+  for (size_t i = 0; i < image_features_.size(); ++i) {
+    counts[i] = image_features_[i].size();
+  }
+  return counts;
+}
+
+void SfM3D::ComputeMapErrors(MapReprojectionErrors& errors) {
+  ::ComputeReprojectionErrors(map_, *camera_projections_.Get(cameras_),
+                              image_features_, errors,
+                              &reprojection_workers_);
+}
+
+void SfM3D::BuildTracks() {
+  using namespace std::chrono;
+  auto t0 = high_resolution_clock::now();
+  tracks_.Build(KeypointCounts(), ccomp_);
+  // Points of the previous tracks (or of the component roots in legacy
+  // archives) get the ids of the new ones
+  for (WorldPoint3D& wp : map_) {
+    if (!wp.views.empty()) {
+      wp.component_id = tracks_.TrackOf(*wp.views.begin());
+    }
+  }
+  auto t1 = high_resolution_clock::now();
+  std::cout << "tracks = " << tracks_.Count()
+            << ", track_observations = " << tracks_.ObservationsCount()
+            << ", track_table_bytes = " << tracks_.MemoryBytes()
+            << ", tracks_time = "
+            << duration_cast<microseconds>(t1 - t0).count() / 1e+6
+            << std::endl;
+}
+
 bool SfM3D::GetMapPointsVec(std::vector<Point3DColor>& glm_points) {
 
   // if(!map_mutex.try_lock()) return false;
@@ -1133,9 +2165,11 @@ bool SfM3D::GetMapPointsVec(std::vector<Point3DColor>& glm_points) {
 
   // std::cout << "\n>> reduce map ratio = "
   //           << map_points_ratio_ << std::endl;
-  // Map3D map = ::ReduceMapByError(map_, cameras_, image_features_, map_points_ratio_);
+  // Map3D map = ::ReduceMapByError(map_, *camera_projections_.Get(cameras_),
+  //     image_features_, map_points_ratio_);
 
-  // ::RemoveOutliersByError(map_, cameras_, image_features_, 0.5);
+  // ::RemoveOutliersByError(map_, *camera_projections_.Get(cameras_),
+  //     image_features_, 0.5);
 
   // if (retain_ratio < 1.0) {
   //   int steps = 0;
@@ -1161,7 +2195,7 @@ bool SfM3D::GetMapPointsVec(std::vector<Point3DColor>& glm_points) {
 
       Point3DColor p3dc;
 
-      cv::KeyPoint kp = image_features_[img_id].keypoints[view.second];
+      cv::KeyPoint kp = image_features_[img_id].keypoint(view.second);
       if (first) {
         orig_angle = kp.angle;
         first = false;
@@ -1206,7 +2240,9 @@ bool SfM3D::GetMapPointsVec(std::vector<Point3DColor>& glm_points) {
 
   
   // Add errors to the points
-  std::vector<double> errs = ::GetReprojectionErrors(map_, cameras_, image_features_);
+  MapReprojectionErrors map_errors;
+  ComputeMapErrors(map_errors);
+  const std::vector<double>& errs = map_errors.point_errors;
   for (int i = 0; i < errs.size(); ++i) {
     glm_points[i].err = errs[i];
   }
@@ -1252,7 +2288,7 @@ bool SfM3D::GetMapCamerasWithPointsVec(MapCameras& map_cameras) {
       int img_id = view.first;
       glm::vec3 v_color = ::GetGlmColorFromImage(
         images_resized_[img_id],
-        image_features_[img_id].keypoints[view.second],
+        image_features_[img_id].pt(view.second),
         resize_scale);
       // std::cout << "o: " << glm::to_string(v_color) << std::endl;
       p3d.color += v_color;
@@ -1316,12 +2352,16 @@ CameraInfo SfM3D::GetCameraInfo(int cam_id) const {
 }
 
 cv::KeyPoint SfM3D::GetKeypoint(int cam_id, int point_id) const {
-  return image_features_[cam_id].keypoints[point_id];
+  return image_features_[cam_id].keypoint(point_id);
 }
 
 
 void SfM3D::GenerateAllPairs() {
   if (!image_pairs_.empty()) return;
+  if (pairs_retrieval_top_k > 0
+      && GenerateRetrievalPairs(pairs_retrieval_top_k)) {
+    return;
+  }
   for (int i = 0; i < ImageCount() - 1; ++i) {
     for (int j = i + 1; j < ImageCount(); ++j) {
       image_pairs_.push_back({i, j});
@@ -1329,6 +2369,80 @@ void SfM3D::GenerateAllPairs() {
   }
 }
 
+bool SfM3D::GenerateRetrievalPairs(const int top_k) {
+  const std::string vocabulary_file = cache_storage.VocabularyFile();
+  if (!boost::filesystem::is_regular_file(vocabulary_file)) return false;
+  VocabularyTree vocabulary;
+  if (!vocabulary.Load(vocabulary_file)) {
+    std::cerr << "Can't load vocabulary: " << vocabulary_file << std::endl;
+    return false;
+  }
+  if (ImageCount() > 0 && image_features_[0].descriptor_bytes()
+      != vocabulary.DescriptorBytes()) {
+    std::cerr << "Vocabulary of other descriptors: " << vocabulary_file
+              << std::endl;
+    return false;
+  }
+
+  using namespace std::chrono;
+  auto t0 = high_resolution_clock::now();
+
+  // Bag of words of the new images are added to the cached index, one
+  // process at a time so the images added by the others are kept
+  const std::string index_file = cache_storage.RetrievalIndexFile();
+  std::shared_ptr<CacheClaim> index_claim = CacheClaim::Acquire(index_file,
+                                                                true);
+  ImageRetrievalIndex index(vocabulary.Id());
+  index.Load(index_file, vocabulary.Id());
+  const int indexed = index.Count();
+  std::vector<int> index_ids(ImageCount());
+  for (int i = 0; i < ImageCount(); ++i) {
+    const std::string key = CacheStorage::ImageKey(ImagePath(i));
+    index_ids[i] = index.Find(key);
+    if (index_ids[i] < 0) {
+      LoadDescriptors(i);
+      index_ids[i] = index.Add(key, vocabulary.Transform(image_features_[i]));
+    }
+  }
+  if (index.Count() > indexed && !index.Save(index_file)) {
+    std::cerr << "Can't save retrieval index: " << index_file << std::endl;
+  }
+  index_claim.reset();
+
+  // Query only the images of this run
+  std::vector<char> allowed(index.Count(), 0);
+  std::vector<int> index_images(index.Count(), -1);
+  for (int i = 0; i < ImageCount(); ++i) {
+    allowed[index_ids[i]] = 1;
+    index_images[index_ids[i]] = i;
+  }
+  std::set<ImagePair> pairs;
+  for (int i = 0; i < ImageCount(); ++i) {
+    allowed[index_ids[i]] = 0;
+    auto similar = index.Query(index.Bow(index_ids[i]), top_k, &allowed);
+    allowed[index_ids[i]] = 1;
+    for (const auto& s : similar) {
+      const int j = index_images[s.first];
+      pairs.insert({std::min(i, j), std::max(i, j)});
+    }
+  }
+  image_pairs_.assign(pairs.begin(), pairs.end());
+
+  auto t1 = high_resolution_clock::now();
+  const long all_pairs = static_cast<long>(ImageCount())
+      * (ImageCount() - 1) / 2;
+  std::cout << "Retrieval pairs: images = " << ImageCount()
+            << ", indexed = " << indexed
+            << ", added = " << index.Count() - indexed
+            << ", top_k = " << top_k
+            << ", pairs = " << image_pairs_.size()
+            << " (all = " << all_pairs << ")"
+            << ", time = "
+            << duration_cast<microseconds>(t1 - t0).count() / 1e+6
+            << std::endl;
+  return true;
+}
+
 int SfM3D::ImageCount() const {
   return image_data_.size();
 }
@@ -1393,15 +2507,26 @@ void SfM3D::RestoreImages() {
       int idx;
       while ((idx = next_idx++) < image_data_.size()) {
 
+        ImageData& im_data = image_data_[idx];
+        boost::filesystem::path full_image_path =
+            boost::filesystem::path(im_data.image_dir)
+            / boost::filesystem::path(im_data.filename);
+
+        cv::Mat img;
+        bool from_cache = cache_storage.GetThumbnail(
+            full_image_path.string(), resize_scale, img);
+        if (!from_cache) {
+          img = ::LoadImage(im_data, resize_scale);
+          cache_storage.SaveThumbnail(full_image_path.string(),
+                                      resize_scale, img);
+        }
+        images_resized_[idx] = img;
+
         cout_mu.lock();
         std::cout << "[th:" << thread_id << "] Restore image " << idx << " out of " << image_data_.size()
-              <<std::endl;    
+              << (from_cache ? " [R]" : " [C]") << std::endl;
         cout_mu.unlock();
 
-        ImageData& im_data = image_data_[idx];
-        cv::Mat img = ::LoadImage(im_data, resize_scale);
-        images_resized_[idx] = img;
-
       }
     };
     resize_threads.push_back(std::thread(resizer, i));
@@ -1438,8 +2563,8 @@ void SfM3D::ShowFeatures(int img_id) {
   
   // int show_id = 0;
   std::vector<cv::KeyPoint> points1, points2;
-  points1 = image_features_[first_id].keypoints;
-  points2 = image_features_[second_id].keypoints;
+  points1 = image_features_[first_id].keypoints();
+  points2 = image_features_[second_id].keypoints();
   int win_x = 0;
   int win_y = 100;
   double win_scale = resize_scale;
@@ -1466,10 +2591,10 @@ void SfM3D::ShowMatches(const Matches& matches) {
   int second_id = matches.image_index.second;
 
   ::ImShowMatchesWithResize(images_resized_[first_id],
-                            image_features_[first_id].keypoints, 
+                            image_features_[first_id].keypoints(), 
                             images_resized_[second_id],
-                            image_features_[second_id].keypoints, 
-                            matches.match,
+                            image_features_[second_id].keypoints(), 
+                            matches.match.ToDMatches(),
                             resize_scale,
                             10, 10);
   cv::waitKey();
@@ -1489,27 +2614,27 @@ void SfM3D::ShowMatchesLineConstraints(const Matches& matches,
   // cv::Mat img1 = images_resized_[first_id].clone();
   // cv::Mat img2 = images_resized_[second_id].clone();
 
+  EpipolarBuffer epipolar;
+  ::ComputeEpipolarDistances(fund, image_features_[first_id],
+                             image_features_[second_id], matches.match,
+                             epipolar);
+
   for (int i = 0; i < matches.match.size(); ++i) {
-    auto match = matches.match[i];
-    cv::Mat points2(3, 1, CV_64F);
-    points2.at<double>(0, 0) = image_features_[second_id].keypoints[match.trainIdx].pt.x;
-    points2.at<double>(1, 0) = image_features_[second_id].keypoints[match.trainIdx].pt.y;
-    points2.at<double>(2, 0) = 1.0;
-
-    cv::Mat points1(1, 3, CV_64F);
-    points1.at<double>(0, 0) = image_features_[first_id].keypoints[match.queryIdx].pt.x;
-    points1.at<double>(0, 1) = image_features_[first_id].keypoints[match.queryIdx].pt.y;
-    points1.at<double>(0, 2) = 1.0;
-
-    cv::Mat kp_l2 = fund * points2;
-    double a = kp_l2.at<double>(0);
-    double b = kp_l2.at<double>(1);
-    double d = sqrt(a*a + b*b);
-
-    cv::Mat dd_mat = points1 * kp_l2 / d;
-    double dd = abs(dd_mat.at<double>(0));
-
-    if (dd > line_dist) {
+    double dd = epipolar.distances[i];
+    if (!(dd <= line_dist)) {
+      auto match = matches.match[i];
+      cv::Mat points2(3, 1, CV_64F);
+      points2.at<double>(0, 0) = image_features_[second_id].pt(match.trainIdx).x;
+      points2.at<double>(1, 0) = image_features_[second_id].pt(match.trainIdx).y;
+      points2.at<double>(2, 0) = 1.0;
+
+      cv::Mat points1(1, 3, CV_64F);
+      points1.at<double>(0, 0) = image_features_[first_id].pt(match.queryIdx).x;
+      points1.at<double>(0, 1) = image_features_[first_id].pt(match.queryIdx).y;
+      points1.at<double>(0, 2) = 1.0;
+
+      cv::Mat kp_l2 = fund * points2;
+
       // Draw point & line
       cv::Mat img1 = images_resized_[first_id].clone();
       cv::Mat img2 = images_resized_[second_id].clone();
@@ -1,5 +1,10 @@
 #include <algorithm>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <cmath>
+#include <limits>
 
 #include <boost/filesystem.hpp>
 #include <opencv2/xfeatures2d.hpp>
@@ -7,6 +12,9 @@
 
 #include "cv_gl/utils.h"
 #include "cv_gl/sfm_common.h"
+#include "cv_gl/hamming_matcher.h"
+#include "cv_gl/epipolar_filter.h"
+#include "cv_gl/reprojection.h"
 // #include "cv_gl/ccomp.hpp"
 
 
@@ -148,6 +156,423 @@ void ExtractFeatures(cv::Mat img, Features& features) {
   std::cout << "features.descriptors: " << features.descriptors.size() << std::endl;
 }
 
+std::string FeatureExtractionParams::CacheNamespace() const {
+  std::stringstream ss;
+  if (backend != "akaze") {
+    ss << "_" << backend;
+  }
+  if (IsTiled()) {
+    ss << "_tiles" << tiles_x << "x" << tiles_y << "o" << tile_overlap
+       << "d" << tile_dedup_dist;
+    if (tile_max_keypoints > 0) ss << "m" << tile_max_keypoints;
+  }
+  if (target_keypoints > 0) {
+    ss << "_target" << target_keypoints;
+  } else if (backend == "akaze" && akaze_threshold != 0.001) {
+    ss << "_th" << akaze_threshold;
+  }
+  if (max_keypoints > 0) {
+    ss << "_budget" << max_keypoints << (anms ? "anms" : "");
+  }
+  std::string ns = ss.str();
+  return ns.empty() ? ns : ns.substr(1);
+}
+
+static const std::vector<FeatureBackend>& FeatureBackends() {
+  static const std::vector<FeatureBackend> backends = {
+    // MLDB descriptor 486 bits
+    {"akaze", 61, cv::NORM_HAMMING, 0.5f, true,
+      [](const FeatureExtractionParams& params) -> cv::Ptr<cv::Feature2D> {
+        return cv::AKAZE::create(cv::AKAZE::DESCRIPTOR_MLDB, 0, 3,
+                                 static_cast<float>(params.akaze_threshold));
+      }},
+    // rBRIEF 256 bits, ORB needs the keypoints cap so it's high enough
+    // for the budget to select from
+    {"orb", 32, cv::NORM_HAMMING, 0.6f, false,
+      [](const FeatureExtractionParams& params) -> cv::Ptr<cv::Feature2D> {
+        int max_keypoints = std::max(params.max_keypoints,
+                                     params.target_keypoints);
+        return cv::ORB::create(max_keypoints > 0 ? 2 * max_keypoints : 10000);
+      }},
+    // 512 bits
+    {"brisk", 64, cv::NORM_HAMMING, 0.6f, false,
+      [](const FeatureExtractionParams& params) -> cv::Ptr<cv::Feature2D> {
+        return cv::BRISK::create();
+      }}
+  };
+  return backends;
+}
+
+std::vector<std::string> FeatureBackendNames() {
+  std::vector<std::string> names;
+  for (const FeatureBackend& backend : FeatureBackends()) {
+    names.push_back(backend.name);
+  }
+  return names;
+}
+
+const FeatureBackend* FindFeatureBackend(const std::string& name) {
+  for (const FeatureBackend& backend : FeatureBackends()) {
+    if (backend.name == name) return &backend;
+  }
+  return nullptr;
+}
+
+const FeatureBackend& GetFeatureBackend(const std::string& name) {
+  const FeatureBackend* backend = FindFeatureBackend(name);
+  if (backend == nullptr) {
+    std::cerr << "Unknown features backend '" << name
+              << "', akaze is used" << std::endl;
+    backend = &FeatureBackends().front();
+  }
+  return *backend;
+}
+
+// Whole image or tiled extraction with the params.backend
+static void ExtractFeaturesBackend(cv::Mat img, Features& features,
+                                   const FeatureExtractionParams& params) {
+  if (params.IsTiled()) {
+    ExtractFeaturesTiled(img, features, params);
+    return;
+  }
+  cv::Mat feature_mask;
+  features.keypoints.clear();
+  features.descriptors = cv::Mat();
+  GetFeatureExtractionRegion(img, feature_mask);
+  cv::Ptr<cv::Feature2D> detector =
+      GetFeatureBackend(params.backend).create(params);
+  detector->detectAndCompute(img, feature_mask, features.keypoints,
+                             features.descriptors);
+}
+
+double ExtractFeatures(cv::Mat img, Features& features,
+                       const FeatureExtractionParams& params) {
+  if (params.CacheNamespace().empty()) {
+    ExtractFeatures(img, features);
+    return params.akaze_threshold;
+  }
+
+  FeatureExtractionParams p = params;
+  int iterations = 1;
+  ExtractFeaturesBackend(img, features, p);
+
+  // Threshold tuning: number of AKAZE keypoints falls roughly inversely
+  // to the detector threshold, so scale it by the count/target ratio
+  // until the count is within tolerance. Other backends just take
+  // the target as a budget.
+  if (p.target_keypoints > 0 && GetFeatureBackend(p.backend).tunable_threshold) {
+    const double target = p.target_keypoints;
+    while (iterations < p.target_max_iterations) {
+      const double count = features.keypoints.size();
+      if (std::abs(count - target) <= p.target_tolerance * target) break;
+      double ratio = count > 0.0 ? count / target : 0.25;
+      ratio = std::max(std::min(ratio, 4.0), 0.25);
+      p.akaze_threshold = std::max(std::min(p.akaze_threshold * ratio, 0.1),
+                                   1e-6);
+      ExtractFeaturesBackend(img, features, p);
+      ++iterations;
+    }
+  }
+
+  const int detected = features.keypoints.size();
+  int budget = p.max_keypoints;
+  if (p.target_keypoints > 0 && (budget <= 0 || p.target_keypoints < budget)) {
+    budget = p.target_keypoints;
+  }
+  ApplyKeypointBudget(features, budget, p.anms, img.size());
+
+  std::cout << "features.keypoints: " << features.keypoints.size()
+            << " (detected: " << detected
+            << ", akaze_threshold: " << p.akaze_threshold
+            << ", iterations: " << iterations << ")" << std::endl;
+  return p.akaze_threshold;
+}
+
+// Suppression via Square Covering (Bailo et al. 2018): keypoints are taken
+// in the order of response and each taken one covers a square of the
+// suppression width around it on the grid with cells of width/2. Binary
+// search finds the largest width that still gives at least num keypoints,
+// so selected keypoints are strong and evenly spread.
+std::vector<int> SelectKeypointsANMS(const std::vector<cv::KeyPoint>& keypoints,
+                                     const int num,
+                                     const cv::Size& img_size) {
+  const int n = keypoints.size();
+  std::vector<int> order(n);
+  for (int i = 0; i < n; ++i) order[i] = i;
+  if (num <= 0 || num >= n) return order;
+
+  std::stable_sort(order.begin(), order.end(),
+      [&keypoints](const int a, const int b) {
+        return keypoints[a].response > keypoints[b].response;
+      });
+
+  // Cells of the smallest width must fit in memory: at 4px it's ~1M cells
+  // for the full size Apolloscape image
+  const int min_width = 4;
+  int low = min_width;
+  int high = std::max(img_size.width, img_size.height);
+  std::vector<int> best;
+  std::vector<int> selected;
+  std::vector<char> covered;
+  while (low <= high) {
+    const int width = (low + high) / 2;
+    const double cell = width / 2.0;
+    const int cols = static_cast<int>(std::ceil(img_size.width / cell)) + 1;
+    const int rows = static_cast<int>(std::ceil(img_size.height / cell)) + 1;
+    const int cover = static_cast<int>(std::floor(width / cell));
+    covered.assign(rows * cols, 0);
+    selected.clear();
+    for (const int idx : order) {
+      const cv::Point2f& pt = keypoints[idx].pt;
+      int r = std::max(std::min(static_cast<int>(pt.y / cell), rows - 1), 0);
+      int c = std::max(std::min(static_cast<int>(pt.x / cell), cols - 1), 0);
+      if (covered[r * cols + c]) continue;
+      selected.push_back(idx);
+      for (int rr = std::max(r - cover, 0);
+           rr <= std::min(r + cover, rows - 1); ++rr) {
+        for (int cc = std::max(c - cover, 0);
+             cc <= std::min(c + cover, cols - 1); ++cc) {
+          covered[rr * cols + cc] = 1;
+        }
+      }
+    }
+    if (selected.size() >= num) {
+      best.swap(selected);
+      if (best.size() == num) break;
+      low = width + 1;
+    } else {
+      high = width - 1;
+    }
+  }
+
+  if (best.size() < num) {
+    // Even the smallest width suppresses too much (very dense clusters),
+    // top up with the strongest remaining ones
+    std::vector<char> taken(n, 0);
+    for (const int idx : best) taken[idx] = 1;
+    for (int i = 0; i < n && best.size() < num; ++i) {
+      if (!taken[order[i]]) best.push_back(order[i]);
+    }
+  }
+
+  // best is in response order so the strongest are kept
+  best.resize(num);
+  std::sort(best.begin(), best.end());
+  return best;
+}
+
+void ApplyKeypointBudget(Features& features, const int max_keypoints,
+                         const bool anms, const cv::Size& img_size) {
+  const std::vector<cv::KeyPoint>& kps = features.keypoints;
+  if (max_keypoints <= 0 || kps.size() <= max_keypoints) return;
+
+  std::vector<int> selected;
+  if (anms) {
+    selected = SelectKeypointsANMS(kps, max_keypoints, img_size);
+  } else {
+    selected.resize(kps.size());
+    for (int i = 0; i < selected.size(); ++i) selected[i] = i;
+    std::nth_element(selected.begin(), selected.begin() + max_keypoints,
+        selected.end(), [&kps](const int a, const int b) {
+          return kps[a].response > kps[b].response;
+        });
+    selected.resize(max_keypoints);
+    std::sort(selected.begin(), selected.end());
+  }
+
+  Features budget;
+  budget.keypoints.reserve(selected.size());
+  budget.descriptors.create(selected.size(), features.descriptors.cols,
+                            features.descriptors.type());
+  for (int i = 0; i < selected.size(); ++i) {
+    budget.keypoints.push_back(kps[selected[i]]);
+    features.descriptors.row(selected[i]).copyTo(budget.descriptors.row(i));
+  }
+  features = budget;
+}
+
+// Keypoints of one tile with their descriptor rows
+struct TileFeatures {
+  cv::Rect core;
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+  // indices of the kept keypoints (owned by the tile core and within budget)
+  std::vector<int> kept;
+};
+
+void ExtractFeaturesTiled(cv::Mat img, Features& features,
+                          const FeatureExtractionParams& params) {
+  features.keypoints.clear();
+  features.descriptors = cv::Mat();
+
+  cv::Mat feature_mask;
+  GetFeatureExtractionRegion(img, feature_mask);
+
+  const int tiles_x = std::max(params.tiles_x, 1);
+  const int tiles_y = std::max(params.tiles_y, 1);
+  const int width = img.size().width;
+  const int height = img.size().height;
+  const cv::Rect img_rect(0, 0, width, height);
+
+  std::vector<TileFeatures> tiles(tiles_x * tiles_y);
+  for (int ty = 0; ty < tiles_y; ++ty) {
+    for (int tx = 0; tx < tiles_x; ++tx) {
+      int x0 = tx * width / tiles_x;
+      int x1 = (tx + 1) * width / tiles_x;
+      int y0 = ty * height / tiles_y;
+      int y1 = (ty + 1) * height / tiles_y;
+      tiles[ty * tiles_x + tx].core = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+    }
+  }
+
+  int capacity = params.tile_threads > 0
+      ? params.tile_threads
+      : static_cast<int>(std::thread::hardware_concurrency());
+  capacity = std::max(std::min(capacity, static_cast<int>(tiles.size())), 1);
+
+  std::atomic<int> next_idx(0);
+  std::vector<std::thread> tile_threads;
+  for (int i = 0; i < capacity; ++i) {
+    tile_threads.push_back(std::thread([&]() {
+      cv::Ptr<cv::Feature2D> detector =
+          GetFeatureBackend(params.backend).create(params);
+      int idx;
+      while ((idx = next_idx++) < tiles.size()) {
+        TileFeatures& tile = tiles[idx];
+        const cv::Rect& core = tile.core;
+        cv::Rect roi(core.x - params.tile_overlap,
+                     core.y - params.tile_overlap,
+                     core.width + 2 * params.tile_overlap,
+                     core.height + 2 * params.tile_overlap);
+        roi = roi & img_rect;
+
+        detector->detectAndCompute(img(roi), feature_mask(roi),
+                                   tile.keypoints, tile.descriptors);
+
+        // Tile owns only keypoints in its core, the overlap is a context
+        for (int k = 0; k < tile.keypoints.size(); ++k) {
+          cv::KeyPoint& kp = tile.keypoints[k];
+          kp.pt.x += roi.x;
+          kp.pt.y += roi.y;
+          if (kp.pt.x >= core.x && kp.pt.x < core.x + core.width
+              && kp.pt.y >= core.y && kp.pt.y < core.y + core.height) {
+            tile.kept.push_back(k);
+          }
+        }
+      }
+    }));
+  }
+  for (auto& th : tile_threads) {
+    th.join();
+  }
+
+  // De-duplicate keypoints detected twice across the tile seams: the same
+  // feature found with slightly different coords on both sides of a seam.
+  // Only keypoints close to an internal seam are checked, stronger wins.
+  const double dedup_dist = params.tile_dedup_dist;
+  typedef std::pair<int, int> TileKey;  // (tile, kept index)
+  std::vector<TileKey> seam_kps;
+  for (int t = 0; t < tiles.size(); ++t) {
+    const cv::Rect& core = tiles[t].core;
+    for (int k = 0; k < tiles[t].kept.size(); ++k) {
+      const cv::Point2f& pt = tiles[t].keypoints[tiles[t].kept[k]].pt;
+      bool near_seam =
+          (core.x > 0 && pt.x - core.x < dedup_dist)
+          || (core.x + core.width < width
+              && core.x + core.width - pt.x < dedup_dist)
+          || (core.y > 0 && pt.y - core.y < dedup_dist)
+          || (core.y + core.height < height
+              && core.y + core.height - pt.y < dedup_dist);
+      if (near_seam) {
+        seam_kps.push_back(std::make_pair(t, k));
+      }
+    }
+  }
+  std::sort(seam_kps.begin(), seam_kps.end(),
+      [&tiles](const TileKey& a, const TileKey& b) {
+        return tiles[a.first].keypoints[tiles[a.first].kept[a.second]].response
+            > tiles[b.first].keypoints[tiles[b.first].kept[b.second]].response;
+      });
+  std::vector<std::vector<bool> > dropped(tiles.size());
+  for (int t = 0; t < tiles.size(); ++t) {
+    dropped[t].resize(tiles[t].kept.size(), false);
+  }
+  std::vector<TileKey> seam_kept;
+  for (const TileKey& sk : seam_kps) {
+    const cv::KeyPoint& kp = tiles[sk.first].keypoints[
+        tiles[sk.first].kept[sk.second]];
+    for (const TileKey& kk : seam_kept) {
+      if (kk.first == sk.first) continue;
+      const cv::KeyPoint& kpk = tiles[kk.first].keypoints[
+          tiles[kk.first].kept[kk.second]];
+      if (kpk.octave == kp.octave && cv::norm(kpk.pt - kp.pt) < dedup_dist) {
+        dropped[sk.first][sk.second] = true;
+        break;
+      }
+    }
+    if (!dropped[sk.first][sk.second]) {
+      seam_kept.push_back(sk);
+    }
+  }
+
+  // Per tile budget by the strongest response, after the seam duplicates
+  // are gone so they don't take the budget
+  for (int t = 0; t < tiles.size(); ++t) {
+    std::vector<int>& kept = tiles[t].kept;
+    int size = 0;
+    for (int k = 0; k < kept.size(); ++k) {
+      if (!dropped[t][k]) kept[size++] = kept[k];
+    }
+    kept.resize(size);
+    if (params.tile_max_keypoints > 0
+        && kept.size() > params.tile_max_keypoints) {
+      const std::vector<cv::KeyPoint>& kps = tiles[t].keypoints;
+      std::nth_element(kept.begin(),
+          kept.begin() + params.tile_max_keypoints,
+          kept.end(), [&kps](const int a, const int b) {
+            return kps[a].response > kps[b].response;
+          });
+      kept.resize(params.tile_max_keypoints);
+      std::sort(kept.begin(), kept.end());
+    }
+    dropped[t].assign(kept.size(), false);
+  }
+
+  // Collect tiles in order into one drop-in Features
+  int total = 0;
+  int desc_cols = 0;
+  int desc_type = 0;
+  for (int t = 0; t < tiles.size(); ++t) {
+    for (int k = 0; k < tiles[t].kept.size(); ++k) {
+      if (!dropped[t][k]) ++total;
+    }
+    if (!tiles[t].descriptors.empty()) {
+      desc_cols = tiles[t].descriptors.cols;
+      desc_type = tiles[t].descriptors.type();
+    }
+  }
+  features.keypoints.reserve(total);
+  if (total > 0) {
+    features.descriptors.create(total, desc_cols, desc_type);
+  }
+  int row = 0;
+  for (int t = 0; t < tiles.size(); ++t) {
+    for (int k = 0; k < tiles[t].kept.size(); ++k) {
+      if (dropped[t][k]) continue;
+      int kp_idx = tiles[t].kept[k];
+      features.keypoints.push_back(tiles[t].keypoints[kp_idx]);
+      tiles[t].descriptors.row(kp_idx).copyTo(features.descriptors.row(row));
+      ++row;
+    }
+  }
+
+  std::cout << "features.keypoints: " << features.keypoints.size()
+            << " (tiles: " << tiles_x << "x" << tiles_y
+            << ", seam duplicates: " << seam_kps.size() - seam_kept.size()
+            << ")" << std::endl;
+  std::cout << "features.descriptors: " << features.descriptors.size() << std::endl;
+}
+
 void ExtractFeaturesAndCameraInfo(const std::string& image_path,
                                   const ImageData& im_data,
                                   const CameraIntrinsics& intr, 
@@ -167,11 +592,14 @@ void ExtractFeaturesAndCameraInfo(const std::string& image_path,
   camera_info.translation[2] = im_data.coords[5];
 }
 
-void ComputeLineKeyPointsMatch(const Features& features1, 
+void ComputeLineKeyPointsMatch(const CompactFeatures& features1, 
                                const CameraInfo camera_info1, 
-                               const Features& features2, 
+                               const CompactFeatures& features2, 
                                const CameraInfo& camera_info2, 
-                               Matches& matches) {
+                               Matches& matches,
+                               const int norm_type,
+                               const float ratio_thresh,
+                               const bool simd_knn) {
 
   // == Compute Fundamental Matrix ==
   // cv::Mat fund;
@@ -180,6 +608,18 @@ void ComputeLineKeyPointsMatch(const Features& features1,
 
   matches.match.clear();
 
+  if (simd_knn && norm_type == cv::NORM_HAMMING
+      && features1.HasDescriptors() && features2.HasDescriptors()
+      && features1.descriptor_stride() == features2.descriptor_stride()) {
+    std::vector<cv::DMatch> knn_matches;
+    ::MatchHammingKnn2(features1.descriptor(0), features1.size(),
+                       features2.descriptor(0), features2.size(),
+                       features1.descriptor_stride(), ratio_thresh,
+                       knn_matches);
+    matches.match.Assign(knn_matches);
+    return;
+  }
+
   // == Look for One point correcpondance
   
   // std::cout << "Create mask ...." << std::endl;
@@ -190,8 +630,8 @@ void ComputeLineKeyPointsMatch(const Features& features1,
   
   
 
-  const cv::Mat& descriptors1 = features1.descriptors;
-  const cv::Mat& descriptors2 = features2.descriptors;
+  const cv::Mat descriptors1 = features1.descriptors();
+  const cv::Mat descriptors2 = features2.descriptors();
 
   /*
 
@@ -261,8 +701,7 @@ void ComputeLineKeyPointsMatch(const Features& features1,
   
   */
 
-  cv::Ptr<cv::DescriptorMatcher> matcher = 
-      cv::DescriptorMatcher::create(cv::DescriptorMatcher::BRUTEFORCE_HAMMING);
+  cv::Ptr<cv::DescriptorMatcher> matcher = cv::BFMatcher::create(norm_type);
 
   // cv::Ptr<cv::DescriptorMatcher> matcher = 
   //     cv::DescriptorMatcher::create(cv::DescriptorMatcher::FLANNBASES);
@@ -275,7 +714,6 @@ void ComputeLineKeyPointsMatch(const Features& features1,
 
   // std::vector<cv::DMatch> good_matches;
   // Filter matches: Lowe's ratio test
-  const float ratio_thresh = 0.5f; //0.6
   for (int m = 0; m < knnMatches.size(); ++m) {
     if (knnMatches[m].size() < 2) continue; // no match for the points
     if (knnMatches[m][0].distance < ratio_thresh * knnMatches[m][1].distance) {
@@ -338,74 +776,235 @@ void ComputeLineKeyPointsMatch(const Features& features1,
   // std::cout << "lgood_matches.size = " << matches.match.size() << std::endl;
 }
 
-void FilterMatchByLineDistance(const Features& features1, 
-                               const CameraInfo camera_info1, 
-                               const Features& features2, 
-                               const CameraInfo& camera_info2, 
-                               Matches& matches, 
-                               const double line_dist) {
+void ComputeLineKeyPointsMatchBatch(
+    const CompactFeatures& features1,
+    const CameraInfo& camera_info1,
+    const std::vector<const CompactFeatures*>& features2,
+    const std::vector<const CameraInfo*>& camera_info2,
+    const std::vector<Matches*>& matches,
+    const int norm_type,
+    const float ratio_thresh,
+    const bool simd_knn) {
+  std::vector<HammingTrainSet> trains;
+  std::vector<int> trains_partners;
+  for (size_t k = 0; k < features2.size(); ++k) {
+    const CompactFeatures& partner = *features2[k];
+    if (simd_knn && norm_type == cv::NORM_HAMMING
+        && features1.HasDescriptors() && partner.HasDescriptors()
+        && features1.descriptor_stride() == partner.descriptor_stride()) {
+      trains.push_back({partner.descriptor(0), partner.size()});
+      trains_partners.push_back(k);
+    } else {
+      ComputeLineKeyPointsMatch(features1, camera_info1,
+                                partner, *camera_info2[k], *matches[k],
+                                norm_type, ratio_thresh, simd_knn);
+    }
+  }
+  if (!trains.empty()) {
+    std::vector<std::vector<cv::DMatch> > knn_matches(trains.size());
+    std::vector<std::vector<cv::DMatch>*> trains_matches;
+    for (auto& m : knn_matches) {
+      trains_matches.push_back(&m);
+    }
+    ::MatchHammingKnn2Batch(features1.descriptor(0), features1.size(),
+                            trains, features1.descriptor_stride(),
+                            ratio_thresh, trains_matches);
+    for (size_t t = 0; t < trains_partners.size(); ++t) {
+      matches[trains_partners[t]]->match.Assign(knn_matches[t]);
+    }
+  }
+}
+
+long ComputeGuidedKeyPointsMatch(const CompactFeatures& features1,
+                                 const CameraInfo& camera_info1,
+                                 const CompactFeatures& features2,
+                                 const CameraInfo& camera_info2,
+                                 Matches& matches,
+                                 const double max_line_dist,
+                                 const int norm_type,
+                                 const float ratio_thresh) {
+  matches.match.clear();
+
+  const int n1 = features1.size();
+  const int n2 = features2.size();
+  if (norm_type != cv::NORM_HAMMING
+      || !features1.HasDescriptors() || !features2.HasDescriptors()
+      || features1.descriptor_stride() != features2.descriptor_stride()) {
+    ComputeLineKeyPointsMatch(features1, camera_info1,
+                              features2, camera_info2,
+                              matches, norm_type, ratio_thresh);
+    return static_cast<long>(n1) * n2;
+  }
 
   cv::Mat fund;
   CalcFundamental(camera_info1, camera_info2, fund);
+  double f[3][3];
+  for (int row = 0; row < 3; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      f[row][col] = fund.at<double>(row, col);
+    }
+  }
 
-  auto match = matches.match.begin();
-  while (match != matches.match.end()) {
-    // cv::DMatch match = knnMatches[m][0];
-    
-    cv::Mat points2(3, 1, CV_64F);
-    points2.at<double>(0, 0) = features2.keypoints[match->trainIdx].pt.x;
-    points2.at<double>(1, 0) = features2.keypoints[match->trainIdx].pt.y;
-    points2.at<double>(2, 0) = 1.0;
-
-    cv::Mat points1(1, 3, CV_64F);
-    points1.at<double>(0, 0) = features1.keypoints[match->queryIdx].pt.x;
-    points1.at<double>(0, 1) = features1.keypoints[match->queryIdx].pt.y;
-    points1.at<double>(0, 2) = 1.0;
-
-    // std::cout << "match = " << match.queryIdx 
-    //           << ", " << match.trainIdx
-    //           << std::endl;
-
-    // std::cout << "p1 = " << points1 << std::endl;
-    // std::cout << "p2 = " << points2 << std::endl;
+  // Epipolar lines of image 2 keypoints in image 1, normalized so
+  // |l . (x1, y1, 1)| is the distance used by FilterMatchByLineDistance
+  std::vector<glm::dvec3> lines(n2);
+  std::vector<bool> valid_lines(n2, false);
+  for (int j = 0; j < n2; ++j) {
+    const cv::Point2f& p = features2.pt(j);
+    double a = f[0][0] * p.x + f[0][1] * p.y + f[0][2];
+    double b = f[1][0] * p.x + f[1][1] * p.y + f[1][2];
+    double c = f[2][0] * p.x + f[2][1] * p.y + f[2][2];
+    double d = sqrt(a * a + b * b);
+    if (d > 0.0) {
+      lines[j] = glm::dvec3(a / d, b / d, c / d);
+      valid_lines[j] = true;
+    }
+  }
 
-    cv::Mat kp_l2 = fund * points2;
-    double a = kp_l2.at<double>(0);
-    double b = kp_l2.at<double>(1);
-    double d = sqrt(a*a + b*b);
+  // Epipole in image 1 (e^T F = 0), all lines pass through it
+  glm::dvec3 cols[3];
+  for (int col = 0; col < 3; ++col) {
+    cols[col] = glm::dvec3(f[0][col], f[1][col], f[2][col]);
+  }
+  glm::dvec3 epipole = glm::cross(cols[0], cols[1]);
+  for (const glm::dvec3& e : {glm::cross(cols[0], cols[2]),
+                              glm::cross(cols[1], cols[2])}) {
+    if (glm::length(e) > glm::length(epipole)) epipole = e;
+  }
+  const bool finite_epipole = std::abs(epipole[2]) * 1e+7
+      > std::hypot(epipole[0], epipole[1]);
+  const double ex = finite_epipole ? epipole[0] / epipole[2] : 0.0;
+  const double ey = finite_epipole ? epipole[1] / epipole[2] : 0.0;
+  // Common normal of the parallel lines for the epipole at infinity
+  const double norm_e = std::hypot(epipole[0], epipole[1]);
+  const double nx = norm_e > 0.0 ? -epipole[1] / norm_e : 0.0;
+  const double ny = norm_e > 0.0 ? epipole[0] / norm_e : 0.0;
+
+  // Line parameter: normal angle in [0, pi) or offset along the normal
+  std::vector<std::pair<double, int> > params;
+  params.reserve(n2);
+  for (int j = 0; j < n2; ++j) {
+    if (!valid_lines[j]) continue;
+    const glm::dvec3& l = lines[j];
+    double param;
+    if (finite_epipole) {
+      param = atan2(l[1], l[0]);
+      if (param < 0.0) param += M_PI;
+      if (param >= M_PI) param -= M_PI;
+    } else {
+      param = (l[0] * nx + l[1] * ny >= 0.0) ? -l[2] : l[2];
+    }
+    params.push_back(std::make_pair(param, j));
+  }
+  std::sort(params.begin(), params.end());
+
+  // Descriptor rows are zero padded to the same stride, so the whole
+  // stride is compared
+  const int stride = features1.descriptor_stride();
+  const HammingDistanceFunc hamming_distance = ::GetHammingDistanceFunc(stride);
+  long comparisons = 0;
+
+  for (int i = 0; i < n1; ++i) {
+    const cv::Point2f& p1 = features1.pt(i);
+    const uchar* desc1 = features1.descriptor(i);
+
+    int best_dist = std::numeric_limits<int>::max();
+    int second_dist = std::numeric_limits<int>::max();
+    int best_idx = -1;
+
+    auto scan = [&](const double lo, const double hi) {
+      auto it = std::lower_bound(params.begin(), params.end(),
+                                 std::make_pair(lo, -1));
+      for (; it != params.end() && it->first <= hi; ++it) {
+        const int j = it->second;
+        const glm::dvec3& l = lines[j];
+        if (std::abs(l[0] * p1.x + l[1] * p1.y + l[2]) > max_line_dist) {
+          continue;
+        }
+        ++comparisons;
+        int dist = hamming_distance(desc1, features2.descriptor(j), stride);
+        if (dist < best_dist) {
+          second_dist = best_dist;
+          best_dist = dist;
+          best_idx = j;
+        } else if (dist < second_dist) {
+          second_dist = dist;
+        }
+      }
+    };
+
+    if (finite_epipole) {
+      // Distance to a line through the epipole is r * |sin(angle diff)|
+      double vx = p1.x - ex;
+      double vy = p1.y - ey;
+      double r = std::hypot(vx, vy);
+      if (r <= max_line_dist) {
+        scan(0.0, M_PI);
+      } else {
+        double phi = atan2(vx, -vy);
+        if (phi < 0.0) phi += M_PI;
+        if (phi >= M_PI) phi -= M_PI;
+        double delta = asin(std::min(1.0, max_line_dist / r)) + 1e-6;
+        if (delta >= M_PI / 2) {
+          scan(0.0, M_PI);
+        } else if (phi - delta < 0.0) {
+          scan(phi - delta + M_PI, M_PI);
+          scan(0.0, phi + delta);
+        } else if (phi + delta >= M_PI) {
+          scan(phi - delta, M_PI);
+          scan(0.0, phi + delta - M_PI);
+        } else {
+          scan(phi - delta, phi + delta);
+        }
+      }
+    } else {
+      // Near parallel lines, extra pixel for the residual slope
+      double s = nx * p1.x + ny * p1.y;
+      scan(s - max_line_dist - 1.0, s + max_line_dist + 1.0);
+    }
 
-    cv::Mat dd_mat = points1 * kp_l2 / d;
-    double dd = abs(dd_mat.at<double>(0));
+    // Lowe's ratio test inside the band (two candidates at least as knn)
+    if (best_idx >= 0 && second_dist != std::numeric_limits<int>::max()
+        && best_dist < ratio_thresh * second_dist) {
+      matches.match.push_back(cv::DMatch(i, best_idx, 0,
+                                         static_cast<float>(best_dist)));
+    }
+  }
 
-    if (dd > line_dist) {
-      // matches.match.push_back(match);
-      // TODO: make remove more efficient in one sweep
-      match = matches.match.erase(match);
-      continue;
-    } 
+  return comparisons;
+}
 
-    // std::cout << "dd[" << matches.match.size() - 1 << "] = " << dd << std::endl;
+void FilterMatchByLineDistance(const CompactFeatures& features1, 
+                               const CameraInfo camera_info1, 
+                               const CompactFeatures& features2, 
+                               const CameraInfo& camera_info2, 
+                               Matches& matches, 
+                               const double line_dist) {
 
-    ++match;
-        
-  }
+  cv::Mat fund;
+  CalcFundamental(camera_info1, camera_info2, fund);
 
+  ::FilterMatchesByEpipolarDistance(fund, features1, features2,
+                                    matches.match, line_dist);
 }
 
 
 
 
 void GetLineMatchedSURFKeypoints(const cv::Mat img1, std::vector<cv::KeyPoint>& keypoints1,
-    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund) {
+    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund,
+    const std::string& backend) {
   cv::Mat feature_mask;
   GetFeatureExtractionRegion(img1, feature_mask);
+  const FeatureBackend& feature_backend = GetFeatureBackend(backend);
 
   // Step 1:: Detect
   int minHessian = 600;
   // cv::Ptr<cv::xfeatures2d::SURF> detector = cv::xfeatures2d::SURF::create(minHessian);
   // cv::Ptr<cv::xfeatures2d::SIFT> detector = cv::xfeatures2d::SIFT::create();
   // cv::Ptr<cv::ORB> detector = cv::ORB::create(10000);
-  cv::Ptr<cv::AKAZE> detector = cv::AKAZE::create();
+  cv::Ptr<cv::Feature2D> detector =
+      feature_backend.create(FeatureExtractionParams());
 
   std::vector<cv::KeyPoint> points1, points2;
   cv::Mat descriptors1, descriptors2;
@@ -436,7 +1035,8 @@ void GetLineMatchedSURFKeypoints(const cv::Mat img1, std::vector<cv::KeyPoint>&
 
 
   // cv::Ptr<cv::DescriptorMatcher> matcher = cv::DescriptorMatcher::create(cv::DescriptorMatcher::BRUTEFORCE);
-  cv::Ptr<cv::DescriptorMatcher> matcher = cv::DescriptorMatcher::create(cv::DescriptorMatcher::BRUTEFORCE_HAMMING);
+  cv::Ptr<cv::DescriptorMatcher> matcher =
+      cv::BFMatcher::create(feature_backend.norm_type);
 
   // == Look for One point correcpondance
   std::vector<cv::DMatch> good_matches;
@@ -686,7 +1286,8 @@ void GetLineMatchedSURFKeypoints(const cv::Mat img1, std::vector<cv::KeyPoint>&
 
 
 void GetMatchedSURFKeypoints(const cv::Mat img1, std::vector<cv::KeyPoint>& keypoints1,
-    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund) {
+    const cv::Mat img2, std::vector<cv::KeyPoint>& keypoints2, const cv::Mat fund,
+    const double max_line_dist) {
 
   cv::Mat mask;
   GetFeatureExtractionRegion(img1, mask);
@@ -734,19 +1335,12 @@ void GetMatchedSURFKeypoints(const cv::Mat img1, std::vector<cv::KeyPoint>& keyp
     // Check fund matrix constraint
     std::cout << "CHECK FUND MATRIX CONSTRAINT!!!\n";
     // Fundamental Matrix Constraint
-    for (size_t i = 0; i < good_matches.size(); ++i) {
-      cv::DMatch match = good_matches[i];
-      cv::Mat p1 = cv::Mat1d({points1[match.queryIdx].pt.x, points1[match.queryIdx].pt.y, 1.0});
-      cv::Mat p2 = cv::Mat1d({points2[match.trainIdx].pt.x, points2[match.trainIdx].pt.y, 1.0});
-      cv::Mat pres = p1.t() * fund * p2;
-      if (pres.at<double>() < 0.01) {
-        // For visualization only
-        best_matches.push_back(match);
-        keypoints1.push_back(points1[match.queryIdx]);
-        keypoints2.push_back(points2[match.trainIdx]);
-      } else {
-        // std::cout << i << ": good_match res (SKIP) = " << pres << std::endl;
-      }
+    best_matches = good_matches;
+    ::FilterMatchesByEpipolarDistance(fund, points1, points2, best_matches,
+                                      max_line_dist);
+    for (size_t i = 0; i < best_matches.size(); ++i) {
+      keypoints1.push_back(points1[best_matches[i].queryIdx]);
+      keypoints2.push_back(points2[best_matches[i].trainIdx]);
     }
 
   } else {
@@ -928,6 +1522,42 @@ void TriangulatePoints(const CameraInfo& camera_info1, const std::vector<cv::Poi
 
 }
 
+bool TriangulateMultiView(const std::vector<cv::Mat>& projs,
+                          const std::vector<cv::Point2f>& points,
+                          cv::Point3d& point3d) {
+  // Rows x * P3 - P1 and y * P3 - P2 of every view, each of unit norm so
+  // views of far and near cameras weigh the same
+  cv::Mat a(2 * points.size(), 4, CV_64F);
+  for (size_t i = 0; i < points.size(); ++i) {
+    const cv::Mat& p = projs[i];
+    double* rx = a.ptr<double>(2 * i);
+    double* ry = a.ptr<double>(2 * i + 1);
+    double nx = 0.0;
+    double ny = 0.0;
+    for (int c = 0; c < 4; ++c) {
+      rx[c] = points[i].x * p.at<double>(2, c) - p.at<double>(0, c);
+      ry[c] = points[i].y * p.at<double>(2, c) - p.at<double>(1, c);
+      nx += rx[c] * rx[c];
+      ny += ry[c] * ry[c];
+    }
+    nx = nx > 0.0 ? 1.0 / sqrt(nx) : 1.0;
+    ny = ny > 0.0 ? 1.0 / sqrt(ny) : 1.0;
+    for (int c = 0; c < 4; ++c) {
+      rx[c] *= nx;
+      ry[c] *= ny;
+    }
+  }
+  cv::Mat x;
+  cv::SVD::solveZ(a, x);
+  const double w = x.at<double>(3);
+  if (std::abs(w) < std::numeric_limits<double>::epsilon()) {
+    return false;
+  }
+  point3d = cv::Point3d(x.at<double>(0) / w, x.at<double>(1) / w,
+                        x.at<double>(2) / w);
+  return true;
+}
+
 std::vector<double> GetReprojectionErrors(const std::vector<cv::Point2f>& points, const cv::Mat& proj, const cv::Mat& points3d) {
 
   std::vector<double> errs(points3d.rows);
@@ -971,57 +1601,33 @@ std::vector<double> GetReprojectionErrors(const std::vector<cv::Point2f>& points
 
 }
 
-double GetReprojectionError(const Map3D& map, const std::vector<CameraInfo>& cameras, const std::vector<Features>& features) {
+double GetReprojectionError(const Map3D& map, const CameraProjections& projections, const std::vector<CompactFeatures>& features) {
 
-  double err = 0.0;
-
-  for (size_t i = 0; i < map.size(); ++i) {
-    err += GetReprojectionError(map[i], cameras, features);
-    /*
-    for (auto& view : map[i].views) {
-      cv::Mat proj = GetProjMatrix(cameras[view.first]);
-      const cv::Point2f& point = features[view.first].keypoints[view.second].pt;
-      cv::Matx41d point3dh(
-        map[i].pt.x, map[i].pt.y, map[i].pt.z, 1.0
-      );
-      cv::Mat pred = proj * cv::Mat(point3dh);
-      pred = pred / pred.at<double>(2);
-      double dx = pred.at<double>(0) - double(point.x);
-      double dy = pred.at<double>(1) - double(point.y);
-      // std::cout << "pred = " << pred << std::endl;
-      // std::cout << "dx, dy = " << dx << ", " << dy << std::endl;
-      err += (dx * dx + dy * dy);
-    }
-    */
-    
-  }
-
-  return err;
+  MapReprojectionErrors errors;
+  ::ComputeReprojectionErrors(map, projections, features, errors);
+  return errors.total;
 
 }
 
 std::vector<double> GetReprojectionErrors(
     const Map3D& map,
-    const std::vector<CameraInfo>& cameras, 
-    const std::vector<Features>& features) {
+    const CameraProjections& projections,
+    const std::vector<CompactFeatures>& features) {
 
-  std::vector<double> errs(map.size());
-  for (size_t i = 0; i < map.size(); ++i) {
-    errs[i] = GetReprojectionError(map[i], cameras, features);
-    errs[i] /= map[i].views.size();
-  }
-  return errs;
+  MapReprojectionErrors errors;
+  ::ComputeReprojectionErrors(map, projections, features, errors);
+  return errors.point_errors;
 
 }
 
 
 double GetReprojectionError(const WorldPoint3D& point3d,
                             const std::vector<CameraInfo>& cameras, 
-                            const std::vector<Features>& features) {
+                            const std::vector<CompactFeatures>& features) {
   double err = 0.0;
   for (auto& view : point3d.views) {
     cv::Mat proj = GetProjMatrix(cameras[view.first]);
-    const cv::Point2f& point = features[view.first].keypoints[view.second].pt;
+    const cv::Point2f& point = features[view.first].pt(view.second);
     cv::Matx41d point3dh(
       point3d.pt.x, point3d.pt.y, point3d.pt.z, 1.0
     );
@@ -1059,11 +1665,12 @@ std::vector<double> GetZDistanceFromCamera(const CameraInfo& camera_info,
 }
 
 void RemoveOutliersByError(Map3D& map,
-                           const std::vector<CameraInfo>& cameras,
-                           const std::vector<Features>& features,
+                           const CameraProjections& projections,
+                           const std::vector<CompactFeatures>& features,
                            const float percentile) {
 
-  std::vector<double> errs = ::GetReprojectionErrors(map, cameras, features);
+  std::vector<double> errs = ::GetReprojectionErrors(map, projections,
+                                                     features);
 
   double min_err = (* std::min_element(errs.begin(), errs.end()));
   double max_err = (* std::max_element(errs.begin(), errs.end()));
@@ -1090,14 +1697,15 @@ void RemoveOutliersByError(Map3D& map,
 }
 
 Map3D ReduceMapByError(const Map3D& map,
-                       const std::vector<CameraInfo>& cameras,
-                       const std::vector<Features>& features,
+                       const CameraProjections& projections,
+                       const std::vector<CompactFeatures>& features,
                        const float ratio) {
 
   if (ratio == 1.0) return Map3D(map);
 
   
-  std::vector<double> errs = ::GetReprojectionErrors(map, cameras, features);
+  std::vector<double> errs = ::GetReprojectionErrors(map, projections,
+                                                     features);
 
   typedef std::pair<int, double> ErrEl;
   std::vector<ErrEl> errsi(errs.size());
@@ -1137,7 +1745,7 @@ Map3D ReduceMapByError(const Map3D& map,
 
 int GetNextBestView(const Map3D& map, 
     const std::unordered_set<int>& views, 
-    CComponents<std::pair<int, int> >& ccomp,
+    const TrackTable& tracks,
     const std::vector<Matches>& image_matches,
     const std::map<std::pair<int, int>, int>& matches_index) {
 
@@ -1167,20 +1775,10 @@ int GetNextBestView(const Map3D& map,
           match_size = image_matches[m->second].match.size();
         }
 
-
-        for (size_t i = 0; i < image_matches[m->second].match.size(); ++i) {
-          const cv::DMatch& match = image_matches[m->second].match[i];
-          int p_id;
-          if (image_matches[m->second].image_index.first == view) {
-            p_id = match.queryIdx;
-          } else {
-            p_id = match.trainIdx;
-          }
-          std::pair<int, int> p = std::make_pair(view, p_id);
-          if (ccomp.Connected(v, p)) {
-            point_match = true;
-            break;
-          }
+        // Point is seen from the view if its track has a keypoint there
+        const int track = tracks.TrackOf(v);
+        if (track >= 0 && tracks.KeypointIn(track, view) >= 0) {
+          point_match = true;
         }
 
         if (point_match) {
@@ -1245,10 +1843,9 @@ int GetNextBestViewByViews(const Map3D& map,
 }
 
 
-// TODO: Make CComponents const!
 void MergeToTheMap(Map3D& map,
                    const Map3D& local_map,
-                   CComponents<std::pair<int, int> >& ccomp) {
+                   const TrackTable& tracks) {
 
   using namespace std::chrono;
 
@@ -1277,7 +1874,7 @@ void MergeToTheMap(Map3D& map,
       //             << lp << ", wp = " << wp << std::endl;
       // }
 
-      if (ccomp.Connected(lp_view, wp_view)) {
+      if (tracks.Connected(lp_view, wp_view)) {
         double dist = cv::norm(lp.pt - wp.pt);
         // std::cout << "[" << idx <<  "] Connected: \n  lp = " << lp
         //           << "  wp = " << wp 
@@ -1383,7 +1980,7 @@ void MergeToTheMap(Map3D& map,
 
 void MergeToTheMapImproved(Map3D& map,
                            const Map3D& local_map,
-                           CComponents<std::pair<int, int> >& ccomp) {
+                           const TrackTable& tracks) {
   using namespace std::chrono;
 
   auto t0 = high_resolution_clock::now();
@@ -1430,7 +2027,7 @@ void MergeToTheMapImproved(Map3D& map,
     int looked_points = 0;
     std::vector<WorldPoint3D>::iterator min_wp_it = map.end();
     std::pair<int, int> lp_view = (*lp.views.begin());
-    int comp_id = ccomp.Find(lp_view);
+    int comp_id = tracks.TrackOf(lp_view);
     // if (cnt == 46) {
     //   std::cout << "look for comp_id = " << comp_id << std::endl;
     // }
@@ -1509,7 +2106,53 @@ void MergeToTheMapImproved(Map3D& map,
 
 }
 
-void CombineMapComponents(Map3D& map, const double max_keep_dist) {
+// Groups points by the track id in [0, tracks_count) with a counting pass,
+// points of a track by the distance from the origin. False (map is not
+// changed) if there is a point of other component id.
+static bool GroupMapByTracks(Map3D& map, const int tracks_count) {
+  std::vector<int> track_offsets(tracks_count + 1, 0);
+  for (const WorldPoint3D& wp : map) {
+    if (wp.component_id < 0 || wp.component_id >= tracks_count) {
+      return false;
+    }
+    ++track_offsets[wp.component_id + 1];
+  }
+  for (int t = 0; t < tracks_count; ++t) {
+    track_offsets[t + 1] += track_offsets[t];
+  }
+  std::vector<int> order(map.size());
+  for (size_t i = 0; i < map.size(); ++i) {
+    order[track_offsets[map[i].component_id]++] = i;
+  }
+  Map3D grouped;
+  grouped.reserve(map.size());
+  for (const int i : order) {
+    grouped.push_back(std::move(map[i]));
+  }
+  map.swap(grouped);
+
+  // Tracks mostly have one or two points
+  auto norm_comp = [](const WorldPoint3D& wp1, const WorldPoint3D& wp2) {
+    return cv::norm(wp1.pt) < cv::norm(wp2.pt);
+  };
+  auto first = map.begin();
+  while (first != map.end()) {
+    auto last = std::next(first);
+    while (last != map.end() && last->component_id == first->component_id) {
+      ++last;
+    }
+    if (std::distance(first, last) > 1) {
+      std::sort(first, last, norm_comp);
+    }
+    first = last;
+  }
+  return true;
+}
+
+void CombineMapComponents(Map3D& map, const double max_keep_dist,
+                          const int tracks_count) {
+  if (map.empty()) return;
+
   auto world_point_comp = [](const WorldPoint3D& wp1,
       const WorldPoint3D& wp2) {
           return wp1.component_id != wp2.component_id
@@ -1523,7 +2166,9 @@ void CombineMapComponents(Map3D& map, const double max_keep_dist) {
   // };
 
   // Sort map by component
-  std::sort(map.begin(), map.end(), world_point_comp);
+  if (tracks_count <= 0 || !GroupMapByTracks(map, tracks_count)) {
+    std::sort(map.begin(), map.end(), world_point_comp);
+  }
 
   // std::cout << "Sorted: " << std::endl;
   // for (auto& wp : map) {
@@ -1601,16 +2246,72 @@ void CombineMapComponents(Map3D& map, const double max_keep_dist) {
 
 }
 
+void ReplaceTrackPoints(Map3D& map,
+                        const Map3D& tracks_map,
+                        const int tracks_count) {
+
+  using namespace std::chrono;
+  auto t0 = high_resolution_clock::now();
+
+  // A track point replaces the map points of its track only if it keeps
+  // all their views, otherwise the map points (maybe bundle adjusted) stay
+  // and the track point is dropped
+  std::vector<int> track_point(tracks_count, -1);
+  for (int i = 0; i < static_cast<int>(tracks_map.size()); ++i) {
+    track_point[tracks_map[i].component_id] = i;
+  }
+  auto track_of = [&track_point, tracks_count](const WorldPoint3D& wp) {
+    return wp.component_id >= 0 && wp.component_id < tracks_count
+        ? track_point[wp.component_id] : -1;
+  };
+  std::vector<bool> replace(tracks_map.size(), true);
+  for (const WorldPoint3D& wp : map) {
+    const int tp = track_of(wp);
+    if (tp < 0 || !replace[tp]) continue;
+    const std::map<int, int>& views = tracks_map[tp].views;
+    for (const auto& v : wp.views) {
+      auto it = views.find(v.first);
+      if (it == views.end() || it->second != v.second) {
+        replace[tp] = false;
+        break;
+      }
+    }
+  }
+  const size_t map_size = map.size();
+  map.erase(std::remove_if(map.begin(), map.end(),
+                           [&track_of, &replace](const WorldPoint3D& wp) {
+                             const int tp = track_of(wp);
+                             return tp >= 0 && replace[tp];
+                           }),
+            map.end());
+  const size_t removed = map_size - map.size();
+  int kept = 0;
+  for (size_t i = 0; i < tracks_map.size(); ++i) {
+    if (replace[i]) {
+      map.push_back(tracks_map[i]);
+    } else {
+      ++kept;
+    }
+  }
+
+  auto t1 = high_resolution_clock::now();
+  auto dur = duration_cast<microseconds>(t1 - t0);
+  std::cout << ", replaced_points = " << removed
+            << ", kept_points = " << kept
+            << ", replace_time = " << dur.count() / 1e+6;
+}
+
 void MergeAndCombinePoints(Map3D& map,
                            const Map3D& local_map,
-                           const double max_keep_dist) {
+                           const double max_keep_dist,
+                           const int tracks_count) {
 
   using namespace std::chrono;
   auto t0 = high_resolution_clock::now();
 
   // std::cout << "\nMerge AND Combine Points:\n";
   map.insert(map.end(), local_map.begin(), local_map.end());
-  ::CombineMapComponents(map, max_keep_dist);
+  ::CombineMapComponents(map, max_keep_dist, tracks_count);
 
   auto t1 = high_resolution_clock::now();
   auto dur = duration_cast<microseconds>(t1 - t0);
@@ -1686,7 +2387,7 @@ struct ReprojectionErrorFunctor {
 };
 
 
-void OptimizeBundle(Map3D& map, const std::vector<CameraInfo>& cameras, const std::vector<Features>& features) {
+void OptimizeBundle(Map3D& map, const std::vector<CameraInfo>& cameras, const std::vector<CompactFeatures>& features) {
 
   // TEST output
   // double R[2];
@@ -1712,7 +2413,7 @@ void OptimizeBundle(Map3D& map, const std::vector<CameraInfo>& cameras, const st
     for (auto& view : map[i].views) {
       ceres::CostFunction* cost_function = ReprojectionErrorFunctor::Create(
           cameras[view.first],
-          features[view.first].keypoints[view.second].pt);
+          features[view.first].pt(view.second));
       problem.AddResidualBlock(cost_function,
           NULL,
           // new ceres::CauchyLoss(0.5),
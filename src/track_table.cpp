@@ -0,0 +1,80 @@
+// Copyright Pavlo 2018
+#include "cv_gl/track_table.h"
+
+void TrackTable::Build(const std::vector<int>& sizes,
+                       DenseCComponents& ccomp) {
+  clear();
+  offsets_.assign(sizes.size() + 1, 0);
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    offsets_[i + 1] = offsets_[i] + sizes[i];
+  }
+  const std::vector<int> labels = ccomp.Labels();
+  if (labels.size() != static_cast<size_t>(offsets_.back())) {
+    std::cerr << "TrackTable: components of " << labels.size()
+              << " keypoints, expected = " << offsets_.back() << std::endl;
+    clear();
+    return;
+  }
+
+  // Label of a component is its smallest element id, so the first element
+  // seen of a component is its label and gets the next track id
+  track_of_.assign(labels.size(), -1);
+  std::vector<int> sizes_of_tracks;
+  for (size_t id = 0; id < labels.size(); ++id) {
+    const int label = labels[id];
+    if (label < 0) continue;
+    if (static_cast<size_t>(label) == id) {
+      track_of_[id] = sizes_of_tracks.size();
+      sizes_of_tracks.push_back(0);
+    } else {
+      track_of_[id] = track_of_[label];
+    }
+    ++sizes_of_tracks[track_of_[id]];
+  }
+
+  track_offsets_.assign(sizes_of_tracks.size() + 1, 0);
+  for (size_t t = 0; t < sizes_of_tracks.size(); ++t) {
+    track_offsets_[t + 1] = track_offsets_[t] + sizes_of_tracks[t];
+  }
+  // Element ids go by image and keypoint, so do the observations
+  observations_.resize(track_offsets_.back());
+  std::vector<int> next(track_offsets_.begin(), track_offsets_.end() - 1);
+  for (int image = 0; image + 1 < static_cast<int>(offsets_.size());
+       ++image) {
+    for (int id = offsets_[image]; id < offsets_[image + 1]; ++id) {
+      if (track_of_[id] < 0) continue;
+      observations_[next[track_of_[id]]++] =
+          ElemType(image, id - offsets_[image]);
+    }
+  }
+}
+
+void TrackTable::clear() {
+  offsets_.clear();
+  track_of_.clear();
+  track_offsets_.assign(1, 0);
+  observations_.clear();
+}
+
+bool TrackTable::HasSizes(const std::vector<int>& sizes) const {
+  if (offsets_.size() != sizes.size() + 1) return false;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    if (offsets_[i + 1] - offsets_[i] != sizes[i]) return false;
+  }
+  return true;
+}
+
+int TrackTable::KeypointIn(const int track, const int image) const {
+  // Tracks are short (a few views), a scan is faster than a search
+  for (const ElemType* o = TrackBegin(track); o != TrackEnd(track); ++o) {
+    if (o->first == image) return o->second;
+    if (o->first > image) break;
+  }
+  return -1;
+}
+
+size_t TrackTable::MemoryBytes() const {
+  return (offsets_.capacity() + track_of_.capacity()
+          + track_offsets_.capacity()) * sizeof(int)
+      + observations_.capacity() * sizeof(ElemType);
+}
@@ -0,0 +1,131 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "cv_gl/triangulation.h"
+
+// Points per block of the stack buffers
+static const size_t kTriangulationBlock = 256;
+
+TriangulationCamera GetTriangulationCamera(const CameraInfo& camera_info) {
+  const cv::Mat proj = ::GetProjMatrix(camera_info);
+  const cv::Mat rt = ::GetRotationTranslationTransform(camera_info);
+  TriangulationCamera camera;
+  for (int c = 0; c < 4; ++c) {
+    for (int r = 0; r < 3; ++r) {
+      camera.proj[r][c] = proj.at<double>(r, c);
+    }
+    camera.depth[c] = rt.at<double>(2, c);
+  }
+  return camera;
+}
+
+// DLT rows x * P3 - P1 and y * P3 - P2 of the view, of unit norm
+static inline void AddViewRows(const double p[3][4], const double x,
+                               const double y, double n[3][3],
+                               double b[3]) {
+  double rx[4], ry[4];
+  double nx = 0.0, ny = 0.0;
+  for (int c = 0; c < 4; ++c) {
+    rx[c] = x * p[2][c] - p[0][c];
+    ry[c] = y * p[2][c] - p[1][c];
+    nx += rx[c] * rx[c];
+    ny += ry[c] * ry[c];
+  }
+  nx = 1.0 / std::sqrt(nx);
+  ny = 1.0 / std::sqrt(ny);
+  for (int c = 0; c < 4; ++c) {
+    rx[c] *= nx;
+    ry[c] *= ny;
+  }
+  // Normal equations of rows[0..2] * X = -rows[3]
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c) {
+      n[r][c] += rx[r] * rx[c] + ry[r] * ry[c];
+    }
+    b[r] -= rx[r] * rx[3] + ry[r] * ry[3];
+  }
+}
+
+static inline double ReprojectionError(const double p[3][4],
+                                       const double x, const double y,
+                                       const double px, const double py,
+                                       const double pz) {
+  const double u = p[0][0] * px + p[0][1] * py + p[0][2] * pz + p[0][3];
+  const double v = p[1][0] * px + p[1][1] * py + p[1][2] * pz + p[1][3];
+  const double w = p[2][0] * px + p[2][1] * py + p[2][2] * pz + p[2][3];
+  const double dx = u / w - x;
+  const double dy = v / w - y;
+  return std::sqrt(dx * dx + dy * dy);
+}
+
+size_t TriangulateValidatePair(const TriangulationCamera& camera1,
+                               const cv::Point2f* points1,
+                               const TriangulationCamera& camera2,
+                               const cv::Point2f* points2,
+                               const size_t count,
+                               const TriangulationChecks& checks,
+                               std::vector<int>& kept,
+                               std::vector<cv::Point3d>& points3d) {
+  kept.clear();
+  points3d.clear();
+
+  double xs[kTriangulationBlock];
+  double ys[kTriangulationBlock];
+  double zs[kTriangulationBlock];
+  uint8_t pass[kTriangulationBlock];
+
+  for (size_t first = 0; first < count; first += kTriangulationBlock) {
+    const size_t size = std::min(kTriangulationBlock, count - first);
+    const cv::Point2f* p1 = points1 + first;
+    const cv::Point2f* p2 = points2 + first;
+
+    for (size_t i = 0; i < size; ++i) {
+      double n[3][3] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
+      double b[3] = {0.0, 0.0, 0.0};
+      AddViewRows(camera1.proj, p1[i].x, p1[i].y, n, b);
+      AddViewRows(camera2.proj, p2[i].x, p2[i].y, n, b);
+
+      // Symmetric 3x3 solve by cofactors
+      const double c00 = n[1][1] * n[2][2] - n[1][2] * n[2][1];
+      const double c01 = n[1][2] * n[2][0] - n[1][0] * n[2][2];
+      const double c02 = n[1][0] * n[2][1] - n[1][1] * n[2][0];
+      const double c11 = n[0][0] * n[2][2] - n[0][2] * n[2][0];
+      const double c12 = n[0][1] * n[2][0] - n[0][0] * n[2][1];
+      const double c22 = n[0][0] * n[1][1] - n[0][1] * n[1][0];
+      const double det = n[0][0] * c00 + n[0][1] * c01 + n[0][2] * c02;
+      const double inv_det = 1.0 / det;
+      const double px = (c00 * b[0] + c01 * b[1] + c02 * b[2]) * inv_det;
+      const double py = (c01 * b[0] + c11 * b[1] + c12 * b[2]) * inv_det;
+      const double pz = (c02 * b[0] + c12 * b[1] + c22 * b[2]) * inv_det;
+
+      const double err1 = ReprojectionError(camera1.proj, p1[i].x, p1[i].y,
+                                            px, py, pz);
+      const double err2 = ReprojectionError(camera2.proj, p2[i].x, p2[i].y,
+                                            px, py, pz);
+      const double depth1 = camera1.depth[0] * px + camera1.depth[1] * py
+                            + camera1.depth[2] * pz + camera1.depth[3];
+      const double depth2 = camera2.depth[0] * px + camera2.depth[1] * py
+                            + camera2.depth[2] * pz + camera2.depth[3];
+
+      // NaN of a degenerate solve fails every compare
+      xs[i] = px;
+      ys[i] = py;
+      zs[i] = pz;
+      pass[i] = (err1 <= checks.max_repr_error)
+                & (err2 <= checks.max_repr_error)
+                & (depth1 >= checks.min_depth) & (depth1 <= checks.max_depth)
+                & (depth2 >= checks.min_depth) & (depth2 <= checks.max_depth)
+                & (pz >= checks.min_height);
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+      if (pass[i]) {
+        kept.push_back(first + i);
+        points3d.push_back(cv::Point3d(xs[i], ys[i], zs[i]));
+      }
+    }
+  }
+  return kept.size();
+}
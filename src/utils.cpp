@@ -9,6 +9,8 @@
 #include <glm/gtc/matrix_inverse.hpp>
 
 #include <iomanip>
+#include <fstream>
+#include <sstream>
 
 #include "cv_gl/utils.h"
 
@@ -215,12 +217,64 @@ std::vector<std::string> SelectRoadRecords(const std::vector<std::string>& kreco
 }
 
 
+// JPEG decoder is able to scale down by 1/2, 1/4 and 1/8 in DCT domain,
+// it's much cheaper than full size decode followed by resize. Returns imread
+// flag for the biggest reduction that still fits the scale_factor and
+// the scale that is left to apply after decode.
+int GetReducedReadFlag(const double scale_factor, double& rest_scale) {
+  const int kReduceFlags[] = { cv::IMREAD_REDUCED_COLOR_8,
+                               cv::IMREAD_REDUCED_COLOR_4,
+                               cv::IMREAD_REDUCED_COLOR_2 };
+  const int kReduceFactors[] = { 8, 4, 2 };
+  for (int i = 0; i < 3; ++i) {
+    if (scale_factor * kReduceFactors[i] <= 1.0) {
+      rest_scale = scale_factor * kReduceFactors[i];
+      return kReduceFlags[i];
+    }
+  }
+  rest_scale = scale_factor;
+  return cv::IMREAD_COLOR;
+}
+
 cv::Mat LoadImage(const ImageData& im_data, double scale_factor) {
   fs::path full_image_path = fs::path(im_data.image_dir)
       / fs::path(im_data.filename);
-  cv::Mat img = cv::imread(full_image_path.string().c_str());
-  if (scale_factor == 1.0) return img;
-  cv::resize(img, img, cv::Size(), scale_factor, scale_factor);
+  if (scale_factor == 1.0) {
+    return cv::imread(full_image_path.string().c_str());
+  }
+  double rest_scale;
+  int flag = GetReducedReadFlag(scale_factor, rest_scale);
+  cv::Mat img = cv::imread(full_image_path.string().c_str(), flag);
+  if (img.empty() || rest_scale == 1.0) return img;
+  cv::resize(img, img, cv::Size(), rest_scale, rest_scale, cv::INTER_AREA);
+  return img;
+}
+
+bool ReadImageBuffer(const ImageData& im_data, std::vector<uchar>& buffer) {
+  fs::path full_image_path = fs::path(im_data.image_dir)
+      / fs::path(im_data.filename);
+  std::ifstream file(full_image_path.string(), std::ios::binary);
+  if (!file) {
+    buffer.clear();
+    return false;
+  }
+  file.seekg(0, std::ios::end);
+  buffer.resize(file.tellg());
+  file.seekg(0, std::ios::beg);
+  file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+  return static_cast<bool>(file);
+}
+
+cv::Mat DecodeImage(const std::vector<uchar>& buffer, double scale_factor) {
+  if (buffer.empty()) return cv::Mat();
+  if (scale_factor == 1.0) {
+    return cv::imdecode(buffer, cv::IMREAD_COLOR);
+  }
+  double rest_scale;
+  int flag = GetReducedReadFlag(scale_factor, rest_scale);
+  cv::Mat img = cv::imdecode(buffer, flag);
+  if (img.empty() || rest_scale == 1.0) return img;
+  cv::resize(img, img, cv::Size(), rest_scale, rest_scale, cv::INTER_AREA);
   return img;
 }
 
@@ -243,6 +297,32 @@ void KeyPointsToPointVec(const std::vector<cv::KeyPoint>& kpoints1,
   }
 }
 
+void KeyPointsToPointVec(const cv::Point2f* kpoints1,
+                         const cv::Point2f* kpoints2,
+                         const std::vector<cv::DMatch>& match,
+                         std::vector<cv::Point2f>& points1,
+                         std::vector<cv::Point2f>& points2) {
+  points1.reserve(points1.size() + match.size());
+  points2.reserve(points2.size() + match.size());
+  for (size_t i = 0; i < match.size(); ++i) {
+    points1.push_back(kpoints1[match[i].queryIdx]);
+    points2.push_back(kpoints2[match[i].trainIdx]);
+  }
+}
+
+void KeyPointsToPointVec(const cv::Point2f* kpoints1,
+                         const cv::Point2f* kpoints2,
+                         const CompactMatches& match,
+                         std::vector<cv::Point2f>& points1,
+                         std::vector<cv::Point2f>& points2) {
+  points1.reserve(points1.size() + match.size());
+  points2.reserve(points2.size() + match.size());
+  for (size_t i = 0; i < match.size(); ++i) {
+    points1.push_back(kpoints1[match.queryIdx(i)]);
+    points2.push_back(kpoints2[match.trainIdx(i)]);
+  }
+}
+
 
 glm::dmat3 GetRotation(const float x_angle, const float y_angle, const float z_angle ) {
     glm::dmat4 rotation(1.0f);
@@ -405,3 +485,35 @@ glm::vec3 GetGlmColorFromImage(const cv::Mat& img, const cv::Point2f& pt, double
 
 
 
+
+// Reads "<key>:   <value> kB" line
+static size_t ReadProcStatusBytes(const std::string& key) {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, key.size(), key) == 0 && line.size() > key.size()
+        && line[key.size()] == ':') {
+      std::istringstream ss(line.substr(key.size() + 1));
+      size_t kb = 0;
+      ss >> kb;
+      return kb * 1024;
+    }
+  }
+  return 0;
+}
+
+size_t GetCurrentRSS() {
+  return ReadProcStatusBytes("VmRSS");
+}
+
+size_t GetPeakRSS() {
+  return ReadProcStatusBytes("VmHWM");
+}
+
+bool ResetPeakRSS() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  if (!clear_refs.is_open()) return false;
+  clear_refs << "5";
+  clear_refs.close();
+  return !clear_refs.fail();
+}
@@ -0,0 +1,410 @@
+// Copyright Pavlo 2018
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include "cv_gl/vocabulary_tree.h"
+
+// k-majority iterations per node, assignments usually settle earlier
+static const int kVocabularyIterations = 10;
+// Load sanity bounds of the header (BRISK rows are 64 bytes)
+static const uint32_t kMaxVocabularyBranching = 256;
+static const uint32_t kMaxVocabularyStride = 256;
+
+VocabularyTree::VocabularyTree()
+    : branching_(0),
+      depth_(0),
+      descriptor_bytes_(0),
+      descriptor_stride_(0),
+      words_(0),
+      id_(0),
+      distance_(nullptr) {}
+
+int VocabularyTree::AddNode(const uchar* centroid) {
+  node_first_child_.push_back(-1);
+  node_children_.push_back(0);
+  node_word_.push_back(-1);
+  centroids_.insert(centroids_.end(), centroid, centroid + descriptor_stride_);
+  return static_cast<int>(node_word_.size()) - 1;
+}
+
+// Binary k-means: centers are the per bit majority of their rows,
+// k-means++ seeding by Hamming distance. Returns non empty clusters.
+static void KMajority(const uchar* descriptors, const int stride,
+                      const int descriptor_bytes,
+                      const std::vector<int>& rows, const int k,
+                      HammingDistanceFunc distance, std::mt19937& rng,
+                      std::vector<std::vector<uchar> >& centers,
+                      std::vector<std::vector<int> >& clusters) {
+  const int n = rows.size();
+  auto row = [&](const int i) {
+    return descriptors + static_cast<size_t>(rows[i]) * stride;
+  };
+
+  // Seeding
+  centers.clear();
+  std::vector<int> min_dist(n, std::numeric_limits<int>::max());
+  int next = std::uniform_int_distribution<int>(0, n - 1)(rng);
+  while (static_cast<int>(centers.size()) < k) {
+    centers.push_back(std::vector<uchar>(row(next), row(next) + stride));
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+      int d = distance(row(i), centers.back().data(), stride);
+      if (d < min_dist[i]) min_dist[i] = d;
+      sum += static_cast<double>(min_dist[i]) * min_dist[i];
+    }
+    if (sum <= 0.0) break;  // all rows are centers already
+    double pick = std::uniform_real_distribution<double>(0.0, sum)(rng);
+    next = n - 1;
+    for (int i = 0; i < n; ++i) {
+      pick -= static_cast<double>(min_dist[i]) * min_dist[i];
+      if (pick <= 0.0 && min_dist[i] > 0) {
+        next = i;
+        break;
+      }
+    }
+  }
+
+  const int kc = centers.size();
+  std::vector<int> assignment(n, -1);
+  std::vector<int> counts(static_cast<size_t>(kc) * descriptor_bytes * 8);
+  std::vector<int> sizes(kc);
+  for (int iter = 0; iter < kVocabularyIterations; ++iter) {
+    bool changed = false;
+    for (int i = 0; i < n; ++i) {
+      int best = 0;
+      int best_dist = std::numeric_limits<int>::max();
+      for (int c = 0; c < kc; ++c) {
+        int d = distance(row(i), centers[c].data(), stride);
+        if (d < best_dist) {
+          best_dist = d;
+          best = c;
+        }
+      }
+      if (assignment[i] != best) {
+        assignment[i] = best;
+        changed = true;
+      }
+    }
+    if (!changed) break;
+
+    std::fill(counts.begin(), counts.end(), 0);
+    std::fill(sizes.begin(), sizes.end(), 0);
+    for (int i = 0; i < n; ++i) {
+      const uchar* d = row(i);
+      int* cnt = counts.data()
+          + static_cast<size_t>(assignment[i]) * descriptor_bytes * 8;
+      for (int b = 0; b < descriptor_bytes; ++b) {
+        for (int bit = 0; bit < 8; ++bit) {
+          cnt[b * 8 + bit] += (d[b] >> bit) & 1;
+        }
+      }
+      ++sizes[assignment[i]];
+    }
+    for (int c = 0; c < kc; ++c) {
+      if (sizes[c] == 0) continue;  // keeps the previous center
+      const int* cnt = counts.data()
+          + static_cast<size_t>(c) * descriptor_bytes * 8;
+      for (int b = 0; b < descriptor_bytes; ++b) {
+        uchar v = 0;
+        for (int bit = 0; bit < 8; ++bit) {
+          if (cnt[b * 8 + bit] * 2 > sizes[c]) v |= (1 << bit);
+        }
+        centers[c][b] = v;
+      }
+    }
+  }
+
+  clusters.assign(kc, std::vector<int>());
+  for (int i = 0; i < n; ++i) {
+    clusters[assignment[i]].push_back(rows[i]);
+  }
+  // Drop the empty ones
+  int kept = 0;
+  for (int c = 0; c < kc; ++c) {
+    if (clusters[c].empty()) continue;
+    if (kept != c) {
+      clusters[kept].swap(clusters[c]);
+      centers[kept].swap(centers[c]);
+    }
+    ++kept;
+  }
+  clusters.resize(kept);
+  centers.resize(kept);
+}
+
+bool VocabularyTree::Train(const uchar* descriptors, const int rows,
+                           const int stride, const int descriptor_bytes,
+                           const std::vector<int>& row_images,
+                           const int branching, const int depth,
+                           const unsigned int seed) {
+  if (rows <= 0 || branching < 2 || depth < 1 || descriptor_bytes <= 0
+      || descriptor_bytes > stride
+      || static_cast<int>(row_images.size()) != rows) {
+    return false;
+  }
+  branching_ = branching;
+  depth_ = depth;
+  descriptor_bytes_ = descriptor_bytes;
+  descriptor_stride_ = stride;
+  words_ = 0;
+  node_first_child_.clear();
+  node_children_.clear();
+  node_word_.clear();
+  centroids_.clear();
+  idf_.clear();
+  distance_ = ::GetHammingDistanceFunc(stride);
+
+  std::mt19937 rng(seed);
+  std::vector<uchar> zero(stride, 0);
+  AddNode(zero.data());
+
+  // Level by level, so children of a node are stored one after another
+  struct PendingNode {
+    int node;
+    int level;
+    std::vector<int> rows;
+  };
+  std::deque<PendingNode> pending;
+  pending.push_back(PendingNode{0, 0, std::vector<int>(rows)});
+  for (int i = 0; i < rows; ++i) pending.front().rows[i] = i;
+
+  std::vector<std::vector<uchar> > centers;
+  std::vector<std::vector<int> > clusters;
+  while (!pending.empty()) {
+    PendingNode p = std::move(pending.front());
+    pending.pop_front();
+    bool leaf = p.level == depth
+        || static_cast<int>(p.rows.size()) <= branching;
+    if (!leaf) {
+      KMajority(descriptors, stride, descriptor_bytes, p.rows, branching,
+                distance_, rng, centers, clusters);
+      leaf = clusters.size() < 2;
+    }
+    if (leaf) {
+      node_word_[p.node] = words_++;
+      continue;
+    }
+    node_first_child_[p.node] = node_word_.size();
+    node_children_[p.node] = clusters.size();
+    for (size_t c = 0; c < clusters.size(); ++c) {
+      int child = AddNode(centers[c].data());
+      pending.push_back(PendingNode{child, p.level + 1,
+                                    std::move(clusters[c])});
+    }
+  }
+
+  // idf over the training images
+  int images = 0;
+  for (int img : row_images) images = std::max(images, img + 1);
+  std::vector<int> word_last_image(words_, -1);
+  std::vector<int> word_images(words_, 0);
+  std::vector<int> order(rows);
+  for (int i = 0; i < rows; ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return row_images[a] < row_images[b];
+  });
+  for (int i : order) {
+    int word = Quantize(descriptors + static_cast<size_t>(i) * stride);
+    if (word_last_image[word] != row_images[i]) {
+      word_last_image[word] = row_images[i];
+      ++word_images[word];
+    }
+  }
+  idf_.resize(words_);
+  for (int w = 0; w < words_; ++w) {
+    idf_[w] = word_images[w] > 0
+        ? static_cast<float>(std::log(static_cast<double>(images)
+                                      / word_images[w]))
+        : 0.0f;
+  }
+
+  ComputeId();
+  return true;
+}
+
+int VocabularyTree::Quantize(const uchar* descriptor) const {
+  int node = 0;
+  while (node_first_child_[node] >= 0) {
+    const int first = node_first_child_[node];
+    const int last = first + node_children_[node];
+    int best = first;
+    int best_dist = std::numeric_limits<int>::max();
+    for (int c = first; c < last; ++c) {
+      int d = distance_(descriptor, centroid(c), descriptor_stride_);
+      if (d < best_dist) {
+        best_dist = d;
+        best = c;
+      }
+    }
+    node = best;
+  }
+  return node_word_[node];
+}
+
+BowVector VocabularyTree::Transform(const CompactFeatures& features) const {
+  BowVector bow;
+  if (empty() || !features.HasDescriptors() || features.empty()
+      || features.descriptor_bytes() != descriptor_bytes_
+      || features.descriptor_stride() != descriptor_stride_) {
+    return bow;
+  }
+  std::vector<int> words(features.size());
+  for (int i = 0; i < features.size(); ++i) {
+    words[i] = Quantize(features.descriptor(i));
+  }
+  std::sort(words.begin(), words.end());
+
+  // tf-idf, words in every training image (idf 0) are dropped
+  double sum = 0.0;
+  for (size_t i = 0; i < words.size();) {
+    size_t j = i;
+    while (j < words.size() && words[j] == words[i]) ++j;
+    float weight = static_cast<float>(j - i) * idf_[words[i]];
+    if (weight > 0.0f) {
+      bow.push_back(std::make_pair(words[i], weight));
+      sum += weight;
+    }
+    i = j;
+  }
+  for (auto& w : bow) {
+    w.second = static_cast<float>(w.second / sum);
+  }
+  return bow;
+}
+
+float VocabularyTree::Score(const BowVector& a, const BowVector& b) {
+  // 1 - |a - b|_1 / 2 == sum of min over the common words
+  float score = 0.0f;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a.size() && j < b.size()) {
+    if (a[i].first < b[j].first) {
+      ++i;
+    } else if (b[j].first < a[i].first) {
+      ++j;
+    } else {
+      score += std::min(a[i].second, b[j].second);
+      ++i;
+      ++j;
+    }
+  }
+  return score;
+}
+
+void VocabularyTree::ComputeId() {
+  // FNV-1a over the tree
+  uint64_t h = 1469598103934665603ull;
+  auto add = [&h](const void* data, const size_t bytes) {
+    const uchar* p = static_cast<const uchar*>(data);
+    for (size_t i = 0; i < bytes; ++i) {
+      h = (h ^ p[i]) * 1099511628211ull;
+    }
+  };
+  add(&branching_, sizeof(branching_));
+  add(&depth_, sizeof(depth_));
+  add(&descriptor_bytes_, sizeof(descriptor_bytes_));
+  add(node_first_child_.data(), node_first_child_.size() * sizeof(int));
+  add(centroids_.data(), centroids_.size());
+  add(idf_.data(), idf_.size() * sizeof(float));
+  id_ = h;
+}
+
+bool VocabularyTree::Save(const std::string& file) const {
+  const std::string tmp_file = file + ".tmp";
+  std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) return false;
+  const uint32_t header[8] = {
+      VOCABULARY_MAGIC, VOCABULARY_VERSION,
+      static_cast<uint32_t>(branching_), static_cast<uint32_t>(depth_),
+      static_cast<uint32_t>(descriptor_bytes_),
+      static_cast<uint32_t>(descriptor_stride_),
+      static_cast<uint32_t>(node_word_.size()),
+      static_cast<uint32_t>(words_)};
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(node_first_child_.data()),
+            node_first_child_.size() * sizeof(int));
+  out.write(reinterpret_cast<const char*>(node_children_.data()),
+            node_children_.size() * sizeof(int));
+  out.write(reinterpret_cast<const char*>(node_word_.data()),
+            node_word_.size() * sizeof(int));
+  out.write(reinterpret_cast<const char*>(centroids_.data()),
+            centroids_.size());
+  out.write(reinterpret_cast<const char*>(idf_.data()),
+            idf_.size() * sizeof(float));
+  bool ok = out.good();
+  out.close();
+  if (!ok || std::rename(tmp_file.c_str(), file.c_str()) != 0) {
+    std::remove(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool VocabularyTree::Load(const std::string& file) {
+  std::ifstream in(file, std::ios::binary | std::ios::ate);
+  if (!in.is_open()) return false;
+  const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+  in.seekg(0);
+  auto broken = [this, &file]() {
+    std::cerr << "Vocabulary is broken: " << file << std::endl;
+    words_ = 0;
+    return false;
+  };
+  uint32_t header[8];
+  if (!in.read(reinterpret_cast<char*>(header), sizeof(header))
+      || header[0] != VOCABULARY_MAGIC || header[1] != VOCABULARY_VERSION) {
+    return broken();
+  }
+  // Header values are checked before anything is sized by them: the
+  // arrays they give should fill the rest of the file exactly
+  const uint64_t nodes = header[6];
+  const uint64_t words = header[7];
+  if (header[2] < 2 || header[2] > kMaxVocabularyBranching || header[3] < 1
+      || header[4] == 0 || header[4] > header[5]
+      || header[5] > kMaxVocabularyStride
+      || header[5] % CompactFeatures::kDescriptorAlign != 0
+      || nodes == 0 || words == 0 || words > nodes
+      || file_size != sizeof(header) + nodes * 3 * sizeof(int)
+                      + nodes * header[5] + words * sizeof(float)) {
+    return broken();
+  }
+  branching_ = header[2];
+  depth_ = header[3];
+  descriptor_bytes_ = header[4];
+  descriptor_stride_ = header[5];
+  words_ = words;
+  node_first_child_.resize(nodes);
+  node_children_.resize(nodes);
+  node_word_.resize(nodes);
+  centroids_.resize(nodes * descriptor_stride_);
+  idf_.resize(words_);
+  in.read(reinterpret_cast<char*>(node_first_child_.data()),
+          nodes * sizeof(int));
+  in.read(reinterpret_cast<char*>(node_children_.data()), nodes * sizeof(int));
+  in.read(reinterpret_cast<char*>(node_word_.data()), nodes * sizeof(int));
+  in.read(reinterpret_cast<char*>(centroids_.data()), centroids_.size());
+  in.read(reinterpret_cast<char*>(idf_.data()), idf_.size() * sizeof(float));
+  if (!in) return broken();
+  // Quantize walks from the root down to a leaf word: inner nodes have
+  // 1..branching children after them, leaves a word in range
+  for (size_t i = 0; i < nodes; ++i) {
+    const int64_t first = node_first_child_[i];
+    const int64_t children = node_children_[i];
+    const bool inner = first >= 0;
+    if ((inner && (first <= static_cast<int64_t>(i) || children < 1
+                   || children > branching_
+                   || first + children > static_cast<int64_t>(nodes)))
+        || (!inner && (node_word_[i] < 0 || node_word_[i] >= words_))) {
+      return broken();
+    }
+  }
+  distance_ = ::GetHammingDistanceFunc(descriptor_stride_);
+  ComputeId();
+  return true;
+}